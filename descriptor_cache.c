@@ -0,0 +1,109 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "descriptor_cache.h"
+
+#define DESCRIPTOR_CACHE_MAGIC 0x32435344 // "DSC2"
+
+// The sector as it will be programmed: the header followed by the image
+static uint8_t sector_buf[DESCRIPTOR_CACHE_SECTOR_SIZE] __attribute__((aligned(4)));
+
+static const descriptor_cache_header_t* cached_header(void)
+{
+  return (const descriptor_cache_header_t*)(XIP_BASE + DESCRIPTOR_CACHE_FLASH_OFFSET);
+}
+
+static uint32_t fnv1a(const uint8_t* data, uint16_t len)
+{
+  uint32_t hash = 2166136261u;
+  for (uint16_t idx = 0; idx < len; idx++) {
+    hash ^= data[idx];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+const uint8_t* descriptor_cache_get(uint16_t* len)
+{
+  const descriptor_cache_header_t* header = cached_header();
+  if (header->magic != DESCRIPTOR_CACHE_MAGIC || header->len > DESCRIPTOR_CACHE_MAX_IMAGE)
+    return NULL;
+  const uint8_t* image = (const uint8_t*)(header + 1);
+  if (fnv1a(image, header->len) != header->checksum)
+    return NULL;
+  *len = header->len;
+  return image;
+}
+
+uint8_t* descriptor_cache_image_buffer(void)
+{
+  return sector_buf + sizeof(descriptor_cache_header_t);
+}
+
+// Fill in the header in front of the image in the buffer
+static void make_header(uint16_t vid, uint16_t pid, uint16_t bcd_device, uint16_t len)
+{
+  descriptor_cache_header_t header = {
+    .magic = DESCRIPTOR_CACHE_MAGIC,
+    .vid = vid,
+    .pid = pid,
+    .bcd_device = bcd_device,
+    .len = len,
+    .checksum = fnv1a(descriptor_cache_image_buffer(), len),
+  };
+  memcpy(sector_buf, &header, sizeof(header));
+}
+
+bool descriptor_cache_matches(uint16_t vid, uint16_t pid, uint16_t bcd_device, uint16_t len)
+{
+  if (len > DESCRIPTOR_CACHE_MAX_IMAGE)
+    return false;
+  make_header(vid, pid, bcd_device, len);
+  return memcmp(sector_buf, cached_header(), sizeof(descriptor_cache_header_t) + len) == 0;
+}
+
+bool descriptor_cache_save(uint16_t vid, uint16_t pid, uint16_t bcd_device, uint16_t len)
+{
+  if (len > DESCRIPTOR_CACHE_MAX_IMAGE)
+    return false;
+  if (descriptor_cache_matches(vid, pid, bcd_device, len))
+    return true; // nothing changed; save the flash the wear
+  uint32_t nbytes = sizeof(descriptor_cache_header_t) + len;
+  nbytes = (nbytes + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+  memset(sector_buf + sizeof(descriptor_cache_header_t) + len, 0xff, nbytes - sizeof(descriptor_cache_header_t) - len);
+  // core1 must not run code from flash while it is erased and programmed
+  multicore_lockout_start_blocking();
+  uint32_t ints = save_and_disable_interrupts();
+  flash_range_erase(DESCRIPTOR_CACHE_FLASH_OFFSET, DESCRIPTOR_CACHE_SECTOR_SIZE);
+  flash_range_program(DESCRIPTOR_CACHE_FLASH_OFFSET, sector_buf, nbytes);
+  restore_interrupts(ints);
+  multicore_lockout_end_blocking();
+  return descriptor_cache_matches(vid, pid, bcd_device, len);
+}
@@ -0,0 +1,116 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file descriptor_cache.h
+ *
+ * This file contains functions that keep a copy of the cloned USB descriptors
+ * in a reserved flash sector so the USB device port can enumerate as soon as
+ * the Pico boots instead of waiting for the MIDI device to be attached and
+ * its descriptors cloned. The cache holds one serialized descriptor image,
+ * keyed by the VID, PID and bcdDevice of the MIDI device it came from and
+ * protected by a checksum.
+ *
+ * Erasing and programming flash stops code from running out of flash on both
+ * cores, so core1 must call multicore_lockout_victim_init() before
+ * descriptor_cache_save() is called on core0. The flash is only written if the
+ * image changed.
+ *
+ * To use this code:
+ * 1. At boot, call descriptor_cache_get() to get the cached image, if any
+ * 2. To save a new image, serialize it into the buffer descriptor_cache_image_buffer()
+ *    returns and call descriptor_cache_save()
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DESCRIPTOR_CACHE_SECTOR_SIZE 4096
+
+#ifndef DESCRIPTOR_CACHE_FLASH_OFFSET
+// Offset of the cache sector from the start of flash; use the last sector by default.
+// descriptor_cache_save() locks core1 out while it erases and programs the sector,
+// about 45 ms on the Pico's W25Q16JV flash (up to 400 ms), so the USB host sends
+// no start-of-frame packets and the just-cloned MIDI device suspends until they resume.
+#define DESCRIPTOR_CACHE_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - DESCRIPTOR_CACHE_SECTOR_SIZE)
+#endif
+
+typedef struct {
+  uint32_t magic;       // DESCRIPTOR_CACHE_MAGIC if the sector holds an image
+  uint16_t vid;         // idVendor of the cloned device
+  uint16_t pid;         // idProduct of the cloned device
+  uint16_t bcd_device;  // bcdDevice of the cloned device
+  uint16_t len;         // number of bytes in the image that follows the header
+  uint32_t checksum;    // FNV-1a hash of the image
+} descriptor_cache_header_t;
+
+#define DESCRIPTOR_CACHE_MAX_IMAGE (DESCRIPTOR_CACHE_SECTOR_SIZE - sizeof(descriptor_cache_header_t))
+
+/**
+ * @brief get the cached descriptor image from flash
+ *
+ * @param len set to the number of bytes in the image
+ * @return a pointer to the image in flash, or NULL if there is no valid image
+ */
+const uint8_t* descriptor_cache_get(uint16_t* len);
+
+/**
+ * @brief get the RAM buffer to serialize a new image in
+ *
+ * @return a pointer to a buffer of DESCRIPTOR_CACHE_MAX_IMAGE bytes
+ */
+uint8_t* descriptor_cache_image_buffer(void);
+
+/**
+ * @brief check if the image in the buffer is the same as the cached image
+ *
+ * @param vid idVendor of the device the image came from
+ * @param pid idProduct of the device the image came from
+ * @param bcd_device bcdDevice of the device the image came from
+ * @param len the number of bytes in the image buffer
+ * @return true if the cache holds the same key and image
+ */
+bool descriptor_cache_matches(uint16_t vid, uint16_t pid, uint16_t bcd_device, uint16_t len);
+
+/**
+ * @brief write the image in the buffer to flash if it differs from the cached image
+ *
+ * Call only from core0 after core1 called multicore_lockout_victim_init().
+ *
+ * @param vid idVendor of the device the image came from
+ * @param pid idProduct of the device the image came from
+ * @param bcd_device bcdDevice of the device the image came from
+ * @param len the number of bytes in the image buffer
+ * @return true if the cache holds the image
+ */
+bool descriptor_cache_save(uint16_t vid, uint16_t pid, uint16_t bcd_device, uint16_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,202 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * This program pushes millions of synthetic USB MIDI packets through the
+ * filter_midi_in() and filter_midi_out() functions on a Linux host and reports
+ * the cost per packet and the throughput for each workload, once a packet at a
+ * time and once in batches through filter_midi_in_batch() and
+ * filter_midi_out_batch(). Use it to catch
+ * hot path regressions in the filter layer before flashing the Pico.
+ *
+ * Usage: filter_bench [number of packets per workload]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "midi_filter.h"
+
+#define DEFAULT_NPACKETS 10000000UL
+// The workload is generated once and replayed until npackets have been filtered
+#define WORKLOAD_LEN 4096
+// Batches are the size of one full-speed USB MIDI bulk endpoint buffer
+#define BATCH_LEN 16
+
+typedef enum {FILTER_DIR_IN, FILTER_DIR_OUT} filter_dir_t;
+
+typedef struct {
+  const char* name;
+  filter_dir_t dir;
+  void (*generate)(uint8_t packet[4], uint32_t idx);
+} workload_t;
+
+static uint32_t rand_state = 1;
+
+static uint32_t next_rand(void)
+{
+  rand_state = rand_state * 1664525u + 1013904223u;
+  return rand_state >> 8;
+}
+
+static void make_packet(uint8_t packet[4], uint8_t cable, uint8_t status, uint8_t data1, uint8_t data2)
+{
+  packet[0] = (uint8_t)(cable << 4) | (status >> 4);
+  packet[1] = status;
+  packet[2] = data1;
+  packet[3] = data2;
+}
+
+// Piano playing on cable 0: note on/note off pairs with some polyphonic aftertouch
+static void gen_notes(uint8_t packet[4], uint32_t idx)
+{
+  uint8_t note = 36 + next_rand() % 61;
+  switch (idx % 3) {
+    case 0:
+      make_packet(packet, 0, 0x90, note, 1 + next_rand() % 127);
+      break;
+    case 1:
+      make_packet(packet, 0, 0xA0, note, next_rand() % 128);
+      break;
+    default:
+      make_packet(packet, 0, 0x80, note, 0x40);
+      break;
+  }
+}
+
+// Mackie Control fader sweeps on cable 1: pitch bend on channels 1-9
+static void gen_faders(uint8_t packet[4], uint32_t idx)
+{
+  uint16_t value = (uint16_t)((idx * 37) & 0x3fff);
+  make_packet(packet, 1, 0xE0 | (idx % 9), value & 0x7f, (value >> 7) & 0x7f);
+}
+
+// Mackie Control button presses and LED updates on cable 1, including the remapped buttons
+static void gen_buttons(uint8_t packet[4], uint32_t idx)
+{
+  static const uint8_t notes[] = {0x46, 0x48, 0x50, 0x51, 0x58, 0x5B, 0x5E, 0x10};
+  make_packet(packet, 1, (idx & 1) ? 0x80 : 0x90, notes[next_rand() % sizeof(notes)], (idx & 1) ? 0 : 0x7f);
+}
+
+// MIDI clock on cable 0
+static void gen_clock(uint8_t packet[4], uint32_t idx)
+{
+  (void)idx;
+  packet[0] = 0x0F;
+  packet[1] = 0xF8;
+  packet[2] = 0;
+  packet[3] = 0;
+}
+
+static const workload_t workloads[] = {
+  {"notes", FILTER_DIR_IN, gen_notes},
+  {"faders", FILTER_DIR_IN, gen_faders},
+  {"buttons", FILTER_DIR_IN, gen_buttons},
+  {"clock", FILTER_DIR_IN, gen_clock},
+  {"notes", FILTER_DIR_OUT, gen_notes},
+  {"faders", FILTER_DIR_OUT, gen_faders},
+  {"buttons", FILTER_DIR_OUT, gen_buttons},
+  {"clock", FILTER_DIR_OUT, gen_clock},
+};
+
+static uint32_t workload_packets[WORKLOAD_LEN];
+
+static double elapsed_ns(const struct timespec* start, const struct timespec* end)
+{
+  return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static uint32_t add_to_checksum(uint32_t checksum, const uint8_t packet[4])
+{
+  return checksum * 31 + packet[0] + packet[1] + packet[2] + packet[3];
+}
+
+static void run_workload(const workload_t* workload, bool batch, unsigned long npackets)
+{
+  rand_state = 1;
+  for (uint32_t idx = 0; idx < WORKLOAD_LEN; idx++) {
+    workload->generate((uint8_t*)&workload_packets[idx], idx);
+  }
+  filter_midi_init();
+  if (workload->dir == FILTER_DIR_IN) {
+    // Tell the fader pickup code where the DAW faders are so hardware fader moves can sync
+    for (uint8_t chan = 0; chan < 9; chan++) {
+      uint8_t packet[4];
+      make_packet(packet, 1, 0xE0 | chan, 0, 0x40);
+      (void)filter_midi_out(packet);
+    }
+  }
+  bool (*filter)(uint8_t packet[4]) = workload->dir == FILTER_DIR_IN ? filter_midi_in : filter_midi_out;
+  size_t (*filter_batch)(uint32_t* packets, size_t npackets, uint32_t* post) =
+      workload->dir == FILTER_DIR_IN ? filter_midi_in_batch : filter_midi_out_batch;
+  unsigned long npassed = 0;
+  uint32_t checksum = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (batch) {
+    for (unsigned long count = 0; count < npackets; count += BATCH_LEN) {
+      uint32_t packets[BATCH_LEN];
+      size_t nbatch = npackets - count < BATCH_LEN ? npackets - count : BATCH_LEN;
+      memcpy(packets, &workload_packets[count % WORKLOAD_LEN], nbatch * sizeof(packets[0]));
+      size_t nkept = filter_batch(packets, nbatch, NULL);
+      npassed += nkept;
+      for (size_t idx = 0; idx < nkept; idx++) {
+        checksum = add_to_checksum(checksum, (uint8_t*)&packets[idx]);
+      }
+    }
+  }
+  else {
+    for (unsigned long count = 0; count < npackets; count++) {
+      uint8_t packet[4];
+      memcpy(packet, &workload_packets[count % WORKLOAD_LEN], sizeof(packet));
+      if (filter(packet)) {
+        ++npassed;
+        checksum = add_to_checksum(checksum, packet);
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double ns = elapsed_ns(&start, &end);
+  printf("%-3s %-8s %-6s %10lu packets %6.2f ns/packet %8.2f Mpackets/s passed=%lu checksum=%08x\n",
+      workload->dir == FILTER_DIR_IN ? "in" : "out", workload->name, batch ? "batch" : "single", npackets,
+      ns / (double)npackets, (double)npackets * 1e3 / ns, npassed, checksum);
+}
+
+int main(int argc, char* argv[])
+{
+  unsigned long npackets = DEFAULT_NPACKETS;
+  if (argc > 1) {
+    npackets = strtoul(argv[1], NULL, 0);
+    if (npackets == 0) {
+      fprintf(stderr, "usage: %s [number of packets per workload]\n", argv[0]);
+      return 1;
+    }
+  }
+  for (size_t idx = 0; idx < sizeof(workloads) / sizeof(workloads[0]); idx++) {
+    run_workload(&workloads[idx], false, npackets);
+    run_workload(&workloads[idx], true, npackets);
+  }
+  return 0;
+}
@@ -0,0 +1,419 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * This program converts MIDI traffic captured by the Pico (see midi_capture.h)
+ * to a Standard MIDI File and, optionally, to a replayable text trace.
+ *
+ * The capture file is either a debug UART log that holds the output of the
+ * `c` console command (lines that start with "c "), or a file of the
+ * MIDI_SYSEX_CMD_GET_CAPTURE SysEx replies (e.g., saved with amidi -r).
+ * Records that appear more than once are kept once. Timestamps are 32-bit
+ * microsecond counters, so the capture must span less than 35 minutes.
+ *
+ * The Standard MIDI File has one track for each direction and virtual cable.
+ * Each track holds the packets after the filter (or before the filter with
+ * --pre) at 100 us resolution.
+ *
+ * The trace has one line per record, oldest first:
+ *   <time us> <in|out> <packet before filter> <packet after filter> <verdict>
+ * Time counts from the first record. Each packet is 8 hex digits, the four
+ * USB MIDI packet bytes in the order they are sent; 00000000 means none.
+ * The verdict is passed, modified, dropped or generated. Lines that start
+ * with # are comments.
+ *
+ * Usage: midi_capture_decode [--pre] <capture file> <output.mid> [output trace]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "midi_capture.h"
+#include "midi_sysex_cmd.h"
+
+// 1 s per quarter note / 10000 ticks per quarter note = 100 us per tick
+#define SMF_TEMPO_US 1000000
+#define SMF_DIVISION 10000
+#define SMF_TICK_US (SMF_TEMPO_US / SMF_DIVISION)
+
+typedef struct {
+  uint8_t dir;
+  uint32_t seq;
+  midi_capture_record_t record;
+  int64_t time_us;          // relative to the first record
+} decoded_record_t;
+
+static decoded_record_t* records;
+static size_t nrecords;
+static size_t records_size;
+
+static void add_record(uint8_t dir, uint32_t seq, uint32_t timestamp_us, uint32_t pre, uint32_t post)
+{
+  if (dir >= MIDI_CAPTURE_NUM_DIRS)
+    return;
+  if (nrecords == records_size) {
+    records_size = records_size ? 2 * records_size : 1024;
+    records = realloc(records, records_size * sizeof(records[0]));
+    if (records == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  decoded_record_t* rec = &records[nrecords++];
+  rec->dir = dir;
+  rec->seq = seq;
+  rec->record.timestamp_us = timestamp_us;
+  rec->record.pre = pre;
+  rec->record.post = post;
+}
+
+// The firmware records packets as little-endian words
+static void word_bytes(uint32_t word, uint8_t bytes[4])
+{
+  for (int idx = 0; idx < 4; idx++)
+    bytes[idx] = (word >> (8 * idx)) & 0xff;
+}
+
+static void parse_capture_reply(const uint8_t* payload, size_t len)
+{
+  if (len < 12)
+    return;
+  uint8_t dir = payload[0];
+  uint32_t seq = midi_sysex_cmd_get_u32(payload + 6);
+  uint8_t count = payload[11];
+  const uint8_t* ptr = payload + 12;
+  for (uint8_t idx = 0; idx < count && ptr + 15 <= payload + len; idx++, ptr += 15)
+    add_record(dir, seq + idx, midi_sysex_cmd_get_u32(ptr), midi_sysex_cmd_get_u32(ptr + 5), midi_sysex_cmd_get_u32(ptr + 10));
+}
+
+static void read_sysex_file(const uint8_t* data, size_t len)
+{
+  static const uint8_t header[] = {0xF0, MIDI_SYSEX_CMD_MANUFACTURER_ID, MIDI_SYSEX_CMD_PRODUCT_ID,
+      MIDI_SYSEX_CMD_GET_CAPTURE | MIDI_SYSEX_CMD_REPLY_FLAG};
+  for (size_t idx = 0; idx + sizeof(header) <= len; idx++) {
+    if (memcmp(data + idx, header, sizeof(header)) != 0)
+      continue;
+    size_t end;
+    for (end = idx + sizeof(header); end < len && data[end] != 0xF7; end++) {
+    }
+    parse_capture_reply(data + idx + sizeof(header), end - idx - sizeof(header));
+    idx = end;
+  }
+}
+
+static void read_log_file(char* text)
+{
+  for (char* line = strtok(text, "\r\n"); line != NULL; line = strtok(NULL, "\r\n")) {
+    unsigned dir;
+    unsigned long seq, timestamp_us, pre, post;
+    if (sscanf(line, "c %u %lx %lx %lx %lx", &dir, &seq, &timestamp_us, &pre, &post) == 5)
+      add_record(dir, seq, timestamp_us, pre, post);
+  }
+}
+
+static int compare_dir_seq(const void* a, const void* b)
+{
+  const decoded_record_t* ra = a;
+  const decoded_record_t* rb = b;
+  if (ra->dir != rb->dir)
+    return ra->dir < rb->dir ? -1 : 1;
+  if (ra->seq != rb->seq)
+    return ra->seq < rb->seq ? -1 : 1;
+  return 0;
+}
+
+static int compare_time(const void* a, const void* b)
+{
+  const decoded_record_t* ra = a;
+  const decoded_record_t* rb = b;
+  if (ra->time_us != rb->time_us)
+    return ra->time_us < rb->time_us ? -1 : 1;
+  return compare_dir_seq(a, b);
+}
+
+// Remove duplicate records and put the rest in time order
+static void sort_records(void)
+{
+  if (nrecords == 0)
+    return;
+  qsort(records, nrecords, sizeof(records[0]), compare_dir_seq);
+  size_t nkept = 1;
+  for (size_t idx = 1; idx < nrecords; idx++) {
+    if (records[idx].dir != records[nkept - 1].dir || records[idx].seq != records[nkept - 1].seq)
+      records[nkept++] = records[idx];
+  }
+  nrecords = nkept;
+  // both cores use the same microsecond timer; unwrap it around the first record
+  uint32_t reference = records[0].record.timestamp_us;
+  int64_t first = INT64_MAX;
+  for (size_t idx = 0; idx < nrecords; idx++) {
+    records[idx].time_us = (int32_t)(records[idx].record.timestamp_us - reference);
+    if (records[idx].time_us < first)
+      first = records[idx].time_us;
+  }
+  for (size_t idx = 0; idx < nrecords; idx++)
+    records[idx].time_us -= first;
+  qsort(records, nrecords, sizeof(records[0]), compare_time);
+}
+
+static const char* verdict_name(midi_capture_verdict_t verdict)
+{
+  static const char* names[] = {"passed", "modified", "dropped", "generated"};
+  return names[verdict];
+}
+
+static bool write_trace(const char* path)
+{
+  FILE* file = fopen(path, "w");
+  if (file == NULL)
+    return false;
+  fprintf(file, "# midi capture trace: time_us dir pre post verdict\n");
+  for (size_t idx = 0; idx < nrecords; idx++) {
+    uint8_t pre[4], post[4];
+    word_bytes(records[idx].record.pre, pre);
+    word_bytes(records[idx].record.post, post);
+    fprintf(file, "%lld %s %02x%02x%02x%02x %02x%02x%02x%02x %s\n", (long long)records[idx].time_us,
+        records[idx].dir == MIDI_CAPTURE_IN ? "in" : "out", pre[0], pre[1], pre[2], pre[3],
+        post[0], post[1], post[2], post[3], verdict_name(midi_capture_verdict(&records[idx].record)));
+  }
+  return fclose(file) == 0;
+}
+
+//--------------------------------------------------------------------+
+// Standard MIDI File
+//--------------------------------------------------------------------+
+typedef struct {
+  uint8_t* data;
+  size_t len;
+  size_t size;
+} buffer_t;
+
+static void put_byte(buffer_t* buf, uint8_t byte)
+{
+  if (buf->len == buf->size) {
+    buf->size = buf->size ? 2 * buf->size : 256;
+    buf->data = realloc(buf->data, buf->size);
+    if (buf->data == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  buf->data[buf->len++] = byte;
+}
+
+static void put_bytes(buffer_t* buf, const uint8_t* bytes, size_t len)
+{
+  for (size_t idx = 0; idx < len; idx++)
+    put_byte(buf, bytes[idx]);
+}
+
+static void put_varlen(buffer_t* buf, uint32_t value)
+{
+  uint8_t bytes[5];
+  int nbytes = 0;
+  do {
+    bytes[nbytes++] = value & 0x7f;
+    value >>= 7;
+  } while (value != 0);
+  while (nbytes-- > 0)
+    put_byte(buf, bytes[nbytes] | (nbytes ? 0x80 : 0));
+}
+
+static void put_u32_be(buffer_t* buf, uint32_t value)
+{
+  for (int shift = 24; shift >= 0; shift -= 8)
+    put_byte(buf, (value >> shift) & 0xff);
+}
+
+typedef struct {
+  buffer_t events;
+  uint32_t last_tick;
+  buffer_t sysex;           // a SysEx message that spans packets
+  bool in_sysex;
+} track_t;
+
+static track_t tracks[MIDI_CAPTURE_NUM_DIRS][16];
+
+static void put_event(track_t* track, uint32_t tick, uint8_t status, const uint8_t* bytes, size_t len)
+{
+  put_varlen(&track->events, tick - track->last_tick);
+  track->last_tick = tick;
+  if (status == 0xF0 || status == 0xF7) {
+    // SysEx, or F7 escape for other bytes an SMF cannot hold as a plain event
+    put_byte(&track->events, status);
+    put_varlen(&track->events, len);
+  }
+  put_bytes(&track->events, bytes, len);
+}
+
+// number of MIDI bytes in a USB MIDI packet for each code index number
+static const uint8_t cin_nbytes[16] = {0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1};
+
+static void add_packet(uint8_t dir, uint32_t tick, uint32_t word)
+{
+  uint8_t packet[4];
+  word_bytes(word, packet);
+  uint8_t cin = packet[0] & 0xf;
+  track_t* track = &tracks[dir][packet[0] >> 4];
+  uint8_t nbytes = cin_nbytes[cin];
+  if (nbytes == 0)
+    return;
+  const uint8_t* bytes = packet + 1;
+  if (cin == 0x4 || ((cin == 0x5 || cin == 0x6 || cin == 0x7) && (track->in_sysex || bytes[0] == 0xF0))) {
+    // SysEx starts, continues or ends
+    for (uint8_t idx = 0; idx < nbytes; idx++) {
+      if (bytes[idx] == 0xF0) {
+        track->sysex.len = 0;
+        track->in_sysex = true;
+      }
+      else if (track->in_sysex) {
+        put_byte(&track->sysex, bytes[idx]);
+      }
+    }
+    if (cin != 0x4 && track->in_sysex) {
+      // the SMF SysEx event holds the bytes after F0, including F7
+      put_event(track, tick, 0xF0, track->sysex.data, track->sysex.len);
+      track->in_sysex = false;
+    }
+  }
+  else if (bytes[0] >= 0x80 && bytes[0] < 0xF0) {
+    put_event(track, tick, bytes[0], bytes, nbytes);
+  }
+  else {
+    // system common and real-time messages
+    put_event(track, tick, 0xF7, bytes, nbytes);
+  }
+}
+
+static void put_track(buffer_t* file, const buffer_t* events)
+{
+  put_bytes(file, (const uint8_t*)"MTrk", 4);
+  put_u32_be(file, events->len + 4);
+  put_bytes(file, events->data, events->len);
+  const uint8_t end_of_track[] = {0x00, 0xFF, 0x2F, 0x00};
+  put_bytes(file, end_of_track, sizeof(end_of_track));
+}
+
+static void put_meta_text(buffer_t* buf, uint8_t type, const char* text)
+{
+  put_byte(buf, 0);
+  put_byte(buf, 0xFF);
+  put_byte(buf, type);
+  put_varlen(buf, strlen(text));
+  put_bytes(buf, (const uint8_t*)text, strlen(text));
+}
+
+static bool write_smf(const char* path, bool pre)
+{
+  for (size_t idx = 0; idx < nrecords; idx++) {
+    uint32_t word = pre ? records[idx].record.pre : records[idx].record.post;
+    if (word != 0)
+      add_packet(records[idx].dir, (uint32_t)(records[idx].time_us / SMF_TICK_US), word);
+  }
+  buffer_t conductor = {0};
+  put_meta_text(&conductor, 0x03, pre ? "MIDI capture before the filter" : "MIDI capture after the filter");
+  const uint8_t tempo[] = {0x00, 0xFF, 0x51, 0x03, (SMF_TEMPO_US >> 16) & 0xff, (SMF_TEMPO_US >> 8) & 0xff, SMF_TEMPO_US & 0xff};
+  put_bytes(&conductor, tempo, sizeof(tempo));
+  uint16_t ntracks = 1;
+  for (int dir = 0; dir < MIDI_CAPTURE_NUM_DIRS; dir++) {
+    for (int cable = 0; cable < 16; cable++)
+      ntracks += tracks[dir][cable].events.len != 0;
+  }
+  buffer_t file = {0};
+  put_bytes(&file, (const uint8_t*)"MThd", 4);
+  put_u32_be(&file, 6);
+  const uint8_t header[] = {0, 1, ntracks >> 8, ntracks & 0xff, SMF_DIVISION >> 8, SMF_DIVISION & 0xff};
+  put_bytes(&file, header, sizeof(header));
+  put_track(&file, &conductor);
+  for (int dir = 0; dir < MIDI_CAPTURE_NUM_DIRS; dir++) {
+    for (int cable = 0; cable < 16; cable++) {
+      track_t* track = &tracks[dir][cable];
+      if (track->events.len == 0)
+        continue;
+      buffer_t events = {0};
+      char name[32];
+      snprintf(name, sizeof(name), "MIDI %s cable %d", dir == MIDI_CAPTURE_IN ? "IN" : "OUT", cable);
+      put_meta_text(&events, 0x03, name);
+      const uint8_t port[] = {0x00, 0xFF, 0x21, 0x01, (uint8_t)cable};
+      put_bytes(&events, port, sizeof(port));
+      put_bytes(&events, track->events.data, track->events.len);
+      put_track(&file, &events);
+      free(events.data);
+    }
+  }
+  FILE* out = fopen(path, "wb");
+  if (out == NULL)
+    return false;
+  bool ok = fwrite(file.data, 1, file.len, out) == file.len;
+  free(file.data);
+  free(conductor.data);
+  return fclose(out) == 0 && ok;
+}
+
+int main(int argc, char* argv[])
+{
+  bool pre = false;
+  int arg = 1;
+  if (arg < argc && strcmp(argv[arg], "--pre") == 0) {
+    pre = true;
+    ++arg;
+  }
+  if (argc - arg < 2 || argc - arg > 3) {
+    fprintf(stderr, "usage: %s [--pre] <capture file> <output.mid> [output trace]\n", argv[0]);
+    return 1;
+  }
+  FILE* in = fopen(argv[arg], "rb");
+  if (in == NULL) {
+    perror(argv[arg]);
+    return 1;
+  }
+  fseek(in, 0, SEEK_END);
+  long len = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  uint8_t* data = malloc(len + 1);
+  if (data == NULL || fread(data, 1, len, in) != (size_t)len) {
+    fprintf(stderr, "%s: read failed\n", argv[arg]);
+    return 1;
+  }
+  fclose(in);
+  data[len] = '\0';
+  if (len > 0 && data[0] == 0xF0)
+    read_sysex_file(data, len);
+  else
+    read_log_file((char*)data);
+  free(data);
+  sort_records();
+  if (!write_smf(argv[arg + 1], pre)) {
+    perror(argv[arg + 1]);
+    return 1;
+  }
+  if (arg + 2 < argc && !write_trace(argv[arg + 2])) {
+    perror(argv[arg + 2]);
+    return 1;
+  }
+  printf("%zu records\n", nrecords);
+  return 0;
+}
@@ -0,0 +1,412 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * This program compiles a readable filter rules file to the binary rules
+ * format in midi_filter_rules.h.
+ *
+ * Each line of the rules file is a rule, a setting or a comment (from # to
+ * the end of the line):
+ *   <in|out> drop  status=<status> [cable=<n|any>] [channel=<n|n-m|any>] [data1=<n|n-m>]
+ *   <in|out> remap status=<status> ... data1=<n|n-m> to=<n>
+ *   <in|out> copy  status=<status> ... to-cable=<n>
+ *   <in|out> stage status=<status> ... stage=<fader-pickup|button-leds>
+ *   in note-map  [cable=<n>] [channel=<n|n-m|any>] [data1=<n|n-m>] [transpose=<n>] [to-channel=<n>]
+ *   in note-drop [cable=<n>] [channel=<n|n-m|any>] [data1=<n|n-m>]
+ *   in velocity  [cable=<n>] [channel=<n|n-m|any>] curve=<linear|exponential|compressed|fixed>
+ *   set <fader-sync-delta|fader-deadband|fader-hysteresis> <value>
+ * "in" rules filter packets from the MIDI device to the DAW and "out" rules
+ * filter packets from the DAW to the MIDI device. The status is note-off,
+ * note-on, poly-pressure, control-change, program-change, channel-pressure,
+ * pitch-bend, system (the real-time messages 0xF8-0xFF) or a status byte
+ * such as 0x90 or 0xF8; a status byte with a channel (e.g., 0x93) also sets
+ * the channel. SysEx and system common messages 0xF0-0xF7 cannot be matched. The cable and channel default
+ * to any and data1 defaults to 0-127. Numbers may be decimal or 0x hex.
+ * A remap of a data1 range maps it to a range of the same size that starts at to.
+ * The note rules need no status; they map the notes of note-on, note-off and
+ * poly-pressure messages. Their cable and channel default to 0, and each
+ * (cable, channel) they name takes one of the MIDI_NOTE_MAP_MAX_MAPS note
+ * maps. A note-map transposes the notes in the data1 range by -64 to 63
+ * semitones (default 0) and moves them to another MIDI channel (default: the
+ * same channel), e.g., for a keyboard split.
+ *
+ * The output is a SysEx file with the MIDI_SYSEX_CMD_LOAD_RULES commands that
+ * upload the rules (e.g., send it with amidi -s), the raw rules with -b, or
+ * a C array initializer with -c. The Pico answers the upload on the virtual
+ * cable it arrived on, so any of its MIDI ports will do.
+ *
+ * Usage: midi_rules_compile [-b|-c] <rules file> <output file>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include "midi_filter_rules.h"
+#include "midi_note_map.h"
+#include "midi_sysex_cmd.h"
+
+// the bytes of the rules each upload command carries
+#define CHUNK_BYTES (MIDI_SYSEX_CMD_MAX_PAYLOAD - 4)
+
+static uint8_t rules[MIDI_FILTER_RULES_MAX_BYTES];
+static int rule_lines[MIDI_FILTER_RULES_MAX_RULES]; // the rules file line of each rule
+static uint8_t nrules;
+
+static bool parse_number(const char* text, long min, long max, long* value)
+{
+  char* end;
+  *value = strtol(text, &end, 0);
+  return end != text && *end == '\0' && *value >= min && *value <= max;
+}
+
+// parse <n>, <n-m> or any
+static bool parse_range(const char* text, long max, uint8_t* lo, uint8_t* hi)
+{
+  if (strcmp(text, "any") == 0) {
+    *lo = 0;
+    *hi = max;
+    return true;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%s", text);
+  char* dash = strchr(buf, '-');
+  long first, last;
+  if (dash) {
+    *dash = '\0';
+    if (!parse_number(buf, 0, max, &first) || !parse_number(dash + 1, first, max, &last))
+      return false;
+  }
+  else {
+    if (!parse_number(buf, 0, max, &first))
+      return false;
+    last = first;
+  }
+  *lo = first;
+  *hi = last;
+  return true;
+}
+
+static bool parse_status(const char* text, uint8_t* rule)
+{
+  static const char* names[] = {"note-off", "note-on", "poly-pressure", "control-change",
+      "program-change", "channel-pressure", "pitch-bend", "system"};
+  for (uint8_t idx = 0; idx < sizeof(names) / sizeof(names[0]); idx++) {
+    if (strcmp(text, names[idx]) == 0) {
+      rule[MIDI_FILTER_RULE_STATUS] = 0x8 + idx;
+      if (rule[MIDI_FILTER_RULE_STATUS] == 0xF)
+        rule[MIDI_FILTER_RULE_CHAN_LO] = 0x8; // real-time only
+      return true;
+    }
+  }
+  long status;
+  if (!parse_number(text, 0x80, 0xff, &status) || (status >= 0xF0 && status <= 0xF7))
+    return false;
+  rule[MIDI_FILTER_RULE_STATUS] = status >> 4;
+  if (status & 0xf)
+    rule[MIDI_FILTER_RULE_CHAN_LO] = rule[MIDI_FILTER_RULE_CHAN_HI] = status & 0xf;
+  return true;
+}
+
+static bool parse_setting(char** words, int nwords, uint8_t* rule)
+{
+  static const char* names[] = {"fader-sync-delta", "fader-deadband", "fader-hysteresis"};
+  static const uint8_t params[] = {MIDI_FILTER_RULES_PARAM_FADER_SYNC_DELTA, MIDI_FILTER_RULES_PARAM_FADER_DEADBAND,
+      MIDI_FILTER_RULES_PARAM_FADER_HYSTERESIS};
+  long value;
+  if (nwords != 3 || !parse_number(words[2], 0, 0x3fff, &value))
+    return false;
+  for (uint8_t idx = 0; idx < sizeof(names) / sizeof(names[0]); idx++) {
+    if (strcmp(words[1], names[idx]) == 0) {
+      rule[MIDI_FILTER_RULE_OP] = MIDI_FILTER_RULE_PARAM;
+      rule[MIDI_FILTER_RULE_DIR] = params[idx];
+      rule[MIDI_FILTER_RULE_CABLE] = value & 0x7f;
+      rule[MIDI_FILTER_RULE_STATUS] = value >> 7;
+      return true;
+    }
+  }
+  return false;
+}
+
+// parse the words of a rule line into rule; returns an error message or NULL
+static const char* parse_rule(char** words, int nwords, uint8_t* rule)
+{
+  memset(rule, 0, MIDI_FILTER_RULES_RULE_BYTES);
+  if (strcmp(words[0], "set") == 0)
+    return parse_setting(words, nwords, rule) ? NULL : "expected set <setting> <value>";
+  if (strcmp(words[0], "in") == 0)
+    rule[MIDI_FILTER_RULE_DIR] = MIDI_FILTER_RULES_IN;
+  else if (strcmp(words[0], "out") == 0)
+    rule[MIDI_FILTER_RULE_DIR] = MIDI_FILTER_RULES_OUT;
+  else
+    return "expected in, out or set";
+  if (nwords < 2)
+    return "expected an operation";
+  static const char* ops[] = {"drop", "remap", "copy", "stage"};
+  for (uint8_t idx = 0; idx < sizeof(ops) / sizeof(ops[0]); idx++) {
+    if (strcmp(words[1], ops[idx]) == 0)
+      rule[MIDI_FILTER_RULE_OP] = MIDI_FILTER_RULE_DROP + idx;
+  }
+  bool note_rule = true;
+  if (strcmp(words[1], "note-map") == 0) {
+    rule[MIDI_FILTER_RULE_OP] = MIDI_FILTER_RULE_NOTE_MAP;
+    rule[MIDI_FILTER_RULE_STATUS] = MIDI_FILTER_RULES_SAME_CHANNEL;
+    rule[MIDI_FILTER_RULE_ARG] = MIDI_FILTER_RULES_NO_TRANSPOSE;
+  }
+  else if (strcmp(words[1], "note-drop") == 0) {
+    rule[MIDI_FILTER_RULE_OP] = MIDI_FILTER_RULE_NOTE_MAP;
+    rule[MIDI_FILTER_RULE_STATUS] = MIDI_FILTER_RULES_NOTE_DROP;
+    rule[MIDI_FILTER_RULE_ARG] = MIDI_FILTER_RULES_NO_TRANSPOSE;
+  }
+  else if (strcmp(words[1], "velocity") == 0) {
+    rule[MIDI_FILTER_RULE_OP] = MIDI_FILTER_RULE_VELOCITY;
+  }
+  else {
+    note_rule = false;
+  }
+  if (rule[MIDI_FILTER_RULE_OP] == 0)
+    return "expected drop, remap, copy, stage, note-map, note-drop or velocity";
+  if (note_rule && rule[MIDI_FILTER_RULE_DIR] != MIDI_FILTER_RULES_IN)
+    return "note rules are for in only";
+  rule[MIDI_FILTER_RULE_CABLE] = note_rule ? 0 : MIDI_FILTER_RULES_ANY_CABLE;
+  rule[MIDI_FILTER_RULE_CHAN_HI] = note_rule ? 0 : 0xf;
+  rule[MIDI_FILTER_RULE_DATA1_HI] = 0x7f;
+  bool has_status = note_rule, has_arg = note_rule && rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_NOTE_MAP;
+  for (int idx = 2; idx < nwords; idx++) {
+    char* value = strchr(words[idx], '=');
+    if (value == NULL)
+      return "expected name=value";
+    *value++ = '\0';
+    const char* name = words[idx];
+    long number;
+    if (strcmp(name, "status") == 0 && !note_rule) {
+      if (!parse_status(value, rule))
+        return "bad status";
+      has_status = true;
+    }
+    else if (strcmp(name, "cable") == 0) {
+      if (strcmp(value, "any") != 0 || note_rule) {
+        if (!parse_number(value, 0, note_rule ? MIDI_NOTE_MAP_CABLES - 1 : 15, &number))
+          return "bad cable";
+        rule[MIDI_FILTER_RULE_CABLE] = number;
+      }
+    }
+    else if (strcmp(name, "channel") == 0) {
+      if (!parse_range(value, 15, &rule[MIDI_FILTER_RULE_CHAN_LO], &rule[MIDI_FILTER_RULE_CHAN_HI]))
+        return "bad channel";
+    }
+    else if (strcmp(name, "data1") == 0 && rule[MIDI_FILTER_RULE_OP] != MIDI_FILTER_RULE_VELOCITY) {
+      if (!parse_range(value, 0x7f, &rule[MIDI_FILTER_RULE_DATA1_LO], &rule[MIDI_FILTER_RULE_DATA1_HI]))
+        return "bad data1";
+    }
+    else if (strcmp(name, "to") == 0 && rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_REMAP) {
+      if (!parse_number(value, 0, 0x7f, &number))
+        return "bad to";
+      rule[MIDI_FILTER_RULE_ARG] = number;
+      has_arg = true;
+    }
+    else if (strcmp(name, "to-cable") == 0 && rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_COPY) {
+      if (!parse_number(value, 0, 15, &number))
+        return "bad to-cable";
+      rule[MIDI_FILTER_RULE_ARG] = number;
+      has_arg = true;
+    }
+    else if (strcmp(name, "stage") == 0 && rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_STAGE) {
+      if (strcmp(value, "fader-pickup") == 0)
+        rule[MIDI_FILTER_RULE_ARG] = MIDI_FILTER_RULES_STAGE_FADER_PICKUP;
+      else if (strcmp(value, "button-leds") == 0)
+        rule[MIDI_FILTER_RULE_ARG] = MIDI_FILTER_RULES_STAGE_BUTTON_LEDS;
+      else
+        return "bad stage";
+      has_arg = true;
+    }
+    else if (strcmp(name, "transpose") == 0 && rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_NOTE_MAP &&
+        rule[MIDI_FILTER_RULE_STATUS] != MIDI_FILTER_RULES_NOTE_DROP) {
+      if (!parse_number(value, -MIDI_FILTER_RULES_NO_TRANSPOSE, 0x7f - MIDI_FILTER_RULES_NO_TRANSPOSE, &number))
+        return "bad transpose";
+      rule[MIDI_FILTER_RULE_ARG] = number + MIDI_FILTER_RULES_NO_TRANSPOSE;
+    }
+    else if (strcmp(name, "to-channel") == 0 && rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_NOTE_MAP &&
+        rule[MIDI_FILTER_RULE_STATUS] != MIDI_FILTER_RULES_NOTE_DROP) {
+      if (!parse_number(value, 0, 15, &number))
+        return "bad to-channel";
+      rule[MIDI_FILTER_RULE_STATUS] = number;
+    }
+    else if (strcmp(name, "curve") == 0 && rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_VELOCITY) {
+      uint8_t curve = 0;
+      while (curve < MIDI_NOTE_MAP_NUM_CURVES && strcmp(value, midi_note_map_curve_name((midi_note_map_curve_t)curve)) != 0)
+        ++curve;
+      if (curve == MIDI_NOTE_MAP_NUM_CURVES)
+        return "bad curve";
+      rule[MIDI_FILTER_RULE_ARG] = curve;
+      has_arg = true;
+    }
+    else {
+      return "unknown or misplaced name";
+    }
+  }
+  if (!has_status)
+    return "missing status=";
+  if (!has_arg && rule[MIDI_FILTER_RULE_OP] != MIDI_FILTER_RULE_DROP)
+    return "missing to=, to-cable=, stage= or curve=";
+  return NULL;
+}
+
+static bool read_rules(const char* path)
+{
+  FILE* in = fopen(path, "r");
+  if (in == NULL) {
+    perror(path);
+    return false;
+  }
+  char line[512];
+  int line_number = 0;
+  bool ok = true;
+  while (fgets(line, sizeof(line), in)) {
+    ++line_number;
+    char* comment = strchr(line, '#');
+    if (comment)
+      *comment = '\0';
+    char* words[16];
+    int nwords = 0;
+    for (char* word = strtok(line, " \t\r\n"); word && nwords < 16; word = strtok(NULL, " \t\r\n"))
+      words[nwords++] = word;
+    if (nwords == 0)
+      continue;
+    if (nrules == MIDI_FILTER_RULES_MAX_RULES) {
+      fprintf(stderr, "%s:%d: more than %d rules\n", path, line_number, MIDI_FILTER_RULES_MAX_RULES);
+      ok = false;
+      break;
+    }
+    uint8_t* rule = rules + MIDI_FILTER_RULES_HEADER_BYTES + nrules * MIDI_FILTER_RULES_RULE_BYTES;
+    const char* error = parse_rule(words, nwords, rule);
+    if (error) {
+      fprintf(stderr, "%s:%d: %s\n", path, line_number, error);
+      ok = false;
+      continue;
+    }
+    rule_lines[nrules++] = line_number;
+  }
+  fclose(in);
+  return ok;
+}
+
+static bool stub_stage(uint8_t packet[4])
+{
+  (void)packet;
+  return true;
+}
+
+static void stub_copy(const uint8_t packet[4])
+{
+  (void)packet;
+}
+
+// Compile the rules the way the Pico does to catch the errors midi_filter_rules_check() cannot
+static bool check_rules(const char* path, uint16_t len)
+{
+  static midi_filter_config_t config;
+  midi_filter_rules_hooks_t hooks;
+  for (uint8_t stage = 0; stage < MIDI_FILTER_RULES_NUM_STAGES; stage++)
+    hooks.stages[stage][MIDI_FILTER_RULES_IN] = hooks.stages[stage][MIDI_FILTER_RULES_OUT] = stub_stage;
+  hooks.copy[MIDI_FILTER_RULES_IN] = hooks.copy[MIDI_FILTER_RULES_OUT] = stub_copy;
+  hooks.note_map = true;
+  uint8_t bad_rule = 0;
+  uint8_t result = midi_filter_rules_compile(rules, len, &hooks, &config, &bad_rule);
+  if (result == MIDI_FILTER_RULES_OK)
+    return true;
+  if (result == MIDI_FILTER_RULES_BAD_RULE || result == MIDI_FILTER_RULES_TABLE_FULL)
+    fprintf(stderr, "%s:%d: %s\n", path, rule_lines[bad_rule], midi_filter_rules_result_name(result));
+  else
+    fprintf(stderr, "%s: %s\n", path, midi_filter_rules_result_name(result));
+  return false;
+}
+
+static void write_sysex(FILE* out, uint16_t len)
+{
+  for (uint16_t offset = 0; offset < len; offset += CHUNK_BYTES) {
+    uint16_t nbytes = len - offset < CHUNK_BYTES ? len - offset : CHUNK_BYTES;
+    uint8_t header[] = {0xF0, MIDI_SYSEX_CMD_MANUFACTURER_ID, MIDI_SYSEX_CMD_PRODUCT_ID, MIDI_SYSEX_CMD_LOAD_RULES,
+        offset & 0x7f, offset >> 7, len & 0x7f, len >> 7};
+    fwrite(header, 1, sizeof(header), out);
+    fwrite(rules + offset, 1, nbytes, out);
+    fputc(0xF7, out);
+  }
+}
+
+static void write_c_array(FILE* out, uint16_t len)
+{
+  for (uint16_t idx = 0; idx < len; idx++) {
+    bool rule_start = idx >= MIDI_FILTER_RULES_HEADER_BYTES &&
+        (idx - MIDI_FILTER_RULES_HEADER_BYTES) % MIDI_FILTER_RULES_RULE_BYTES == 0;
+    if (idx == 0 || rule_start || idx == len - 1)
+      fprintf(out, idx == 0 ? "  " : "\n  ");
+    else
+      fputc(' ', out);
+    fprintf(out, "0x%02x,", rules[idx]);
+  }
+  fprintf(out, "\n");
+}
+
+int main(int argc, char* argv[])
+{
+  char format = 's';
+  int arg = 1;
+  if (arg < argc && (strcmp(argv[arg], "-b") == 0 || strcmp(argv[arg], "-c") == 0)) {
+    format = argv[arg][1];
+    ++arg;
+  }
+  if (arg + 2 != argc) {
+    fprintf(stderr, "usage: %s [-b|-c] <rules file> <output file>\n", argv[0]);
+    return 1;
+  }
+  if (!read_rules(argv[arg]))
+    return 1;
+  rules[0] = MIDI_FILTER_RULES_VERSION;
+  rules[1] = nrules;
+  uint16_t len = MIDI_FILTER_RULES_HEADER_BYTES + nrules * MIDI_FILTER_RULES_RULE_BYTES;
+  rules[len] = midi_filter_rules_checksum(rules, len);
+  ++len;
+  if (!check_rules(argv[arg], len))
+    return 1;
+  FILE* out = fopen(argv[arg + 1], format == 'c' ? "w" : "wb");
+  if (out == NULL) {
+    perror(argv[arg + 1]);
+    return 1;
+  }
+  if (format == 'b')
+    fwrite(rules, 1, len, out);
+  else if (format == 'c')
+    write_c_array(out, len);
+  else
+    write_sysex(out, len);
+  if (fclose(out) != 0) {
+    perror(argv[arg + 1]);
+    return 1;
+  }
+  printf("%u rules, %u bytes\n", nrules, len);
+  return 0;
+}
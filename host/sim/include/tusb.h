@@ -0,0 +1,130 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+// Simulator stand-in for the TinyUSB header. It declares only what the
+// firmware uses; host/sim/sim_usb.c implements the functions.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+extern int sim_log_level;
+#define TU_LOG1(...) do { if (sim_log_level >= 1) printf(__VA_ARGS__); } while (0)
+#define TU_LOG2(...) do { if (sim_log_level >= 2) printf(__VA_ARGS__); } while (0)
+#define TU_LOG2_MEM(buf, len, indent) do { (void)(buf); (void)(len); (void)(indent); } while (0)
+
+#define TU_ATTR_WEAK __attribute__((weak))
+#define TU_ATTR_PACKED __attribute__((packed))
+#define U16_TO_U8S_LE(_u16) (uint8_t)((_u16) & 0xff), (uint8_t)(((_u16) >> 8) & 0xff)
+
+enum {
+  TUSB_DESC_DEVICE = 1,
+  TUSB_DESC_CONFIGURATION = 2,
+  TUSB_DESC_STRING = 3,
+  TUSB_DESC_INTERFACE = 4,
+  TUSB_DESC_ENDPOINT = 5,
+  TUSB_DESC_CS_INTERFACE = 0x24,
+  TUSB_DESC_CS_ENDPOINT = 0x25
+};
+enum { TUSB_CLASS_AUDIO = 1 };
+enum { TUSB_XFER_BULK = 2 };
+enum { TUSB_DIR_IN_MASK = 0x80 };
+enum { TUSB_DESC_CONFIG_ATT_BUS_POWERED = 0x80 };
+enum { AUDIO_SUBCLASS_CONTROL = 1, AUDIO_SUBCLASS_MIDI_STREAMING = 3 };
+enum { AUDIO_CS_AC_INTERFACE_HEADER = 1 };
+enum { MIDI_CS_INTERFACE_HEADER = 1, MIDI_CS_INTERFACE_IN_JACK = 2, MIDI_CS_INTERFACE_OUT_JACK = 3 };
+enum { MIDI_JACK_EMBEDDED = 1, MIDI_JACK_EXTERNAL = 2 };
+enum { MIDI_CS_ENDPOINT_GENERAL = 1 };
+
+typedef struct TU_ATTR_PACKED {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint16_t bcdUSB;
+  uint8_t bDeviceClass;
+  uint8_t bDeviceSubClass;
+  uint8_t bDeviceProtocol;
+  uint8_t bMaxPacketSize0;
+  uint16_t idVendor;
+  uint16_t idProduct;
+  uint16_t bcdDevice;
+  uint8_t iManufacturer;
+  uint8_t iProduct;
+  uint8_t iSerialNumber;
+  uint8_t bNumConfigurations;
+} tusb_desc_device_t;
+
+typedef struct TU_ATTR_PACKED {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint16_t wTotalLength;
+  uint8_t bNumInterfaces;
+  uint8_t bConfigurationValue;
+  uint8_t iConfiguration;
+  uint8_t bmAttributes;
+  uint8_t bMaxPower;
+} tusb_desc_configuration_t;
+
+typedef enum {
+  XFER_RESULT_SUCCESS,
+  XFER_RESULT_FAILED,
+  XFER_RESULT_STALLED,
+  XFER_RESULT_TIMEOUT
+} xfer_result_t;
+
+typedef struct tuh_xfer_s tuh_xfer_t;
+typedef void (*tuh_xfer_cb_t)(tuh_xfer_t* xfer);
+struct tuh_xfer_s {
+  uint8_t daddr;
+  uint8_t ep_addr;
+  xfer_result_t result;
+  uint32_t actual_len;
+  uint8_t* buffer;
+  tuh_xfer_cb_t complete_cb;
+  uintptr_t user_data;
+};
+
+// USB host stack (core1)
+bool tuh_init(uint8_t rhport);
+void tuh_task(void);
+bool tuh_vid_pid_get(uint8_t daddr, uint16_t* vid, uint16_t* pid);
+bool tuh_descriptor_get_device(uint8_t daddr, void* buffer, uint16_t len, tuh_xfer_cb_t complete_cb, uintptr_t user_data);
+bool tuh_descriptor_get_configuration(uint8_t daddr, uint8_t index, void* buffer, uint16_t len,
+    tuh_xfer_cb_t complete_cb, uintptr_t user_data);
+bool tuh_descriptor_get_string(uint8_t daddr, uint8_t index, uint16_t language_id, void* buffer, uint16_t len,
+    tuh_xfer_cb_t complete_cb, uintptr_t user_data);
+
+// USB device stack (core0)
+bool tud_init(uint8_t rhport);
+void tud_task(void);
+bool tud_connect(void);
+bool tud_disconnect(void);
+
+// Descriptor callbacks the application implements
+uint8_t const* tud_descriptor_device_cb(void);
+uint8_t const* tud_descriptor_configuration_cb(uint8_t index);
+uint16_t const* tud_descriptor_string_cb(uint8_t index, uint16_t langid);
+uint8_t midid_get_endpoint0_size(void);
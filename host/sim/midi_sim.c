@@ -0,0 +1,247 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_sim.c
+ *
+ * This program boots midi_app.c on Linux against the USB model in
+ * sim_usb.c and runs scripted scenarios: first enumeration, a boot from the
+ * descriptor cache, traffic bursts, slow consumers at both ends and an
+ * unplug. Each scenario is one simulated boot in its own process. The flash
+ * carries over from one scenario to the next, the same as a real Pico
+ * across power cycles.
+ *
+ * At the end of a scenario the program types "s" and "l" on the debug
+ * console, so the firmware prints its own ring, retry queue and latency
+ * statistics. Then the program reports what the model saw at both ends of
+ * the link: throughput, FIFO depths and lost or reordered packets. It
+ * exits with a nonzero status if a scenario did not meet its expectations.
+ *
+ * To use this code:
+ *   ./build-host/midi_sim [-v] [scenario...]
+ * Run it with no arguments to run every scenario in order. -v turns on the
+ * firmware's TU_LOG2 messages.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sim_usb.h"
+
+int midi_app_main(void);
+extern int sim_log_level;
+
+typedef struct {
+  const char* name;
+  const char* description;
+  uint32_t attach_ms;   //!< when the MIDI device is plugged in
+  uint32_t detach_ms;   //!< when it is unplugged; 0 to leave it plugged in
+  uint32_t reattach_ms; //!< when it is plugged in again; 0 to leave it unplugged
+  uint32_t traffic_ms;  //!< when the traffic starts; 0 to start it as soon as each end is up
+  uint32_t duration_ms; //!< traffic stops MIDI_SIM_DRAIN_MS before the end
+  sim_traffic_t in;     //!< MIDI device to PC
+  sim_traffic_t out;    //!< PC to MIDI device
+  uint32_t pc_packets_per_ms;
+  uint32_t device_packets_per_ms;
+  bool lossless;        //!< every packet must arrive once and in order
+  bool cached;          //!< the device port must enumerate before the MIDI device is plugged in
+  uint32_t host_mounts; //!< the number of times the MIDI device must mount
+} scenario_t;
+
+// How long the scenario runs after the traffic stops
+#define MIDI_SIM_DRAIN_MS 300
+// How long the firmware has to print its statistics
+#define MIDI_SIM_CONSOLE_MS 100
+
+static const scenario_t scenarios[] = {
+  {
+    .name = "enumeration",
+    .description = "first boot with blank flash; clone the descriptors and enumerate the device port",
+    .attach_ms = 200, .duration_ms = 1500,
+    .in = {.rate = 200}, .out = {.rate = 200},
+    .pc_packets_per_ms = 16, .device_packets_per_ms = 16,
+    .host_mounts = 1,
+  },
+  {
+    .name = "cached-boot",
+    .description = "boot from the descriptor cache; the device port enumerates before the MIDI device is plugged in",
+    .attach_ms = 500, .traffic_ms = 600, .duration_ms = 1500,
+    .in = {.rate = 200}, .out = {.rate = 200},
+    .pc_packets_per_ms = 16, .device_packets_per_ms = 16,
+    .lossless = true, .cached = true, .host_mounts = 1,
+  },
+  {
+    .name = "burst",
+    .description = "steady traffic both ways with a 256 packet burst every 100 ms",
+    .attach_ms = 100, .traffic_ms = 500, .duration_ms = 2000,
+    .in = {.rate = 1000, .burst = 256, .burst_period_ms = 100},
+    .out = {.rate = 1000, .burst = 128, .burst_period_ms = 100},
+    .pc_packets_per_ms = 16, .device_packets_per_ms = 16,
+    .lossless = true, .host_mounts = 1,
+  },
+  {
+    .name = "slow-consumer",
+    .description = "both ends read one packet per ms while the other end sends three",
+    .attach_ms = 100, .duration_ms = 2000,
+    .in = {.rate = 3000}, .out = {.rate = 3000},
+    .pc_packets_per_ms = 1, .device_packets_per_ms = 1,
+    .host_mounts = 1,
+  },
+  {
+    .name = "unplug",
+    .description = "unplug the MIDI device in the middle of traffic and plug it in again",
+    .attach_ms = 100, .detach_ms = 1000, .reattach_ms = 1300, .duration_ms = 2500,
+    .in = {.rate = 1000}, .out = {.rate = 1000},
+    .pc_packets_per_ms = 16, .device_packets_per_ms = 16,
+    .host_mounts = 2,
+  },
+};
+#define MIDI_SIM_NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static void wait_until(uint32_t ms)
+{
+  uint32_t now = sim_now_ms();
+  if (ms > now)
+    usleep((ms - now) * 1000u);
+}
+
+static void print_stream(const char* name, const sim_stream_stats_t* stream)
+{
+  uint32_t active_us = stream->last_us - stream->first_us;
+  unsigned long rate = active_us ? (unsigned long)((uint64_t)(stream->delivered - 1) * 1000000u / active_us) : 0;
+  printf("%s: generated=%lu sent=%lu delivered=%lu missing=%lu out of order=%lu throughput=%lu packets/s\r\n", name,
+      (unsigned long)stream->generated, (unsigned long)stream->sent, (unsigned long)stream->delivered,
+      (unsigned long)stream->missing, (unsigned long)stream->out_of_order, rate);
+  printf("%s: most packets waiting at the source=%lu deepest receive FIFO=%lu\r\n", name,
+      (unsigned long)stream->backlog_max, (unsigned long)stream->fifo_max);
+}
+
+// run one simulated boot; return true if it met the scenario's expectations
+static bool run_scenario(const scenario_t* scenario)
+{
+  if (scenario->traffic_ms == 0) {
+    sim_set_in_traffic(&scenario->in);
+    sim_set_out_traffic(&scenario->out);
+  }
+  sim_set_consumer_rates(scenario->pc_packets_per_ms, scenario->device_packets_per_ms);
+  sim_start(midi_app_main);
+  wait_until(scenario->attach_ms);
+  sim_attach_device();
+  if (scenario->traffic_ms != 0) {
+    // by now both ends are up, so every packet has somewhere to go
+    wait_until(scenario->traffic_ms);
+    sim_set_in_traffic(&scenario->in);
+    sim_set_out_traffic(&scenario->out);
+  }
+  if (scenario->detach_ms) {
+    wait_until(scenario->detach_ms);
+    sim_detach_device();
+    if (scenario->reattach_ms) {
+      wait_until(scenario->reattach_ms);
+      sim_attach_device();
+    }
+  }
+  wait_until(scenario->duration_ms - MIDI_SIM_DRAIN_MS);
+  sim_quiesce();
+  wait_until(scenario->duration_ms);
+  sim_console("sl");
+  wait_until(scenario->duration_ms + MIDI_SIM_CONSOLE_MS);
+  sim_stop();
+
+  sim_stats_t stats;
+  sim_get_stats(&stats);
+  printf("--- %s results\r\n", scenario->name);
+  print_stream("MIDI IN", &stats.in);
+  print_stream("MIDI OUT", &stats.out);
+  printf("host port: mounts=%lu descriptor requests=%lu OUT transfers=%lu packets per transfer=%.2f\r\n",
+      (unsigned long)stats.host_mounts, (unsigned long)stats.descriptor_requests, (unsigned long)stats.out_transfers,
+      stats.out_transfers ? (double)stats.out_transfer_packets / stats.out_transfers : 0.0);
+  printf("device port: enumerations=%lu first at %lu ms disconnects=%lu product=\"%s\"\r\n",
+      (unsigned long)stats.enumerations, (unsigned long)stats.first_enumeration_ms, (unsigned long)stats.disconnects,
+      stats.product);
+
+  bool passed = true;
+  if (stats.host_mounts != scenario->host_mounts) {
+    printf("FAIL: the MIDI device mounted %lu times\r\n", (unsigned long)stats.host_mounts);
+    passed = false;
+  }
+  if (stats.enumerations == 0 || strcmp(stats.product, "KeyLab Essential 88") != 0) {
+    printf("FAIL: the PC did not end up with the MIDI device's product name\r\n");
+    passed = false;
+  }
+  if (scenario->cached && stats.first_enumeration_ms >= scenario->attach_ms) {
+    printf("FAIL: the device port waited for the MIDI device\r\n");
+    passed = false;
+  }
+  if (scenario->lossless) {
+    const sim_stream_stats_t* streams[2] = {&stats.in, &stats.out};
+    for (int idx = 0; idx < 2; idx++) {
+      const sim_stream_stats_t* stream = streams[idx];
+      if (stream->delivered != stream->generated || stream->missing != 0 || stream->out_of_order != 0) {
+        printf("FAIL: %s lost or reordered packets\r\n", idx == 0 ? "MIDI IN" : "MIDI OUT");
+        passed = false;
+      }
+    }
+  }
+  return passed;
+}
+
+int main(int argc, char* argv[])
+{
+  int first_arg = 1;
+  if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+    sim_log_level = 2;
+    ++first_arg;
+  }
+  sim_init();
+  int nfailed = 0;
+  for (size_t idx = 0; idx < MIDI_SIM_NUM_SCENARIOS; idx++) {
+    const scenario_t* scenario = &scenarios[idx];
+    bool selected = first_arg == argc;
+    for (int arg = first_arg; arg < argc; arg++)
+      selected |= strcmp(argv[arg], scenario->name) == 0;
+    if (!selected)
+      continue;
+    printf("=== %s: %s\r\n", scenario->name, scenario->description);
+    fflush(stdout);
+    // the firmware's static state lasts for one boot, so each boot gets a fresh process
+    pid_t pid = fork();
+    if (pid == 0) {
+      bool passed = run_scenario(scenario);
+      fflush(stdout);
+      _exit(passed ? 0 : 1);
+    }
+    int status = 1;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      printf("=== %s FAILED\r\n", scenario->name);
+      ++nfailed;
+    }
+    else {
+      printf("=== %s passed\r\n", scenario->name);
+    }
+  }
+  return nfailed == 0 ? 0 : 1;
+}
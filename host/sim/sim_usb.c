@@ -0,0 +1,925 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file sim_usb.c
+ *
+ * This file contains a Linux model of the USB ports midi_app.c drives.
+ * See sim_usb.h. The host port has one MIDI device plugged into it with
+ * two IN cables and two OUT cables. The model keeps time in 1 ms USB frames:
+ * each frame the MIDI device fills the host driver's receive FIFO with at
+ * most one 64-byte transfer and takes the transfer tuh_midi_stream_flush()
+ * started once it has room for it, and the PC reads the device port's
+ * transmit FIFO and fills its receive FIFO. All model state is guarded by
+ * one mutex. The firmware callbacks run without holding it, in the thread
+ * of the core that runs them on the RP2040.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "bsp/board_api.h"
+#include "tusb.h"
+#include "usb_midi_host.h"
+#include "class/midi/midi_device.h"
+#include "sim_usb.h"
+
+// How long the host stack takes to enumerate the MIDI device after it is plugged in
+#define SIM_HOST_ENUMERATION_US 50000
+// How long a descriptor request to the MIDI device takes
+#define SIM_DESCRIPTOR_REQUEST_US 1000
+// How long the PC takes to enumerate the device port after it connects
+#define SIM_PC_ENUMERATION_US 20000
+// How many packets fit in one full speed bulk transfer
+#define SIM_TRANSFER_PACKETS 16
+#define SIM_DEV_ADDR 1
+#define SIM_NUM_CABLES_IN 2
+#define SIM_NUM_CABLES_OUT 2
+#define SIM_LANGID 0x0409
+
+int sim_log_level = 1;
+uint8_t* sim_flash;
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_cond = PTHREAD_COND_INITIALIZER;
+static struct timespec boot_time;
+static bool stopping = false;
+static pthread_t core0_thread, core1_thread;
+static bool core1_launched = false;
+static int (*core0_entry)(void);
+static void (*core1_entry)(void);
+static sim_stats_t stats;
+
+// multicore lockout
+static struct {
+  bool victim;    // core1 called multicore_lockout_victim_init()
+  bool requested; // core0 wants core1 paused
+  bool paused;    // core1 is paused
+  bool exited;    // core1 stopped for good
+} lockout;
+
+static struct {
+  char chars[64];
+  uint8_t head;
+  uint8_t count;
+} console;
+
+typedef struct {
+  uint32_t packets[SIM_TRANSFER_PACKETS];
+  uint8_t head;
+  uint8_t count;
+  uint8_t capacity;
+} sim_fifo_t;
+
+// a traffic source at one end of the USB link and its sink at the other
+typedef struct {
+  sim_traffic_t traffic;
+  bool active;
+  uint64_t start_us;
+  uint64_t steady;   // packets of the steady rate generated so far
+  uint64_t bursts;   // bursts generated so far
+  uint32_t backlog;  // packets generated but not sent
+  uint16_t next_seq; // sequence number of the next packet sent
+  uint16_t expected_seq; // sequence number the sink expects next
+  sim_stream_stats_t* stats;
+} sim_stream_t;
+
+static sim_stream_t in_stream = {.stats = &stats.in};
+static sim_stream_t out_stream = {.stats = &stats.out};
+
+// the MIDI device on the host port
+static struct {
+  bool plugged;
+  bool mounted;
+  uint64_t plug_us;
+  uint64_t frame_us;
+  sim_fifo_t rx; // host driver receive FIFO
+  sim_fifo_t tx; // host driver transmit FIFO
+  uint32_t inflight[SIM_TRANSFER_PACKETS]; // the bulk OUT transfer in progress
+  uint8_t ninflight;
+  uint32_t accepted;  // packets of the transfer in progress the device took so far
+  uint32_t accept_rate;
+  bool xfer_busy;     // a descriptor request is in progress
+  uint64_t xfer_due_us;
+  uint8_t xfer_type;
+  uint8_t xfer_index;
+  uint16_t xfer_len;
+  tuh_xfer_t xfer;
+} host = {
+  .rx = {.capacity = SIM_HOST_FIFO_PACKETS},
+  .tx = {.capacity = SIM_HOST_FIFO_PACKETS},
+  .accept_rate = SIM_TRANSFER_PACKETS,
+};
+
+// the PC on the device port
+static struct {
+  bool connected;
+  bool mounted;
+  uint64_t connect_us;
+  uint64_t frame_us;
+  sim_fifo_t rx; // device driver receive FIFO
+  sim_fifo_t tx; // device driver transmit FIFO
+  uint32_t read_rate;
+} pc = {
+  .rx = {.capacity = SIM_DEVICE_FIFO_PACKETS},
+  .tx = {.capacity = SIM_DEVICE_FIFO_PACKETS},
+  .read_rate = SIM_TRANSFER_PACKETS,
+};
+
+//--------------------------------------------------------------------+
+// MIDI device descriptors
+//--------------------------------------------------------------------+
+#define SIM_VID 0x1c75
+#define SIM_PID 0x02cb
+static const char* const device_strings[] = {
+  NULL, "Arturia", "KeyLab Essential 88", "SIM00001", "MIDI IN", "DAW IN", "MIDI OUT", "DAW OUT",
+};
+static const uint8_t jack_istrings[] = {4, 5, 6, 7};
+
+static const tusb_desc_device_t device_descriptor = {
+  .bLength = sizeof(tusb_desc_device_t),
+  .bDescriptorType = TUSB_DESC_DEVICE,
+  .bcdUSB = 0x0200,
+  .bMaxPacketSize0 = 64,
+  .idVendor = SIM_VID,
+  .idProduct = SIM_PID,
+  .bcdDevice = 0x0100,
+  .iManufacturer = 1,
+  .iProduct = 2,
+  .iSerialNumber = 3,
+  .bNumConfigurations = 1,
+};
+
+#define SIM_CONFIG_LEN (9 + 9 + 9 + 9 + 7 + SIM_NUM_CABLES_IN * (6 + 9) + SIM_NUM_CABLES_OUT * (6 + 9) + \
+    7 + 4 + SIM_NUM_CABLES_OUT + 7 + 4 + SIM_NUM_CABLES_IN)
+static uint8_t config_descriptor[SIM_CONFIG_LEN];
+
+// An Audio Control interface and a MIDI Streaming interface with external and embedded jacks per cable
+static void build_config_descriptor(void)
+{
+  uint8_t* ptr = config_descriptor;
+  uint16_t ms_len = 7 + SIM_NUM_CABLES_IN * (6 + 9) + SIM_NUM_CABLES_OUT * (6 + 9);
+  const uint8_t head[] = {
+    9, TUSB_DESC_CONFIGURATION, U16_TO_U8S_LE(SIM_CONFIG_LEN), 2, 1, 0, TUSB_DESC_CONFIG_ATT_BUS_POWERED, 50,
+    9, TUSB_DESC_INTERFACE, 0, 0, 0, TUSB_CLASS_AUDIO, AUDIO_SUBCLASS_CONTROL, 0, 0,
+    9, TUSB_DESC_CS_INTERFACE, AUDIO_CS_AC_INTERFACE_HEADER, U16_TO_U8S_LE(0x0100), U16_TO_U8S_LE(9), 1, 1,
+    9, TUSB_DESC_INTERFACE, 1, 0, 2, TUSB_CLASS_AUDIO, AUDIO_SUBCLASS_MIDI_STREAMING, 0, 0,
+    7, TUSB_DESC_CS_INTERFACE, MIDI_CS_INTERFACE_HEADER, U16_TO_U8S_LE(0x0100), U16_TO_U8S_LE(ms_len),
+  };
+  memcpy(ptr, head, sizeof(head));
+  ptr += sizeof(head);
+  // IN cable k: external IN jack 2k+1 feeds embedded OUT jack 2k+2
+  for (uint8_t cable = 0; cable < SIM_NUM_CABLES_IN; cable++) {
+    uint8_t id = 2 * cable + 1;
+    const uint8_t jacks[] = {
+      6, TUSB_DESC_CS_INTERFACE, MIDI_CS_INTERFACE_IN_JACK, MIDI_JACK_EXTERNAL, id, jack_istrings[cable],
+      9, TUSB_DESC_CS_INTERFACE, MIDI_CS_INTERFACE_OUT_JACK, MIDI_JACK_EMBEDDED, id + 1, 1, id, 1, 0,
+    };
+    memcpy(ptr, jacks, sizeof(jacks));
+    ptr += sizeof(jacks);
+  }
+  // OUT cable k: embedded IN jack feeds external OUT jack
+  for (uint8_t cable = 0; cable < SIM_NUM_CABLES_OUT; cable++) {
+    uint8_t id = 2 * (SIM_NUM_CABLES_IN + cable) + 1;
+    const uint8_t jacks[] = {
+      6, TUSB_DESC_CS_INTERFACE, MIDI_CS_INTERFACE_IN_JACK, MIDI_JACK_EMBEDDED, id, 0,
+      9, TUSB_DESC_CS_INTERFACE, MIDI_CS_INTERFACE_OUT_JACK, MIDI_JACK_EXTERNAL, id + 1, 1, id, 1,
+      jack_istrings[SIM_NUM_CABLES_IN + cable],
+    };
+    memcpy(ptr, jacks, sizeof(jacks));
+    ptr += sizeof(jacks);
+  }
+  const uint8_t ep_out[] = {7, TUSB_DESC_ENDPOINT, 0x01, TUSB_XFER_BULK, U16_TO_U8S_LE(64), 0,
+      4 + SIM_NUM_CABLES_OUT, TUSB_DESC_CS_ENDPOINT, MIDI_CS_ENDPOINT_GENERAL, SIM_NUM_CABLES_OUT};
+  memcpy(ptr, ep_out, sizeof(ep_out));
+  ptr += sizeof(ep_out);
+  for (uint8_t cable = 0; cable < SIM_NUM_CABLES_OUT; cable++)
+    *ptr++ = 2 * (SIM_NUM_CABLES_IN + cable) + 1;
+  const uint8_t ep_in[] = {7, TUSB_DESC_ENDPOINT, 0x81, TUSB_XFER_BULK, U16_TO_U8S_LE(64), 0,
+      4 + SIM_NUM_CABLES_IN, TUSB_DESC_CS_ENDPOINT, MIDI_CS_ENDPOINT_GENERAL, SIM_NUM_CABLES_IN};
+  memcpy(ptr, ep_in, sizeof(ep_in));
+  ptr += sizeof(ep_in);
+  for (uint8_t cable = 0; cable < SIM_NUM_CABLES_IN; cable++)
+    *ptr++ = 2 * cable + 2;
+}
+
+// Fill buf with a descriptor the way the MIDI device answers GET_DESCRIPTOR; return its length or 0 to stall
+static uint16_t get_descriptor(uint8_t type, uint8_t index, uint8_t* buf)
+{
+  if (type == TUSB_DESC_DEVICE) {
+    memcpy(buf, &device_descriptor, sizeof(device_descriptor));
+    return sizeof(device_descriptor);
+  }
+  if (type == TUSB_DESC_CONFIGURATION && index == 0) {
+    memcpy(buf, config_descriptor, sizeof(config_descriptor));
+    return sizeof(config_descriptor);
+  }
+  if (type != TUSB_DESC_STRING)
+    return 0;
+  if (index == 0) {
+    const uint8_t langids[] = {4, TUSB_DESC_STRING, U16_TO_U8S_LE(SIM_LANGID)};
+    memcpy(buf, langids, sizeof(langids));
+    return sizeof(langids);
+  }
+  if (index >= sizeof(device_strings) / sizeof(device_strings[0]))
+    return 0;
+  const char* str = device_strings[index];
+  uint8_t len = 2;
+  for (; *str; str++) {
+    buf[len++] = (uint8_t)*str;
+    buf[len++] = 0;
+  }
+  buf[0] = len;
+  buf[1] = TUSB_DESC_STRING;
+  return len;
+}
+
+//--------------------------------------------------------------------+
+// Traffic
+//--------------------------------------------------------------------+
+static bool fifo_push(sim_fifo_t* fifo, uint32_t packet)
+{
+  if (fifo->count == fifo->capacity)
+    return false;
+  fifo->packets[(fifo->head + fifo->count++) % fifo->capacity] = packet;
+  return true;
+}
+
+static bool fifo_pop(sim_fifo_t* fifo, uint32_t* packet)
+{
+  if (fifo->count == 0)
+    return false;
+  *packet = fifo->packets[fifo->head];
+  fifo->head = (fifo->head + 1) % fifo->capacity;
+  --fifo->count;
+  return true;
+}
+
+static void fifo_clear(sim_fifo_t* fifo)
+{
+  fifo->head = 0;
+  fifo->count = 0;
+}
+
+static void stream_start(sim_stream_t* stream, uint64_t now)
+{
+  stream->active = stream->traffic.rate != 0 || stream->traffic.burst != 0;
+  stream->start_us = now;
+  stream->steady = 0;
+  stream->bursts = 0;
+}
+
+// the source went away; it forgets the packets it did not send
+static void stream_stop(sim_stream_t* stream)
+{
+  stream->active = false;
+  stream->backlog = 0;
+}
+
+static void stream_generate(sim_stream_t* stream, uint64_t now)
+{
+  if (!stream->active)
+    return;
+  uint64_t elapsed = now - stream->start_us;
+  uint64_t steady = elapsed * stream->traffic.rate / 1000000;
+  uint64_t npackets = steady - stream->steady;
+  stream->steady = steady;
+  if (stream->traffic.burst_period_ms != 0) {
+    uint64_t bursts = elapsed / (stream->traffic.burst_period_ms * 1000ull);
+    npackets += (bursts - stream->bursts) * stream->traffic.burst;
+    stream->bursts = bursts;
+  }
+  stream->backlog += (uint32_t)npackets;
+  stream->stats->generated += (uint32_t)npackets;
+  if (stream->backlog > stream->stats->backlog_max)
+    stream->stats->backlog_max = stream->backlog;
+}
+
+// take the next packet off the backlog: poly aftertouch on cable 0 carrying a 14-bit sequence number
+static uint32_t stream_next_packet(sim_stream_t* stream)
+{
+  uint16_t seq = stream->next_seq++ & 0x3fff;
+  uint8_t bytes[4] = {0x0A, 0xA0, seq & 0x7f, (seq >> 7) & 0x7f};
+  uint32_t packet;
+  memcpy(&packet, bytes, sizeof(packet));
+  --stream->backlog;
+  ++stream->stats->sent;
+  return packet;
+}
+
+// put back a packet that did not fit on the bus
+static void stream_unsend(sim_stream_t* stream)
+{
+  --stream->next_seq;
+  ++stream->backlog;
+  --stream->stats->sent;
+}
+
+static void stream_deliver(sim_stream_t* stream, uint32_t packet, uint64_t now)
+{
+  uint8_t bytes[4];
+  memcpy(bytes, &packet, sizeof(bytes));
+  if (bytes[0] != 0x0A || bytes[1] != 0xA0)
+    return; // the firmware sent it on its own
+  uint16_t seq = bytes[2] | (bytes[3] << 7);
+  uint16_t ahead = (seq - stream->expected_seq) & 0x3fff;
+  if (ahead < 0x2000) {
+    stream->stats->missing += ahead;
+    stream->expected_seq = (seq + 1) & 0x3fff;
+  }
+  else {
+    ++stream->stats->out_of_order;
+  }
+  if (stream->stats->delivered++ == 0)
+    stream->stats->first_us = (uint32_t)now;
+  stream->stats->last_us = (uint32_t)now;
+}
+
+//--------------------------------------------------------------------+
+// pico-sdk
+//--------------------------------------------------------------------+
+uint64_t time_us_64(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - boot_time.tv_sec) * 1000000u + now.tv_nsec / 1000 - boot_time.tv_nsec / 1000;
+}
+
+uint32_t time_us_32(void)
+{
+  return (uint32_t)time_us_64();
+}
+
+void sleep_us(uint64_t us)
+{
+  usleep(us);
+}
+
+void sleep_ms(uint32_t ms)
+{
+  usleep(ms * 1000u);
+}
+
+// core0 calls it every time through the main loop, so core0 stops here.
+// Both cores yield once per loop so they run side by side on a single CPU.
+int getchar_timeout_us(uint32_t timeout_us)
+{
+  (void)timeout_us;
+  int chr = PICO_ERROR_TIMEOUT;
+  sched_yield();
+  pthread_mutex_lock(&sim_lock);
+  if (stopping) {
+    pthread_mutex_unlock(&sim_lock);
+    pthread_exit(NULL);
+  }
+  if (console.count != 0) {
+    chr = console.chars[console.head];
+    console.head = (console.head + 1) % sizeof(console.chars);
+    --console.count;
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return chr;
+}
+
+static void* core1_thread_main(void* arg)
+{
+  (void)arg;
+  core1_entry();
+  return NULL;
+}
+
+void multicore_reset_core1(void)
+{
+}
+
+void multicore_launch_core1(void (*entry)(void))
+{
+  core1_entry = entry;
+  core1_launched = pthread_create(&core1_thread, NULL, core1_thread_main, NULL) == 0;
+}
+
+void multicore_lockout_victim_init(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  lockout.victim = true;
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void multicore_lockout_start_blocking(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  if (lockout.victim) {
+    lockout.requested = true;
+    while (!lockout.paused && !lockout.exited)
+      pthread_cond_wait(&sim_cond, &sim_lock);
+  }
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void multicore_lockout_end_blocking(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  lockout.requested = false;
+  pthread_cond_broadcast(&sim_cond);
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count)
+{
+  memset(sim_flash + flash_offs, 0xff, count);
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t* data, size_t count)
+{
+  // programming can only clear bits
+  for (size_t idx = 0; idx < count; idx++)
+    sim_flash[flash_offs + idx] &= data[idx];
+}
+
+void board_init(void)
+{
+}
+
+uint32_t board_millis(void)
+{
+  return (uint32_t)(time_us_64() / 1000);
+}
+
+void board_led_write(bool state)
+{
+  (void)state;
+}
+
+//--------------------------------------------------------------------+
+// USB host port (core1)
+//--------------------------------------------------------------------+
+bool tuh_init(uint8_t rhport)
+{
+  (void)rhport;
+  return true;
+}
+
+// core1 calls it every time through its loop, so core1 pauses and stops here
+void tuh_task(void)
+{
+  uint64_t now = time_us_64();
+  bool mount = false, unmount = false, xfer_done = false;
+  uint32_t nrx = 0;
+  tuh_xfer_t xfer;
+  sched_yield();
+  pthread_mutex_lock(&sim_lock);
+  if (lockout.requested) {
+    lockout.paused = true;
+    pthread_cond_broadcast(&sim_cond);
+    while (lockout.requested)
+      pthread_cond_wait(&sim_cond, &sim_lock);
+    lockout.paused = false;
+  }
+  if (stopping) {
+    lockout.exited = true;
+    pthread_cond_broadcast(&sim_cond);
+    pthread_mutex_unlock(&sim_lock);
+    pthread_exit(NULL);
+  }
+  if (host.plugged && !host.mounted && now - host.plug_us >= SIM_HOST_ENUMERATION_US) {
+    host.mounted = true;
+    mount = true;
+    ++stats.host_mounts;
+    stream_start(&in_stream, now);
+  }
+  else if (!host.plugged && host.mounted) {
+    host.mounted = false;
+    unmount = true;
+    stream_stop(&in_stream);
+    fifo_clear(&host.rx);
+    fifo_clear(&host.tx);
+    host.ninflight = 0;
+    host.xfer_busy = false;
+  }
+  if (host.xfer_busy && now >= host.xfer_due_us) {
+    uint8_t desc[256];
+    uint16_t len = get_descriptor(host.xfer_type, host.xfer_index, desc);
+    host.xfer.result = len == 0 ? XFER_RESULT_STALLED : XFER_RESULT_SUCCESS;
+    host.xfer.actual_len = len < host.xfer_len ? len : host.xfer_len;
+    memcpy(host.xfer.buffer, desc, host.xfer.actual_len);
+    host.xfer_busy = false;
+    xfer = host.xfer;
+    xfer_done = true;
+  }
+  if (now - host.frame_us >= 1000) {
+    uint32_t nframes = (uint32_t)((now - host.frame_us) / 1000);
+    host.frame_us += nframes * 1000ull;
+    if (host.mounted) {
+      // one bulk IN transfer per frame
+      stream_generate(&in_stream, now);
+      for (uint32_t idx = 0; idx < SIM_TRANSFER_PACKETS && in_stream.backlog != 0; idx++) {
+        if (!fifo_push(&host.rx, stream_next_packet(&in_stream))) {
+          stream_unsend(&in_stream);
+          break;
+        }
+      }
+      if (host.rx.count > stats.in.fifo_max)
+        stats.in.fifo_max = host.rx.count;
+      // the bulk OUT transfer completes once the MIDI device has room for all of it
+      if (host.ninflight != 0) {
+        host.accepted += nframes * host.accept_rate;
+        if (host.accepted >= host.ninflight) {
+          for (uint8_t idx = 0; idx < host.ninflight; idx++)
+            stream_deliver(&out_stream, host.inflight[idx], now);
+          host.ninflight = 0;
+          host.accepted = 0;
+        }
+      }
+    }
+  }
+  if (host.mounted)
+    nrx = host.rx.count;
+  pthread_mutex_unlock(&sim_lock);
+
+  if (unmount)
+    tuh_midi_umount_cb(SIM_DEV_ADDR, 0);
+  if (mount)
+    tuh_midi_mount_cb(SIM_DEV_ADDR, 0x81, 0x01, SIM_NUM_CABLES_IN, SIM_NUM_CABLES_OUT);
+  if (xfer_done && xfer.complete_cb)
+    xfer.complete_cb(&xfer);
+  if (nrx != 0)
+    tuh_midi_rx_cb(SIM_DEV_ADDR, nrx);
+}
+
+bool tuh_vid_pid_get(uint8_t daddr, uint16_t* vid, uint16_t* pid)
+{
+  if (daddr != SIM_DEV_ADDR || !tuh_midi_configured(daddr))
+    return false;
+  *vid = SIM_VID;
+  *pid = SIM_PID;
+  return true;
+}
+
+static bool start_descriptor_request(uint8_t daddr, uint8_t type, uint8_t index, void* buffer, uint16_t len,
+    tuh_xfer_cb_t complete_cb, uintptr_t user_data)
+{
+  bool started = false;
+  pthread_mutex_lock(&sim_lock);
+  if (daddr == SIM_DEV_ADDR && host.mounted && !host.xfer_busy) {
+    host.xfer_busy = true;
+    host.xfer_due_us = time_us_64() + SIM_DESCRIPTOR_REQUEST_US;
+    host.xfer_type = type;
+    host.xfer_index = index;
+    host.xfer_len = len;
+    host.xfer = (tuh_xfer_t){.daddr = daddr, .buffer = buffer, .complete_cb = complete_cb, .user_data = user_data};
+    ++stats.descriptor_requests;
+    started = true;
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return started;
+}
+
+bool tuh_descriptor_get_device(uint8_t daddr, void* buffer, uint16_t len, tuh_xfer_cb_t complete_cb, uintptr_t user_data)
+{
+  return start_descriptor_request(daddr, TUSB_DESC_DEVICE, 0, buffer, len, complete_cb, user_data);
+}
+
+bool tuh_descriptor_get_configuration(uint8_t daddr, uint8_t index, void* buffer, uint16_t len,
+    tuh_xfer_cb_t complete_cb, uintptr_t user_data)
+{
+  return start_descriptor_request(daddr, TUSB_DESC_CONFIGURATION, index, buffer, len, complete_cb, user_data);
+}
+
+bool tuh_descriptor_get_string(uint8_t daddr, uint8_t index, uint16_t language_id, void* buffer, uint16_t len,
+    tuh_xfer_cb_t complete_cb, uintptr_t user_data)
+{
+  (void)language_id; // the MIDI device only has one language
+  return start_descriptor_request(daddr, TUSB_DESC_STRING, index, buffer, len, complete_cb, user_data);
+}
+
+bool tuh_midi_configured(uint8_t dev_addr)
+{
+  pthread_mutex_lock(&sim_lock);
+  bool configured = dev_addr == SIM_DEV_ADDR && host.mounted;
+  pthread_mutex_unlock(&sim_lock);
+  return configured;
+}
+
+uint8_t tuh_midi_get_all_istrings(uint8_t dev_addr, const uint8_t** istrings)
+{
+  (void)dev_addr;
+  *istrings = jack_istrings;
+  return sizeof(jack_istrings);
+}
+
+uint32_t tuh_midi_packet_read_n(uint8_t dev_addr, uint8_t* buffer, uint32_t bufsize)
+{
+  uint32_t nread = 0;
+  pthread_mutex_lock(&sim_lock);
+  if (dev_addr == SIM_DEV_ADDR) {
+    for (; nread + 4 <= bufsize && fifo_pop(&host.rx, (uint32_t*)(buffer + nread)); nread += 4) {
+    }
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return nread;
+}
+
+uint32_t tuh_midi_packet_write_n(uint8_t dev_addr, const uint8_t* buffer, uint32_t bufsize)
+{
+  uint32_t nwritten = 0;
+  pthread_mutex_lock(&sim_lock);
+  if (dev_addr == SIM_DEV_ADDR && host.mounted) {
+    for (; nwritten + 4 <= bufsize; nwritten += 4) {
+      uint32_t packet;
+      memcpy(&packet, buffer + nwritten, sizeof(packet));
+      if (!fifo_push(&host.tx, packet))
+        break;
+    }
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return nwritten;
+}
+
+uint32_t tuh_midi_stream_flush(uint8_t dev_addr)
+{
+  uint32_t nbytes = 0;
+  pthread_mutex_lock(&sim_lock);
+  if (dev_addr == SIM_DEV_ADDR && host.mounted && host.ninflight == 0 && host.tx.count != 0) {
+    while (fifo_pop(&host.tx, &host.inflight[host.ninflight]))
+      ++host.ninflight;
+    nbytes = host.ninflight * 4u;
+    ++stats.out_transfers;
+    stats.out_transfer_packets += host.ninflight;
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return nbytes;
+}
+
+//--------------------------------------------------------------------+
+// USB device port (core0)
+//--------------------------------------------------------------------+
+bool tud_init(uint8_t rhport)
+{
+  (void)rhport;
+  return tud_connect();
+}
+
+bool tud_connect(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  pc.connected = true;
+  pc.connect_us = time_us_64();
+  pthread_mutex_unlock(&sim_lock);
+  return true;
+}
+
+bool tud_disconnect(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  if (pc.connected)
+    ++stats.disconnects;
+  pc.connected = false;
+  pc.mounted = false;
+  stream_stop(&out_stream);
+  fifo_clear(&pc.rx);
+  fifo_clear(&pc.tx);
+  pthread_mutex_unlock(&sim_lock);
+  return true;
+}
+
+static void string_to_ascii(const uint16_t* desc, char* str, size_t size)
+{
+  size_t len = 0;
+  if (desc != NULL) {
+    for (uint8_t idx = 1; idx < (desc[0] & 0xff) / 2 && len + 1 < size; idx++)
+      str[len++] = (char)desc[idx];
+  }
+  str[len] = '\0';
+}
+
+// read the descriptors the way the PC does when the device port connects
+static bool pc_enumerate(void)
+{
+  const tusb_desc_device_t* device = (const tusb_desc_device_t*)tud_descriptor_device_cb();
+  const uint8_t* config = tud_descriptor_configuration_cb(0);
+  if (device == NULL || device->bLength != sizeof(tusb_desc_device_t) || config == NULL ||
+      config[1] != TUSB_DESC_CONFIGURATION) {
+    TU_LOG1("sim: the PC could not read the device port descriptors\r\n");
+    return false;
+  }
+  const uint16_t* langids = tud_descriptor_string_cb(0, 0);
+  uint16_t langid = langids != NULL && (langids[0] & 0xff) >= 4 ? langids[1] : SIM_LANGID;
+  char product[sizeof(stats.product)];
+  string_to_ascii(device->iProduct ? tud_descriptor_string_cb(device->iProduct, langid) : NULL, product, sizeof(product));
+  if (device->iManufacturer)
+    (void)tud_descriptor_string_cb(device->iManufacturer, langid);
+  pthread_mutex_lock(&sim_lock);
+  memcpy(stats.product, product, sizeof(product));
+  pthread_mutex_unlock(&sim_lock);
+  TU_LOG1("sim: the PC enumerated %04x:%04x \"%s\" at %lu ms\r\n", device->idVendor, device->idProduct, product,
+      (unsigned long)(time_us_64() / 1000));
+  return true;
+}
+
+void tud_task(void)
+{
+  uint64_t now = time_us_64();
+  pthread_mutex_lock(&sim_lock);
+  bool enumerate = pc.connected && !pc.mounted && now - pc.connect_us >= SIM_PC_ENUMERATION_US;
+  pthread_mutex_unlock(&sim_lock);
+  if (enumerate) {
+    bool enumerated = pc_enumerate();
+    pthread_mutex_lock(&sim_lock);
+    if (!enumerated) {
+      pc.connect_us = now; // try again later
+    }
+    else if (pc.connected) {
+      pc.mounted = true;
+      if (stats.enumerations++ == 0)
+        stats.first_enumeration_ms = (uint32_t)(now / 1000);
+      stream_start(&out_stream, now);
+    }
+    pthread_mutex_unlock(&sim_lock);
+  }
+  pthread_mutex_lock(&sim_lock);
+  if (now - pc.frame_us >= 1000) {
+    uint32_t nframes = (uint32_t)((now - pc.frame_us) / 1000);
+    pc.frame_us += nframes * 1000ull;
+    if (pc.mounted) {
+      uint32_t packet;
+      for (uint32_t idx = 0; idx < nframes * pc.read_rate && fifo_pop(&pc.tx, &packet); idx++)
+        stream_deliver(&in_stream, packet, now);
+      stream_generate(&out_stream, now);
+      for (uint32_t idx = 0; idx < SIM_TRANSFER_PACKETS && out_stream.backlog != 0; idx++) {
+        if (!fifo_push(&pc.rx, stream_next_packet(&out_stream))) {
+          stream_unsend(&out_stream);
+          break;
+        }
+      }
+      if (pc.rx.count > stats.out.fifo_max)
+        stats.out.fifo_max = pc.rx.count;
+    }
+  }
+  pthread_mutex_unlock(&sim_lock);
+}
+
+bool tud_midi_mounted(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  bool mounted = pc.mounted;
+  pthread_mutex_unlock(&sim_lock);
+  return mounted;
+}
+
+bool tud_midi_packet_read(uint8_t packet[4])
+{
+  pthread_mutex_lock(&sim_lock);
+  bool read = fifo_pop(&pc.rx, (uint32_t*)packet);
+  pthread_mutex_unlock(&sim_lock);
+  return read;
+}
+
+bool tud_midi_packet_write(const uint8_t packet[4])
+{
+  uint32_t word;
+  memcpy(&word, packet, sizeof(word));
+  pthread_mutex_lock(&sim_lock);
+  bool written = pc.mounted && fifo_push(&pc.tx, word);
+  pthread_mutex_unlock(&sim_lock);
+  return written;
+}
+
+//--------------------------------------------------------------------+
+// Scenario control
+//--------------------------------------------------------------------+
+void sim_init(void)
+{
+  sim_flash = mmap(NULL, PICO_FLASH_SIZE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (sim_flash == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  memset(sim_flash, 0xff, PICO_FLASH_SIZE_BYTES);
+  build_config_descriptor();
+}
+
+void sim_set_in_traffic(const sim_traffic_t* traffic)
+{
+  pthread_mutex_lock(&sim_lock);
+  in_stream.traffic = *traffic;
+  if (host.mounted)
+    stream_start(&in_stream, time_us_64());
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void sim_set_out_traffic(const sim_traffic_t* traffic)
+{
+  pthread_mutex_lock(&sim_lock);
+  out_stream.traffic = *traffic;
+  if (pc.mounted)
+    stream_start(&out_stream, time_us_64());
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void sim_set_consumer_rates(uint32_t pc_packets_per_ms, uint32_t device_packets_per_ms)
+{
+  pthread_mutex_lock(&sim_lock);
+  pc.read_rate = pc_packets_per_ms;
+  host.accept_rate = device_packets_per_ms;
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void sim_quiesce(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  in_stream.active = false;
+  out_stream.active = false;
+  pthread_mutex_unlock(&sim_lock);
+}
+
+static void* core0_thread_main(void* arg)
+{
+  (void)arg;
+  core0_entry();
+  return NULL;
+}
+
+void sim_start(int (*app_main)(void))
+{
+  clock_gettime(CLOCK_MONOTONIC, &boot_time);
+  core0_entry = app_main;
+  if (pthread_create(&core0_thread, NULL, core0_thread_main, NULL) != 0) {
+    perror("pthread_create");
+    exit(1);
+  }
+}
+
+void sim_stop(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  stopping = true;
+  pthread_cond_broadcast(&sim_cond);
+  pthread_mutex_unlock(&sim_lock);
+  pthread_join(core0_thread, NULL);
+  if (core1_launched)
+    pthread_join(core1_thread, NULL);
+}
+
+void sim_attach_device(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  host.plugged = true;
+  host.plug_us = time_us_64();
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void sim_detach_device(void)
+{
+  pthread_mutex_lock(&sim_lock);
+  host.plugged = false;
+  pthread_mutex_unlock(&sim_lock);
+}
+
+void sim_console(const char* chars)
+{
+  pthread_mutex_lock(&sim_lock);
+  for (; *chars && console.count < sizeof(console.chars); chars++)
+    console.chars[(console.head + console.count++) % sizeof(console.chars)] = *chars;
+  pthread_mutex_unlock(&sim_lock);
+}
+
+uint32_t sim_now_ms(void)
+{
+  return (uint32_t)(time_us_64() / 1000);
+}
+
+void sim_get_stats(sim_stats_t* copy)
+{
+  pthread_mutex_lock(&sim_lock);
+  *copy = stats;
+  pthread_mutex_unlock(&sim_lock);
+}
@@ -0,0 +1,156 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file sim_usb.h
+ *
+ * This file contains the interface to a Linux model of the USB ports that
+ * midi_app.c drives: the PIO-USB host port with a MIDI device plugged into
+ * it and the native USB device port with a PC attached. The model stands in
+ * for the pico-sdk, TinyUSB and USB MIDI driver functions declared in
+ * host/sim/include. core0 and core1 each run in their own thread.
+ *
+ * Both traffic streams are 4-byte poly aftertouch packets on virtual
+ * cable 0 that carry a 14-bit sequence number, so the receiving end can
+ * count packets that went missing or arrived out of order.
+ *
+ * To use this code:
+ * 1. Call sim_init() once, then fork a process for each simulated boot;
+ *    the flash survives from one boot to the next.
+ * 2. Set up the traffic and consumer rates, then call sim_start().
+ * 3. Call sim_attach_device(), sim_detach_device() and sim_console() as
+ *    the scenario goes along.
+ * 4. Call sim_quiesce() a little before the end so the packets on their
+ *    way can arrive, then call sim_stop() and sim_get_stats().
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The FIFO sizes of the USB MIDI drivers in packets
+#define SIM_HOST_FIFO_PACKETS 16
+#define SIM_DEVICE_FIFO_PACKETS 16
+
+typedef struct {
+  uint32_t rate;            //!< packets per second sent at an even pace
+  uint32_t burst;           //!< packets sent all at once every burst_period_ms
+  uint32_t burst_period_ms; //!< 0 for no bursts
+} sim_traffic_t;
+
+typedef struct {
+  uint32_t generated;    //!< packets the source produced
+  uint32_t sent;         //!< packets the source got onto the USB bus
+  uint32_t delivered;    //!< packets that reached the far end
+  uint32_t missing;      //!< gaps in the sequence numbers the far end saw
+  uint32_t out_of_order; //!< packets the far end saw after a later one
+  uint32_t backlog_max;  //!< most packets waiting at the source for the bus
+  uint32_t fifo_max;     //!< deepest the driver FIFO between the bus and the firmware got
+  uint32_t first_us;     //!< when the first packet was delivered
+  uint32_t last_us;      //!< when the last packet was delivered
+} sim_stream_stats_t;
+
+typedef struct {
+  sim_stream_stats_t in;  //!< MIDI device to PC
+  sim_stream_stats_t out; //!< PC to MIDI device
+  uint32_t host_mounts;   //!< times the host port mounted the MIDI device
+  uint32_t descriptor_requests;
+  uint32_t out_transfers; //!< bulk OUT transfers to the MIDI device
+  uint32_t out_transfer_packets; //!< packets in those transfers
+  uint32_t enumerations;  //!< times the PC enumerated the device port
+  uint32_t first_enumeration_ms; //!< when the PC first enumerated the device port
+  uint32_t disconnects;   //!< times the firmware soft-disconnected the device port
+  char product[64];       //!< the product name the PC read at its last enumeration
+} sim_stats_t;
+
+/**
+ * @brief erase the simulated flash and set up the state shared by all boots
+ */
+void sim_init(void);
+
+/**
+ * @brief set the traffic the MIDI device sends while it is mounted; it starts now if it is mounted
+ */
+void sim_set_in_traffic(const sim_traffic_t* traffic);
+
+/**
+ * @brief set the traffic the PC sends while the device port is mounted; it starts now if it is mounted
+ */
+void sim_set_out_traffic(const sim_traffic_t* traffic);
+
+/**
+ * @brief set how fast the PC reads the device port and the MIDI device accepts packets
+ *
+ * @param pc_packets_per_ms the most packets the PC reads from the device port per frame
+ * @param device_packets_per_ms the most packets the MIDI device accepts per frame
+ */
+void sim_set_consumer_rates(uint32_t pc_packets_per_ms, uint32_t device_packets_per_ms);
+
+/**
+ * @brief stop generating traffic; packets already generated are still sent
+ */
+void sim_quiesce(void);
+
+/**
+ * @brief boot the firmware: run app_main in the core0 thread
+ */
+void sim_start(int (*app_main)(void));
+
+/**
+ * @brief stop both cores; call it from the thread that called sim_start()
+ */
+void sim_stop(void);
+
+/**
+ * @brief plug the MIDI device into the host port
+ */
+void sim_attach_device(void);
+
+/**
+ * @brief unplug the MIDI device from the host port
+ */
+void sim_detach_device(void);
+
+/**
+ * @brief type characters on the debug console
+ */
+void sim_console(const char* chars);
+
+/**
+ * @return uint32_t milliseconds since sim_start()
+ */
+uint32_t sim_now_ms(void);
+
+/**
+ * @brief copy the statistics the model collected
+ */
+void sim_get_stats(sim_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
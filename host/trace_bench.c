@@ -0,0 +1,430 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * This program replays MIDI traffic traces through the filter layer on a
+ * Linux host, the way midi_app.c drives it: packets in the same direction
+ * that arrive within the same 1 ms USB frame go through
+ * filter_midi_in_batch() or filter_midi_out_batch() together, and the
+ * filter's poll functions run once per frame of trace time. It reports the
+ * throughput, per-packet cost percentiles and a checksum of everything the
+ * filter sent on for each trace. The costs come from the fastest of several
+ * rounds of replays. Because the poll functions see trace time
+ * rather than wall clock time, the checksum depends only on the filter code.
+ *
+ * By default it replays the corpus in trace_corpus.c. Pass trace files
+ * (for example one that midi_capture_decode wrote from a capture of real
+ * traffic) to replay those instead.
+ *
+ * A baseline file stores the results of a known good build. With -b the
+ * program exits with status 1 if any trace's output differs from the
+ * baseline or its mean or median cost per packet grew by more than the
+ * tolerance. The costs only compare on the same machine, so
+ * host/trace_bench_baseline.txt only has the output of each trace; record
+ * a baseline with costs using -w before changing the filter.
+ *
+ * Usage: trace_bench [-b baseline] [-w baseline] [-t tolerance %] [-n packets] [-d dir] [trace file...]
+ *   -b  compare the results with a baseline file
+ *   -w  write the results to a baseline file
+ *   -t  the cost increase in percent that counts as a regression (default 25)
+ *   -n  replay each trace until at least this many packets went through (default 2000000)
+ *   -d  write the corpus traces to .trace files in a directory and exit
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "midi_filter.h"
+#include "trace_corpus.h"
+
+#define DEFAULT_NPACKETS 2000000UL
+#define DEFAULT_TOLERANCE_PCT 25.0
+// Batches are at most the size of one full-speed USB MIDI bulk endpoint buffer
+#define BATCH_LEN 16
+#define FRAME_US 1000
+// Keep polling after the last packet so the filter can send what it held back
+#define DRAIN_US 100000
+// The most packets a poll function may return at once
+#define POLL_LEN 64
+#define MAX_TRACE_NAME 64
+// The packets are replayed in rounds and the round with the lowest mean cost
+// counts, which keeps other load on the machine out of the comparison
+#define ROUNDS 5
+
+typedef struct {
+  char name[MAX_TRACE_NAME];
+  unsigned long packets;  // packets in one replay of the trace
+  unsigned long passed;   // packets the filter sent on in one replay, including generated ones
+  uint32_t checksum;      // of everything the filter sent on in one replay
+  double mean_ns;         // per packet
+  double p50_ns;
+  double p90_ns;
+  double p99_ns;
+  double mpackets_per_s;
+} result_t;
+
+typedef struct {
+  float ns_per_packet;
+  uint8_t npackets;
+} sample_t;
+
+static sample_t* samples;
+static size_t nsamples;
+static size_t samples_capacity;
+static double timer_overhead_ns;
+
+static double elapsed_ns(const struct timespec* start, const struct timespec* end)
+{
+  return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+// the least time a clock_gettime() pair takes; it is subtracted from each batch
+static double measure_timer_overhead(void)
+{
+  double least = 1e9;
+  for (int idx = 0; idx < 10000; idx++) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = elapsed_ns(&start, &end);
+    if (ns < least)
+      least = ns;
+  }
+  return least;
+}
+
+static void add_sample(double ns, size_t npackets)
+{
+  if (nsamples == samples_capacity) {
+    samples_capacity = samples_capacity ? 2 * samples_capacity : 65536;
+    samples = realloc(samples, samples_capacity * sizeof(*samples));
+    if (samples == NULL) {
+      fprintf(stderr, "out of memory for the samples\n");
+      exit(1);
+    }
+  }
+  ns -= timer_overhead_ns;
+  samples[nsamples].ns_per_packet = (float)((ns > 0 ? ns : 0) / (double)npackets);
+  samples[nsamples].npackets = (uint8_t)npackets;
+  ++nsamples;
+}
+
+static int compare_samples(const void* lhs, const void* rhs)
+{
+  float left = ((const sample_t*)lhs)->ns_per_packet, right = ((const sample_t*)rhs)->ns_per_packet;
+  return left < right ? -1 : (left > right);
+}
+
+// the cost per packet that the given fraction of the packets did not exceed
+static double percentile(unsigned long total_packets, double fraction)
+{
+  unsigned long target = (unsigned long)ceil(fraction * (double)total_packets);
+  unsigned long count = 0;
+  for (size_t idx = 0; idx < nsamples; idx++) {
+    count += samples[idx].npackets;
+    if (count >= target)
+      return samples[idx].ns_per_packet;
+  }
+  return nsamples ? samples[nsamples - 1].ns_per_packet : 0;
+}
+
+static uint32_t add_to_checksum(uint32_t checksum, uint8_t dir, const uint8_t packet[4])
+{
+  // FNV-1a
+  const uint8_t bytes[5] = {dir, packet[0], packet[1], packet[2], packet[3]};
+  for (size_t idx = 0; idx < sizeof(bytes); idx++)
+    checksum = (checksum ^ bytes[idx]) * 16777619u;
+  return checksum;
+}
+
+static void poll_filter(uint32_t now_us, result_t* result)
+{
+  uint32_t packets[POLL_LEN];
+  size_t npackets = filter_midi_in_poll(now_us, packets, POLL_LEN);
+  for (size_t idx = 0; idx < npackets; idx++)
+    result->checksum = add_to_checksum(result->checksum, TRACE_DIR_IN, (const uint8_t*)&packets[idx]);
+  result->passed += npackets;
+  npackets = filter_midi_out_poll(now_us, packets, POLL_LEN);
+  for (size_t idx = 0; idx < npackets; idx++)
+    result->checksum = add_to_checksum(result->checksum, TRACE_DIR_OUT, (const uint8_t*)&packets[idx]);
+  result->passed += npackets;
+}
+
+// replay the trace once from a freshly initialized filter; record the cost of each batch if timed
+static double replay(const trace_t* trace, bool timed, result_t* result)
+{
+  double total_ns = 0;
+  result->passed = 0;
+  result->checksum = 2166136261u;
+  filter_midi_init();
+  filter_midi_out_mounted();
+  uint32_t frame_us = 0;
+  size_t idx = 0;
+  while (idx < trace->len) {
+    const trace_event_t* first = &trace->events[idx];
+    while (first->time_us >= frame_us + FRAME_US) {
+      frame_us += FRAME_US;
+      poll_filter(frame_us, result);
+    }
+    uint32_t packets[BATCH_LEN];
+    size_t nbatch = 0;
+    while (idx < trace->len && nbatch < BATCH_LEN && trace->events[idx].dir == first->dir &&
+        trace->events[idx].time_us < frame_us + FRAME_US) {
+      memcpy(&packets[nbatch++], trace->events[idx++].packet, sizeof(packets[0]));
+    }
+    size_t (*filter_batch)(uint32_t* packets, size_t npackets, uint32_t* post) =
+        first->dir == TRACE_DIR_IN ? filter_midi_in_batch : filter_midi_out_batch;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t nkept = filter_batch(packets, nbatch, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (timed) {
+      double ns = elapsed_ns(&start, &end);
+      total_ns += ns - timer_overhead_ns;
+      add_sample(ns, nbatch);
+    }
+    for (size_t kept = 0; kept < nkept; kept++)
+      result->checksum = add_to_checksum(result->checksum, first->dir, (const uint8_t*)&packets[kept]);
+    result->passed += nkept;
+  }
+  for (uint32_t end_us = frame_us + DRAIN_US; frame_us < end_us; ) {
+    frame_us += FRAME_US;
+    poll_filter(frame_us, result);
+  }
+  return total_ns;
+}
+
+static void run_trace(const char* name, const trace_t* trace, unsigned long min_packets, result_t* result)
+{
+  memset(result, 0, sizeof(*result));
+  snprintf(result->name, sizeof(result->name), "%s", name);
+  result->packets = trace->len;
+  if (trace->len == 0)
+    return;
+  // the first replay warms up the caches and gives the reference output
+  replay(trace, false, result);
+  result_t first = *result;
+  result->mean_ns = INFINITY;
+  for (int round = 0; round < ROUNDS; round++) {
+    nsamples = 0;
+    double total_ns = 0;
+    unsigned long total_packets = 0;
+    result_t replayed = first;
+    do {
+      total_ns += replay(trace, true, &replayed);
+      total_packets += trace->len;
+      if (replayed.checksum != first.checksum || replayed.passed != first.passed) {
+        fprintf(stderr, "%s: the filter output differs between replays; it keeps state across filter_midi_init()\n", name);
+        result->checksum = replayed.checksum;
+        result->passed = replayed.passed;
+      }
+    } while (total_packets < min_packets / ROUNDS);
+    double mean_ns = total_ns / (double)total_packets;
+    if (mean_ns >= result->mean_ns)
+      continue;
+    qsort(samples, nsamples, sizeof(*samples), compare_samples);
+    result->mean_ns = mean_ns;
+    result->p50_ns = percentile(total_packets, 0.50);
+    result->p90_ns = percentile(total_packets, 0.90);
+    result->p99_ns = percentile(total_packets, 0.99);
+    result->mpackets_per_s = total_ns > 0 ? (double)total_packets * 1e3 / total_ns : 0;
+  }
+}
+
+static void print_result(const result_t* result)
+{
+  printf("%-20s %8lu packets passed=%-8lu checksum=%08x %7.2f Mpackets/s mean=%6.2f p50=%6.2f p90=%6.2f p99=%6.2f ns/packet\n",
+      result->name, result->packets, result->passed, result->checksum, result->mpackets_per_s, result->mean_ns,
+      result->p50_ns, result->p90_ns, result->p99_ns);
+}
+
+static bool write_baseline(const char* path, const result_t* results, size_t nresults)
+{
+  FILE* file = fopen(path, "w");
+  if (file == NULL)
+    return false;
+  fprintf(file, "# trace_bench baseline: trace packets passed checksum mean_ns p50_ns p99_ns\n");
+  for (size_t idx = 0; idx < nresults; idx++) {
+    fprintf(file, "%s %lu %lu %08x %.2f %.2f %.2f\n", results[idx].name, results[idx].packets, results[idx].passed,
+        results[idx].checksum, results[idx].mean_ns, results[idx].p50_ns, results[idx].p99_ns);
+  }
+  return fclose(file) == 0;
+}
+
+// compare the results with a baseline file; return the number of regressions or -1 if the file cannot be read
+static int check_baseline(const char* path, const result_t* results, size_t nresults, double tolerance_pct)
+{
+  FILE* file = fopen(path, "r");
+  if (file == NULL)
+    return -1;
+  int nregressions = 0;
+  size_t nchecked = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    result_t base;
+    if (line[0] == '#')
+      continue;
+    // the costs are optional; a baseline shared between machines only has the output
+    int nfields = sscanf(line, "%63s %lu %lu %x %lf %lf %lf", base.name, &base.packets, &base.passed, &base.checksum,
+        &base.mean_ns, &base.p50_ns, &base.p99_ns);
+    if (nfields < 4)
+      continue;
+    bool has_costs = nfields == 7;
+    const result_t* result = NULL;
+    for (size_t idx = 0; idx < nresults; idx++) {
+      if (strcmp(results[idx].name, base.name) == 0)
+        result = &results[idx];
+    }
+    if (result == NULL)
+      continue;
+    ++nchecked;
+    double limit = 1.0 + tolerance_pct / 100.0;
+    if (result->packets != base.packets) {
+      printf("REGRESSION %s: the trace has %lu packets; the baseline has %lu\n", base.name, result->packets, base.packets);
+      ++nregressions;
+    }
+    else if (result->passed != base.passed || result->checksum != base.checksum) {
+      printf("REGRESSION %s: output passed=%lu checksum=%08x; the baseline has passed=%lu checksum=%08x\n", base.name,
+          result->passed, result->checksum, base.passed, base.checksum);
+      ++nregressions;
+    }
+    if (has_costs && result->mean_ns > base.mean_ns * limit) {
+      printf("REGRESSION %s: mean cost %.2f ns/packet is more than %.0f%% over the baseline %.2f\n", base.name,
+          result->mean_ns, tolerance_pct, base.mean_ns);
+      ++nregressions;
+    }
+    if (has_costs && result->p50_ns > base.p50_ns * limit) {
+      printf("REGRESSION %s: median cost %.2f ns/packet is more than %.0f%% over the baseline %.2f\n", base.name,
+          result->p50_ns, tolerance_pct, base.p50_ns);
+      ++nregressions;
+    }
+  }
+  fclose(file);
+  if (nchecked < nresults)
+    printf("%zu of %zu traces are not in the baseline %s\n", nresults - nchecked, nresults, path);
+  return nregressions;
+}
+
+static bool dump_corpus(const char* dir)
+{
+  for (size_t idx = 0; idx < trace_corpus_len; idx++) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.trace", dir, trace_corpus[idx].name);
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+      return false;
+    trace_t trace;
+    trace_init(&trace);
+    trace_corpus[idx].build(&trace);
+    fprintf(file, "# %s: %s\n", trace_corpus[idx].name, trace_corpus[idx].description);
+    bool written = trace_write(&trace, file);
+    trace_free(&trace);
+    if (fclose(file) != 0 || !written)
+      return false;
+    printf("wrote %s\n", path);
+  }
+  return true;
+}
+
+int main(int argc, char* argv[])
+{
+  const char* baseline_in = NULL;
+  const char* baseline_out = NULL;
+  double tolerance_pct = DEFAULT_TOLERANCE_PCT;
+  unsigned long min_packets = DEFAULT_NPACKETS;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:w:t:n:d:")) != -1) {
+    switch (opt) {
+      case 'b':
+        baseline_in = optarg;
+        break;
+      case 'w':
+        baseline_out = optarg;
+        break;
+      case 't':
+        tolerance_pct = strtod(optarg, NULL);
+        break;
+      case 'n':
+        min_packets = strtoul(optarg, NULL, 0);
+        break;
+      case 'd':
+        return dump_corpus(optarg) ? 0 : 1;
+      default:
+        fprintf(stderr, "usage: %s [-b baseline] [-w baseline] [-t tolerance %%] [-n packets] [-d dir] [trace file...]\n",
+            argv[0]);
+        return 1;
+    }
+  }
+  timer_overhead_ns = measure_timer_overhead();
+  size_t ntraces = optind < argc ? (size_t)(argc - optind) : trace_corpus_len;
+  result_t* results = calloc(ntraces, sizeof(*results));
+  if (results == NULL)
+    return 1;
+  for (size_t idx = 0; idx < ntraces; idx++) {
+    trace_t trace;
+    trace_init(&trace);
+    const char* name;
+    if (optind < argc) {
+      const char* path = argv[optind + idx];
+      FILE* file = fopen(path, "r");
+      if (file == NULL || !trace_read(&trace, file))
+        fprintf(stderr, "%s: cannot read all of the trace\n", path);
+      if (file != NULL)
+        fclose(file);
+      name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    }
+    else {
+      trace_corpus[idx].build(&trace);
+      name = trace_corpus[idx].name;
+    }
+    run_trace(name, &trace, min_packets, &results[idx]);
+    print_result(&results[idx]);
+    trace_free(&trace);
+  }
+  int status = 0;
+  if (baseline_out != NULL && !write_baseline(baseline_out, results, ntraces)) {
+    fprintf(stderr, "cannot write %s\n", baseline_out);
+    status = 1;
+  }
+  if (baseline_in != NULL) {
+    int nregressions = check_baseline(baseline_in, results, ntraces, tolerance_pct);
+    if (nregressions < 0) {
+      fprintf(stderr, "cannot read %s\n", baseline_in);
+      status = 1;
+    }
+    else if (nregressions > 0) {
+      printf("%d regressions against %s\n", nregressions, baseline_in);
+      status = 1;
+    }
+    else {
+      printf("no regressions against %s\n", baseline_in);
+    }
+  }
+  free(results);
+  free(samples);
+  return status;
+}
@@ -0,0 +1,333 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "trace_corpus.h"
+
+#define TRACE_PIANO_US 20000000
+#define TRACE_MC_US 10000000
+// sixteenth notes at 140 BPM
+#define TRACE_SIXTEENTH_US 107143
+// 24 PPQN at 120 BPM
+#define TRACE_CLOCK_US 20833
+// how fast a DAW or USB MIDI device sends a burst: one packet per 64 us fills a full speed frame
+#define TRACE_BURST_US 62
+
+static uint32_t seed;
+
+static uint32_t rand_below(uint32_t n)
+{
+  seed = seed * 1664525u + 1013904223u;
+  return (seed >> 8) % n;
+}
+
+void trace_init(trace_t* trace)
+{
+  trace->events = NULL;
+  trace->len = 0;
+  trace->capacity = 0;
+}
+
+void trace_free(trace_t* trace)
+{
+  free(trace->events);
+  trace_init(trace);
+}
+
+void trace_add(trace_t* trace, uint32_t time_us, trace_dir_t dir, const uint8_t packet[4])
+{
+  if (trace->len == trace->capacity) {
+    size_t capacity = trace->capacity ? 2 * trace->capacity : 4096;
+    trace_event_t* events = realloc(trace->events, capacity * sizeof(*events));
+    if (events == NULL) {
+      fprintf(stderr, "out of memory for the trace\n");
+      exit(1);
+    }
+    trace->events = events;
+    trace->capacity = capacity;
+  }
+  trace_event_t* event = &trace->events[trace->len++];
+  event->time_us = time_us;
+  event->dir = (uint8_t)dir;
+  memcpy(event->packet, packet, sizeof(event->packet));
+}
+
+static const trace_event_t* sort_events;
+
+static int compare_event_idx(const void* lhs, const void* rhs)
+{
+  size_t left = *(const size_t*)lhs, right = *(const size_t*)rhs;
+  if (sort_events[left].time_us != sort_events[right].time_us)
+    return sort_events[left].time_us < sort_events[right].time_us ? -1 : 1;
+  return left < right ? -1 : (left > right);
+}
+
+void trace_sort(trace_t* trace)
+{
+  size_t* order = malloc(trace->len * sizeof(*order));
+  trace_event_t* sorted = malloc(trace->len * sizeof(*sorted));
+  if (trace->len != 0 && (order == NULL || sorted == NULL)) {
+    fprintf(stderr, "out of memory for the trace\n");
+    exit(1);
+  }
+  for (size_t idx = 0; idx < trace->len; idx++)
+    order[idx] = idx;
+  sort_events = trace->events;
+  qsort(order, trace->len, sizeof(*order), compare_event_idx);
+  for (size_t idx = 0; idx < trace->len; idx++)
+    sorted[idx] = trace->events[order[idx]];
+  free(order);
+  free(trace->events);
+  trace->events = sorted;
+  trace->capacity = trace->len;
+}
+
+static void add_msg(trace_t* trace, uint32_t time_us, trace_dir_t dir, uint8_t cable, uint8_t status, uint8_t data1,
+    uint8_t data2)
+{
+  uint8_t cin = status >= 0xF8 ? 0xF : status >> 4;
+  uint8_t packet[4] = {(uint8_t)((cable << 4) | cin), status, data1, data2};
+  trace_add(trace, time_us, dir, packet);
+}
+
+// add a SysEx message 3 bytes per packet, one packet every interval_us; return the time after the last packet
+static uint32_t add_sysex(trace_t* trace, uint32_t time_us, trace_dir_t dir, uint8_t cable, const uint8_t* bytes,
+    size_t len, uint32_t interval_us)
+{
+  for (size_t idx = 0; idx < len; idx += 3, time_us += interval_us) {
+    size_t nbytes = len - idx < 3 ? len - idx : 3;
+    bool last = idx + nbytes == len;
+    uint8_t packet[4] = {(uint8_t)((cable << 4) | (last ? 0x4 + nbytes : 0x4)), bytes[idx],
+        nbytes > 1 ? bytes[idx + 1] : 0, nbytes > 2 ? bytes[idx + 2] : 0};
+    trace_add(trace, time_us, dir, packet);
+  }
+  return time_us;
+}
+
+// Dense piano playing on cable 0: chords and runs with polyphonic aftertouch
+// on every held note, channel pressure and the sustain pedal
+static void build_piano(trace_t* trace)
+{
+  seed = 1;
+  for (uint32_t step_us = 0; step_us < TRACE_PIANO_US; step_us += TRACE_SIXTEENTH_US) {
+    bool chord = (step_us / TRACE_SIXTEENTH_US) % 4 == 0;
+    uint32_t nnotes = chord ? 3 + rand_below(3) : 1 + rand_below(2);
+    for (uint32_t idx = 0; idx < nnotes; idx++) {
+      uint8_t note = chord ? 36 + rand_below(24) : 60 + rand_below(25);
+      uint32_t on_us = step_us + rand_below(3000);
+      uint32_t off_us = on_us + 80000 + rand_below(500000);
+      add_msg(trace, on_us, TRACE_DIR_IN, 0, 0x90, note, 20 + rand_below(108));
+      for (uint32_t at_us = on_us + 10000; at_us < off_us; at_us += 10000)
+        add_msg(trace, at_us, TRACE_DIR_IN, 0, 0xA0, note, rand_below(128));
+      // some keyboards send note on with velocity 0 instead of note off
+      if (rand_below(4) == 0)
+        add_msg(trace, off_us, TRACE_DIR_IN, 0, 0x90, note, 0);
+      else
+        add_msg(trace, off_us, TRACE_DIR_IN, 0, 0x80, note, 0x40);
+    }
+  }
+  for (uint32_t time_us = 5000; time_us < TRACE_PIANO_US; time_us += 15000)
+    add_msg(trace, time_us, TRACE_DIR_IN, 0, 0xD0, rand_below(128), 0);
+  // sustain pedal down for most of every 2 bars
+  for (uint32_t time_us = 0; time_us < TRACE_PIANO_US; time_us += 32 * TRACE_SIXTEENTH_US) {
+    add_msg(trace, time_us + 1000, TRACE_DIR_IN, 0, 0xB0, 64, 127);
+    add_msg(trace, time_us + 30 * TRACE_SIXTEENTH_US, TRACE_DIR_IN, 0, 0xB0, 64, 0);
+  }
+  trace_sort(trace);
+}
+
+// Mackie Control sweeps of all 9 faders (pitch bend E0-E8 on cable 1). The
+// hardware faders chatter by a few LSBs, sweep up and down together, then
+// rest. The DAW starts with its faders elsewhere and echoes the hardware
+// fader once the hardware fader has picked it up.
+static void build_mc_faders(trace_t* trace)
+{
+  seed = 2;
+  uint16_t daw[9];
+  bool caught[9];
+  for (uint8_t chan = 0; chan < 9; chan++) {
+    daw[chan] = 0x1000 + chan * 0x300;
+    caught[chan] = false;
+    add_msg(trace, 0, TRACE_DIR_OUT, 1, 0xE0 | chan, daw[chan] & 0x7f, daw[chan] >> 7);
+  }
+  for (uint32_t time_us = 10000; time_us < TRACE_MC_US; time_us += 5000) {
+    uint32_t cycle_us = time_us % 3000000;
+    for (uint8_t chan = 0; chan < 9; chan++) {
+      int32_t value;
+      if (cycle_us < 2000000) {
+        // a triangle sweep; each fader lags the one before it a little
+        uint32_t pos = (cycle_us + 2000000 - chan * 20000) % 2000000;
+        value = pos < 1000000 ? (int32_t)(pos * 0x3fffull / 1000000) : (int32_t)((2000000 - pos) * 0x3fffull / 1000000);
+      }
+      else {
+        value = 0x200 + chan * 0x400; // resting
+      }
+      value += (int32_t)rand_below(5) - 2;
+      value = value < 0 ? 0 : value > 0x3fff ? 0x3fff : value;
+      uint32_t move_us = time_us + chan * 100;
+      add_msg(trace, move_us, TRACE_DIR_IN, 1, 0xE0 | chan, value & 0x7f, value >> 7);
+      if (!caught[chan] && abs(value - daw[chan]) <= 0x7f)
+        caught[chan] = true;
+      if (caught[chan] && (time_us / 5000) % 4 == 0 && daw[chan] != value) {
+        daw[chan] = (uint16_t)value;
+        add_msg(trace, move_us + 3000, TRACE_DIR_OUT, 1, 0xE0 | chan, value & 0x7f, value >> 7);
+      }
+    }
+  }
+  trace_sort(trace);
+}
+
+// A DAW bank switch every 400 ms: the user presses Bank Left or Bank Right
+// and the DAW floods the control surface with every button LED (most
+// unchanged), the fader positions, the V-Pot rings and both lines of the
+// scribble strip LCD, all on cable 1. Level meters run throughout.
+static void build_mc_bank_switch(trace_t* trace)
+{
+  static const char* const names[] = {
+    "Kick", "Snare", "HiHat", "Toms", "OH L", "OH R", "Bass", "Keys",
+    "Pad", "Lead", "Vox", "BVox", "Gtr 1", "Gtr 2", "FX 1", "FX 2",
+  };
+  seed = 3;
+  uint32_t bank = 0;
+  for (uint32_t switch_us = 100000; switch_us < TRACE_MC_US; switch_us += 400000) {
+    uint32_t nswitch = switch_us / 400000;
+    uint8_t button = nswitch % 3 == 2 ? 0x2E : 0x2F;
+    bank = button == 0x2F ? bank + 1 : bank - 1;
+    add_msg(trace, switch_us, TRACE_DIR_IN, 1, 0x90, button, 0x7f);
+    add_msg(trace, switch_us + 80000, TRACE_DIR_IN, 1, 0x90, button, 0);
+    uint32_t time_us = switch_us + 5000;
+    for (uint8_t note = 0; note < 0x76; note++, time_us += TRACE_BURST_US) {
+      bool lit = (note % 3 == 0) != (note < 8 && (bank & 1));
+      add_msg(trace, time_us, TRACE_DIR_OUT, 1, 0x90, note, lit ? 0x7f : 0);
+    }
+    for (uint8_t chan = 0; chan < 8; chan++, time_us += TRACE_BURST_US) {
+      uint16_t value = rand_below(0x4000);
+      add_msg(trace, time_us, TRACE_DIR_OUT, 1, 0xE0 | chan, value & 0x7f, value >> 7);
+    }
+    for (uint8_t chan = 0; chan < 8; chan++, time_us += TRACE_BURST_US)
+      add_msg(trace, time_us, TRACE_DIR_OUT, 1, 0xB0, 0x30 + chan, rand_below(0x7f));
+    // F0 00 00 66 14 12 00 <112 characters> F7
+    uint8_t lcd[7 + 112 + 1] = {0xF0, 0x00, 0x00, 0x66, 0x14, 0x12, 0x00};
+    memset(lcd + 7, ' ', 112);
+    for (uint8_t chan = 0; chan < 8; chan++) {
+      const char* name = names[(bank * 8 + chan) % (sizeof(names) / sizeof(names[0]))];
+      memcpy(lcd + 7 + chan * 7, name, strlen(name));
+      memcpy(lcd + 7 + 56 + chan * 7, chan % 2 ? "  Pan" : "  Vol", 5);
+    }
+    lcd[sizeof(lcd) - 1] = 0xF7;
+    (void)add_sysex(trace, time_us, TRACE_DIR_OUT, 1, lcd, sizeof(lcd), TRACE_BURST_US);
+  }
+  // channel pressure level meters for 8 channels every 100 ms
+  for (uint32_t time_us = 0; time_us < TRACE_MC_US; time_us += 100000) {
+    for (uint8_t chan = 0; chan < 8; chan++)
+      add_msg(trace, time_us + chan * TRACE_BURST_US, TRACE_DIR_OUT, 1, 0xD0, (chan << 4) | rand_below(13), 0);
+  }
+  trace_sort(trace);
+}
+
+// 24 PPQN MIDI clock both ways on cable 0 while the MIDI device sends 4 KB
+// SysEx bulk dumps and the DAW sends 1 KB patch dumps. The clock packets
+// land between the SysEx packets.
+static void build_clock_sysex(trace_t* trace)
+{
+  static uint8_t dump[4096];
+  seed = 4;
+  add_msg(trace, 0, TRACE_DIR_IN, 0, 0xFA, 0, 0);
+  add_msg(trace, 7000, TRACE_DIR_OUT, 0, 0xFA, 0, 0);
+  for (uint32_t time_us = TRACE_CLOCK_US; time_us < TRACE_MC_US; time_us += TRACE_CLOCK_US) {
+    add_msg(trace, time_us, TRACE_DIR_IN, 0, 0xF8, 0, 0);
+    add_msg(trace, time_us + 7000, TRACE_DIR_OUT, 0, 0xF8, 0, 0);
+  }
+  static const uint8_t header[] = {0xF0, 0x00, 0x20, 0x6B, 0x7F, 0x42};
+  for (uint32_t time_us = 500000; time_us < TRACE_MC_US; time_us += 2000000) {
+    memcpy(dump, header, sizeof(header));
+    for (size_t idx = sizeof(header); idx < sizeof(dump) - 1; idx++)
+      dump[idx] = rand_below(0x80);
+    dump[sizeof(dump) - 1] = 0xF7;
+    (void)add_sysex(trace, time_us, TRACE_DIR_IN, 0, dump, sizeof(dump), 100);
+  }
+  for (uint32_t time_us = 1300000; time_us < TRACE_MC_US; time_us += 3000000) {
+    memcpy(dump, header, sizeof(header));
+    for (size_t idx = sizeof(header); idx < 1023; idx++)
+      dump[idx] = rand_below(0x80);
+    dump[1023] = 0xF7;
+    (void)add_sysex(trace, time_us, TRACE_DIR_OUT, 0, dump, 1024, TRACE_BURST_US);
+  }
+  add_msg(trace, TRACE_MC_US, TRACE_DIR_IN, 0, 0xFC, 0, 0);
+  add_msg(trace, TRACE_MC_US, TRACE_DIR_OUT, 0, 0xFC, 0, 0);
+  trace_sort(trace);
+}
+
+const trace_corpus_entry_t trace_corpus[] = {
+  {"piano", "dense piano playing with aftertouch, channel pressure and sustain", build_piano},
+  {"mc-faders", "Mackie Control sweeps of 9 faders (E0-E8) with DAW echoes", build_mc_faders},
+  {"mc-bank-switch", "DAW bank switches flooding button LEDs, faders, V-Pots and the LCD", build_mc_bank_switch},
+  {"clock-sysex", "24 PPQN clock both ways under SysEx bulk dumps", build_clock_sysex},
+};
+const size_t trace_corpus_len = sizeof(trace_corpus) / sizeof(trace_corpus[0]);
+
+bool trace_read(trace_t* trace, FILE* file)
+{
+  char line[256];
+  bool valid = true;
+  size_t first = trace->len;
+  long long min_us = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    long long time_us;
+    char dir[4];
+    unsigned int word;
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+      continue;
+    if (sscanf(line, "%lld %3s %8x", &time_us, dir, &word) != 3 ||
+        (strcmp(dir, "in") != 0 && strcmp(dir, "out") != 0)) {
+      valid = false;
+      continue;
+    }
+    // the hex digits are the packet bytes in wire order
+    uint8_t packet[4] = {word >> 24, (word >> 16) & 0xff, (word >> 8) & 0xff, word & 0xff};
+    if (word == 0)
+      continue; // the filter generated it; the capture has no packet going into the filter
+    if (trace->len == first || time_us < min_us)
+      min_us = time_us;
+    trace_add(trace, (uint32_t)time_us, dir[0] == 'i' ? TRACE_DIR_IN : TRACE_DIR_OUT, packet);
+  }
+  // capture traces may start before time 0
+  for (size_t idx = first; idx < trace->len; idx++)
+    trace->events[idx].time_us -= (uint32_t)min_us;
+  trace_sort(trace);
+  return valid;
+}
+
+bool trace_write(const trace_t* trace, FILE* file)
+{
+  fprintf(file, "# midi trace: time_us dir packet\n");
+  for (size_t idx = 0; idx < trace->len; idx++) {
+    const trace_event_t* event = &trace->events[idx];
+    fprintf(file, "%lu %s %02x%02x%02x%02x\n", (unsigned long)event->time_us, event->dir == TRACE_DIR_IN ? "in" : "out",
+        event->packet[0], event->packet[1], event->packet[2], event->packet[3]);
+  }
+  return !ferror(file);
+}
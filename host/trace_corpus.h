@@ -0,0 +1,119 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file trace_corpus.h
+ *
+ * This file contains a fixed corpus of realistic MIDI traffic traces for
+ * benchmarking the filter layer, and functions that read and write traces
+ * as text. A trace is a list of timestamped 4-byte USB MIDI packets, each
+ * heading either to the USB Host MIDI IN port (from the MIDI device) or to
+ * the MIDI OUT port (from the DAW). The corpus traces are generated from
+ * fixed seeds, so every build replays exactly the same packets.
+ *
+ * The text format has one packet per line, oldest first:
+ *   <time_us> <in|out> <packet bytes as 8 hex digits in wire order>
+ * Anything after the third field is ignored and lines that start with #
+ * are comments, so the trace midi_capture_decode writes from a capture of
+ * real traffic can be replayed too.
+ *
+ * To use this code:
+ * 1. Call trace_init() on a trace_t structure.
+ * 2. Call the build function of an entry in trace_corpus[] or call trace_read().
+ * 3. Replay trace.events[0 .. trace.len - 1].
+ * 4. Call trace_free() when done.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {TRACE_DIR_IN, TRACE_DIR_OUT} trace_dir_t;
+
+typedef struct {
+  uint32_t time_us; //!< time since the start of the trace
+  uint8_t dir;      //!< a trace_dir_t
+  uint8_t packet[4];
+} trace_event_t;
+
+typedef struct {
+  trace_event_t* events;
+  size_t len;
+  size_t capacity;
+} trace_t;
+
+typedef struct {
+  const char* name;
+  const char* description;
+  void (*build)(trace_t* trace);
+} trace_corpus_entry_t;
+
+extern const trace_corpus_entry_t trace_corpus[];
+extern const size_t trace_corpus_len;
+
+/**
+ * @brief initialize an empty trace
+ */
+void trace_init(trace_t* trace);
+
+/**
+ * @brief free the events of a trace and make it empty
+ */
+void trace_free(trace_t* trace);
+
+/**
+ * @brief add a packet to a trace; call trace_sort() after adding packets out of time order
+ */
+void trace_add(trace_t* trace, uint32_t time_us, trace_dir_t dir, const uint8_t packet[4]);
+
+/**
+ * @brief sort a trace by time, keeping packets with the same time in the order they were added
+ */
+void trace_sort(trace_t* trace);
+
+/**
+ * @brief add the lines of a text trace to a trace
+ *
+ * @param trace the trace to add to
+ * @param file the file to read
+ * @return true if every line that is not a comment was a valid packet
+ */
+bool trace_read(trace_t* trace, FILE* file);
+
+/**
+ * @brief write a trace as text
+ *
+ * @return true if the trace was written
+ */
+bool trace_write(const trace_t* trace, FILE* file);
+
+#ifdef __cplusplus
+}
+#endif
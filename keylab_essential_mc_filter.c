@@ -22,115 +22,389 @@
  * THE SOFTWARE.
  *
  */
+#include <stdio.h>
+#include <string.h>
 #include "midi_filter.h"
 #include "class/midi/midi.h"
 #include "midi_mc_fader_pickup.h"
+#include "mc_led_cache.h"
+#include "mc_lcd_shadow.h"
+#include "midi_filter_table.h"
+#include "midi_note_map.h"
+#include "midi_filter_config.h"
+#include "midi_filter_rules.h"
 
 #define KEYLAB_ESSENTIAL_NFADERS 9
+// The Mackie Control messages use virtual cable 1
+#define KEYLAB_ESSENTIAL_MC_CABLE 1
 
+// The initial fader pickup thresholds; midi_filter_config_edit() can change them while MIDI flows
 // Assume that if abs(hardware fader value - daw fader value) is within 127, then the faders are synchronized
 #define KEYLAB_ESSENTIAL_FADERS_DELTA 0x7f
-static mc_fader_pickup_t fader_pickup[KEYLAB_ESSENTIAL_NFADERS]; // fader channels 1-8 plus the main fader
+// The Keylab Essential faders are not motorized and chatter by a few LSBs when they are not moving
+#define KEYLAB_ESSENTIAL_FADERS_DEADBAND 4
+#define KEYLAB_ESSENTIAL_FADERS_HYSTERESIS 4
+// Send the last value the deadband held back once the fader has not moved for this long
+#define KEYLAB_ESSENTIAL_FADERS_SETTLE_US 20000
+// The format of the state filter_midi_save_state() stores
+#define KEYLAB_ESSENTIAL_STATE_VERSION 1
+// fader channels 1-8 plus the main fader. filter_midi_in() updates them on one core while
+// filter_midi_out() updates them on the other; the pickup functions are safe for that
+static mc_fader_pickup_t fader_pickup[KEYLAB_ESSENTIAL_NFADERS];
+// the suppressed count and time when filter_midi_in_poll() last saw each fader move
+static struct {
+  uint32_t suppressed;
+  uint32_t since_us;
+} fader_settle[KEYLAB_ESSENTIAL_NFADERS];
 
-void filter_midi_init(void)
+static mc_led_cache_t led_cache; // the button LED states the DAW set
+
+// the notes the Keylab Essential keys are sounding, as the note maps sent them; filter_midi_in() core only
+static midi_note_map_state_t note_state;
+
+#ifndef KEYLAB_ESSENTIAL_MC_LCD_MODE
+// Define as MC_LCD_SHADOW_DROP if the control surface has no display for the Mackie Control LCD text
+#define KEYLAB_ESSENTIAL_MC_LCD_MODE MC_LCD_SHADOW_DIFF
+#endif
+// The Mackie Control main unit device ID in the LCD SysEx messages
+#define KEYLAB_ESSENTIAL_MC_DEVICE_ID 0x14
+static mc_lcd_shadow_t lcd_shadow; // the LCD text the DAW wrote
+#if MC_LCD_SHADOW_MAX_PACKETS > FILTER_MIDI_OUT_POLL_PACKETS
+#error "filter_midi_out_poll() has no room for a whole LCD write"
+#endif
+
+// bit n set means a SysEx message from the DAW on cable n has started and not ended; filter_midi_out() core only
+static uint16_t out_sysex_open;
+
+// the version of the configuration whose fader thresholds the pickups use; filter_midi_in() core only
+static uint32_t fader_config_version;
+
+// The rules filter_midi_init() loads, compiled from host/rules/keylab_essential_mc.rules with
+// midi_rules_compile -c. filter_midi_load_rules() replaces them.
+static const uint8_t default_rules[] = {
+  0x01, 0x0e,
+  0x02, 0x00, 0x01, 0x09, 0x00, 0x00, 0x50, 0x50, 0x48,
+  0x02, 0x00, 0x01, 0x09, 0x00, 0x00, 0x51, 0x51, 0x46,
+  0x01, 0x00, 0x01, 0x09, 0x00, 0x00, 0x58, 0x58, 0x00,
+  0x02, 0x00, 0x01, 0x08, 0x00, 0x00, 0x50, 0x50, 0x48,
+  0x02, 0x00, 0x01, 0x08, 0x00, 0x00, 0x51, 0x51, 0x46,
+  0x01, 0x00, 0x01, 0x08, 0x00, 0x00, 0x58, 0x58, 0x00,
+  0x02, 0x01, 0x01, 0x09, 0x00, 0x00, 0x48, 0x48, 0x50,
+  0x02, 0x01, 0x01, 0x09, 0x00, 0x00, 0x46, 0x46, 0x51,
+  0x02, 0x01, 0x01, 0x08, 0x00, 0x00, 0x48, 0x48, 0x50,
+  0x02, 0x01, 0x01, 0x08, 0x00, 0x00, 0x46, 0x46, 0x51,
+  0x04, 0x00, 0x01, 0x0e, 0x00, 0x08, 0x00, 0x7f, 0x01,
+  0x04, 0x01, 0x01, 0x0e, 0x00, 0x08, 0x00, 0x7f, 0x01,
+  0x04, 0x01, 0x01, 0x09, 0x00, 0x00, 0x00, 0x7f, 0x02,
+  0x04, 0x01, 0x01, 0x08, 0x00, 0x00, 0x00, 0x7f, 0x02,
+  0x54,
+};
+
+#ifndef KEYLAB_ESSENTIAL_MAX_COPIES
+// The most packets the copy rules can make in one batch in each direction
+#define KEYLAB_ESSENTIAL_MAX_COPIES 32
+#endif
+// The packets the copy rules made, indexed by MIDI_FILTER_RULES_IN or MIDI_FILTER_RULES_OUT.
+// The poll function for the direction sends them; each is used only on the core that filters that direction
+static struct {
+  uint32_t packets[KEYLAB_ESSENTIAL_MAX_COPIES];
+  uint8_t count;
+  uint32_t dropped;
+} copies[2];
+
+// fader move from the Keylab Essential. Filter it out if the fader is not in sync with the DAW
+static bool fader_move_from_keylab(uint8_t packet[4])
 {
-  for (int chan = 0; chan < KEYLAB_ESSENTIAL_NFADERS; chan++)
+  TU_LOG2("received packet %02x %02x %02x\r\n", packet[1], packet[2], packet[3]);
+  if ((packet[1] & 0xf) >= KEYLAB_ESSENTIAL_NFADERS)
+    return true; // loaded rules may send any pitch bend channel here
+  return mc_fader_pickup_set_hw_fader_value(&fader_pickup[packet[1] & 0xf], mc_fader_extract_value(packet));
+}
+
+// fader move command from DAW. Update Mackie Control fader synchronization
+static bool fader_move_from_daw(uint8_t packet[4])
+{
+  if ((packet[1] & 0xf) < KEYLAB_ESSENTIAL_NFADERS)
+    (void)mc_fader_pickup_set_daw_fader_value(&fader_pickup[packet[1] & 0xf], mc_fader_extract_value(packet));
+  return false;
+}
+
+// button LED command from the DAW. Filter it out if it would not change the LED
+static bool led_from_daw(uint8_t packet[4])
+{
+  return mc_led_cache_update(&led_cache, packet);
+}
+
+static void add_copy(uint8_t dir, const uint8_t packet[4])
+{
+  if (copies[dir].count == KEYLAB_ESSENTIAL_MAX_COPIES)
   {
-    mc_fader_pickup_init(fader_pickup+chan, KEYLAB_ESSENTIAL_FADERS_DELTA);
+    ++copies[dir].dropped;
+    return;
   }
+  memcpy(copies[dir].packets + copies[dir].count++, packet, 4);
 }
 
-/**
- * @brief
- * 
- * @param packet the 4-byte USB MIDI packet
- * @return uint8_t the virtual MIDI cable 0-15
- */
-static uint8_t get_cable_num(uint8_t packet[4])
+static void copy_from_keylab(const uint8_t packet[4])
 {
-  return (packet[0] >> 4) & 0xf;
+  add_copy(MIDI_FILTER_RULES_IN, packet);
 }
 
-#if 0
-/**
- * @brief Get the channel num object
- * 
- * @param packet the 4-byte USB MIDI packet
- * @return uint8_t 0 if not a channel message or the
- * MIDI channel number 1-16
- */
-static uint8_t get_channel_num(uint8_t packet[4])
+static void copy_from_daw(const uint8_t packet[4])
+{
+  add_copy(MIDI_FILTER_RULES_OUT, packet);
+}
+
+// Move up to max_packets copies to packets; returns the number moved
+static size_t take_copies(uint8_t dir, uint32_t* packets, size_t max_packets)
 {
-  uint8_t channel = 0;
-  if (packet[1]>= 0x80 && packet[0] <= 0xEF)
+  size_t npackets = copies[dir].count < max_packets ? copies[dir].count : max_packets;
+  memcpy(packets, copies[dir].packets, npackets * sizeof(uint32_t));
+  copies[dir].count -= npackets;
+  memmove(copies[dir].packets, copies[dir].packets + npackets, copies[dir].count * sizeof(uint32_t));
+  return npackets;
+}
+
+// The stateful stages and copy functions the rules may use
+static const midi_filter_rules_hooks_t rules_hooks = {
+  .stages = {
+    [MIDI_FILTER_RULES_STAGE_FADER_PICKUP] = {fader_move_from_keylab, fader_move_from_daw},
+    [MIDI_FILTER_RULES_STAGE_BUTTON_LEDS] = {NULL, led_from_daw},
+  },
+  .copy = {copy_from_keylab, copy_from_daw},
+  .note_map = true,
+};
+
+// Get the configuration for packets from the Keylab Essential and apply any new fader thresholds
+static const midi_filter_config_t* read_in_config(void)
+{
+  const midi_filter_config_t* config = midi_filter_config_read(MIDI_FILTER_CONFIG_READER_IN);
+  if (config->version != fader_config_version)
   {
-    channel = (packet[1] & 0xf) + 1;
+    for (uint8_t chan = 0; chan < KEYLAB_ESSENTIAL_NFADERS; chan++)
+    {
+      mc_fader_pickup_set_sync_delta(fader_pickup+chan, config->fader_sync_delta);
+      mc_fader_pickup_set_deadband(fader_pickup+chan, config->fader_deadband, config->fader_hysteresis);
+    }
+    fader_config_version = config->version;
   }
-  return channel;
+  return config;
+}
+
+void filter_midi_init(void)
+{
+  midi_filter_config_t* config = midi_filter_config_init();
+  config->fader_sync_delta = KEYLAB_ESSENTIAL_FADERS_DELTA;
+  config->fader_deadband = KEYLAB_ESSENTIAL_FADERS_DEADBAND;
+  config->fader_hysteresis = KEYLAB_ESSENTIAL_FADERS_HYSTERESIS;
+  uint8_t bad_rule = 0;
+  uint8_t result = midi_filter_rules_compile(default_rules, sizeof(default_rules), &rules_hooks, config, &bad_rule);
+  if (result != MIDI_FILTER_RULES_OK)
+    printf("default filter rules: %s at rule %u\r\n", midi_filter_rules_result_name(result), bad_rule);
+  for (int chan = 0; chan < KEYLAB_ESSENTIAL_NFADERS; chan++)
+  {
+    mc_fader_pickup_init(fader_pickup+chan, config->fader_sync_delta);
+    mc_fader_pickup_set_deadband(fader_pickup+chan, config->fader_deadband, config->fader_hysteresis);
+  }
+  memset(fader_settle, 0, sizeof(fader_settle));
+  memset(copies, 0, sizeof(copies));
+  out_sysex_open = 0;
+  midi_note_map_state_init(&note_state);
+  mc_led_cache_init(&led_cache);
+  mc_lcd_shadow_init(&lcd_shadow, KEYLAB_ESSENTIAL_MC_LCD_MODE, KEYLAB_ESSENTIAL_MC_CABLE, KEYLAB_ESSENTIAL_MC_DEVICE_ID);
+  midi_filter_config_publish(config);
+  fader_config_version = config->version;
 }
-#endif
 
 // Filter messages from the Arturia Keylab Essential
-bool filter_midi_in(uint8_t packet[4])
+size_t filter_midi_in_batch(uint32_t* packets, size_t npackets, uint32_t* post)
 {
-  bool packet_not_filtered_out = true;
-  if (get_cable_num(packet) == 1)
+  // one configuration for the whole batch so no packet sees half of an update
+  const midi_filter_config_t* config = read_in_config();
+  size_t nkept = 0;
+  for (size_t idx = 0; idx < npackets; idx++)
   {
-    // remap the note numbers for certain button presses
-    if (packet[1] == 0x90 || packet[1] == 0x80)
-    {
-      switch (packet[2])
-      {
-        default:
-          break;
-        case 0x50: // Save button
-          packet[2] = 0x48;
-          break;
-        case 0x51: // Undo button
-          packet[2] = 0x46;
-          break;
-        case 0x58:
-          packet_not_filtered_out = false;
-          break;
-      }
-    }
-    else if (packet[1] >= 0xe0 && packet[1] <= 0xe8)
+    uint32_t packet = packets[idx];
+    bool kept = midi_filter_table_apply(&config->in, (uint8_t*)&packet) &&
+        midi_note_map_apply(&config->note_map, &note_state, (uint8_t*)&packet);
+    if (post != NULL)
+      post[idx] = kept ? packet : 0;
+    if (kept)
+      packets[nkept++] = packet;
+  }
+  return nkept;
+}
+
+// Keep track of the SysEx messages from the DAW a packet on its way out starts or ends
+static inline void track_out_sysex(uint32_t packet)
+{
+  const uint8_t* bytes = (const uint8_t*)&packet;
+  uint8_t cin = bytes[0] & 0xf;
+  if (cin == 0x4)
+    out_sysex_open |= 1u << (bytes[0] >> 4);
+  else if (cin != 0xF)
+    out_sysex_open &= ~(1u << (bytes[0] >> 4)); // the message ended or was cut short
+}
+
+// Filter messages from the DAW
+size_t filter_midi_out_batch(uint32_t* packets, size_t npackets, uint32_t* post)
+{
+  const midi_filter_config_t* config = midi_filter_config_read(MIDI_FILTER_CONFIG_READER_OUT);
+  size_t nkept = 0;
+  for (size_t idx = 0; idx < npackets; idx++)
+  {
+    // LCD writes go through the LCD shadow and come back out of filter_midi_out_poll().
+    // The shadow can send a packet it held back in place of this one.
+    uint32_t packet = packets[idx];
+    bool kept = mc_lcd_shadow_rx_packet(&lcd_shadow, &packet) &&
+        midi_filter_table_apply(&config->out, (uint8_t*)&packet);
+    if (post != NULL)
+      post[idx] = kept ? packet : 0;
+    if (kept)
     {
-      // fader move from the Keylab Essential. Filter it out if the fader is not in sync with the DAW
-      TU_LOG2("received packet %02x %02x %02x\r\n", packet[1], packet[2], packet[3]);
-      packet_not_filtered_out = mc_fader_pickup_set_hw_fader_value(&fader_pickup[packet[1] & 0xf], mc_fader_extract_value(packet));
+      track_out_sysex(packet);
+      packets[nkept++] = packet;
     }
   }
-  return packet_not_filtered_out;
+  return nkept;
 }
 
-// Filter messages from the DAW
-bool filter_midi_out(uint8_t packet[4])
+// Send the resting value of any fader whose last moves the deadband held back
+size_t filter_midi_in_poll(uint32_t now_us, uint32_t* packets, size_t max_packets)
 {
-  bool packet_not_filtered_out = true;
-  if (get_cable_num(packet) == 1)
+  (void)read_in_config(); // a quiescent point for configuration updates even when no packets arrive
+  size_t npackets = take_copies(MIDI_FILTER_RULES_IN, packets, max_packets);
+  for (uint8_t chan = 0; chan < KEYLAB_ESSENTIAL_NFADERS && npackets < max_packets; chan++)
   {
-    // remap the note numbers for certain button LEDs
-    if (packet[1] == 0x90 || packet[1] == 0x80)
+    mc_fader_pickup_t* pickup = fader_pickup + chan;
+    if (!mc_fader_pickup_has_pending_value(pickup))
+      continue;
+    if (pickup->suppressed != fader_settle[chan].suppressed)
     {
-      switch (packet[2])
-      {
-        default:
-            break;
-        case 0x48: // Save button
-            packet[2] = 0x50;
-            break;
-        case 0x46: // Undo button
-            packet[2] = 0x51;
-            break;
-      }
+      // the fader moved since the last poll; wait for it to settle
+      fader_settle[chan].suppressed = pickup->suppressed;
+      fader_settle[chan].since_us = now_us;
+      continue;
     }
-    else if (packet[1] >= 0xe0 && packet[1] <= 0xe8)
+    uint16_t value;
+    if (now_us - fader_settle[chan].since_us >= KEYLAB_ESSENTIAL_FADERS_SETTLE_US &&
+        mc_fader_pickup_take_pending_value(pickup, &value))
     {
-      // fader move command from DAW. Update Mackie Control fader synchronization
-      packet_not_filtered_out = false;
-      (void)mc_fader_pickup_set_daw_fader_value(&fader_pickup[packet[1] & 0xf], mc_fader_extract_value(packet));
+      uint8_t packet[4] = {(KEYLAB_ESSENTIAL_MC_CABLE << 4) | 0xE, 0xE0 | chan, value & 0x7f, (value >> 7) & 0x7f};
+      memcpy(packets + npackets, packet, sizeof(packet));
+      ++npackets;
     }
   }
-  return packet_not_filtered_out;
+  return npackets;
+}
+
+void filter_midi_out_mounted(void)
+{
+  mc_led_cache_start_refresh(&led_cache);
+  mc_lcd_shadow_start_refresh(&lcd_shadow);
+}
+
+size_t filter_midi_out_poll(uint32_t now_us, uint32_t* packets, size_t max_packets)
+{
+  (void)now_us;
+  // a quiescent point for configuration updates
+  const midi_filter_config_t* config = midi_filter_config_read(MIDI_FILTER_CONFIG_READER_OUT);
+  // a DAW packet the LCD shadow held back goes out before anything else
+  size_t npackets = 0;
+  if (max_packets > 0 && mc_lcd_shadow_take_held(&lcd_shadow, packets))
+    npackets = midi_filter_table_apply_batch(&config->out, packets, 1);
+  if (npackets != 0)
+    track_out_sysex(packets[0]);
+  // generated packets must not land inside a SysEx message the DAW is still sending
+  if (out_sysex_open != 0)
+    return npackets;
+  npackets += take_copies(MIDI_FILTER_RULES_OUT, packets + npackets, max_packets - npackets);
+  npackets += mc_lcd_shadow_get_packets(&lcd_shadow, packets + npackets, max_packets - npackets);
+  return npackets + mc_led_cache_refresh(&led_cache, packets + npackets, max_packets - npackets);
+}
+
+void filter_midi_print_stats(void)
+{
+  printf("button LEDs: forwarded=%lu dropped=%lu refreshed=%lu\r\n", (unsigned long)led_cache.forwarded,
+      (unsigned long)led_cache.dropped, (unsigned long)led_cache.refreshed);
+  printf("LCD: bytes in=%lu bytes out=%lu SysEx dropped=%lu\r\n", (unsigned long)lcd_shadow.lcd_bytes_in,
+      (unsigned long)lcd_shadow.lcd_bytes_out, (unsigned long)lcd_shadow.dropped);
+  printf("rule copies dropped: in=%lu out=%lu\r\n", (unsigned long)copies[MIDI_FILTER_RULES_IN].dropped,
+      (unsigned long)copies[MIDI_FILTER_RULES_OUT].dropped);
+  printf("fader deadband suppressed:");
+  for (uint8_t chan = 0; chan < KEYLAB_ESSENTIAL_NFADERS; chan++)
+  {
+    printf(" %lu", (unsigned long)fader_pickup[chan].suppressed);
+  }
+  printf("\r\n");
+}
+
+uint8_t filter_midi_load_rules(const uint8_t* rules, uint16_t len, uint8_t* bad_rule)
+{
+  // report broken rules even while the previous configuration is still in use
+  uint8_t result = midi_filter_rules_check(rules, len, bad_rule);
+  if (result != MIDI_FILTER_RULES_OK)
+    return result;
+  midi_filter_config_t* config = midi_filter_config_edit();
+  if (config == NULL)
+    return MIDI_FILTER_RULES_BUSY;
+  result = midi_filter_rules_compile(rules, len, &rules_hooks, config, bad_rule);
+  if (result == MIDI_FILTER_RULES_OK)
+    midi_filter_config_publish(config);
+  return result;
+}
+
+size_t filter_midi_save_state(uint8_t* buf, size_t max_len)
+{
+  // version, number of faders, then a flag and the 14-bit DAW value, 7 bits at a time, for each fader
+  size_t len = 2 + 3 * KEYLAB_ESSENTIAL_NFADERS;
+  if (max_len < len)
+    return 0;
+  *buf++ = KEYLAB_ESSENTIAL_STATE_VERSION;
+  *buf++ = KEYLAB_ESSENTIAL_NFADERS;
+  for (uint8_t chan = 0; chan < KEYLAB_ESSENTIAL_NFADERS; chan++)
+  {
+    uint32_t word = mc_fader_pickup_load(fader_pickup + chan);
+    mc_fader_pickup_state_t state = mc_fader_pickup_word_state(word);
+    uint16_t daw = mc_fader_pickup_word_daw(word);
+    bool known = state != MC_FADER_PICKUP_RESET && state != MC_FADER_PICKUP_DAW_UNKNOWN;
+    *buf++ = known ? 1 : 0;
+    *buf++ = known ? (daw & 0x7f) : 0;
+    *buf++ = known ? ((daw >> 7) & 0x7f) : 0;
+  }
+  return len;
+}
+
+void filter_midi_restore_state(const uint8_t* buf, size_t len)
+{
+  if (len < 2 || buf[0] != KEYLAB_ESSENTIAL_STATE_VERSION || buf[1] != KEYLAB_ESSENTIAL_NFADERS ||
+      len < 2 + 3 * KEYLAB_ESSENTIAL_NFADERS)
+    return;
+  buf += 2;
+  for (uint8_t chan = 0; chan < KEYLAB_ESSENTIAL_NFADERS; chan++, buf += 3)
+  {
+    // the hardware faders may have moved while the power was off, so they must pick the value up again
+    if (buf[0])
+      (void)mc_fader_pickup_set_daw_fader_value(fader_pickup + chan, buf[1] | (buf[2] << 7));
+  }
+}
+
+bool filter_midi_in(uint8_t packet[4])
+{
+  uint32_t word;
+  memcpy(&word, packet, sizeof(word));
+  if (filter_midi_in_batch(&word, 1, NULL) == 0)
+    return false;
+  memcpy(packet, &word, sizeof(word));
+  return true;
+}
+
+bool filter_midi_out(uint8_t packet[4])
+{
+  uint32_t word;
+  memcpy(&word, packet, sizeof(word));
+  if (filter_midi_out_batch(&word, 1, NULL) == 0)
+    return false;
+  memcpy(packet, &word, sizeof(word));
+  return true;
 }
@@ -0,0 +1,272 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include "mc_lcd_shadow.h"
+
+#define MC_LCD_SHADOW_HEADER_LEN 7 // F0 00 00 66 <device ID> 12 <offset>
+// Merge two changed segments if the unchanged gap between them is no longer
+// than the header and F7 a separate LCD write would need
+#define MC_LCD_SHADOW_MERGE_GAP (MC_LCD_SHADOW_HEADER_LEN + 1)
+
+void mc_lcd_shadow_init(mc_lcd_shadow_t* shadow, mc_lcd_shadow_mode_t mode, uint8_t cable, uint8_t device_id)
+{
+  memset(shadow, 0, sizeof(*shadow));
+  shadow->mode = mode;
+  shadow->cable = cable;
+  shadow->device_id = device_id;
+}
+
+// Split a complete SysEx message into USB MIDI packets and queue them
+static bool queue_sysex(mc_lcd_shadow_t* shadow, const uint8_t* bytes, uint16_t len)
+{
+  if (shadow->tx_next == shadow->tx_len)
+    shadow->tx_next = shadow->tx_len = 0;
+  if (shadow->tx_len + (len + 2) / 3 > MC_LCD_SHADOW_TX_SIZE)
+  {
+    ++shadow->dropped;
+    return false;
+  }
+  for (uint16_t idx = 0; idx < len; idx += 3)
+  {
+    uint8_t nbytes = len - idx < 3 ? len - idx : 3;
+    uint8_t cin = idx + nbytes == len ? (uint8_t)(0x4 + nbytes) : 0x4; // 0x5, 0x6 or 0x7 end the SysEx
+    uint8_t packet[4] = {(uint8_t)((shadow->cable << 4) | cin), bytes[idx],
+        nbytes > 1 ? bytes[idx + 1] : 0, nbytes > 2 ? bytes[idx + 2] : 0};
+    memcpy(&shadow->tx[shadow->tx_len++], packet, sizeof(packet));
+  }
+  return true;
+}
+
+static bool queue_lcd_write(mc_lcd_shadow_t* shadow, uint8_t offset, const uint8_t* chars, uint8_t nchars)
+{
+  uint8_t msg[MC_LCD_SHADOW_HEADER_LEN + MC_LCD_SHADOW_SIZE + 1] = {0xF0, 0x00, 0x00, 0x66, shadow->device_id, 0x12, offset};
+  memcpy(msg + MC_LCD_SHADOW_HEADER_LEN, chars, nchars);
+  msg[MC_LCD_SHADOW_HEADER_LEN + nchars] = 0xF7;
+  if (!queue_sysex(shadow, msg, MC_LCD_SHADOW_HEADER_LEN + nchars + 1))
+    return false;
+  shadow->lcd_bytes_out += MC_LCD_SHADOW_HEADER_LEN + nchars + 1;
+  return true;
+}
+
+static bool is_changed(const mc_lcd_shadow_t* shadow, uint8_t pos, uint8_t chr)
+{
+  return !shadow->known[pos] || shadow->text[pos] != chr;
+}
+
+// Send the parts of an LCD write that change what the LCD shows
+static void lcd_write(mc_lcd_shadow_t* shadow, uint8_t offset, const uint8_t* chars, uint8_t nchars)
+{
+  if (offset >= MC_LCD_SHADOW_SIZE)
+    return;
+  if (nchars > MC_LCD_SHADOW_SIZE - offset)
+    nchars = MC_LCD_SHADOW_SIZE - offset;
+  if (shadow->mode != MC_LCD_SHADOW_DIFF)
+  {
+    // nothing is sent, so nothing is known to be on the LCD
+    memcpy(shadow->text + offset, chars, nchars);
+    memset(shadow->known + offset, false, nchars);
+    return;
+  }
+  uint8_t idx = 0;
+  while (idx < nchars)
+  {
+    if (!is_changed(shadow, offset + idx, chars[idx]))
+    {
+      ++idx;
+      continue;
+    }
+    uint8_t start = idx;
+    uint8_t end = idx + 1; // one past the last changed character in the segment
+    for (uint8_t next = end; next < nchars && next - end <= MC_LCD_SHADOW_MERGE_GAP; next++)
+    {
+      if (is_changed(shadow, offset + next, chars[next]))
+        end = next + 1;
+    }
+    // a segment that did not fit in tx stays unknown so the next write of it is sent
+    bool queued = queue_lcd_write(shadow, offset + start, chars + start, end - start);
+    memcpy(shadow->text + offset + start, chars + start, end - start);
+    memset(shadow->known + offset + start, queued, end - start);
+    idx = end;
+  }
+}
+
+// A complete LCD write is in rx_buf
+static void rx_complete(mc_lcd_shadow_t* shadow)
+{
+  const uint8_t* msg = shadow->rx_buf;
+  uint16_t len = shadow->rx_len;
+  if (len >= MC_LCD_SHADOW_HEADER_LEN + 1 && msg[len - 1] == 0xF7)
+  {
+    uint8_t nchars = len - MC_LCD_SHADOW_HEADER_LEN - 1;
+    shadow->lcd_bytes_in += len;
+    lcd_write(shadow, msg[6], msg + MC_LCD_SHADOW_HEADER_LEN, nchars);
+  }
+  else
+  {
+    ++shadow->dropped;
+  }
+}
+
+// true if the bytes captured so far can still be the start of an LCD write
+static bool rx_is_lcd_write(const mc_lcd_shadow_t* shadow)
+{
+  const uint8_t header[] = {0xF0, 0x00, 0x00, 0x66, shadow->device_id, 0x12};
+  for (uint16_t idx = 0; idx < shadow->rx_len && idx < sizeof(header); idx++)
+  {
+    if (shadow->rx_buf[idx] != header[idx])
+      return false;
+  }
+  return true;
+}
+
+// Capture a packet from the DAW if it is part of an LCD write. Return true if
+// the packet is to be sent on. If the message being captured turns out not to
+// be an LCD write, set *released and store its first packet, which was taken,
+// in *first; it must be sent before this one.
+static bool capture_packet(mc_lcd_shadow_t* shadow, const uint8_t packet[4], uint32_t* first, bool* released)
+{
+  if ((packet[0] >> 4) != shadow->cable)
+    return true;
+  uint8_t cin = packet[0] & 0xf;
+  if (!shadow->rx_active)
+  {
+    if (cin != 0x4 || packet[1] != 0xF0 || packet[2] != 0x00 || packet[3] != 0x00)
+      return true;
+    shadow->rx_active = true;
+    shadow->rx_overflow = false;
+    shadow->rx_len = 0;
+  }
+  uint8_t nbytes;
+  switch (cin)
+  {
+    case 0x4: // SysEx starts or continues
+    case 0x7: // SysEx ends with following three bytes
+      nbytes = 3;
+      break;
+    case 0x6: // SysEx ends with following two bytes
+      nbytes = 2;
+      break;
+    case 0x5: // SysEx ends with following single byte
+      nbytes = 1;
+      break;
+    case 0xF: // a real-time message may interleave with SysEx
+      return true;
+    default:
+      // not SysEx; the message was cut short. Drop it and pass the packet on
+      shadow->rx_active = false;
+      ++shadow->dropped;
+      return true;
+  }
+  for (uint8_t idx = 1; idx <= nbytes; idx++)
+  {
+    if (shadow->rx_len < sizeof(shadow->rx_buf))
+      shadow->rx_buf[shadow->rx_len++] = packet[idx];
+    else
+      shadow->rx_overflow = true;
+  }
+  if (!rx_is_lcd_write(shadow))
+  {
+    // only the first packet was taken; the rest of the message goes on unchanged
+    uint8_t start[4] = {(shadow->cable << 4) | 0x4, shadow->rx_buf[0], shadow->rx_buf[1], shadow->rx_buf[2]};
+    memcpy(first, start, sizeof(start));
+    *released = true;
+    shadow->rx_active = false;
+    return true;
+  }
+  if (cin != 0x4)
+  {
+    shadow->rx_active = false;
+    if (shadow->rx_overflow)
+      ++shadow->dropped;
+    else
+      rx_complete(shadow);
+  }
+  return false;
+}
+
+bool mc_lcd_shadow_rx_packet(mc_lcd_shadow_t* shadow, uint32_t* packet)
+{
+  uint32_t first;
+  bool released = false;
+  bool pass = capture_packet(shadow, (const uint8_t*)packet, &first, &released);
+  // The packets to send, oldest first. A packet is released only after the
+  // capture took the one before it, and that took packet's slot sent any
+  // held packet, so at most two are left and at most one stays held.
+  uint32_t send[3];
+  size_t nsend = 0;
+  if (shadow->held)
+    send[nsend++] = shadow->held_packet;
+  if (released)
+    send[nsend++] = first;
+  if (pass)
+    send[nsend++] = *packet;
+  shadow->held = nsend > 1;
+  if (shadow->held)
+    shadow->held_packet = send[1];
+  if (nsend == 0)
+    return false;
+  *packet = send[0];
+  return true;
+}
+
+bool mc_lcd_shadow_take_held(mc_lcd_shadow_t* shadow, uint32_t* packet)
+{
+  if (!shadow->held)
+    return false;
+  *packet = shadow->held_packet;
+  shadow->held = false;
+  return true;
+}
+
+void mc_lcd_shadow_start_refresh(mc_lcd_shadow_t* shadow)
+{
+  if (shadow->mode != MC_LCD_SHADOW_DIFF)
+    return;
+  uint8_t text[MC_LCD_SHADOW_SIZE];
+  bool any_known = false;
+  for (uint8_t pos = 0; pos < MC_LCD_SHADOW_SIZE; pos++)
+  {
+    text[pos] = shadow->known[pos] ? shadow->text[pos] : ' ';
+    any_known |= shadow->known[pos];
+  }
+  if (any_known)
+    queue_lcd_write(shadow, 0, text, MC_LCD_SHADOW_SIZE);
+}
+
+size_t mc_lcd_shadow_get_packets(mc_lcd_shadow_t* shadow, uint32_t* packets, size_t max_packets)
+{
+  // hand out whole messages only so no other packet on the cable can land inside one
+  size_t npackets = 0;
+  for (size_t count = 1; count <= max_packets && shadow->tx_next + count <= shadow->tx_len; count++)
+  {
+    uint8_t cin = ((const uint8_t*)&shadow->tx[shadow->tx_next + count - 1])[0] & 0xf;
+    if (cin != 0x4)
+      npackets = count;
+  }
+  memcpy(packets, shadow->tx + shadow->tx_next, npackets * sizeof(packets[0]));
+  shadow->tx_next += npackets;
+  return npackets;
+}
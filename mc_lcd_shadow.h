@@ -0,0 +1,168 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file mc_lcd_shadow.h
+ *
+ * This file contains a shadow copy of the Mackie Control 2 line by 56 character
+ * LCD (the scribble strips). The DAW writes the LCD with the SysEx message
+ * F0 00 00 66 <device ID> 12 <offset> <characters> F7, where offset 0-55 is
+ * the top line and 56-111 is the bottom line. DAWs re-send long stretches of
+ * text that has not changed, and that text must squeeze through the slow USB
+ * host port like everything else.
+ *
+ * The shadow captures the LCD writes on the Mackie Control virtual cable. An
+ * LCD write is compared with the shadow and replaced with LCD writes of only
+ * the changed segments; nearby segments are merged when that is shorter than
+ * sending two headers. If the control surface has no display, LCD writes can
+ * be dropped instead. LCD writes longer than MC_LCD_SHADOW_MAX_SYSEX bytes
+ * are dropped.
+ *
+ * Every other message is sent on unchanged and in order. The shadow cannot
+ * tell an LCD write from other SysEx until the header's second packet, so it
+ * takes the first packet of any SysEx message that starts F0 00 00. If the
+ * message is not an LCD write, the shadow gives that packet back in place of
+ * the next one and holds on to the next one until a packet it takes frees a
+ * slot or mc_lcd_shadow_take_held() is called.
+ *
+ * To use this code:
+ * 1. Create a mc_lcd_shadow_t structure and call mc_lcd_shadow_init() to initialize it
+ * 2. Pass each packet from the DAW to mc_lcd_shadow_rx_packet(). If it returns
+ *    true, send the packet it leaves in place of the one passed in. Otherwise
+ *    the shadow took the packet; send nothing in its place.
+ * 3. Periodically call mc_lcd_shadow_take_held() and then mc_lcd_shadow_get_packets()
+ *    and send the packets they return to the control surface.
+ * 4. When the control surface is connected, call mc_lcd_shadow_start_refresh()
+ *    to send it the text the DAW has written so far.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MC_LCD_SHADOW_WIDTH 56
+#define MC_LCD_SHADOW_SIZE (2 * MC_LCD_SHADOW_WIDTH)
+
+#ifndef MC_LCD_SHADOW_MAX_SYSEX
+// The longest LCD write the shadow can capture, including F0 and F7
+#define MC_LCD_SHADOW_MAX_SYSEX 128
+#endif
+
+// The most packets one LCD write takes: the header, all of the characters and F7
+#define MC_LCD_SHADOW_MAX_PACKETS ((7 + MC_LCD_SHADOW_SIZE + 1 + 2) / 3)
+
+#ifndef MC_LCD_SHADOW_TX_SIZE
+// Number of packets that can wait to go to the control surface
+#define MC_LCD_SHADOW_TX_SIZE 128
+#endif
+
+typedef enum {
+  MC_LCD_SHADOW_DIFF,   // send only the LCD segments that changed
+  MC_LCD_SHADOW_DROP,   // the control surface has no display; drop LCD writes
+} mc_lcd_shadow_mode_t;
+
+typedef struct {
+  mc_lcd_shadow_mode_t mode;
+  uint8_t cable;                      // the Mackie Control virtual cable
+  uint8_t device_id;                  // the Mackie Control device ID in the SysEx header (0x14 for the main unit)
+  uint8_t text[MC_LCD_SHADOW_SIZE];   // the LCD characters the control surface shows
+  bool known[MC_LCD_SHADOW_SIZE];     // true if the control surface has been sent the character
+  bool rx_active;                     // an LCD write is being captured
+  bool rx_overflow;                   // the LCD write is too long to capture
+  uint16_t rx_len;                    // number of bytes in rx_buf
+  uint8_t rx_buf[MC_LCD_SHADOW_MAX_SYSEX];
+  uint32_t tx[MC_LCD_SHADOW_TX_SIZE]; // packets waiting to go to the control surface
+  uint16_t tx_len;                    // number of packets in tx
+  uint16_t tx_next;                   // index of the next packet in tx to send
+  bool held;                          // a packet from the DAW waits to be sent before any later one
+  uint32_t held_packet;
+  uint32_t lcd_bytes_in;              // LCD write bytes received from the DAW
+  uint32_t lcd_bytes_out;             // LCD write bytes sent to the control surface
+  uint32_t dropped;                   // LCD writes dropped because they were cut short, too long or did not fit in tx
+} mc_lcd_shadow_t;
+
+/**
+ * @brief initialize the shadow so every LCD character is unknown
+ *
+ * @param shadow a pointer to the mc_lcd_shadow_t structure to initialize
+ * @param mode MC_LCD_SHADOW_DIFF or MC_LCD_SHADOW_DROP
+ * @param cable the virtual cable 0-15 that carries the Mackie Control messages
+ * @param device_id the Mackie Control device ID of the LCD to shadow
+ */
+void mc_lcd_shadow_init(mc_lcd_shadow_t* shadow, mc_lcd_shadow_mode_t mode, uint8_t cable, uint8_t device_id);
+
+/**
+ * @brief pass a packet from the DAW through the shadow
+ *
+ * @param shadow a pointer to the mc_lcd_shadow_t structure
+ * @param packet the 4-byte USB MIDI packet; replaced with the packet to send
+ * in its place, which can be an earlier packet the shadow held
+ * @return true if *packet should be filtered and sent as usual; false if the
+ * shadow took the packet and there is nothing to send in its place
+ */
+bool mc_lcd_shadow_rx_packet(mc_lcd_shadow_t* shadow, uint32_t* packet);
+
+/**
+ * @brief take the packet from the DAW the shadow is holding, if any
+ *
+ * The held packet must be sent before the packets from mc_lcd_shadow_get_packets()
+ * and before any later packet from the DAW.
+ *
+ * @param shadow a pointer to the mc_lcd_shadow_t structure
+ * @param packet the held 4-byte USB MIDI packet
+ * @return true if a packet was held
+ */
+bool mc_lcd_shadow_take_held(mc_lcd_shadow_t* shadow, uint32_t* packet);
+
+/**
+ * @brief queue an LCD write of all of the text the DAW has written so far
+ *
+ * Call this after the control surface is connected or reconnected.
+ *
+ * @param shadow a pointer to the mc_lcd_shadow_t structure
+ */
+void mc_lcd_shadow_start_refresh(mc_lcd_shadow_t* shadow);
+
+/**
+ * @brief get the packets that are waiting to go to the control surface
+ *
+ * Only whole LCD writes are stored. Send them to the control surface
+ * together, with no other packet on the cable between them.
+ *
+ * @param shadow a pointer to the mc_lcd_shadow_t structure
+ * @param packets the array to store the 4-byte USB MIDI packets
+ * @param max_packets the maximum number of packets to store; at least
+ * MC_LCD_SHADOW_MAX_PACKETS, or the longest LCD writes never go out
+ * @return size_t the number of packets stored
+ */
+size_t mc_lcd_shadow_get_packets(mc_lcd_shadow_t* shadow, uint32_t* packets, size_t max_packets);
+
+#ifdef __cplusplus
+}
+#endif
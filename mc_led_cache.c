@@ -0,0 +1,85 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include "mc_led_cache.h"
+
+#define MC_LED_CACHE_REFRESH_DONE (MC_LED_CACHE_NCABLES * 128)
+
+void mc_led_cache_init(mc_led_cache_t* cache)
+{
+  memset(cache, 0, sizeof(*cache));
+  cache->refresh_next = MC_LED_CACHE_REFRESH_DONE;
+}
+
+bool mc_led_cache_update(mc_led_cache_t* cache, const uint8_t packet[4])
+{
+  uint8_t cable = packet[0] >> 4;
+  uint8_t note = packet[2] & 0x7f;
+  uint8_t word = note / 32;
+  uint32_t bit = 1u << (note % 32);
+  bool on = (packet[1] & 0xf0) == 0x90 && packet[3] != 0;
+  bool flash = on && packet[3] == 1;
+  uint32_t* known = &cache->known[cable][word];
+  uint32_t* on_bits = &cache->on[cable][word];
+  uint32_t* flash_bits = &cache->flash[cable][word];
+  if ((*known & bit) && ((*on_bits & bit) != 0) == on && ((*flash_bits & bit) != 0) == flash)
+  {
+    ++cache->dropped;
+    return false;
+  }
+  *known |= bit;
+  *on_bits = on ? (*on_bits | bit) : (*on_bits & ~bit);
+  *flash_bits = flash ? (*flash_bits | bit) : (*flash_bits & ~bit);
+  ++cache->forwarded;
+  return true;
+}
+
+void mc_led_cache_start_refresh(mc_led_cache_t* cache)
+{
+  cache->refresh_next = 0;
+}
+
+size_t mc_led_cache_refresh(mc_led_cache_t* cache, uint32_t* packets, size_t max_packets)
+{
+  size_t npackets = 0;
+  while (npackets < max_packets && cache->refresh_next < MC_LED_CACHE_REFRESH_DONE)
+  {
+    uint8_t cable = cache->refresh_next / 128;
+    uint8_t note = cache->refresh_next % 128;
+    uint8_t word = note / 32;
+    uint32_t bit = 1u << (note % 32);
+    if (cache->on[cable][word] & bit)
+    {
+      uint8_t velocity = (cache->flash[cable][word] & bit) ? 1 : 0x7f;
+      uint8_t packet[4] = {(uint8_t)((cable << 4) | 0x9), 0x90, note, velocity};
+      memcpy(packets + npackets, packet, sizeof(packet));
+      ++npackets;
+    }
+    ++cache->refresh_next;
+  }
+  cache->refreshed += npackets;
+  return npackets;
+}
@@ -0,0 +1,114 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file mc_led_cache.h
+ *
+ * This file contains a cache of the Mackie Control button LED states the DAW
+ * has set. The DAW sets a button LED with a MIDI note on message: velocity 0
+ * turns the LED off, velocity 1 makes it flash and any other velocity turns it
+ * on. The DAW re-sends the state of every LED on each bank or mode change, and
+ * most of those messages do not change anything. Sending them to a control
+ * surface with a slow USB endpoint delays the messages that matter.
+ *
+ * The cache keeps two bitmaps of 128 notes per virtual cable (on and flashing)
+ * plus a bitmap of the notes whose state the DAW has set at least once. A note
+ * message that would not change the LED state is redundant. After the control
+ * surface is (re)connected, its LEDs are all off; the cache can generate note
+ * on messages to restore every LED the DAW turned on.
+ *
+ * To use this code:
+ * 1. Create a mc_led_cache_t structure and call mc_led_cache_init() to initialize it
+ * 2. For each Mackie Control LED message (note on or note off) from the DAW, call
+ *    mc_led_cache_update(). If it returns false, do not send the message to the
+ *    control surface.
+ * 3. When the control surface is connected, call mc_led_cache_start_refresh()
+ *    and then call mc_led_cache_refresh() periodically to get the note on messages
+ *    to send until it returns 0.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MC_LED_CACHE_NCABLES 16
+#define MC_LED_CACHE_NWORDS (128 / 32) // 32-bit words per 128-note bitmap
+
+typedef struct {
+  uint32_t known[MC_LED_CACHE_NCABLES][MC_LED_CACHE_NWORDS]; // bit set once the DAW has set the LED state
+  uint32_t on[MC_LED_CACHE_NCABLES][MC_LED_CACHE_NWORDS];    // bit set if the LED is on or flashing
+  uint32_t flash[MC_LED_CACHE_NCABLES][MC_LED_CACHE_NWORDS]; // bit set if the LED is flashing
+  uint16_t refresh_next;  // cable * 128 + note of the next LED to refresh
+  uint32_t forwarded;     // number of LED messages that changed the LED state
+  uint32_t dropped;       // number of LED messages that were redundant
+  uint32_t refreshed;     // number of LED messages generated to refresh the control surface
+} mc_led_cache_t;
+
+/**
+ * @brief initialize the cache so every LED state is unknown
+ *
+ * @param cache a pointer to the mc_led_cache_t structure to initialize
+ */
+void mc_led_cache_init(mc_led_cache_t* cache);
+
+/**
+ * @brief update the cache with an LED message from the DAW
+ *
+ * @param cache a pointer to the mc_led_cache_t structure
+ * @param packet a 4-byte USB MIDI note on or note off packet
+ * @return true if the message changes the LED state and should be sent to the
+ * control surface; false if it is redundant
+ */
+bool mc_led_cache_update(mc_led_cache_t* cache, const uint8_t packet[4]);
+
+/**
+ * @brief start sending the cached LED states to the control surface again
+ *
+ * Call this after the control surface is connected or reconnected.
+ *
+ * @param cache a pointer to the mc_led_cache_t structure
+ */
+void mc_led_cache_start_refresh(mc_led_cache_t* cache);
+
+/**
+ * @brief get the next note on messages that restore the LEDs the DAW turned on
+ *
+ * LEDs that are off or unknown are skipped because a newly connected control
+ * surface has all of its LEDs off.
+ *
+ * @param cache a pointer to the mc_led_cache_t structure
+ * @param packets the array to store the 4-byte USB MIDI note on packets
+ * @param max_packets the maximum number of packets to store
+ * @return size_t the number of packets stored; 0 when the refresh is done
+ */
+size_t mc_led_cache_refresh(mc_led_cache_t* cache, uint32_t* packets, size_t max_packets);
+
+#ifdef __cplusplus
+}
+#endif
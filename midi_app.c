@@ -42,7 +42,6 @@
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
 #include "pico/bootrom.h"
-#include "hardware/watchdog.h"
 #include "pio_usb.h"
 
 #include "tusb.h"
@@ -51,15 +50,163 @@
 #include "class/midi/midi_device.h"
 #include "usb_descriptors.h"
 #include "midi_filter.h"
+#include "midi_filter_config.h"
+#include "midi_filter_rules.h"
+#include "midi_packet_ring.h"
+#include "midi_latency_hist.h"
+#include "midi_sysex_cmd.h"
+#include "midi_tx_queue.h"
+#include "midi_hub_router.h"
+#include "midi_flush_policy.h"
+#include "midi_capture.h"
+#include "midi_config_store.h"
 //--------------------------------------------------------------------+
 // MACRO TYPEDEF CONSTANT ENUM DECLARATION
 //--------------------------------------------------------------------+
+// Packets are read, filtered and written in batches of up to one
+// full-speed bulk endpoint buffer (64 bytes)
+#define MIDI_BATCH_MAX_PACKETS 16
+
+#if FILTER_MIDI_OUT_POLL_PACKETS > MIDI_PACKET_RING_SIZE / 2
+#error "poll_midi_filter_out() must fit all of the packets of a poll in the MIDI OUT ring"
+#endif
+
+// When the USB host is slow to read MIDI IN packets, replace waiting
+// pitch bend (Mackie Control fader) messages on cable 1 and CC messages
+// on cable 0 with newer values. The Mackie Control cable 1 CC messages are
+// relative V-Pot and jog wheel steps, so they must all be sent, and the
+// cable 0 pitch bend is the keyboard's pitch wheel, which plays with the notes.
+#ifndef MIDI_IN_COALESCE_CC_CABLES
+#define MIDI_IN_COALESCE_CC_CABLES 0x0001
+#endif
+#ifndef MIDI_IN_COALESCE_PITCH_BEND_CABLES
+#define MIDI_IN_COALESCE_PITCH_BEND_CABLES 0x0002
+#endif
+
+// Set MIDI_HUB_AGGREGATE to 1 to merge all MIDI devices attached through a USB
+// hub into one MIDI device with a virtual cable for each cable of each device
+// instead of cloning the first MIDI device. Set MIDI_HUB_VID and MIDI_HUB_PID to
+// your own USB IDs. The composite device is built MIDI_HUB_SETTLE_MS after the
+// last MIDI device attached so a hub full of devices enumerates only once.
+#ifndef MIDI_HUB_AGGREGATE
+#define MIDI_HUB_AGGREGATE 0
+#endif
+#ifndef MIDI_HUB_VID
+#define MIDI_HUB_VID 0xCafe
+#endif
+#ifndef MIDI_HUB_PID
+#define MIDI_HUB_PID 0x4010
+#endif
+#ifndef MIDI_HUB_SETTLE_MS
+#define MIDI_HUB_SETTLE_MS 500
+#endif
+
+// The filter rules and state are saved to flash, but writing flash pauses
+// both cores and erasing a sector stalls the USB host port long enough to
+// suspend the MIDI device, so the writes wait until no MIDI has passed
+// through for MIDI_CONFIG_STORE_IDLE_MS. The filter state changes whenever
+// the DAW moves a fader, so it is saved at most once every
+// MIDI_CONFIG_STORE_STATE_INTERVAL_MS (at most 71 minutes, the time_us_32()
+// period), or right away with the w command.
+#ifndef MIDI_CONFIG_STORE_IDLE_MS
+#define MIDI_CONFIG_STORE_IDLE_MS 2000
+#endif
+#ifndef MIDI_CONFIG_STORE_STATE_INTERVAL_MS
+#define MIDI_CONFIG_STORE_STATE_INTERVAL_MS (30 * 60 * 1000)
+#endif
 
 //--------------------------------------------------------------------+
 // STATIC GLOBALS DECLARATION
 //--------------------------------------------------------------------+
 static uint8_t midi_dev_addr = 0;
 
+// Packets flow between the cores only through these rings so that core0
+// only calls the USB device stack and core1 only calls the USB host stack.
+static midi_packet_ring_t midi_in_ring;   // filtered MIDI IN packets: core1 (host) -> core0 (device)
+static midi_packet_ring_t midi_out_ring;  // filtered MIDI OUT packets: core0 (device) -> core1 (host)
+// System real-time messages (MIDI clock, start, stop, active sensing, etc.) skip
+// ahead of waiting SysEx packets, e.g., the rest of a long SysEx message. USB MIDI
+// packets are self-contained, so a real-time packet may go between the packets of
+// a SysEx message just as a real-time byte may go between SysEx bytes on a DIN cable.
+// A real-time packet never overtakes any other message (e.g., Continue after a Song
+// Position Pointer): while one waits, real-time packets stay in order in midi_in_ring.
+static midi_packet_ring_t midi_in_rt_ring; // filtered MIDI IN real-time packets: core1 (host) -> core0 (device)
+static uint32_t midi_in_ordered_pushed;   // non-SysEx packets core1 pushed to midi_in_ring; written by core1
+static uint32_t midi_in_ordered_popped;   // non-SysEx packets core0 popped from midi_in_ring; core0 only
+static uint32_t midi_in_ordered_done;     // non-SysEx packets that left midi_in_ring and the retry queue; written by core0
+
+// Time from when a packet arrives at one USB port until it is handed to the other USB stack
+static midi_latency_hist_t midi_in_latency;  // updated on core0
+static midi_latency_hist_t midi_out_latency; // updated on core1
+static midi_latency_hist_t midi_in_rt_latency; // MIDI IN real-time packets only; updated on core0
+
+// The last packets through the filter in each direction, for troubleshooting
+static midi_capture_t midi_in_capture;    // recorded on core1
+static midi_capture_t midi_out_capture;   // recorded on core0
+static struct {
+  bool active;
+  midi_capture_dir_t dir;
+  uint32_t seq;           // the next record to print
+  uint32_t end;           // the head of the ring when the dump started
+} capture_dump;           // used only on core0
+
+// Packets a USB stack refused because its transmit FIFO was full wait here
+static midi_tx_queue_t midi_dev_tx_queue;    // used only on core0
+static midi_tx_queue_t midi_host_tx_queue;   // used only on core1
+static midi_tx_queue_t midi_dev_rt_tx_queue; // used only on core0
+static uint32_t midi_in_rt_ahead;            // real-time packets sent while other packets waited; core0 only
+
+// SysEx command replies wait here while a SysEx message from the MIDI device is open on their cable
+static struct {
+  uint32_t packets[MIDI_TX_QUEUE_SIZE];
+  uint32_t timestamps[MIDI_TX_QUEUE_SIZE];
+  uint32_t count;
+  uint16_t cables;        // the cables the waiting replies go out on
+} cmd_reply_wait;         // used only on core0
+static uint16_t midi_in_sysex_open; // cables a SysEx message from the MIDI device is still open on; core0 only
+
+// core1 counts MIDI device mounts; core0 tells the filter when the count changes
+static uint32_t midi_host_mounts;
+static uint32_t filter_midi_mounts;   // used only on core0
+
+// Hot-plug recovery: core1 records when the MIDI device goes away and comes back
+static bool midi_host_unmounted = false;  // set by core1, cleared by core0
+static uint32_t midi_host_unmount_us;     // written by core1 before it sets midi_host_unmounted
+static uint32_t midi_host_mount_us;       // written by core1 before it increments midi_host_mounts
+static bool device_descriptors_cloned = false; // set by core1 when cloning finishes, cleared by core0 when done with them
+static struct {
+  bool pending;           // the MIDI device was unplugged and is not usable yet
+  uint32_t unmount_us;    // when the MIDI device was unplugged
+  uint32_t count;         // number of times the MIDI device came back
+  uint32_t last_unplug_ms;// time from unplug until the MIDI device was usable again
+  uint32_t last_attach_ms;// time from attach until the MIDI device was usable again
+  uint32_t max_attach_ms;
+} hot_plug;               // used only on core0
+
+static midi_flush_policy_t midi_host_flush; // decides when to send the packets written to the MIDI device
+
+// The MIDI device a host tx queue writes to and its flush policy; the write context of midi_host_write()
+typedef struct
+{
+  const uint8_t* dev_addr;  // where the device's address is kept; 0 while no device is there
+  midi_flush_policy_t* flush;
+} midi_host_target_t;
+static midi_host_target_t midi_host_target = {&midi_dev_addr, &midi_host_flush};
+
+// MIDI_HUB_AGGREGATE: all MIDI devices behind the hub share one device port
+static midi_hub_router_t midi_hub;        // used only on core1
+static midi_tx_queue_t midi_hub_tx_queues[MIDI_HUB_MAX_DEVICES]; // used only on core1
+static midi_flush_policy_t midi_hub_flush[MIDI_HUB_MAX_DEVICES];
+static midi_host_target_t midi_hub_targets[MIDI_HUB_MAX_DEVICES];
+static bool midi_hub_rebuild = false;     // the composite device descriptors are out of date
+static uint32_t midi_hub_change_us;       // when the last MIDI device attached
+static char midi_hub_jack_names[2 * MIDI_HUB_MAX_CABLES][12];
+
+static uint32_t midi_traffic_us;          // when MIDI last passed through core0; used only on core0
+static uint32_t config_check_us;          // when the filter state was last saved; used only on core0
+static bool config_save_now;              // the w command asked to save to flash without waiting; used only on core0
+
+// core0: filter packets from the USB host and queue them for core1
 static void poll_midi_dev_rx(bool connected)
 {
   // device must be attached and have at least one endpoint ready to receive a message
@@ -67,16 +214,678 @@ static void poll_midi_dev_rx(bool connected)
   {
     return;
   }
-  uint8_t packet[4];
-  while (tud_midi_packet_read(packet))
+  uint32_t packets[MIDI_BATCH_MAX_PACKETS];
+  uint32_t nread;
+  do
+  {
+    uint32_t npackets = 0;
+    for (nread = 0; nread < MIDI_BATCH_MAX_PACKETS && tud_midi_packet_read((uint8_t*)(packets+npackets)); nread++)
+    {
+      // vendor SysEx commands are for this program; do not send them to the MIDI device
+      if (!midi_sysex_cmd_rx_packet((uint8_t*)(packets+npackets)))
+        ++npackets;
+    }
+    uint32_t now = time_us_32();
+    if (nread > 0)
+      midi_traffic_us = now;
+    size_t nkept = midi_capture_filter_batch(&midi_out_capture, filter_midi_out_batch, packets, npackets, now);
+    midi_packet_ring_push_n(&midi_out_ring, packets, nkept, now);
+  } while (nread == MIDI_BATCH_MAX_PACKETS);
+}
+
+// core0: forward any packets the filter generated on its own to core1
+static void poll_midi_filter_out(void)
+{
+  uint32_t mounts = __atomic_load_n(&midi_host_mounts, __ATOMIC_ACQUIRE);
+  if (mounts != filter_midi_mounts)
+  {
+    filter_midi_mounts = mounts;
+    filter_midi_out_mounted();
+  }
+  // a quiescent point for configuration updates even while the ring is too
+  // full to poll the filter; otherwise a busy DAW can hold off every edit
+  (void)midi_filter_config_read(MIDI_FILTER_CONFIG_READER_OUT);
+  // leave room in the ring for the packets from the USB host. The packets
+  // are pushed together, so a SysEx message the filter generated arrives whole
+  if (midi_packet_ring_level(&midi_out_ring) > MIDI_PACKET_RING_SIZE / 2)
+    return;
+  uint32_t packets[FILTER_MIDI_OUT_POLL_PACKETS];
+  uint32_t now = time_us_32();
+  size_t npackets = filter_midi_out_poll(now, packets, FILTER_MIDI_OUT_POLL_PACKETS);
+  for (size_t idx = 0; idx < npackets; idx++)
+    midi_capture_add(&midi_out_capture, now, 0, packets[idx]);
+  if (npackets != 0)
+    midi_packet_ring_push_n(&midi_out_ring, packets, npackets, now);
+}
+
+// core0: write packets to the USB host until the device driver's transmit FIFO is full.
+// The device driver has no bulk write, so write a packet at a time. ctx is the
+// latency histogram of the queue.
+static uint32_t midi_dev_write(const uint32_t* packets, const uint32_t* timestamps, uint32_t npackets, void* ctx)
+{
+  midi_latency_hist_t* hist = ctx;
+  uint32_t now = time_us_32();
+  uint32_t nwritten;
+  for (nwritten = 0; nwritten < npackets && tud_midi_packet_write((const uint8_t*)(packets+nwritten)); nwritten++)
+    midi_latency_hist_add(hist, now - timestamps[nwritten]);
+  return nwritten;
+}
+
+// core0: note where the SysEx messages start and end in the packets from the MIDI device
+static void track_midi_in_sysex(uint32_t packet)
+{
+  uint8_t cable_cin = ((const uint8_t*)&packet)[0];
+  if ((cable_cin & 0xf) == 0x4)
+    midi_in_sysex_open |= 1u << (cable_cin >> 4);
+  else if ((cable_cin & 0xf) != 0xF)
+    midi_in_sysex_open &= ~(1u << (cable_cin >> 4)); // the message ended or was cut short
+}
+
+// core0: send the waiting SysEx command replies once no SysEx message from the MIDI device
+// is open on their cables and the MIDI IN retry queue can take all of them
+static void flush_cmd_replies(void)
+{
+  if (cmd_reply_wait.count == 0 || (midi_in_sysex_open & cmd_reply_wait.cables) != 0 ||
+      MIDI_TX_QUEUE_SIZE - midi_dev_tx_queue.count < cmd_reply_wait.count)
+    return;
+  midi_tx_queue_send(&midi_dev_tx_queue, cmd_reply_wait.packets, cmd_reply_wait.timestamps, cmd_reply_wait.count);
+  cmd_reply_wait.count = 0;
+  cmd_reply_wait.cables = 0;
+}
+
+// core0: send SysEx command reply packets to the USB host. A reply must not land inside
+// a SysEx message the MIDI device is still sending on its cable, so it waits for the
+// message to end behind any earlier replies.
+static void send_cmd_reply(const uint32_t* packets, uint32_t npackets)
+{
+  if (cmd_reply_wait.count + npackets > MIDI_TX_QUEUE_SIZE)
+    return; // cmd_reply_room() keeps this from happening
+  uint32_t now = time_us_32();
+  for (uint32_t idx = 0; idx < npackets; idx++)
+  {
+    cmd_reply_wait.packets[cmd_reply_wait.count] = packets[idx];
+    cmd_reply_wait.timestamps[cmd_reply_wait.count++] = now;
+    cmd_reply_wait.cables |= 1u << (((const uint8_t*)(packets + idx))[0] >> 4);
+  }
+  flush_cmd_replies();
+}
+
+// core0: the number of reply packets the MIDI IN retry queue can take without dropping any
+static uint32_t cmd_reply_room(void)
+{
+  uint32_t used = midi_dev_tx_queue.count + cmd_reply_wait.count;
+  return used < MIDI_TX_QUEUE_SIZE ? MIDI_TX_QUEUE_SIZE - used : 0;
+}
+
+// true if the packet carries SysEx bytes (CIN 0x4-0x7), which real-time packets may overtake
+static inline bool midi_in_is_sysex(uint32_t packet)
+{
+  uint8_t cin = ((const uint8_t*)&packet)[0] & 0xf;
+  return cin >= 0x4 && cin <= 0x7;
+}
+
+// core0: count the packets waiting in the MIDI IN retry queue that real-time packets must not overtake
+static uint32_t midi_in_queued_ordered(void)
+{
+  uint32_t count = 0;
+  for (uint32_t idx = 0; idx < midi_dev_tx_queue.count; idx++)
+  {
+    if (!midi_in_is_sysex(midi_dev_tx_queue.packets[(midi_dev_tx_queue.head + idx) % MIDI_TX_QUEUE_SIZE]))
+      ++count;
+  }
+  return count;
+}
+
+// core0: send the real-time packets core1 queued to the USB host ahead of any waiting SysEx packets
+static void poll_midi_dev_rt_tx(bool connected)
+{
+  uint32_t packets[MIDI_BATCH_MAX_PACKETS];
+  uint32_t timestamps[MIDI_BATCH_MAX_PACKETS];
+  uint32_t npackets;
+  while ((npackets = midi_packet_ring_pop_n(&midi_in_rt_ring, packets, timestamps, MIDI_BATCH_MAX_PACKETS)) > 0)
+  {
+    // MIDI clock alone keeps the config store from writing to flash; active
+    // sensing, which is sent even when nothing plays, does not
+    for (uint32_t idx = 0; idx < npackets; idx++)
+    {
+      if (((const uint8_t*)(packets + idx))[1] != 0xFE)
+      {
+        midi_traffic_us = time_us_32();
+        break;
+      }
+    }
+    // discard packets while the USB host is not listening.
+    if (connected)
+    {
+      if (midi_dev_tx_queue.count != 0 || midi_packet_ring_level(&midi_in_ring) != 0)
+        midi_in_rt_ahead += npackets;
+      midi_tx_queue_send(&midi_dev_rt_tx_queue, packets, timestamps, npackets);
+    }
+  }
+}
+
+// core0: send packets core1 queued to the USB host
+static void poll_midi_dev_tx(bool connected)
+{
+  uint32_t packets[MIDI_BATCH_MAX_PACKETS];
+  uint32_t timestamps[MIDI_BATCH_MAX_PACKETS];
+  uint32_t npackets;
+  if (connected)
+  {
+    midi_tx_queue_retry(&midi_dev_rt_tx_queue);
+    poll_midi_dev_rt_tx(connected);
+    midi_tx_queue_retry(&midi_dev_tx_queue);
+    flush_cmd_replies();
+  }
+  else
+  {
+    midi_tx_queue_clear(&midi_dev_rt_tx_queue);
+    midi_tx_queue_clear(&midi_dev_tx_queue);
+    cmd_reply_wait.count = 0;
+    cmd_reply_wait.cables = 0;
+    midi_in_sysex_open = 0;
+    poll_midi_dev_rt_tx(connected);
+  }
+  while ((npackets = midi_packet_ring_pop_n(&midi_in_ring, packets, timestamps, MIDI_BATCH_MAX_PACKETS)) > 0)
+  {
+    midi_traffic_us = time_us_32();
+    for (uint32_t idx = 0; idx < npackets; idx++)
+    {
+      if (!midi_in_is_sysex(packets[idx]))
+        ++midi_in_ordered_popped;
+    }
+    // discard packets while the USB host is not listening.
+    if (connected)
+    {
+      // a waiting command reply goes out right after the packet that ends the SysEx message holding it back
+      uint32_t nsent = 0;
+      for (uint32_t idx = 0; idx < npackets; idx++)
+      {
+        track_midi_in_sysex(packets[idx]);
+        if (cmd_reply_wait.count != 0 && (midi_in_sysex_open & cmd_reply_wait.cables) == 0)
+        {
+          midi_tx_queue_send(&midi_dev_tx_queue, packets + nsent, timestamps + nsent, idx + 1 - nsent);
+          nsent = idx + 1;
+          flush_cmd_replies();
+        }
+      }
+      if (nsent < npackets)
+        midi_tx_queue_send(&midi_dev_tx_queue, packets + nsent, timestamps + nsent, npackets - nsent);
+    }
+    // real-time packets that arrived meanwhile go between these batches
+    poll_midi_dev_rt_tx(connected);
+  }
+  // tell core1 when only SysEx packets are left for real-time packets to overtake
+  __atomic_store_n(&midi_in_ordered_done, midi_in_ordered_popped - midi_in_queued_ordered(), __ATOMIC_RELEASE);
+}
+
+// core1: queue filtered MIDI IN packets for core0. Real-time packets take the priority lane
+// unless a message they must not overtake is waiting.
+static void midi_in_push(uint32_t* packets, size_t npackets, uint32_t now)
+{
+  uint32_t rt_packets[MIDI_BATCH_MAX_PACKETS];
+  size_t nrt = 0;
+  size_t nkept = 0;
+  // core0 may not have counted the packets it sent yet; that only keeps real-time packets in order longer
+  bool sysex_only = __atomic_load_n(&midi_in_ordered_done, __ATOMIC_ACQUIRE) == midi_in_ordered_pushed;
+  for (size_t idx = 0; idx < npackets; idx++)
+  {
+    if (sysex_only && midi_tx_queue_is_realtime(packets[idx]))
+    {
+      rt_packets[nrt++] = packets[idx];
+    }
+    else
+    {
+      if (!midi_in_is_sysex(packets[idx]))
+        sysex_only = false;
+      packets[nkept++] = packets[idx];
+    }
+  }
+  if (nrt != 0)
+    midi_packet_ring_push_n(&midi_in_rt_ring, rt_packets, nrt, now);
+  if (nkept != 0)
+  {
+    // count only the packets the ring stored; a full ring drops the rest, and counting
+    // those would keep the real-time packets in order for good
+    uint32_t npushed = midi_packet_ring_push_n(&midi_in_ring, packets, nkept, now);
+    uint32_t nordered = 0;
+    for (uint32_t idx = 0; idx < npushed; idx++)
+    {
+      if (!midi_in_is_sysex(packets[idx]))
+        ++nordered;
+    }
+    // core0 may count these packets as done before it sees them pushed; the counts only
+    // match once both have, so real-time packets just stay in order a little longer
+    __atomic_store_n(&midi_in_ordered_pushed, midi_in_ordered_pushed + nordered, __ATOMIC_RELEASE);
+  }
+}
+
+// core1: write packets to the MIDI device until the host driver's transmit FIFO is full.
+// ctx is the midi_host_target_t of the queue.
+static uint32_t midi_host_write(const uint32_t* packets, const uint32_t* timestamps, uint32_t npackets, void* ctx)
+{
+  const midi_host_target_t* target = ctx;
+  uint32_t nwritten = tuh_midi_packet_write_n(*target->dev_addr, (const uint8_t*)packets, npackets * sizeof(packets[0])) / sizeof(packets[0]);
+  uint32_t now = time_us_32();
+  for (uint32_t idx = 0; idx < nwritten; idx++)
+    midi_latency_hist_add(&midi_out_latency, now - timestamps[idx]);
+  midi_flush_policy_written(target->flush, nwritten, now);
+  return nwritten;
+}
+
+// core1: send the packets written to a MIDI device when its flush policy says so
+static void flush_midi_host(uint8_t dev_addr, midi_flush_policy_t* policy)
+{
+  if (midi_flush_policy_due(policy, time_us_32()))
+    midi_flush_policy_flushed(policy, tuh_midi_stream_flush(dev_addr));
+}
+
+// core1: send packets core0 queued to the MIDI device
+static void poll_midi_host_tx(void)
+{
+  uint32_t packets[MIDI_BATCH_MAX_PACKETS];
+  uint32_t timestamps[MIDI_BATCH_MAX_PACKETS];
+  uint32_t npackets;
+  midi_tx_queue_retry(&midi_host_tx_queue);
+  while ((npackets = midi_packet_ring_pop_n(&midi_out_ring, packets, timestamps, MIDI_BATCH_MAX_PACKETS)) > 0)
   {
-    if (filter_midi_out(packet))
-      tuh_midi_packet_write(midi_dev_addr, packet);
+    midi_tx_queue_send(&midi_host_tx_queue, packets, timestamps, npackets);
   }
 }
 
+// core1: throw away the packets core0 queued while no MIDI device is there to
+// take them, so the ring does not fill up and a device that is plugged in
+// later does not get a stale, truncated backlog first
+static void discard_midi_host_tx(void)
+{
+  uint32_t packets[MIDI_BATCH_MAX_PACKETS];
+  uint32_t timestamps[MIDI_BATCH_MAX_PACKETS];
+  while (midi_packet_ring_pop_n(&midi_out_ring, packets, timestamps, MIDI_BATCH_MAX_PACKETS) > 0)
+    continue;
+}
+
+// core1: send packets core0 queued to the MIDI devices behind the hub, each to its own device
+static void poll_midi_hub_tx(void)
+{
+  uint32_t packets[MIDI_BATCH_MAX_PACKETS];
+  uint32_t timestamps[MIDI_BATCH_MAX_PACKETS];
+  uint32_t npackets;
+  for (uint8_t slot = 0; slot < MIDI_HUB_MAX_DEVICES; slot++)
+  {
+    if (midi_hub.devices[slot].dev_addr != 0)
+      midi_tx_queue_retry(&midi_hub_tx_queues[slot]);
+  }
+  while ((npackets = midi_packet_ring_pop_n(&midi_out_ring, packets, timestamps, MIDI_BATCH_MAX_PACKETS)) > 0)
+  {
+    // static because the core1 stack is small
+    static uint32_t routed[MIDI_HUB_MAX_DEVICES][MIDI_BATCH_MAX_PACKETS];
+    static uint32_t routed_timestamps[MIDI_HUB_MAX_DEVICES][MIDI_BATCH_MAX_PACKETS];
+    uint32_t nrouted[MIDI_HUB_MAX_DEVICES] = {0};
+    for (uint32_t idx = 0; idx < npackets; idx++)
+    {
+      uint8_t slot = midi_hub_router_out(&midi_hub, (uint8_t*)(packets+idx));
+      if (slot != MIDI_HUB_NO_SLOT)
+      {
+        routed[slot][nrouted[slot]] = packets[idx];
+        routed_timestamps[slot][nrouted[slot]++] = timestamps[idx];
+      }
+    }
+    for (uint8_t slot = 0; slot < MIDI_HUB_MAX_DEVICES; slot++)
+    {
+      if (nrouted[slot] != 0)
+        midi_tx_queue_send(&midi_hub_tx_queues[slot], routed[slot], routed_timestamps[slot], nrouted[slot]);
+    }
+  }
+  for (uint8_t slot = 0; slot < MIDI_HUB_MAX_DEVICES; slot++)
+  {
+    if (midi_hub.devices[slot].dev_addr != 0)
+      flush_midi_host(midi_hub.devices[slot].dev_addr, &midi_hub_flush[slot]);
+  }
+}
+
+// core1: read one batch at a time from each MIDI device that has packets waiting,
+// in turn, so a busy device cannot hold up the others
+static void poll_midi_hub_rx(void)
+{
+  uint8_t dev_addr;
+  while ((dev_addr = midi_hub_router_next_rx(&midi_hub)) != 0)
+  {
+    uint32_t packets[MIDI_BATCH_MAX_PACKETS];
+    uint32_t npackets = tuh_midi_packet_read_n(dev_addr, (uint8_t*)packets, sizeof(packets)) / sizeof(packets[0]);
+    if (npackets < MIDI_BATCH_MAX_PACKETS)
+      midi_hub_router_clear_rx_pending(&midi_hub, dev_addr);
+    uint32_t now = time_us_32();
+    size_t nkept = midi_hub_router_in(&midi_hub, dev_addr, packets, npackets);
+    nkept = midi_capture_filter_batch(&midi_in_capture, filter_midi_in_batch, packets, nkept, now);
+    midi_in_push(packets, nkept, now);
+  }
+}
+
+// core1: give a newly mounted MIDI device its cables in the composite device
+static void midi_hub_attach(uint8_t dev_addr, uint8_t num_cables_in, uint8_t num_cables_out)
+{
+  uint16_t vid = 0;
+  uint16_t pid = 0;
+  (void)tuh_vid_pid_get(dev_addr, &vid, &pid);
+  bool layout_changed;
+  uint8_t slot = midi_hub_router_attach(&midi_hub, dev_addr, vid, pid, num_cables_in, num_cables_out, &layout_changed);
+  if (slot == MIDI_HUB_NO_SLOT)
+  {
+    TU_LOG1("no room for MIDI device addr=%u in the composite MIDI device\r\n", dev_addr);
+    return;
+  }
+  midi_tx_queue_clear(&midi_hub_tx_queues[slot]);
+  midi_flush_policy_clear(&midi_hub_flush[slot]);
+  const midi_hub_device_t* device = &midi_hub.devices[slot];
+  TU_LOG1("MIDI device addr=%u is hub device %u: IN cables %u-%u, OUT cables %u-%u%s\r\n", dev_addr, slot + 1,
+      device->in_base, device->in_base + device->num_cables_in - 1, device->out_base,
+      device->out_base + device->num_cables_out - 1, layout_changed ? "" : " (unchanged)");
+  // Build the descriptors again even if the cables did not change; the device
+  // port compares them with the cached copy and records the hot-plug recovery
+  midi_hub_rebuild = true;
+  midi_hub_change_us = time_us_32();
+}
+
+// core1: build the composite device descriptors once the MIDI devices stop attaching
+static void poll_midi_hub_descriptors(void)
+{
+  if (!midi_hub_rebuild || time_us_32() - midi_hub_change_us < MIDI_HUB_SETTLE_MS * 1000 ||
+      __atomic_load_n(&device_descriptors_cloned, __ATOMIC_ACQUIRE))
+    return; // wait for more devices or for core0 to finish with the last descriptors
+  midi_hub_rebuild = false;
+  const char* in_jack_names[MIDI_HUB_MAX_CABLES];
+  const char* out_jack_names[MIDI_HUB_MAX_CABLES];
+  for (uint8_t cable = 0; cable < MIDI_HUB_MAX_CABLES; cable++)
+  {
+    in_jack_names[cable] = "MIDI";
+    out_jack_names[cable] = "MIDI";
+  }
+  // name each jack "MIDI <hub device>-<device cable>"
+  for (uint8_t slot = 0; slot < MIDI_HUB_MAX_DEVICES; slot++)
+  {
+    const midi_hub_device_t* device = &midi_hub.devices[slot];
+    if (!device->reserved)
+      continue;
+    for (uint8_t cable = 0; cable < device->num_cables_in; cable++)
+    {
+      char* name = midi_hub_jack_names[device->in_base + cable];
+      snprintf(name, sizeof(midi_hub_jack_names[0]), "MIDI %u-%u", slot + 1, cable + 1);
+      in_jack_names[device->in_base + cable] = name;
+    }
+    for (uint8_t cable = 0; cable < device->num_cables_out; cable++)
+    {
+      char* name = midi_hub_jack_names[MIDI_HUB_MAX_CABLES + device->out_base + cable];
+      snprintf(name, sizeof(midi_hub_jack_names[0]), "MIDI %u-%u", slot + 1, cable + 1);
+      out_jack_names[device->out_base + cable] = name;
+    }
+  }
+  if (!synthesize_midi_descriptors(MIDI_HUB_VID, MIDI_HUB_PID, 0x0100, "rppicomidi", "Pico MIDI Hub",
+      midi_hub.num_cables_in, in_jack_names, midi_hub.num_cables_out, out_jack_names))
+    TU_LOG1("failed to build the composite MIDI device descriptors\r\n");
+}
+
+// core0: reply to MIDI_SYSEX_CMD_GET_LATENCY with, for MIDI IN and then MIDI OUT,
+// count, min, max, p50 and p99 in microseconds, the number of buckets and then each bucket count
+static void get_latency_cmd(uint8_t cable, const uint8_t* payload, uint16_t len)
+{
+  (void)payload;
+  (void)len;
+  uint8_t reply[2 * (6 + MIDI_LATENCY_HIST_NBUCKETS) * 5];
+  uint8_t* ptr = reply;
+  const midi_latency_hist_t* hists[2] = {&midi_in_latency, &midi_out_latency};
+  for (int idx = 0; idx < 2; idx++)
+  {
+    const midi_latency_hist_t* hist = hists[idx];
+    ptr = midi_sysex_cmd_put_u32(ptr, hist->count);
+    ptr = midi_sysex_cmd_put_u32(ptr, hist->count ? hist->min_us : 0);
+    ptr = midi_sysex_cmd_put_u32(ptr, hist->max_us);
+    ptr = midi_sysex_cmd_put_u32(ptr, midi_latency_hist_percentile(hist, 50));
+    ptr = midi_sysex_cmd_put_u32(ptr, midi_latency_hist_percentile(hist, 99));
+    ptr = midi_sysex_cmd_put_u32(ptr, MIDI_LATENCY_HIST_NBUCKETS);
+    for (int bucket = 0; bucket < MIDI_LATENCY_HIST_NBUCKETS; bucket++)
+      ptr = midi_sysex_cmd_put_u32(ptr, hist->buckets[bucket]);
+  }
+  midi_sysex_cmd_reply(cable, MIDI_SYSEX_CMD_GET_LATENCY, reply, ptr - reply);
+}
+
+// core0: reply to MIDI_SYSEX_CMD_GET_CAPTURE with a page of captured records
+static void get_capture_cmd(uint8_t cable, const uint8_t* payload, uint16_t len)
+{
+  if (len < 6 || payload[0] >= MIDI_CAPTURE_NUM_DIRS)
+  {
+    uint8_t cmd = MIDI_SYSEX_CMD_GET_CAPTURE;
+    midi_sysex_cmd_reply(cable, MIDI_SYSEX_CMD_NAK, &cmd, 1);
+    return;
+  }
+  midi_capture_dir_t dir = (midi_capture_dir_t)payload[0];
+  uint8_t reply[MIDI_CAPTURE_PAGE_MAX_LEN];
+  uint32_t reply_len = midi_capture_encode_page(dir == MIDI_CAPTURE_IN ? &midi_in_capture : &midi_out_capture,
+      dir, midi_sysex_cmd_get_u32(payload + 1), reply);
+  midi_sysex_cmd_reply(cable, MIDI_SYSEX_CMD_GET_CAPTURE, reply, reply_len);
+}
+
+// core0: the filter rules MIDI_SYSEX_CMD_LOAD_RULES is receiving
+static struct {
+  uint8_t bytes[MIDI_FILTER_RULES_MAX_BYTES];
+  uint16_t len; // the number of bytes received so far
+} rules_upload;
+
+// core0: store a chunk of filter rules and load the rules once they have all arrived
+static void load_rules_cmd(uint8_t cable, const uint8_t* payload, uint16_t len)
+{
+  uint8_t reply[3] = {MIDI_SYSEX_CMD_RULES_STORED, MIDI_FILTER_RULES_OK, 0x7f};
+  uint16_t offset = len >= 4 ? payload[0] | (payload[1] << 7) : 0;
+  uint16_t total = len >= 4 ? payload[2] | (payload[3] << 7) : 0;
+  // chunks must arrive in order; a chunk at offset 0 starts a new upload
+  if (len < 4 || total > sizeof(rules_upload.bytes) || (offset != 0 && offset != rules_upload.len) ||
+      offset + len - 4 > total)
+  {
+    rules_upload.len = 0;
+    reply[0] = MIDI_SYSEX_CMD_RULES_REJECTED;
+    reply[1] = MIDI_FILTER_RULES_BAD_LENGTH;
+  }
+  else
+  {
+    memcpy(rules_upload.bytes + offset, payload + 4, len - 4);
+    rules_upload.len = offset + len - 4;
+    if (rules_upload.len == total)
+    {
+      uint8_t bad_rule = 0x7f;
+      reply[1] = filter_midi_load_rules(rules_upload.bytes, total, &bad_rule);
+      reply[0] = reply[1] == MIDI_FILTER_RULES_OK ? MIDI_SYSEX_CMD_RULES_LOADED : MIDI_SYSEX_CMD_RULES_REJECTED;
+      reply[2] = reply[1] == MIDI_FILTER_RULES_OK ? 0x7f : bad_rule;
+      rules_upload.len = 0;
+      printf("filter rules: %s\r\n", midi_filter_rules_result_name(reply[1]));
+      // keep the rules across reboots
+      if (reply[1] == MIDI_FILTER_RULES_OK)
+        (void)midi_config_store_put(MIDI_CONFIG_STORE_RULES, rules_upload.bytes, total);
+    }
+  }
+  midi_sysex_cmd_reply(cable, MIDI_SYSEX_CMD_LOAD_RULES, reply, sizeof(reply));
+}
+
+// core0: print the captured records one per loop so the dump does not hold up the USB device port
+static void poll_capture_dump(void)
+{
+  if (!capture_dump.active)
+    return;
+  const midi_capture_t* capture = capture_dump.dir == MIDI_CAPTURE_IN ? &midi_in_capture : &midi_out_capture;
+  midi_capture_record_t record;
+  uint32_t seq = capture_dump.seq;
+  if (seq != capture_dump.end && midi_capture_read(capture, &seq, &record, 1) == 1 && seq < capture_dump.end)
+  {
+    // c <direction> <sequence number> <timestamp us> <packet before filter> <packet after filter>
+    printf("c %u %08lx %08lx %08lx %08lx\r\n", capture_dump.dir, (unsigned long)seq,
+        (unsigned long)record.timestamp_us, (unsigned long)record.pre, (unsigned long)record.post);
+    capture_dump.seq = seq + 1;
+    return;
+  }
+  if (capture_dump.dir == MIDI_CAPTURE_IN)
+  {
+    capture_dump.dir = MIDI_CAPTURE_OUT;
+    capture_dump.seq = 0;
+    capture_dump.end = __atomic_load_n(&midi_out_capture.head, __ATOMIC_ACQUIRE);
+    return;
+  }
+  capture_dump.active = false;
+  printf("MIDI capture end\r\n");
+}
+
+static void print_ring_stats(const char* name, midi_packet_ring_t* ring)
+{
+  printf("%s: level=%lu high_water=%lu overflows=%lu size=%u\r\n", name,
+      (unsigned long)midi_packet_ring_level(ring), (unsigned long)ring->prod.high_water,
+      (unsigned long)ring->prod.overflows, MIDI_PACKET_RING_SIZE);
+}
+
+static void print_tx_queue_stats(const char* name, midi_tx_queue_t* queue)
+{
+  printf("%s: level=%lu queued=%lu retried=%lu dropped=%lu coalesced=%lu size=%u policy=%s\r\n", name,
+      (unsigned long)queue->count, (unsigned long)queue->queued, (unsigned long)queue->retried,
+      (unsigned long)queue->dropped, (unsigned long)queue->coalesced, MIDI_TX_QUEUE_SIZE,
+      midi_tx_queue_policy_name(queue->policy));
+}
+
+// core0: keep the current filter state to be saved to flash
+static void put_filter_state(void)
+{
+  uint8_t state[64];
+  size_t len = filter_midi_save_state(state, sizeof(state));
+  if (len > 0)
+    (void)midi_config_store_put(MIDI_CONFIG_STORE_FILTER_STATE, state, len);
+}
+
+// core0: handle single-character commands from the debug UART
+static void poll_debug_console(void)
+{
+  int chr = getchar_timeout_us(0);
+  if (chr == PICO_ERROR_TIMEOUT)
+    return;
+  switch (chr)
+  {
+    case 's':
+      print_ring_stats("MIDI IN ring", &midi_in_ring);
+      print_ring_stats("MIDI IN real-time ring", &midi_in_rt_ring);
+      print_ring_stats("MIDI OUT ring", &midi_out_ring);
+      print_tx_queue_stats("MIDI IN retry queue", &midi_dev_tx_queue);
+      print_tx_queue_stats("MIDI IN real-time retry queue", &midi_dev_rt_tx_queue);
+      printf("MIDI IN real-time packets sent ahead of waiting packets=%lu\r\n", (unsigned long)midi_in_rt_ahead);
+      if (MIDI_HUB_AGGREGATE)
+      {
+        printf("hub: IN cables=%u OUT cables=%u layout changes=%lu dropped=%lu\r\n", midi_hub.num_cables_in,
+            midi_hub.num_cables_out, (unsigned long)midi_hub.layout_changes, (unsigned long)midi_hub.dropped);
+        for (uint8_t slot = 0; slot < MIDI_HUB_MAX_DEVICES; slot++)
+        {
+          if (midi_hub.devices[slot].reserved)
+          {
+            char name[32];
+            snprintf(name, sizeof(name), "hub device %u retry queue", slot + 1);
+            print_tx_queue_stats(name, &midi_hub_tx_queues[slot]);
+            snprintf(name, sizeof(name), "hub device %u flush", slot + 1);
+            midi_flush_policy_print(name, &midi_hub_flush[slot]);
+          }
+        }
+      }
+      else
+      {
+        print_tx_queue_stats("MIDI OUT retry queue", &midi_host_tx_queue);
+        midi_flush_policy_print("MIDI OUT flush", &midi_host_flush);
+      }
+      midi_config_store_print_stats();
+      printf("hot-plug: recoveries=%lu last unplug-to-usable=%lu ms last attach-to-usable=%lu ms max attach-to-usable=%lu ms\r\n",
+          (unsigned long)hot_plug.count, (unsigned long)hot_plug.last_unplug_ms,
+          (unsigned long)hot_plug.last_attach_ms, (unsigned long)hot_plug.max_attach_ms);
+      break;
+    case 'p':
+    {
+      midi_tx_queue_policy_t policy = (midi_tx_queue_policy_t)((midi_dev_tx_queue.policy + 1) % MIDI_TX_QUEUE_NUM_POLICIES);
+      midi_tx_queue_set_policy(&midi_dev_tx_queue, policy);
+      midi_tx_queue_set_policy(&midi_dev_rt_tx_queue, policy);
+      midi_tx_queue_set_policy(&midi_host_tx_queue, policy);
+      for (uint8_t slot = 0; slot < MIDI_HUB_MAX_DEVICES; slot++)
+        midi_tx_queue_set_policy(&midi_hub_tx_queues[slot], policy);
+      printf("retry queue drop policy is %s\r\n", midi_tx_queue_policy_name(policy));
+      break;
+    }
+    case 'o':
+    {
+      midi_flush_preset_t preset = (midi_flush_preset_t)((midi_host_flush.preset + 1) % MIDI_FLUSH_NUM_PRESETS);
+      midi_flush_policy_set_preset(&midi_host_flush, preset);
+      for (uint8_t slot = 0; slot < MIDI_HUB_MAX_DEVICES; slot++)
+        midi_flush_policy_set_preset(&midi_hub_flush[slot], preset);
+      printf("MIDI OUT flush policy is %s\r\n", midi_flush_policy_preset_name(preset));
+      break;
+    }
+    case 'c':
+      if (!MIDI_CAPTURE_ENABLED)
+        break;
+      printf("MIDI capture begin\r\n");
+      capture_dump.active = true;
+      capture_dump.dir = MIDI_CAPTURE_IN;
+      capture_dump.seq = 0;
+      capture_dump.end = __atomic_load_n(&midi_in_capture.head, __ATOMIC_ACQUIRE);
+      break;
+    case 'l':
+      midi_latency_hist_print("MIDI IN", &midi_in_latency);
+      midi_latency_hist_print("MIDI IN real-time", &midi_in_rt_latency);
+      midi_latency_hist_print("MIDI OUT", &midi_out_latency);
+      break;
+    case 'f':
+      filter_midi_print_stats();
+      break;
+    case 'd':
+    {
+      // change the filter configuration while MIDI flows; the filter picks it up between batches
+      midi_filter_config_t* config = midi_filter_config_edit();
+      if (config == NULL)
+      {
+        printf("the previous filter configuration is still in use; try again\r\n");
+        break;
+      }
+      static const uint16_t deadbands[] = {0, 4, 8, 16};
+      uint8_t idx = 0;
+      while (idx < sizeof(deadbands) / sizeof(deadbands[0]) && deadbands[idx] != config->fader_deadband)
+        ++idx;
+      idx = (idx + 1) % (sizeof(deadbands) / sizeof(deadbands[0]));
+      config->fader_deadband = deadbands[idx];
+      config->fader_hysteresis = deadbands[idx];
+      midi_filter_config_publish(config);
+      printf("fader deadband is %u (filter configuration %lu)\r\n", config->fader_deadband, (unsigned long)config->version);
+      break;
+    }
+    case 'w':
+      // saving stalls the USB host port; do it now rather than at the next idle time
+      put_filter_state();
+      config_save_now = midi_config_store_pending();
+      printf(config_save_now ? "saving the filter rules and state to flash\r\n" : "the filter rules and state are already saved\r\n");
+      break;
+    default:
+      printf("commands: s=queue statistics l=latency histograms f=filter statistics c=dump MIDI capture p=next drop policy o=next MIDI OUT flush policy d=next fader deadband w=save the filter state to flash\r\n");
+      break;
+  }
+}
+
+// core1: forward any packets the filter generated on its own to core0
+static void poll_midi_filter_in(void)
+{
+  uint32_t packets[MIDI_BATCH_MAX_PACKETS];
+  uint32_t now = time_us_32();
+  size_t npackets = filter_midi_in_poll(now, packets, MIDI_BATCH_MAX_PACKETS);
+  for (size_t idx = 0; idx < npackets; idx++)
+    midi_capture_add(&midi_in_capture, now, 0, packets[idx]);
+  if (npackets != 0)
+    midi_in_push(packets, npackets, now);
+}
+
 static void midi_host_app_task(void)
 {
+  if (MIDI_HUB_AGGREGATE) {
+    poll_midi_hub_descriptors();
+    poll_midi_hub_rx();
+    poll_midi_filter_in();
+    poll_midi_hub_tx();
+    return;
+  }
   if (cloning_is_required()) {
     if (midi_dev_addr != 0 && tuh_midi_configured(midi_dev_addr)) {
       TU_LOG2("start descriptor cloning\r\n");
@@ -86,8 +895,15 @@ static void midi_host_app_task(void)
   else if (clone_next_string_is_required()) {
     clone_next_string();
   }
-  else if (descriptors_are_cloned()) {
-    tuh_midi_stream_flush(midi_dev_addr);
+  // also a quiescent point for filter configuration updates, so poll even with no device
+  poll_midi_filter_in();
+  // the device port may be up before the strings are cloned, so do not wait for them
+  if (midi_dev_addr != 0 && tuh_midi_configured(midi_dev_addr)) {
+    poll_midi_host_tx();
+    flush_midi_host(midi_dev_addr, &midi_host_flush);
+  }
+  else if (midi_dev_addr == 0) {
+    discard_midi_host_tx();
   }
 }
 
@@ -109,8 +925,17 @@ void tuh_midi_mount_cb(uint8_t dev_addr, uint8_t in_ep, uint8_t out_ep, uint8_t
   TU_LOG1("Attached MIDI device addr=%u, IN EPT=%u has %u cables, OUT EPT=%u has %u cables\r\n",
       dev_addr, in_ep & 0xf, num_cables_rx, out_ep & 0xf, num_cables_tx);
 
-  midi_dev_addr = dev_addr;
-  set_cloning_required();
+  if (MIDI_HUB_AGGREGATE) {
+    midi_hub_attach(dev_addr, num_cables_rx, (uint8_t)num_cables_tx);
+  }
+  else {
+    // drop what core0 queued since the last loop before it sends the LED and LCD refresh
+    discard_midi_host_tx();
+    midi_dev_addr = dev_addr;
+    set_cloning_required();
+  }
+  midi_host_mount_us = time_us_32();
+  __atomic_add_fetch(&midi_host_mounts, 1, __ATOMIC_RELEASE);
 }
 
 // Invoked when device with hid interface is un-mounted
@@ -118,25 +943,49 @@ void tuh_midi_umount_cb(uint8_t dev_addr, uint8_t instance)
 {
   (void)dev_addr;
   (void)instance;
+  if (MIDI_HUB_AGGREGATE) {
+    // the device's cables stay in the composite device in case it comes back
+    uint8_t slot = midi_hub_router_detach(&midi_hub, dev_addr);
+    if (slot != MIDI_HUB_NO_SLOT) {
+      midi_tx_queue_clear(&midi_hub_tx_queues[slot]);
+      midi_flush_policy_clear(&midi_hub_flush[slot]);
+    }
+    midi_host_unmount_us = time_us_32();
+    __atomic_store_n(&midi_host_unmounted, true, __ATOMIC_RELEASE);
+    TU_LOG1("MIDI device address = %d, instance = %d is unmounted\r\n", dev_addr, instance);
+    return;
+  }
   midi_dev_addr = 0;
   set_descriptors_uncloned();
+  midi_tx_queue_clear(&midi_host_tx_queue);
+  midi_flush_policy_clear(&midi_host_flush);
+  // If core0 is still looking at the cloned descriptors or the device port is
+  // using them, they are freed when the next MIDI device is cloned instead
+  if (!__atomic_load_n(&device_descriptors_cloned, __ATOMIC_ACQUIRE) && cached_descriptors_in_use())
+    free_cloned_descriptors();
+  midi_host_unmount_us = time_us_32();
+  __atomic_store_n(&midi_host_unmounted, true, __ATOMIC_RELEASE);
   TU_LOG1("MIDI device address = %d, instance = %d is unmounted\r\n", dev_addr, instance);
-  watchdog_reboot(0,0,10); // wait 10 ms and then reboot
 }
 
 void tuh_midi_rx_cb(uint8_t dev_addr, uint32_t num_packets)
 {
-  if (midi_dev_addr == dev_addr)
+  if (MIDI_HUB_AGGREGATE)
   {
-    while (num_packets>0)
+    // poll_midi_hub_rx() shares the reads between the devices
+    if (num_packets != 0)
+      midi_hub_router_set_rx_pending(&midi_hub, dev_addr);
+    return;
+  }
+  if (midi_dev_addr == dev_addr && num_packets != 0)
+  {
+    uint32_t packets[MIDI_BATCH_MAX_PACKETS];
+    uint32_t npackets;
+    while ((npackets = tuh_midi_packet_read_n(dev_addr, (uint8_t*)packets, sizeof(packets)) / sizeof(packets[0])) > 0)
     {
-      --num_packets;
-      uint8_t packet[4];
-      while (tuh_midi_packet_read(dev_addr, packet))
-      {
-        if (filter_midi_in(packet))
-          tud_midi_packet_write(packet);
-      }
+      uint32_t now = time_us_32();
+      size_t nkept = midi_capture_filter_batch(&midi_in_capture, filter_midi_in_batch, packets, npackets, now);
+      midi_in_push(packets, nkept, now);
     }
   }
 }
@@ -152,6 +1001,8 @@ void tuh_midi_tx_cb(uint8_t dev_addr)
 static void led_blinking_task(void);
 // core1: handle host events
 void core1_main() {
+  // core0 pauses core1 while it writes the descriptor cache to flash
+  multicore_lockout_victim_init();
   sleep_ms(10);
 
   // To run USB SOF interrupt in core1, init host stack for pio_usb (roothub
@@ -165,9 +1016,132 @@ void core1_main() {
   }
 }
 static enum {MIDI_DEVICE_NOT_INITIALIZED, MIDI_DEVICE_NEEDS_INIT, MIDI_DEVICE_IS_INITIALIZED} midi_device_status = MIDI_DEVICE_NOT_INITIALIZED;
+static bool device_port_disconnected = false; // core0 soft-disconnected the device port
+static bool device_config_cloned = false; // set by core1, cleared by core0
+void device_config_clone_complete_cb()
+{
+  __atomic_store_n(&device_config_cloned, true, __ATOMIC_RELEASE);
+}
+
 void device_clone_complete_cb()
 {
-  midi_device_status = MIDI_DEVICE_NEEDS_INIT;
+  __atomic_store_n(&device_descriptors_cloned, true, __ATOMIC_RELEASE);
+}
+
+// How long the device port stays disconnected so the PC notices the descriptors changed
+#define MIDI_DEVICE_REENUMERATE_MS 100
+
+// core0: note when the MIDI device is unplugged
+static void poll_host_unmount(void)
+{
+  if (!__atomic_exchange_n(&midi_host_unmounted, false, __ATOMIC_ACQ_REL))
+    return;
+  hot_plug.pending = true;
+  hot_plug.unmount_us = midi_host_unmount_us;
+  // a SysEx message the unplug cut short never ends; do not hold command replies for it
+  midi_in_sysex_open = 0;
+  // the composite hub device keeps the unplugged device's cables, so it stays connected
+  if (!MIDI_HUB_AGGREGATE && midi_device_status == MIDI_DEVICE_IS_INITIALIZED && !cached_descriptors_in_use() &&
+      !device_port_disconnected) {
+    // the device port describes a MIDI device that is gone; the PC must not use it
+    tud_disconnect();
+    device_port_disconnected = true;
+  }
+}
+
+// core0: bring up the device port or check the cached descriptors it is already using
+static void poll_cloned_descriptors(void)
+{
+  if (__atomic_exchange_n(&device_config_cloned, false, __ATOMIC_ACQ_REL) && !cached_descriptors_in_use()) {
+    // start the device port now; it serves placeholders for strings that are not cloned yet
+    if (midi_device_status == MIDI_DEVICE_NOT_INITIALIZED) {
+      midi_device_status = MIDI_DEVICE_NEEDS_INIT;
+    }
+    else if (device_port_disconnected) {
+      tud_connect();
+      device_port_disconnected = false;
+      TU_LOG1("device port reconnected before the strings were cloned\r\n");
+    }
+  }
+  if (!__atomic_load_n(&device_descriptors_cloned, __ATOMIC_ACQUIRE))
+    return;
+  if (cloned_descriptors_match_cache()) {
+    TU_LOG1("cloned descriptors match the cached descriptors\r\n");
+    // serve the cached copy so core1 may free the cloned descriptors when the MIDI device goes away
+    (void)load_cached_descriptors();
+  }
+  else {
+    // the PC only reads the descriptors when the device port enumerates; enumerate again
+    // if the port described another device or the PC got placeholder strings
+    if (midi_device_status == MIDI_DEVICE_IS_INITIALIZED && !device_port_disconnected &&
+        (cached_descriptors_in_use() || placeholder_strings_served())) {
+      tud_disconnect();
+      device_port_disconnected = true;
+    }
+    use_cloned_descriptors();
+    if (save_cloned_descriptors())
+      (void)load_cached_descriptors();
+    else
+      TU_LOG1("failed to save the descriptor cache\r\n");
+    if (device_port_disconnected)
+      sleep_ms(MIDI_DEVICE_REENUMERATE_MS);
+  }
+  if (device_port_disconnected) {
+    tud_connect();
+    device_port_disconnected = false;
+    TU_LOG1("device port reconnected\r\n");
+  }
+  if (midi_device_status == MIDI_DEVICE_NOT_INITIALIZED)
+    midi_device_status = MIDI_DEVICE_NEEDS_INIT;
+  if (hot_plug.pending) {
+    uint32_t now = time_us_32();
+    hot_plug.pending = false;
+    ++hot_plug.count;
+    hot_plug.last_unplug_ms = (now - hot_plug.unmount_us) / 1000;
+    hot_plug.last_attach_ms = (now - midi_host_mount_us) / 1000;
+    if (hot_plug.last_attach_ms > hot_plug.max_attach_ms)
+      hot_plug.max_attach_ms = hot_plug.last_attach_ms;
+    TU_LOG1("MIDI device usable %lu ms after unplug, %lu ms after attach\r\n",
+        (unsigned long)hot_plug.last_unplug_ms, (unsigned long)hot_plug.last_attach_ms);
+  }
+  // core1 may free the cloned descriptors now
+  __atomic_store_n(&device_descriptors_cloned, false, __ATOMIC_RELEASE);
+}
+
+// core0: load the filter rules and state saved on an earlier run
+static void load_stored_config(void)
+{
+  uint32_t start = time_us_32();
+  midi_config_store_init();
+  uint16_t len;
+  const uint8_t* rules = midi_config_store_get(MIDI_CONFIG_STORE_RULES, &len);
+  if (rules != NULL)
+  {
+    uint8_t bad_rule = 0x7f;
+    uint8_t result = filter_midi_load_rules(rules, len, &bad_rule);
+    if (result != MIDI_FILTER_RULES_OK)
+      printf("stored filter rules: %s at rule %u\r\n", midi_filter_rules_result_name(result), bad_rule);
+  }
+  const uint8_t* state = midi_config_store_get(MIDI_CONFIG_STORE_FILTER_STATE, &len);
+  if (state != NULL)
+    filter_midi_restore_state(state, len);
+  TU_LOG1("stored configuration loaded in %lu us\r\n", (unsigned long)(time_us_32() - start));
+}
+
+// core0: save filter state changes and write them to flash while MIDI is idle
+static void poll_config_store(void)
+{
+  uint32_t now = time_us_32();
+  if (now - config_check_us >= MIDI_CONFIG_STORE_STATE_INTERVAL_MS * 1000)
+  {
+    config_check_us = now;
+    put_filter_state();
+  }
+  // one flash operation per loop so the USB device port is still serviced between them
+  if (config_save_now)
+    config_save_now = midi_config_store_task() || midi_config_store_pending();
+  else if (now - midi_traffic_us >= MIDI_CONFIG_STORE_IDLE_MS * 1000)
+    (void)midi_config_store_task();
 }
 
 // core0: handle device events
@@ -175,25 +1149,61 @@ int main(void) {
   // set up board clocks, UART pins, PIO Pins
   board_init();
 
+  midi_packet_ring_init(&midi_in_ring);
+  midi_packet_ring_init(&midi_out_ring);
+  midi_packet_ring_init(&midi_in_rt_ring);
+  midi_latency_hist_init(&midi_in_latency);
+  midi_latency_hist_init(&midi_out_latency);
+  midi_latency_hist_init(&midi_in_rt_latency);
+  midi_tx_queue_init(&midi_dev_tx_queue, midi_dev_write, &midi_in_latency, MIDI_TX_QUEUE_DEFAULT_POLICY);
+  midi_tx_queue_init(&midi_host_tx_queue, midi_host_write, &midi_host_target, MIDI_TX_QUEUE_DEFAULT_POLICY);
+  midi_tx_queue_init(&midi_dev_rt_tx_queue, midi_dev_write, &midi_in_rt_latency, MIDI_TX_QUEUE_DEFAULT_POLICY);
+  midi_tx_queue_set_coalescing(&midi_dev_tx_queue, MIDI_IN_COALESCE_CC_CABLES, MIDI_IN_COALESCE_PITCH_BEND_CABLES);
+  midi_hub_router_init(&midi_hub);
+  midi_flush_policy_init(&midi_host_flush, MIDI_FLUSH_DEFAULT_PRESET);
+  for (uint8_t slot = 0; slot < MIDI_HUB_MAX_DEVICES; slot++)
+  {
+    midi_hub_targets[slot].dev_addr = &midi_hub.devices[slot].dev_addr;
+    midi_hub_targets[slot].flush = &midi_hub_flush[slot];
+    midi_tx_queue_init(&midi_hub_tx_queues[slot], midi_host_write, &midi_hub_targets[slot], MIDI_TX_QUEUE_DEFAULT_POLICY);
+    midi_flush_policy_init(&midi_hub_flush[slot], MIDI_FLUSH_DEFAULT_PRESET);
+  }
+  midi_sysex_cmd_init(send_cmd_reply, cmd_reply_room);
+  midi_sysex_cmd_register(MIDI_SYSEX_CMD_GET_LATENCY, get_latency_cmd);
+  midi_sysex_cmd_register(MIDI_SYSEX_CMD_GET_CAPTURE, get_capture_cmd);
+  midi_sysex_cmd_register(MIDI_SYSEX_CMD_LOAD_RULES, load_rules_cmd);
+  midi_capture_init(&midi_in_capture);
+  midi_capture_init(&midi_out_capture);
+  // enumerate the device port right away if the descriptors were cached on an earlier run
+  if (load_cached_descriptors())
+    midi_device_status = MIDI_DEVICE_NEEDS_INIT;
   multicore_reset_core1();
   // all USB task run in core1
   multicore_launch_core1(core1_main);
 
   TU_LOG1("pico-usb-midi-filter\r\n");
   filter_midi_init();
+  load_stored_config();
   while (1)
   {
+    poll_host_unmount();
+    poll_cloned_descriptors();
     if (midi_device_status == MIDI_DEVICE_NEEDS_INIT) {
       tud_init(0);
-      TU_LOG1("MIDI device initialized\r\n");
+      TU_LOG1("MIDI device initialized %lu ms after boot\r\n", (unsigned long)to_ms_since_boot(get_absolute_time()));
       midi_device_status = MIDI_DEVICE_IS_INITIALIZED;
     }
     else if (midi_device_status == MIDI_DEVICE_IS_INITIALIZED) {
       tud_task();
       bool connected = tud_midi_mounted();
       poll_midi_dev_rx(connected);
+      poll_midi_dev_tx(connected);
     }
-    
+    poll_midi_filter_out();
+    poll_debug_console();
+    poll_capture_dump();
+    poll_config_store();
+
     led_blinking_task();
   }
 
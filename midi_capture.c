@@ -0,0 +1,95 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "midi_capture.h"
+#include "midi_sysex_cmd.h"
+
+size_t midi_capture_filter_batch(midi_capture_t* capture, size_t (*filter)(uint32_t* packets, size_t npackets, uint32_t* post),
+    uint32_t* packets, size_t npackets, uint32_t timestamp_us)
+{
+  if (!MIDI_CAPTURE_ENABLED)
+    return filter(packets, npackets, NULL);
+  size_t nkept = 0;
+  for (size_t first = 0; first < npackets; first += MIDI_CAPTURE_MAX_BATCH) {
+    size_t nbatch = npackets - first < MIDI_CAPTURE_MAX_BATCH ? npackets - first : MIDI_CAPTURE_MAX_BATCH;
+    uint32_t pre[MIDI_CAPTURE_MAX_BATCH];
+    uint32_t post[MIDI_CAPTURE_MAX_BATCH];
+    memcpy(pre, packets + first, nbatch * sizeof(pre[0]));
+    // the filter leaves the kept packets at packets + first; move them up behind the earlier ones
+    size_t nbatch_kept = filter(packets + first, nbatch, post);
+    if (first != nkept)
+      memmove(packets + nkept, packets + first, nbatch_kept * sizeof(packets[0]));
+    nkept += nbatch_kept;
+    for (size_t idx = 0; idx < nbatch; idx++)
+      midi_capture_add(capture, timestamp_us, pre[idx], post[idx]);
+  }
+  return nkept;
+}
+
+uint32_t midi_capture_read(const midi_capture_t* capture, uint32_t* seq, midi_capture_record_t* records, uint32_t max_records)
+{
+  uint32_t head = __atomic_load_n(&capture->head, __ATOMIC_ACQUIRE);
+  // the producer may already be writing record head, which overwrites record head - MIDI_CAPTURE_SIZE
+  uint32_t oldest = head >= MIDI_CAPTURE_SIZE ? head - MIDI_CAPTURE_SIZE + 1 : 0;
+  uint32_t first = *seq;
+  if (first > head)
+    first = head; // not recorded yet
+  else if (first < oldest)
+    first = oldest; // already overwritten; start at the oldest record
+  uint32_t ncopied = head - first < max_records ? head - first : max_records;
+  for (uint32_t idx = 0; idx < ncopied; idx++)
+    records[idx] = capture->records[(first + idx) & (MIDI_CAPTURE_SIZE - 1)];
+  // The producer may have overwritten the oldest records while they were copied,
+  // and may be writing record new_head over record new_head - MIDI_CAPTURE_SIZE now
+  uint32_t new_head = __atomic_load_n(&capture->head, __ATOMIC_ACQUIRE);
+  uint32_t ndiscard = 0;
+  if (new_head - first >= MIDI_CAPTURE_SIZE)
+    ndiscard = new_head - first - MIDI_CAPTURE_SIZE + 1;
+  if (ndiscard >= ncopied) {
+    *seq = first + ndiscard;
+    return 0;
+  }
+  if (ndiscard != 0)
+    memmove(records, records + ndiscard, (ncopied - ndiscard) * sizeof(records[0]));
+  *seq = first + ndiscard;
+  return ncopied - ndiscard;
+}
+
+uint32_t midi_capture_encode_page(const midi_capture_t* capture, midi_capture_dir_t dir, uint32_t seq, uint8_t* payload)
+{
+  midi_capture_record_t records[MIDI_CAPTURE_PAGE_RECORDS];
+  uint32_t nrecords = midi_capture_read(capture, &seq, records, MIDI_CAPTURE_PAGE_RECORDS);
+  uint8_t* ptr = payload;
+  *ptr++ = (uint8_t)dir;
+  ptr = midi_sysex_cmd_put_u32(ptr, __atomic_load_n(&capture->head, __ATOMIC_ACQUIRE));
+  ptr = midi_sysex_cmd_put_u32(ptr, seq);
+  *ptr++ = (uint8_t)nrecords;
+  for (uint32_t idx = 0; idx < nrecords; idx++) {
+    ptr = midi_sysex_cmd_put_u32(ptr, records[idx].timestamp_us);
+    ptr = midi_sysex_cmd_put_u32(ptr, records[idx].pre);
+    ptr = midi_sysex_cmd_put_u32(ptr, records[idx].post);
+  }
+  return ptr - payload;
+}
@@ -0,0 +1,213 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_capture.h
+ *
+ * This file contains an always-on capture of the MIDI traffic through the
+ * filter. Each direction has a fixed-size ring that remembers the last
+ * MIDI_CAPTURE_SIZE packets. Each record holds the time the packet arrived
+ * in microseconds, the packet before the filter and the packet after the
+ * filter:
+ * - a packet the filter passed unchanged has post == pre
+ * - a packet the filter changed has post != pre
+ * - a packet the filter dropped has post == 0
+ * - a packet the filter generated on its own has pre == 0
+ * An all-zero USB MIDI packet is padding that carries no MIDI data, so 0
+ * never stands for a real packet.
+ *
+ * Recording a packet is three stores and a release store of the ring head,
+ * so the capture can stay enabled in production. Only one core may record
+ * to a ring. Any core may read it; midi_capture_read() discards records the
+ * producer overwrote while they were being copied.
+ *
+ * The records can be read over the USB MIDI device port with the
+ * MIDI_SYSEX_CMD_GET_CAPTURE vendor SysEx command. The request payload is
+ * the direction (1 byte) and the sequence number of the first record wanted
+ * (5 bytes). The reply payload is the direction (1 byte), the sequence number
+ * of the next record the ring will write (5 bytes), the sequence number of the
+ * first record in the reply (5 bytes), the number of records in the reply
+ * (1 byte) and then, for each record, the timestamp, the packet before the
+ * filter and the packet after the filter (5 bytes each). A record's sequence
+ * number counts the packets recorded in that direction since boot. Ask for
+ * records again from the first sequence number after the last record in a
+ * reply until the reply holds no records. host/midi_capture_decode converts
+ * the replies to a Standard MIDI File and a replayable trace.
+ *
+ * To use this code:
+ * 1. Call midi_capture_init() for each direction before either core touches the ring.
+ * 2. On the core that filters the packets, call midi_capture_filter_batch()
+ *    instead of the batch filter function, and call midi_capture_add() for
+ *    each packet the filter generates on its own.
+ * 3. Call midi_capture_read() or midi_capture_encode_page() to get the records.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MIDI_CAPTURE_ENABLED
+#define MIDI_CAPTURE_ENABLED 1
+#endif
+
+#ifndef MIDI_CAPTURE_SIZE
+// Number of records in each direction's ring. Must be a power of 2.
+#define MIDI_CAPTURE_SIZE 512
+#endif
+
+#ifndef MIDI_CAPTURE_MAX_BATCH
+// The most packets midi_capture_filter_batch() passes to one call of the batch filter
+#define MIDI_CAPTURE_MAX_BATCH 16
+#endif
+
+#if (MIDI_CAPTURE_SIZE & (MIDI_CAPTURE_SIZE - 1)) != 0
+#error "MIDI_CAPTURE_SIZE must be a power of 2"
+#endif
+
+// The most records in one MIDI_SYSEX_CMD_GET_CAPTURE reply
+#define MIDI_CAPTURE_PAGE_RECORDS 8
+// The length of a MIDI_SYSEX_CMD_GET_CAPTURE reply payload holding MIDI_CAPTURE_PAGE_RECORDS records
+#define MIDI_CAPTURE_PAGE_MAX_LEN (1 + 5 + 5 + 1 + MIDI_CAPTURE_PAGE_RECORDS * 15)
+
+typedef enum {
+  MIDI_CAPTURE_IN,      // from the MIDI device to the USB host
+  MIDI_CAPTURE_OUT,     // from the USB host to the MIDI device
+  MIDI_CAPTURE_NUM_DIRS
+} midi_capture_dir_t;
+
+typedef enum {
+  MIDI_CAPTURE_PASSED,
+  MIDI_CAPTURE_MODIFIED,
+  MIDI_CAPTURE_DROPPED,
+  MIDI_CAPTURE_GENERATED
+} midi_capture_verdict_t;
+
+typedef struct {
+  uint32_t timestamp_us;  // when the packet arrived
+  uint32_t pre;           // the packet before the filter; 0 if the filter generated it
+  uint32_t post;          // the packet after the filter; 0 if the filter dropped it
+} midi_capture_record_t;
+
+typedef struct {
+  uint32_t head;          // sequence number of the next record to write; written only by the producer
+  midi_capture_record_t records[MIDI_CAPTURE_SIZE];
+} midi_capture_t;
+
+/**
+ * @brief initialize an empty capture ring
+ *
+ * @param capture a pointer to the ring
+ */
+static inline void midi_capture_init(midi_capture_t* capture)
+{
+  memset(capture, 0, sizeof(*capture));
+}
+
+/**
+ * @brief record a packet (producer core only)
+ *
+ * @param capture a pointer to the ring
+ * @param timestamp_us the time the packet arrived
+ * @param pre the packet before the filter, or 0 if the filter generated it
+ * @param post the packet after the filter, or 0 if the filter dropped it
+ */
+static inline void midi_capture_add(midi_capture_t* capture, uint32_t timestamp_us, uint32_t pre, uint32_t post)
+{
+  if (!MIDI_CAPTURE_ENABLED)
+    return;
+  uint32_t head = capture->head;
+  midi_capture_record_t* record = &capture->records[head & (MIDI_CAPTURE_SIZE - 1)];
+  record->timestamp_us = timestamp_us;
+  record->pre = pre;
+  record->post = post;
+  __atomic_store_n(&capture->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief get what the filter did with a recorded packet
+ *
+ * @param record a pointer to the record
+ * @return midi_capture_verdict_t the verdict
+ */
+static inline midi_capture_verdict_t midi_capture_verdict(const midi_capture_record_t* record)
+{
+  if (record->pre == 0)
+    return MIDI_CAPTURE_GENERATED;
+  if (record->post == 0)
+    return MIDI_CAPTURE_DROPPED;
+  return record->pre == record->post ? MIDI_CAPTURE_PASSED : MIDI_CAPTURE_MODIFIED;
+}
+
+/**
+ * @brief filter an array of packets in place and record each packet (producer core only)
+ *
+ * The filter reports what became of each packet through its post array.
+ * Batches longer than MIDI_CAPTURE_MAX_BATCH packets are filtered in more
+ * than one call.
+ *
+ * @param capture a pointer to the ring
+ * @param filter the batch filter function (e.g., filter_midi_in_batch)
+ * @param packets the array of 4-byte USB MIDI packets
+ * @param npackets the number of packets in the array
+ * @param timestamp_us the time the packets arrived
+ * @return size_t the number of packets the filter kept, moved to the start of
+ * the array in their original order
+ */
+size_t midi_capture_filter_batch(midi_capture_t* capture, size_t (*filter)(uint32_t* packets, size_t npackets, uint32_t* post),
+    uint32_t* packets, size_t npackets, uint32_t timestamp_us);
+
+/**
+ * @brief copy records from the ring (any core)
+ *
+ * @param capture a pointer to the ring
+ * @param seq the sequence number of the first record wanted. If the ring has
+ * already overwritten it, it is set to the oldest record copied. The oldest
+ * record in the ring is never copied because the producer may be overwriting
+ * it, so at most MIDI_CAPTURE_SIZE - 1 records can be read back.
+ * @param records the array to store the records
+ * @param max_records the most records to copy
+ * @return uint32_t the number of records copied
+ */
+uint32_t midi_capture_read(const midi_capture_t* capture, uint32_t* seq, midi_capture_record_t* records, uint32_t max_records);
+
+/**
+ * @brief encode a MIDI_SYSEX_CMD_GET_CAPTURE reply payload (any core)
+ *
+ * @param capture a pointer to the ring
+ * @param dir the direction of the ring
+ * @param seq the sequence number of the first record wanted
+ * @param payload the buffer for the payload, at least MIDI_CAPTURE_PAGE_MAX_LEN bytes
+ * @return uint32_t the length of the payload
+ */
+uint32_t midi_capture_encode_page(const midi_capture_t* capture, midi_capture_dir_t dir, uint32_t seq, uint8_t* payload);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,298 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "midi_config_store.h"
+
+#define MIDI_CONFIG_STORE_MAGIC 0x3147434d // "MCG1"
+
+// the number of pages a record with len data bytes takes
+#define RECORD_PAGES(len) ((sizeof(midi_config_store_header_t) + (len) + MIDI_CONFIG_STORE_PAGE_SIZE - 1) / MIDI_CONFIG_STORE_PAGE_SIZE)
+
+static const midi_config_store_header_t* newest[MIDI_CONFIG_STORE_NUM_TYPES]; // in flash; NULL if none
+static uint8_t active_sector;   // the sector new records go to
+static uint8_t write_page;      // the page after the last programmed page in active_sector
+static uint32_t next_seq;       // the sequence number of the next record
+
+// the data midi_config_store_put() got that is not written yet
+static struct {
+  uint8_t data[MIDI_CONFIG_STORE_MAX_DATA];
+  uint16_t len;
+  bool pending;
+} staged[MIDI_CONFIG_STORE_NUM_TYPES];
+
+// the record being written, a page per call to midi_config_store_task()
+static struct {
+  bool busy;
+  uint8_t type;
+  uint8_t sector;
+  uint8_t first_page;
+  uint8_t npages;
+  uint8_t done;         // the number of pages programmed; the header page goes last
+  uint8_t image[sizeof(midi_config_store_header_t) + MIDI_CONFIG_STORE_MAX_DATA] __attribute__((aligned(4)));
+} rec;
+
+static uint8_t copy_mask;       // the types whose newest record a compaction still has to copy
+static uint8_t page_buf[MIDI_CONFIG_STORE_PAGE_SIZE] __attribute__((aligned(4)));
+static struct {
+  uint32_t programmed;
+  uint32_t erased;
+  uint32_t failed;      // records that did not read back correctly
+} stats;
+
+static uint32_t flash_offset(uint8_t sector, uint8_t page)
+{
+  return MIDI_CONFIG_STORE_FLASH_OFFSET + sector * MIDI_CONFIG_STORE_SECTOR_SIZE + page * MIDI_CONFIG_STORE_PAGE_SIZE;
+}
+
+static const uint8_t* flash_page(uint8_t sector, uint8_t page)
+{
+  return (const uint8_t*)(XIP_BASE + flash_offset(sector, page));
+}
+
+static uint32_t fnv1a(const uint8_t* data, uint16_t len)
+{
+  uint32_t hash = 2166136261u;
+  for (uint16_t idx = 0; idx < len; idx++) {
+    hash ^= data[idx];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static bool page_is_erased(const uint8_t* page)
+{
+  const uint32_t* words = (const uint32_t*)page;
+  for (uint16_t idx = 0; idx < MIDI_CONFIG_STORE_PAGE_SIZE / sizeof(uint32_t); idx++) {
+    if (words[idx] != 0xffffffffu)
+      return false;
+  }
+  return true;
+}
+
+// true if the page starts a complete record
+static bool record_is_valid(const midi_config_store_header_t* header, uint8_t page)
+{
+  return header->magic == MIDI_CONFIG_STORE_MAGIC && header->type < MIDI_CONFIG_STORE_NUM_TYPES &&
+      header->len <= MIDI_CONFIG_STORE_MAX_DATA && page + RECORD_PAGES(header->len) <= MIDI_CONFIG_STORE_PAGES_PER_SECTOR &&
+      fnv1a((const uint8_t*)(header + 1), header->len) == header->checksum;
+}
+
+static uint8_t sector_of(const midi_config_store_header_t* header)
+{
+  return ((uintptr_t)header - XIP_BASE - MIDI_CONFIG_STORE_FLASH_OFFSET) / MIDI_CONFIG_STORE_SECTOR_SIZE;
+}
+
+void midi_config_store_init(void)
+{
+  memset(newest, 0, sizeof(newest));
+  memset(staged, 0, sizeof(staged));
+  rec.busy = false;
+  copy_mask = 0;
+  active_sector = 0;
+  next_seq = 0;
+  for (uint8_t sector = 0; sector < MIDI_CONFIG_STORE_SECTORS; sector++) {
+    uint8_t page = 0;
+    while (page < MIDI_CONFIG_STORE_PAGES_PER_SECTOR) {
+      const midi_config_store_header_t* header = (const midi_config_store_header_t*)flash_page(sector, page);
+      if (!record_is_valid(header, page)) {
+        ++page;
+        continue;
+      }
+      if (newest[header->type] == NULL || header->seq > newest[header->type]->seq)
+        newest[header->type] = header;
+      if (header->seq >= next_seq) {
+        next_seq = header->seq + 1;
+        active_sector = sector;
+      }
+      page += RECORD_PAGES(header->len);
+    }
+  }
+  // append after the last page anything was programmed in, even a record cut short
+  write_page = MIDI_CONFIG_STORE_PAGES_PER_SECTOR;
+  while (write_page > 0 && page_is_erased(flash_page(active_sector, write_page - 1)))
+    --write_page;
+  // a compaction cut short leaves newest records in the previous sector; copy them before it is erased
+  for (uint8_t type = 0; type < MIDI_CONFIG_STORE_NUM_TYPES; type++) {
+    if (newest[type] != NULL && sector_of(newest[type]) != active_sector) {
+      memcpy(staged[type].data, newest[type] + 1, newest[type]->len);
+      staged[type].len = newest[type]->len;
+      staged[type].pending = true;
+    }
+  }
+}
+
+const uint8_t* midi_config_store_get(uint8_t type, uint16_t* len)
+{
+  if (type >= MIDI_CONFIG_STORE_NUM_TYPES || newest[type] == NULL)
+    return NULL;
+  *len = newest[type]->len;
+  return (const uint8_t*)(newest[type] + 1);
+}
+
+bool midi_config_store_put(uint8_t type, const uint8_t* data, uint16_t len)
+{
+  if (type >= MIDI_CONFIG_STORE_NUM_TYPES || len > MIDI_CONFIG_STORE_MAX_DATA)
+    return false;
+  // compare with what the store will hold once the writes in progress finish
+  const uint8_t* current = NULL;
+  uint16_t current_len = 0;
+  if (staged[type].pending) {
+    current = staged[type].data;
+    current_len = staged[type].len;
+  }
+  else if (rec.busy && rec.type == type) {
+    current = rec.image + sizeof(midi_config_store_header_t);
+    current_len = ((const midi_config_store_header_t*)rec.image)->len;
+  }
+  else {
+    current = midi_config_store_get(type, &current_len);
+  }
+  if (current != NULL && current_len == len && memcmp(current, data, len) == 0)
+    return true; // nothing changed; save the flash the wear
+  memcpy(staged[type].data, data, len);
+  staged[type].len = len;
+  staged[type].pending = true;
+  return true;
+}
+
+bool midi_config_store_pending(void)
+{
+  if (rec.busy || copy_mask != 0)
+    return true;
+  for (uint8_t type = 0; type < MIDI_CONFIG_STORE_NUM_TYPES; type++) {
+    if (staged[type].pending)
+      return true;
+  }
+  return false;
+}
+
+// Erase or program flash while core1 does not run code from flash
+static void flash_write(uint32_t offset, const uint8_t* page)
+{
+  multicore_lockout_start_blocking();
+  uint32_t ints = save_and_disable_interrupts();
+  if (page == NULL)
+    flash_range_erase(offset, MIDI_CONFIG_STORE_SECTOR_SIZE);
+  else
+    flash_range_program(offset, page, MIDI_CONFIG_STORE_PAGE_SIZE);
+  restore_interrupts(ints);
+  multicore_lockout_end_blocking();
+}
+
+// Move to the next sector and copy the newest record of each type there unless newer data is waiting
+static void start_compaction(void)
+{
+  active_sector = (active_sector + 1) % MIDI_CONFIG_STORE_SECTORS;
+  write_page = 0;
+  copy_mask = 0;
+  for (uint8_t type = 0; type < MIDI_CONFIG_STORE_NUM_TYPES; type++) {
+    if (newest[type] != NULL && !staged[type].pending)
+      copy_mask |= 1u << type;
+  }
+  flash_write(flash_offset(active_sector, 0), NULL);
+  ++stats.erased;
+}
+
+static void start_record(uint8_t type, const uint8_t* data, uint16_t len)
+{
+  midi_config_store_header_t header = {
+    .magic = MIDI_CONFIG_STORE_MAGIC,
+    .type = type,
+    .reserved = 0xff,
+    .len = len,
+    .seq = next_seq++,
+    .checksum = fnv1a(data, len),
+  };
+  memcpy(rec.image, &header, sizeof(header));
+  memcpy(rec.image + sizeof(header), data, len);
+  rec.busy = true;
+  rec.type = type;
+  rec.sector = active_sector;
+  rec.first_page = write_page;
+  rec.npages = RECORD_PAGES(len);
+  rec.done = 0;
+  write_page += rec.npages;
+}
+
+static void program_next_page(void)
+{
+  // the pages after the header first, so the record only counts once all of it is there
+  uint8_t page = (rec.done + 1) % rec.npages;
+  uint16_t nbytes = sizeof(midi_config_store_header_t) + ((const midi_config_store_header_t*)rec.image)->len;
+  uint16_t offset = page * MIDI_CONFIG_STORE_PAGE_SIZE;
+  uint16_t ncopy = nbytes - offset < MIDI_CONFIG_STORE_PAGE_SIZE ? nbytes - offset : MIDI_CONFIG_STORE_PAGE_SIZE;
+  memset(page_buf, 0xff, sizeof(page_buf));
+  memcpy(page_buf, rec.image + offset, ncopy);
+  flash_write(flash_offset(rec.sector, rec.first_page + page), page_buf);
+  ++stats.programmed;
+  if (++rec.done < rec.npages)
+    return;
+  rec.busy = false;
+  const midi_config_store_header_t* header = (const midi_config_store_header_t*)flash_page(rec.sector, rec.first_page);
+  if (record_is_valid(header, rec.first_page))
+    newest[rec.type] = header;
+  else
+    ++stats.failed;
+}
+
+bool midi_config_store_task(void)
+{
+  if (!rec.busy) {
+    if (copy_mask != 0) {
+      uint8_t type = 0;
+      while ((copy_mask & (1u << type)) == 0)
+        ++type;
+      copy_mask &= ~(1u << type);
+      start_record(type, (const uint8_t*)(newest[type] + 1), newest[type]->len);
+    }
+    else {
+      uint8_t type = 0;
+      while (type < MIDI_CONFIG_STORE_NUM_TYPES && !staged[type].pending)
+        ++type;
+      if (type == MIDI_CONFIG_STORE_NUM_TYPES)
+        return false;
+      if (write_page + RECORD_PAGES(staged[type].len) > MIDI_CONFIG_STORE_PAGES_PER_SECTOR) {
+        start_compaction();
+        return true;
+      }
+      staged[type].pending = false;
+      start_record(type, staged[type].data, staged[type].len);
+    }
+  }
+  program_next_page();
+  return true;
+}
+
+void midi_config_store_print_stats(void)
+{
+  printf("config store: sector=%u next page=%u pages programmed=%lu sectors erased=%lu failed records=%lu\r\n",
+      active_sector, write_page, (unsigned long)stats.programmed, (unsigned long)stats.erased, (unsigned long)stats.failed);
+}
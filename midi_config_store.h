@@ -0,0 +1,154 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_config_store.h
+ *
+ * This file contains a small log-structured store in reserved flash sectors
+ * for the data that should survive a reboot besides the USB descriptors
+ * (see descriptor_cache.h): the filter rules loaded at run time and the
+ * filter state, such as the last DAW fader values. Each record is a header
+ * (type, length, sequence number and checksum) followed by the data, and
+ * takes whole flash pages. A new record is appended after the last one, and
+ * the newest valid record of each type wins. When the sector being written
+ * is full, the store erases the next sector in turn, copies the newest
+ * record of each type into it and continues there, so the erases are spread
+ * over all of the sectors.
+ *
+ * Erasing and programming flash stops code from running out of flash on both
+ * cores, and core1 runs the USB host out of flash, so each flash write locks
+ * it out. A sector erase takes about 45 ms on the Pico's W25Q16JV flash (up
+ * to 400 ms by the datasheet) and a page program about 0.4 ms (up to 3 ms).
+ * The USB host sends no start-of-frame packets meanwhile, and a USB device
+ * that sees none for 3 ms suspends, so an erase suspends the attached MIDI
+ * device; it resumes when the frames start again, but MIDI it had not sent
+ * yet can be lost. midi_config_store_put() only keeps the record in RAM, and
+ * midi_config_store_task() writes it one page program or one sector erase
+ * per call. Put data that changes often, such as fader values, only rarely
+ * or when the user asks, since every sector the records fill costs an erase,
+ * and call midi_config_store_task() only when no MIDI is flowing, so the
+ * stalls land while nothing plays. A record's header page is programmed last,
+ * so a write cut short by a power loss leaves the previous record in effect.
+ * Reading the store at boot takes a scan of the record headers and one checksum
+ * of each newest record.
+ *
+ * To use this code:
+ * 1. At boot, call midi_config_store_init(), then midi_config_store_get() for each record type.
+ * 2. Call midi_config_store_put() whenever the data for a record type changes; it
+ *    does nothing if the data matches the stored record.
+ * 3. On core0, call midi_config_store_task() periodically while MIDI is idle. core1 must
+ *    call multicore_lockout_victim_init() before the first call.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "descriptor_cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MIDI_CONFIG_STORE_SECTOR_SIZE 4096
+#define MIDI_CONFIG_STORE_PAGE_SIZE   256
+#define MIDI_CONFIG_STORE_PAGES_PER_SECTOR (MIDI_CONFIG_STORE_SECTOR_SIZE / MIDI_CONFIG_STORE_PAGE_SIZE)
+
+#ifndef MIDI_CONFIG_STORE_SECTORS
+// The number of sectors to spread the erases over; at least 2
+#define MIDI_CONFIG_STORE_SECTORS 4
+#endif
+
+#ifndef MIDI_CONFIG_STORE_FLASH_OFFSET
+// Offset of the first sector from the start of flash; use the sectors just below the descriptor cache by default
+#define MIDI_CONFIG_STORE_FLASH_OFFSET (DESCRIPTOR_CACHE_FLASH_OFFSET - MIDI_CONFIG_STORE_SECTORS * MIDI_CONFIG_STORE_SECTOR_SIZE)
+#endif
+
+#ifndef MIDI_CONFIG_STORE_MAX_DATA
+// The most data bytes a record can hold. The newest record of every type
+// must fit in one sector with room for one more
+#define MIDI_CONFIG_STORE_MAX_DATA 1024
+#endif
+
+// Record types
+#define MIDI_CONFIG_STORE_RULES        0 //!< the filter rules; see midi_filter_rules.h
+#define MIDI_CONFIG_STORE_FILTER_STATE 1 //!< the filter state; see filter_midi_save_state()
+#define MIDI_CONFIG_STORE_NUM_TYPES    2
+
+typedef struct {
+  uint32_t magic;     // MIDI_CONFIG_STORE_MAGIC if the page starts a record
+  uint8_t type;       // one of the record types
+  uint8_t reserved;   // 0xff
+  uint16_t len;       // number of data bytes that follow the header
+  uint32_t seq;       // one more than the sequence number of the record written before it
+  uint32_t checksum;  // FNV-1a hash of the data
+} midi_config_store_header_t;
+
+/**
+ * @brief find the newest record of each type in flash
+ */
+void midi_config_store_init(void);
+
+/**
+ * @brief get the data of the newest stored record of a type
+ *
+ * @param type the record type
+ * @param len set to the number of data bytes
+ * @return const uint8_t* a pointer to the data in flash, or NULL if there is no record of the type
+ */
+const uint8_t* midi_config_store_get(uint8_t type, uint16_t* len);
+
+/**
+ * @brief keep new data for a record type until midi_config_store_task() writes it
+ *
+ * @param type the record type
+ * @param data the data
+ * @param len the number of data bytes, at most MIDI_CONFIG_STORE_MAX_DATA
+ * @return true if the data is stored or will be
+ */
+bool midi_config_store_put(uint8_t type, const uint8_t* data, uint16_t len);
+
+/**
+ * @brief check if any data is waiting to be written
+ *
+ * @return true if midi_config_store_task() has work to do
+ */
+bool midi_config_store_pending(void);
+
+/**
+ * @brief do at most one flash page program or sector erase to write the waiting data
+ *
+ * Call only from core0 after core1 called multicore_lockout_victim_init().
+ *
+ * @return true if the flash was written
+ */
+bool midi_config_store_task(void);
+
+/**
+ * @brief print the number of pages programmed and sectors erased using printf()
+ */
+void midi_config_store_print_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -26,6 +26,7 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -40,6 +41,59 @@ bool filter_midi_in(uint8_t packet[4]);
 // Modify the data heading to the USB Host MIDI OUT port
 // if need be.
 bool filter_midi_out(uint8_t packet[4]);
+
+// Filter an array of 4-byte USB MIDI packets heading to the USB Host
+// MIDI IN port in place. Packets that are filtered out are removed and
+// the rest are moved to the start of the array in their original order.
+// If post is not NULL, post[idx] is set to the packet packets[idx] became,
+// or 0 if it was filtered out, so each packet's verdict can be recorded.
+// Returns the number of packets left in the array.
+size_t filter_midi_in_batch(uint32_t* packets, size_t npackets, uint32_t* post);
+
+// Filter an array of 4-byte USB MIDI packets heading to the USB Host
+// MIDI OUT port in place the same way filter_midi_in_batch() does.
+size_t filter_midi_out_batch(uint32_t* packets, size_t npackets, uint32_t* post);
+
+// Get any packets the filter generated on its own that are heading to
+// the USB Host MIDI IN port (e.g., a value the filter held back that
+// is now due). Call this periodically from the same core that calls
+// filter_midi_in(); now_us is the current time in microseconds.
+// Returns the number of packets stored in packets.
+size_t filter_midi_in_poll(uint32_t now_us, uint32_t* packets, size_t max_packets);
+
+// Called when a MIDI device is connected to the USB Host port so the
+// filter can restore any device state it keeps (e.g., button LEDs).
+// Call this from the same core that calls filter_midi_out().
+void filter_midi_out_mounted(void);
+
+// Get any packets the filter generated on its own that are heading to
+// the USB Host MIDI OUT port. Call this periodically from the same core
+// that calls filter_midi_out(); now_us is the current time in microseconds.
+// A SysEx message the filter generates is stored whole, so pass room for
+// FILTER_MIDI_OUT_POLL_PACKETS packets and send the packets together.
+// The filter generates nothing while a SysEx message from the USB Host
+// has started but not ended. Returns the number of packets stored in packets.
+#define FILTER_MIDI_OUT_POLL_PACKETS 48
+size_t filter_midi_out_poll(uint32_t now_us, uint32_t* packets, size_t max_packets);
+
+// Print any statistics the filter keeps using printf()
+void filter_midi_print_stats(void);
+
+// Replace the filter rules with rules in the format in midi_filter_rules.h.
+// Call this from the same core that calls filter_midi_out(). Returns
+// MIDI_FILTER_RULES_OK or the error; bad_rule is set to the index of the
+// rule the error is about, if any. A filter that does not support rules
+// returns MIDI_FILTER_RULES_NO_STAGE.
+uint8_t filter_midi_load_rules(const uint8_t* rules, uint16_t len, uint8_t* bad_rule);
+
+// Store the filter state worth keeping across a reboot (e.g., the last
+// DAW fader values) in buf. Returns the number of bytes stored; 0 if the
+// filter keeps no such state or it does not fit in max_len bytes.
+size_t filter_midi_save_state(uint8_t* buf, size_t max_len);
+
+// Restore the state filter_midi_save_state() stored. Call this after
+// filter_midi_init(). State the filter does not recognize is ignored.
+void filter_midi_restore_state(const uint8_t* buf, size_t len);
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
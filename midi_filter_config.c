@@ -0,0 +1,83 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include "midi_filter_config.h"
+
+static midi_filter_config_t configs[2];
+static midi_filter_config_t* current = &configs[0];
+// counts the publications; the spare buffer was retired at retired_epoch
+static uint32_t epoch = 0;
+static uint32_t retired_epoch = 0;
+// the epoch each reader saw at its last quiescent point
+static uint32_t reader_epoch[MIDI_FILTER_CONFIG_NREADERS];
+
+midi_filter_config_t* midi_filter_config_init(void)
+{
+  memset(configs, 0, sizeof(configs));
+  midi_filter_table_init(&configs[0].in);
+  midi_filter_table_init(&configs[0].out);
+  midi_note_map_init(&configs[0].note_map);
+  epoch = 0;
+  retired_epoch = 0;
+  memset(reader_epoch, 0, sizeof(reader_epoch));
+  __atomic_store_n(&current, &configs[0], __ATOMIC_RELEASE);
+  return &configs[0];
+}
+
+// true once every reader has passed a quiescent point since the spare buffer was replaced
+static bool spare_is_free(void)
+{
+  for (uint8_t reader = 0; reader < MIDI_FILTER_CONFIG_NREADERS; reader++) {
+    if ((int32_t)(__atomic_load_n(&reader_epoch[reader], __ATOMIC_ACQUIRE) - retired_epoch) < 0)
+      return false;
+  }
+  return true;
+}
+
+midi_filter_config_t* midi_filter_config_edit(void)
+{
+  if (!spare_is_free())
+    return NULL;
+  midi_filter_config_t* config = current == &configs[0] ? &configs[1] : &configs[0];
+  memcpy(config, current, sizeof(*config));
+  return config;
+}
+
+void midi_filter_config_publish(midi_filter_config_t* config)
+{
+  if (config == current)
+    return; // the first configuration; midi_filter_config_init() already made it current
+  config->version = current->version + 1;
+  __atomic_store_n(&current, config, __ATOMIC_SEQ_CST);
+  // a reader that sees the new epoch at a quiescent point no longer uses the old buffer
+  retired_epoch = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+const midi_filter_config_t* midi_filter_config_read(uint8_t reader)
+{
+  __atomic_store_n(&reader_epoch[reader], __atomic_load_n(&epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,115 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_filter_config.h
+ *
+ * This file contains the live filter configuration: the filter rule tables
+ * for both directions, the note maps and the fader pickup thresholds, kept
+ * in an object that the filter never changes while it uses it. Both cores read the
+ * configuration while MIDI traffic flows: core1 filters packets from the
+ * MIDI device and core0 filters packets from the DAW.
+ *
+ * To change the configuration, one core edits a copy off the hot path and
+ * publishes it with a single atomic pointer store (read-copy-update). A
+ * filter call reads the pointer once and uses that configuration for the
+ * whole batch, so no packet ever sees half of an update. Each reader marks
+ * a quiescent point every time it reads the pointer, because it no longer
+ * uses the configuration it read before. There are two configuration buffers.
+ * The one that was replaced can be edited again only after every reader has
+ * passed a quiescent point since the swap.
+ *
+ * To use this code:
+ * 1. Call midi_filter_config_init() and fill in the configuration it returns,
+ *    then call midi_filter_config_publish() before any reader runs.
+ * 2. At the start of each filter call, call midi_filter_config_read() with the
+ *    ID of the reader (one per core) and use the configuration it returns
+ *    until the call returns. Call it regularly even when no packets arrive
+ *    (e.g., from the filter's poll function) so updates do not wait on an idle reader.
+ * 3. To change the configuration, call midi_filter_config_edit() on the core
+ *    that publishes. If it returns NULL, a reader may still be using the spare
+ *    buffer; try again later. Otherwise change the copy it returns and call
+ *    midi_filter_config_publish().
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "midi_filter_table.h"
+#include "midi_note_map.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Reader IDs; each reader must run on a single core
+#define MIDI_FILTER_CONFIG_READER_IN  0 //!< the filter for packets from the MIDI device (core1)
+#define MIDI_FILTER_CONFIG_READER_OUT 1 //!< the filter for packets from the DAW (core0)
+#define MIDI_FILTER_CONFIG_NREADERS   2
+
+typedef struct {
+  midi_filter_table_t in;     //!< rules for packets from the MIDI device
+  midi_filter_table_t out;    //!< rules for packets from the DAW
+  midi_note_map_t note_map;   //!< note and velocity maps for packets from the MIDI device
+  uint16_t fader_sync_delta;  //!< see mc_fader_pickup_init()
+  uint16_t fader_deadband;    //!< see mc_fader_pickup_set_deadband()
+  uint16_t fader_hysteresis;  //!< see mc_fader_pickup_set_deadband()
+  uint32_t version;           //!< counts the published configurations; set by midi_filter_config_publish()
+} midi_filter_config_t;
+
+/**
+ * @brief forget every configuration and get a buffer for the first one
+ *
+ * Call this before any reader runs.
+ *
+ * @return midi_filter_config_t* a configuration with rule tables that pass every packet
+ */
+midi_filter_config_t* midi_filter_config_init(void);
+
+/**
+ * @brief get a copy of the current configuration to change
+ *
+ * @return midi_filter_config_t* the copy, or NULL if a reader may still be
+ * using the buffer for the copy
+ */
+midi_filter_config_t* midi_filter_config_edit(void);
+
+/**
+ * @brief make a configuration current
+ *
+ * @param config the configuration midi_filter_config_init() or midi_filter_config_edit() returned
+ */
+void midi_filter_config_publish(midi_filter_config_t* config);
+
+/**
+ * @brief note that a reader is done with the configuration it read before and get the current one
+ *
+ * @param reader MIDI_FILTER_CONFIG_READER_IN or MIDI_FILTER_CONFIG_READER_OUT
+ * @return const midi_filter_config_t* the current configuration
+ */
+const midi_filter_config_t* midi_filter_config_read(uint8_t reader);
+
+#ifdef __cplusplus
+}
+#endif
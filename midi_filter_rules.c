@@ -0,0 +1,243 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "midi_filter_rules.h"
+
+uint8_t midi_filter_rules_checksum(const uint8_t* rules, uint16_t len)
+{
+  uint8_t sum = 0;
+  for (uint16_t idx = 0; idx < len; idx++)
+    sum += rules[idx];
+  return sum & 0x7f;
+}
+
+// true if the fields of a rule are in range
+static bool rule_is_valid(const uint8_t* rule)
+{
+  if (rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_PARAM) {
+    uint8_t param = rule[MIDI_FILTER_RULE_DIR];
+    if (param < MIDI_FILTER_RULES_PARAM_FADER_SYNC_DELTA || param > MIDI_FILTER_RULES_PARAM_FADER_HYSTERESIS)
+      return false;
+    for (uint8_t idx = MIDI_FILTER_RULE_CHAN_LO; idx < MIDI_FILTER_RULES_RULE_BYTES; idx++) {
+      if (rule[idx] != 0)
+        return false;
+    }
+    return true;
+  }
+  uint8_t arg = rule[MIDI_FILTER_RULE_ARG];
+  if (rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_NOTE_MAP || rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_VELOCITY) {
+    if (rule[MIDI_FILTER_RULE_DIR] != MIDI_FILTER_RULES_IN || rule[MIDI_FILTER_RULE_CABLE] >= MIDI_NOTE_MAP_CABLES ||
+        rule[MIDI_FILTER_RULE_CHAN_LO] > rule[MIDI_FILTER_RULE_CHAN_HI] || rule[MIDI_FILTER_RULE_CHAN_HI] > 0xF ||
+        rule[MIDI_FILTER_RULE_DATA1_LO] > rule[MIDI_FILTER_RULE_DATA1_HI])
+      return false;
+    if (rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_VELOCITY)
+      return rule[MIDI_FILTER_RULE_STATUS] == 0 && arg < MIDI_NOTE_MAP_NUM_CURVES &&
+          rule[MIDI_FILTER_RULE_DATA1_LO] == 0 && rule[MIDI_FILTER_RULE_DATA1_HI] == 0x7f;
+    return rule[MIDI_FILTER_RULE_STATUS] <= MIDI_FILTER_RULES_SAME_CHANNEL ||
+        (rule[MIDI_FILTER_RULE_STATUS] == MIDI_FILTER_RULES_NOTE_DROP && arg == MIDI_FILTER_RULES_NO_TRANSPOSE);
+  }
+  if (rule[MIDI_FILTER_RULE_DIR] > MIDI_FILTER_RULES_OUT || rule[MIDI_FILTER_RULE_CABLE] > MIDI_FILTER_RULES_ANY_CABLE ||
+      rule[MIDI_FILTER_RULE_STATUS] < 0x8 || rule[MIDI_FILTER_RULE_STATUS] > 0xF ||
+      rule[MIDI_FILTER_RULE_CHAN_LO] > rule[MIDI_FILTER_RULE_CHAN_HI] || rule[MIDI_FILTER_RULE_CHAN_HI] > 0xF ||
+      rule[MIDI_FILTER_RULE_DATA1_LO] > rule[MIDI_FILTER_RULE_DATA1_HI])
+    return false;
+  // The tables match packet byte 1 only, so a rule on F0-F7 would catch one packet of a
+  // SysEx message and let the rest through; only system real-time messages F8-FF can match
+  if (rule[MIDI_FILTER_RULE_STATUS] == 0xF && rule[MIDI_FILTER_RULE_CHAN_LO] < 0x8)
+    return false;
+  switch (rule[MIDI_FILTER_RULE_OP]) {
+    case MIDI_FILTER_RULE_DROP:
+      return arg == 0;
+    case MIDI_FILTER_RULE_REMAP:
+      return arg + rule[MIDI_FILTER_RULE_DATA1_HI] - rule[MIDI_FILTER_RULE_DATA1_LO] <= 0x7f;
+    case MIDI_FILTER_RULE_COPY:
+      return arg <= 0xF;
+    case MIDI_FILTER_RULE_STAGE:
+      // the filter table runs handlers by status byte only
+      return arg != 0 && arg < MIDI_FILTER_RULES_NUM_STAGES &&
+          rule[MIDI_FILTER_RULE_DATA1_LO] == 0 && rule[MIDI_FILTER_RULE_DATA1_HI] == 0x7f;
+    default:
+      return false;
+  }
+}
+
+uint8_t midi_filter_rules_check(const uint8_t* rules, uint16_t len, uint8_t* bad_rule)
+{
+  if (len < MIDI_FILTER_RULES_HEADER_BYTES + 1 || rules[0] != MIDI_FILTER_RULES_VERSION)
+    return MIDI_FILTER_RULES_BAD_HEADER;
+  for (uint16_t idx = 0; idx < len; idx++) {
+    if (rules[idx] & 0x80)
+      return MIDI_FILTER_RULES_BAD_HEADER;
+  }
+  uint8_t nrules = rules[1];
+  if (nrules > MIDI_FILTER_RULES_MAX_RULES ||
+      len != MIDI_FILTER_RULES_HEADER_BYTES + nrules * MIDI_FILTER_RULES_RULE_BYTES + 1)
+    return MIDI_FILTER_RULES_BAD_LENGTH;
+  if (midi_filter_rules_checksum(rules, len - 1) != rules[len - 1])
+    return MIDI_FILTER_RULES_BAD_CHECKSUM;
+  for (uint8_t idx = 0; idx < nrules; idx++) {
+    if (!rule_is_valid(rules + MIDI_FILTER_RULES_HEADER_BYTES + idx * MIDI_FILTER_RULES_RULE_BYTES)) {
+      *bad_rule = idx;
+      return MIDI_FILTER_RULES_BAD_RULE;
+    }
+  }
+  return MIDI_FILTER_RULES_OK;
+}
+
+static void set_param(midi_filter_config_t* config, const uint8_t* rule)
+{
+  uint16_t value = rule[MIDI_FILTER_RULE_CABLE] | (rule[MIDI_FILTER_RULE_STATUS] << 7);
+  switch (rule[MIDI_FILTER_RULE_DIR]) {
+    case MIDI_FILTER_RULES_PARAM_FADER_SYNC_DELTA:
+      config->fader_sync_delta = value;
+      break;
+    case MIDI_FILTER_RULES_PARAM_FADER_DEADBAND:
+      config->fader_deadband = value;
+      break;
+    case MIDI_FILTER_RULES_PARAM_FADER_HYSTERESIS:
+      config->fader_hysteresis = value;
+      break;
+  }
+}
+
+// Fill in the note maps for one rule and one MIDI channel
+static bool compile_note_map(midi_note_map_t* map, const uint8_t* rule, uint8_t chan)
+{
+  uint8_t cable = rule[MIDI_FILTER_RULE_CABLE];
+  uint8_t status = rule[MIDI_FILTER_RULE_STATUS];
+  uint8_t arg = rule[MIDI_FILTER_RULE_ARG];
+  if (rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_VELOCITY)
+    return midi_note_map_set_velocity(map, cable, chan, (midi_note_map_curve_t)arg);
+  if (status == MIDI_FILTER_RULES_NOTE_DROP)
+    return midi_note_map_drop_notes(map, cable, chan, rule[MIDI_FILTER_RULE_DATA1_LO], rule[MIDI_FILTER_RULE_DATA1_HI]);
+  return midi_note_map_set_notes(map, cable, chan, rule[MIDI_FILTER_RULE_DATA1_LO], rule[MIDI_FILTER_RULE_DATA1_HI],
+      (int8_t)(arg - MIDI_FILTER_RULES_NO_TRANSPOSE), status == MIDI_FILTER_RULES_SAME_CHANNEL ? chan : status);
+}
+
+// Add the actions for one rule to the table for one virtual cable and status byte
+static bool compile_status(midi_filter_table_t* table, const uint8_t* rule, uint8_t cable, uint8_t status, uint8_t handler_id)
+{
+  uint8_t lo = rule[MIDI_FILTER_RULE_DATA1_LO];
+  uint8_t hi = rule[MIDI_FILTER_RULE_DATA1_HI];
+  uint8_t arg = rule[MIDI_FILTER_RULE_ARG];
+  // a rule for every first data byte needs no data1 table
+  bool all_data1 = lo == 0 && hi == 0x7f;
+  switch (rule[MIDI_FILTER_RULE_OP]) {
+    case MIDI_FILTER_RULE_DROP:
+      if (all_data1)
+        return midi_filter_table_drop_status(table, cable, status);
+      for (uint8_t data1 = lo; data1 <= hi; data1++) {
+        if (!midi_filter_table_drop_data1(table, cable, status, data1))
+          return false;
+      }
+      return true;
+    case MIDI_FILTER_RULE_REMAP:
+      for (uint8_t data1 = lo; data1 <= hi; data1++) {
+        if (!midi_filter_table_remap_data1(table, cable, status, data1, arg + data1 - lo))
+          return false;
+      }
+      return true;
+    case MIDI_FILTER_RULE_COPY:
+      if (all_data1)
+        return midi_filter_table_copy_status(table, cable, status, arg);
+      for (uint8_t data1 = lo; data1 <= hi; data1++) {
+        if (!midi_filter_table_copy_data1(table, cable, status, data1, arg))
+          return false;
+      }
+      return true;
+    case MIDI_FILTER_RULE_STAGE:
+      return midi_filter_table_set_status_handler(table, cable, status, handler_id);
+    default:
+      return false;
+  }
+}
+
+uint8_t midi_filter_rules_compile(const uint8_t* rules, uint16_t len, const midi_filter_rules_hooks_t* hooks,
+    midi_filter_config_t* config, uint8_t* bad_rule)
+{
+  uint8_t result = midi_filter_rules_check(rules, len, bad_rule);
+  if (result != MIDI_FILTER_RULES_OK)
+    return result;
+  midi_filter_table_t* tables[2] = {&config->in, &config->out};
+  uint8_t handler_ids[2][MIDI_FILTER_RULES_NUM_STAGES] = {{0}};
+  for (uint8_t dir = 0; dir < 2; dir++) {
+    midi_filter_table_init(tables[dir]);
+    midi_filter_table_set_copy_sink(tables[dir], hooks->copy[dir]);
+  }
+  midi_note_map_init(&config->note_map);
+  uint8_t nrules = rules[1];
+  for (uint8_t idx = 0; idx < nrules; idx++) {
+    const uint8_t* rule = rules + MIDI_FILTER_RULES_HEADER_BYTES + idx * MIDI_FILTER_RULES_RULE_BYTES;
+    *bad_rule = idx;
+    if (rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_PARAM) {
+      set_param(config, rule);
+      continue;
+    }
+    if (rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_NOTE_MAP || rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_VELOCITY) {
+      if (!hooks->note_map)
+        return MIDI_FILTER_RULES_NO_STAGE;
+      for (uint8_t chan = rule[MIDI_FILTER_RULE_CHAN_LO]; chan <= rule[MIDI_FILTER_RULE_CHAN_HI]; chan++) {
+        if (!compile_note_map(&config->note_map, rule, chan))
+          return MIDI_FILTER_RULES_TABLE_FULL;
+      }
+      continue;
+    }
+    uint8_t dir = rule[MIDI_FILTER_RULE_DIR];
+    uint8_t handler_id = 0;
+    if (rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_STAGE) {
+      // register each stage with a table the first time a rule uses it
+      uint8_t stage = rule[MIDI_FILTER_RULE_ARG];
+      if (hooks->stages[stage][dir] == NULL)
+        return MIDI_FILTER_RULES_NO_STAGE;
+      if (handler_ids[dir][stage] == 0)
+        handler_ids[dir][stage] = midi_filter_table_add_handler(tables[dir], hooks->stages[stage][dir]);
+      if (handler_ids[dir][stage] == 0)
+        return MIDI_FILTER_RULES_TABLE_FULL;
+      handler_id = handler_ids[dir][stage];
+    }
+    else if (rule[MIDI_FILTER_RULE_OP] == MIDI_FILTER_RULE_COPY && hooks->copy[dir] == NULL) {
+      return MIDI_FILTER_RULES_NO_STAGE;
+    }
+    uint8_t first_cable = rule[MIDI_FILTER_RULE_CABLE] == MIDI_FILTER_RULES_ANY_CABLE ? 0 : rule[MIDI_FILTER_RULE_CABLE];
+    uint8_t last_cable = rule[MIDI_FILTER_RULE_CABLE] == MIDI_FILTER_RULES_ANY_CABLE ? 15 : rule[MIDI_FILTER_RULE_CABLE];
+    for (uint8_t cable = first_cable; cable <= last_cable; cable++) {
+      for (uint8_t chan = rule[MIDI_FILTER_RULE_CHAN_LO]; chan <= rule[MIDI_FILTER_RULE_CHAN_HI]; chan++) {
+        uint8_t status = (rule[MIDI_FILTER_RULE_STATUS] << 4) | chan;
+        if (!compile_status(tables[dir], rule, cable, status, handler_id))
+          return MIDI_FILTER_RULES_TABLE_FULL;
+      }
+    }
+  }
+  return MIDI_FILTER_RULES_OK;
+}
+
+const char* midi_filter_rules_result_name(uint8_t result)
+{
+  static const char* names[] = {"ok", "bad header", "bad length", "bad checksum", "bad rule",
+      "stage not provided", "filter table full", "busy"};
+  if (result >= sizeof(names) / sizeof(names[0]))
+    return "unknown";
+  return names[result];
+}
@@ -0,0 +1,184 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_filter_rules.h
+ *
+ * This file contains a compact binary format for filter rules and the code
+ * that checks the rules and compiles them into the filter tables of a
+ * midi_filter_config_t (see midi_filter_table.h). With it, the rules for a
+ * new controller or DAW are a data file instead of a firmware build: the
+ * host tool midi_rules_compile turns a readable rules file into the binary
+ * form, and a program on the DAW computer uploads it with the vendor SysEx
+ * command MIDI_SYSEX_CMD_LOAD_RULES.
+ *
+ * Every byte is 0-127 so the rules can travel in SysEx unchanged:
+ *   <version> <number of rules> <rule>... <checksum>
+ * The checksum is the sum of all bytes before it, modulo 128. Each rule is
+ * MIDI_FILTER_RULES_RULE_BYTES bytes long; see the MIDI_FILTER_RULE_* offsets.
+ * A rule matches packets in one direction on a virtual cable (or all of them)
+ * with a status byte whose upper nibble is MIDI_FILTER_RULE_STATUS, whose
+ * lower nibble (the MIDI channel) is in the channel range, and whose first
+ * data byte is in the data1 range. The rule then drops, remaps, or copies
+ * the packet to another virtual cable, or passes it to a stateful stage
+ * the filter provides such as fader pickup. A MIDI_FILTER_RULE_PARAM rule
+ * sets a value in the configuration instead of matching packets, and the
+ * MIDI_FILTER_RULE_NOTE_MAP and MIDI_FILTER_RULE_VELOCITY rules fill in the
+ * note maps (see midi_note_map.h), which the filter applies after the filter
+ * tables.
+ *
+ * To use this code:
+ * 1. Fill in a midi_filter_rules_hooks_t with the stages and copy functions the filter provides.
+ * 2. Call midi_filter_config_edit() to get a configuration to change, then call
+ *    midi_filter_rules_compile() to replace its rules.
+ * 3. If midi_filter_rules_compile() returns MIDI_FILTER_RULES_OK, call midi_filter_config_publish().
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "midi_filter_table.h"
+#include "midi_filter_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MIDI_FILTER_RULES_VERSION      1
+#define MIDI_FILTER_RULES_HEADER_BYTES 2 //!< version and number of rules
+#define MIDI_FILTER_RULES_RULE_BYTES   9
+
+#ifndef MIDI_FILTER_RULES_MAX_RULES
+#define MIDI_FILTER_RULES_MAX_RULES 64
+#endif
+#define MIDI_FILTER_RULES_MAX_BYTES (MIDI_FILTER_RULES_HEADER_BYTES + MIDI_FILTER_RULES_MAX_RULES * MIDI_FILTER_RULES_RULE_BYTES + 1)
+
+// The bytes of a rule
+#define MIDI_FILTER_RULE_OP       0 //!< one of the rule operations below
+#define MIDI_FILTER_RULE_DIR      1 //!< MIDI_FILTER_RULES_IN or MIDI_FILTER_RULES_OUT
+#define MIDI_FILTER_RULE_CABLE    2 //!< virtual cable 0-15 or MIDI_FILTER_RULES_ANY_CABLE
+#define MIDI_FILTER_RULE_STATUS   3 //!< the upper nibble of the status byte, 0x8-0xF; 0xF needs CHAN_LO 8 or more (real-time only)
+#define MIDI_FILTER_RULE_CHAN_LO  4 //!< the lowest status byte lower nibble (MIDI channel) 0-15
+#define MIDI_FILTER_RULE_CHAN_HI  5 //!< the highest status byte lower nibble 0-15
+#define MIDI_FILTER_RULE_DATA1_LO 6 //!< the lowest first data byte 0-127
+#define MIDI_FILTER_RULE_DATA1_HI 7 //!< the highest first data byte 0-127
+#define MIDI_FILTER_RULE_ARG      8 //!< depends on the operation
+
+// Rule operations
+#define MIDI_FILTER_RULE_DROP  0x01 //!< drop the packet; ARG is 0
+#define MIDI_FILTER_RULE_REMAP 0x02 //!< replace data1 in DATA1_LO to DATA1_HI with ARG to ARG + DATA1_HI - DATA1_LO
+#define MIDI_FILTER_RULE_COPY  0x03 //!< also send the packet on virtual cable ARG
+#define MIDI_FILTER_RULE_STAGE 0x04 //!< pass the packet to stage ARG; the data1 range must be 0-127
+#define MIDI_FILTER_RULE_PARAM 0x05 //!< set parameter DIR to CABLE | (STATUS << 7); the other bytes are 0
+// Move the notes DATA1_LO to DATA1_HI to the note number plus ARG - MIDI_FILTER_RULES_NO_TRANSPOSE
+// on the MIDI channel in STATUS (0-15 or MIDI_FILTER_RULES_SAME_CHANNEL), or filter them out if STATUS
+// is MIDI_FILTER_RULES_NOTE_DROP. Only for MIDI_FILTER_RULES_IN on a cable below MIDI_NOTE_MAP_CABLES
+#define MIDI_FILTER_RULE_NOTE_MAP 0x06
+// Re-scale the note-on velocity with the midi_note_map_curve_t in ARG. STATUS is 0 and the data1
+// range is 0-127; otherwise the same as MIDI_FILTER_RULE_NOTE_MAP
+#define MIDI_FILTER_RULE_VELOCITY 0x07
+
+#define MIDI_FILTER_RULES_IN        0 //!< packets from the MIDI device to the DAW
+#define MIDI_FILTER_RULES_OUT       1 //!< packets from the DAW to the MIDI device
+#define MIDI_FILTER_RULES_ANY_CABLE 0x10
+
+// STATUS and ARG values for MIDI_FILTER_RULE_NOTE_MAP
+#define MIDI_FILTER_RULES_SAME_CHANNEL 0x10 //!< keep the MIDI channel of the note
+#define MIDI_FILTER_RULES_NOTE_DROP    0x11 //!< filter out the notes; ARG is MIDI_FILTER_RULES_NO_TRANSPOSE
+#define MIDI_FILTER_RULES_NO_TRANSPOSE 0x40
+
+// Stages for MIDI_FILTER_RULE_STAGE
+#define MIDI_FILTER_RULES_STAGE_FADER_PICKUP 1 //!< Mackie Control fader pickup; see midi_mc_fader_pickup.h
+#define MIDI_FILTER_RULES_STAGE_BUTTON_LEDS  2 //!< Mackie Control button LED cache; see mc_led_cache.h
+#define MIDI_FILTER_RULES_NUM_STAGES         3
+
+// Parameters for MIDI_FILTER_RULE_PARAM
+#define MIDI_FILTER_RULES_PARAM_FADER_SYNC_DELTA 1 //!< midi_filter_config_t fader_sync_delta
+#define MIDI_FILTER_RULES_PARAM_FADER_DEADBAND   2 //!< midi_filter_config_t fader_deadband
+#define MIDI_FILTER_RULES_PARAM_FADER_HYSTERESIS 3 //!< midi_filter_config_t fader_hysteresis
+
+// Results
+#define MIDI_FILTER_RULES_OK           0
+#define MIDI_FILTER_RULES_BAD_HEADER   1 //!< too short, not 7-bit, or an unknown version
+#define MIDI_FILTER_RULES_BAD_LENGTH   2 //!< the length does not match the number of rules
+#define MIDI_FILTER_RULES_BAD_CHECKSUM 3
+#define MIDI_FILTER_RULES_BAD_RULE     4 //!< a rule has an unknown operation or a field out of range
+#define MIDI_FILTER_RULES_NO_STAGE     5 //!< the filter does not provide the stage or note maps in that direction
+#define MIDI_FILTER_RULES_TABLE_FULL   6 //!< the rules need more actions, data1 tables or note maps than there are
+#define MIDI_FILTER_RULES_BUSY         7 //!< the previous configuration is still in use; try again
+
+typedef struct {
+  midi_filter_handler_t stages[MIDI_FILTER_RULES_NUM_STAGES][2]; //!< [stage][direction]; NULL if the filter does not provide it
+  midi_filter_copy_t copy[2];                                    //!< [direction] takes the copies MIDI_FILTER_RULE_COPY makes
+  bool note_map;                                                 //!< the filter applies the note_map of the configuration
+} midi_filter_rules_hooks_t;
+
+/**
+ * @brief compute the checksum of the bytes before the checksum
+ *
+ * @param rules the rules
+ * @param len the number of bytes before the checksum
+ * @return uint8_t the checksum
+ */
+uint8_t midi_filter_rules_checksum(const uint8_t* rules, uint16_t len);
+
+/**
+ * @brief check that rules are well formed without compiling them
+ *
+ * @param rules the rules
+ * @param len the number of bytes in rules, including the checksum
+ * @param bad_rule set to the index of the first bad rule if the result is MIDI_FILTER_RULES_BAD_RULE
+ * @return uint8_t MIDI_FILTER_RULES_OK or the error
+ */
+uint8_t midi_filter_rules_check(const uint8_t* rules, uint16_t len, uint8_t* bad_rule);
+
+/**
+ * @brief replace the rule tables of a configuration with compiled rules
+ *
+ * The fader parameters the rules do not set keep their values; the note maps
+ * pass every note unchanged unless the rules map them. If the result
+ * is not MIDI_FILTER_RULES_OK, the configuration is only partly compiled; do not
+ * publish it.
+ *
+ * @param rules the rules
+ * @param len the number of bytes in rules, including the checksum
+ * @param hooks the stages and copy functions the filter provides
+ * @param config the configuration to compile the rules into
+ * @param bad_rule set to the index of the rule that failed, if any
+ * @return uint8_t MIDI_FILTER_RULES_OK or the error
+ */
+uint8_t midi_filter_rules_compile(const uint8_t* rules, uint16_t len, const midi_filter_rules_hooks_t* hooks,
+    midi_filter_config_t* config, uint8_t* bad_rule);
+
+/**
+ * @brief get a short description of a result
+ *
+ * @param result the value midi_filter_rules_check() or midi_filter_rules_compile() returned
+ * @return const char* the description
+ */
+const char* midi_filter_rules_result_name(uint8_t result);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,178 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "midi_filter_table.h"
+#include <string.h>
+
+void midi_filter_table_init(midi_filter_table_t* table)
+{
+  memset(table, 0, sizeof(*table));
+}
+
+uint8_t midi_filter_table_add_handler(midi_filter_table_t* table, midi_filter_handler_t handler)
+{
+  if (table->nhandlers >= MIDI_FILTER_TABLE_MAX_HANDLERS)
+    return 0;
+  table->handlers[table->nhandlers++] = handler;
+  return table->nhandlers;
+}
+
+static midi_filter_action_t* new_action(midi_filter_table_t* table, uint8_t* idx)
+{
+  if (table->nactions >= MIDI_FILTER_TABLE_MAX_ACTIONS)
+    return NULL;
+  midi_filter_action_t* action = &table->actions[table->nactions++];
+  memset(action, 0, sizeof(*action));
+  *idx = table->nactions;
+  return action;
+}
+
+// Get the action for all packets on the cable with the status byte; create one if there is none
+static midi_filter_action_t* get_status_action(midi_filter_table_t* table, uint8_t cable, uint8_t status)
+{
+  if (cable > 15 || status < 0x80)
+    return NULL;
+  uint8_t* entry = &table->status_action[cable][status & 0x7f];
+  if (*entry != 0)
+    return &table->actions[*entry - 1];
+  return new_action(table, entry);
+}
+
+// Get the action for packets on the cable with the status byte and first data byte; create one if there is none.
+// A new data1 action inherits the handler and copy of the status action so they still happen after a remap.
+static midi_filter_action_t* get_data1_action(midi_filter_table_t* table, uint8_t cable, uint8_t status, uint8_t data1)
+{
+  if (data1 > 0x7f)
+    return NULL;
+  midi_filter_action_t* status_action = get_status_action(table, cable, status);
+  if (status_action == NULL)
+    return NULL;
+  if ((status_action->flags & MIDI_FILTER_ACTION_DISPATCH) == 0) {
+    if (table->ndata1_tables >= MIDI_FILTER_TABLE_MAX_DATA1_TABLES)
+      return NULL;
+    status_action->data1_table = table->ndata1_tables++;
+    status_action->flags |= MIDI_FILTER_ACTION_DISPATCH;
+  }
+  uint8_t* entry = &table->data1_action[status_action->data1_table][data1];
+  if (*entry != 0)
+    return &table->actions[*entry - 1];
+  midi_filter_action_t* action = new_action(table, entry);
+  if (action) {
+    action->handler = status_action->handler;
+    action->flags = status_action->flags & MIDI_FILTER_ACTION_COPY;
+    action->copy_cable = status_action->copy_cable;
+  }
+  return action;
+}
+
+bool midi_filter_table_drop_status(midi_filter_table_t* table, uint8_t cable, uint8_t status)
+{
+  midi_filter_action_t* action = get_status_action(table, cable, status);
+  if (action == NULL)
+    return false;
+  // a dropped status byte never needs a data1 lookup
+  action->flags = MIDI_FILTER_ACTION_DROP;
+  return true;
+}
+
+bool midi_filter_table_set_status_handler(midi_filter_table_t* table, uint8_t cable, uint8_t status, uint8_t handler_id)
+{
+  if (handler_id == 0 || handler_id > table->nhandlers)
+    return false;
+  midi_filter_action_t* action = get_status_action(table, cable, status);
+  if (action == NULL)
+    return false;
+  action->handler = handler_id;
+  if (action->flags & MIDI_FILTER_ACTION_DISPATCH) {
+    // data1 actions that already exist must run the handler too
+    for (int data1 = 0; data1 < 128; data1++) {
+      uint8_t idx = table->data1_action[action->data1_table][data1];
+      if (idx != 0)
+        table->actions[idx - 1].handler = handler_id;
+    }
+  }
+  return true;
+}
+
+bool midi_filter_table_remap_data1(midi_filter_table_t* table, uint8_t cable, uint8_t status, uint8_t data1, uint8_t new_data1)
+{
+  if (new_data1 > 0x7f)
+    return false;
+  midi_filter_action_t* action = get_data1_action(table, cable, status, data1);
+  if (action == NULL)
+    return false;
+  action->flags |= MIDI_FILTER_ACTION_SET_DATA1;
+  action->data1 = new_data1;
+  return true;
+}
+
+bool midi_filter_table_drop_data1(midi_filter_table_t* table, uint8_t cable, uint8_t status, uint8_t data1)
+{
+  midi_filter_action_t* action = get_data1_action(table, cable, status, data1);
+  if (action == NULL)
+    return false;
+  action->flags |= MIDI_FILTER_ACTION_DROP;
+  return true;
+}
+
+void midi_filter_table_set_copy_sink(midi_filter_table_t* table, midi_filter_copy_t copy)
+{
+  table->copy = copy;
+}
+
+// Make an action copy its packets; a NULL action means the table is full
+static bool set_copy(midi_filter_action_t* action, uint8_t copy_cable)
+{
+  if (action == NULL)
+    return false;
+  action->flags |= MIDI_FILTER_ACTION_COPY;
+  action->copy_cable = copy_cable;
+  return true;
+}
+
+bool midi_filter_table_copy_status(midi_filter_table_t* table, uint8_t cable, uint8_t status, uint8_t copy_cable)
+{
+  if (copy_cable > 15 || table->copy == NULL)
+    return false;
+  midi_filter_action_t* action = get_status_action(table, cable, status);
+  if (!set_copy(action, copy_cable))
+    return false;
+  if (action->flags & MIDI_FILTER_ACTION_DISPATCH) {
+    // data1 actions that already exist must make the copy too
+    for (int data1 = 0; data1 < 128; data1++) {
+      uint8_t idx = table->data1_action[action->data1_table][data1];
+      if (idx != 0)
+        set_copy(&table->actions[idx - 1], copy_cable);
+    }
+  }
+  return true;
+}
+
+bool midi_filter_table_copy_data1(midi_filter_table_t* table, uint8_t cable, uint8_t status, uint8_t data1, uint8_t copy_cable)
+{
+  if (copy_cable > 15 || table->copy == NULL)
+    return false;
+  return set_copy(get_data1_action(table, cable, status, data1), copy_cable);
+}
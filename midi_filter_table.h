@@ -0,0 +1,259 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_filter_table.h
+ *
+ * This file contains a table-driven MIDI packet filter engine. Filter rules
+ * (remaps, drops, copies and stateful handlers) are compiled once into lookup tables
+ * so that filtering a packet costs one table load indexed by the virtual
+ * cable and status byte, an optional second table load indexed by the first
+ * data byte, and at most one call to a stateful handler. Adding more rules
+ * does not make the hot path slower.
+ *
+ * To use this code:
+ * 1. Create a midi_filter_table_t structure for each direction you want to filter
+ * 2. Call midi_filter_table_init() to initialize each structure
+ * 3. Register any stateful handlers with midi_filter_table_add_handler() and
+ *    add rules with the midi_filter_table_drop_status(), midi_filter_table_set_status_handler(),
+ *    midi_filter_table_remap_data1() and midi_filter_table_drop_data1() functions.
+ *    To copy packets to another virtual cable, call midi_filter_table_set_copy_sink() and
+ *    add rules with midi_filter_table_copy_status() or midi_filter_table_copy_data1().
+ * 4. For each packet, call midi_filter_table_apply() and only forward the packet
+ *    if it returns true, or call midi_filter_table_apply_batch() for an array of packets.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MIDI_FILTER_TABLE_MAX_ACTIONS
+#define MIDI_FILTER_TABLE_MAX_ACTIONS 64
+#endif
+
+#ifndef MIDI_FILTER_TABLE_MAX_DATA1_TABLES
+#define MIDI_FILTER_TABLE_MAX_DATA1_TABLES 8
+#endif
+
+#ifndef MIDI_FILTER_TABLE_MAX_HANDLERS
+#define MIDI_FILTER_TABLE_MAX_HANDLERS 8
+#endif
+
+#define MIDI_FILTER_ACTION_DROP      0x01 //!< Filter out the packet
+#define MIDI_FILTER_ACTION_SET_DATA1 0x02 //!< Replace the first data byte with the action's data1
+#define MIDI_FILTER_ACTION_DISPATCH  0x04 //!< Look up the action for the first data byte in a data1 table
+#define MIDI_FILTER_ACTION_COPY      0x08 //!< Also send a copy of the packet on the action's copy_cable
+
+/**
+ * @brief a stateful filter stage
+ *
+ * @param packet the 4-byte USB MIDI packet; the handler may modify it
+ * @return true if the packet should be forwarded, false to filter it out
+ */
+typedef bool (*midi_filter_handler_t)(uint8_t packet[4]);
+
+/**
+ * @brief take a copy of a packet a copy rule made
+ *
+ * @param packet the 4-byte USB MIDI packet with the new virtual cable number
+ */
+typedef void (*midi_filter_copy_t)(const uint8_t packet[4]);
+
+typedef struct {
+  uint8_t flags;        // MIDI_FILTER_ACTION_* bits
+  uint8_t data1;        // the new first data byte if flags has MIDI_FILTER_ACTION_SET_DATA1
+  uint8_t handler;      // 1-based index into handlers; 0 means no handler
+  uint8_t data1_table;  // index into data1_action if flags has MIDI_FILTER_ACTION_DISPATCH
+  uint8_t copy_cable;   // the virtual cable for the copy if flags has MIDI_FILTER_ACTION_COPY
+} midi_filter_action_t;
+
+typedef struct {
+  uint8_t status_action[16][128];   // (cable, status byte & 0x7f) -> 1-based index into actions; 0 means pass
+  uint8_t data1_action[MIDI_FILTER_TABLE_MAX_DATA1_TABLES][128]; // data1 -> 1-based index into actions; 0 means use the status action
+  midi_filter_action_t actions[MIDI_FILTER_TABLE_MAX_ACTIONS];
+  midi_filter_handler_t handlers[MIDI_FILTER_TABLE_MAX_HANDLERS];
+  midi_filter_copy_t copy;          // takes the copies the copy rules make
+  uint8_t nactions;
+  uint8_t ndata1_tables;
+  uint8_t nhandlers;
+} midi_filter_table_t;
+
+/**
+ * @brief initialize a filter table so it passes every packet unchanged
+ *
+ * @param table is a pointer to the structure to initialize
+ */
+void midi_filter_table_init(midi_filter_table_t* table);
+
+/**
+ * @brief register a stateful handler with the filter table
+ *
+ * @param table a pointer to the filter table
+ * @param handler the handler function
+ * @return uint8_t the handler ID to use with midi_filter_table_set_status_handler()
+ * or 0 if there is no room for another handler
+ */
+uint8_t midi_filter_table_add_handler(midi_filter_table_t* table, midi_filter_handler_t handler);
+
+/**
+ * @brief filter out all packets on a virtual cable with a given status byte
+ *
+ * @param table a pointer to the filter table
+ * @param cable the virtual cable number 0-15
+ * @param status the MIDI status byte 0x80-0xFF
+ * @return true if the rule was added, false if the table is full
+ */
+bool midi_filter_table_drop_status(midi_filter_table_t* table, uint8_t cable, uint8_t status);
+
+/**
+ * @brief call a stateful handler for all packets on a virtual cable with a given status byte
+ *
+ * Any data1 remap rules for the same cable and status byte are applied before the handler is called.
+ *
+ * @param table a pointer to the filter table
+ * @param cable the virtual cable number 0-15
+ * @param status the MIDI status byte 0x80-0xFF
+ * @param handler_id the ID midi_filter_table_add_handler() returned
+ * @return true if the rule was added, false if the table is full
+ */
+bool midi_filter_table_set_status_handler(midi_filter_table_t* table, uint8_t cable, uint8_t status, uint8_t handler_id);
+
+/**
+ * @brief replace the first data byte of a message (e.g., a note number) with another value
+ *
+ * @param table a pointer to the filter table
+ * @param cable the virtual cable number 0-15
+ * @param status the MIDI status byte 0x80-0xFF
+ * @param data1 the first data byte value to match 0-127
+ * @param new_data1 the replacement first data byte value 0-127
+ * @return true if the rule was added, false if the table is full
+ */
+bool midi_filter_table_remap_data1(midi_filter_table_t* table, uint8_t cable, uint8_t status, uint8_t data1, uint8_t new_data1);
+
+/**
+ * @brief filter out messages with a specific first data byte (e.g., a note number)
+ *
+ * @param table a pointer to the filter table
+ * @param cable the virtual cable number 0-15
+ * @param status the MIDI status byte 0x80-0xFF
+ * @param data1 the first data byte value to match 0-127
+ * @return true if the rule was added, false if the table is full
+ */
+bool midi_filter_table_drop_data1(midi_filter_table_t* table, uint8_t cable, uint8_t status, uint8_t data1);
+
+/**
+ * @brief set the function that takes the copies the copy rules make
+ *
+ * @param table a pointer to the filter table
+ * @param copy the function
+ */
+void midi_filter_table_set_copy_sink(midi_filter_table_t* table, midi_filter_copy_t copy);
+
+/**
+ * @brief send a copy of all packets on a virtual cable with a given status byte on another virtual cable
+ *
+ * The copy is made after any data1 remap and before any stateful handler runs.
+ *
+ * @param table a pointer to the filter table; call midi_filter_table_set_copy_sink() first
+ * @param cable the virtual cable number 0-15
+ * @param status the MIDI status byte 0x80-0xFF
+ * @param copy_cable the virtual cable number 0-15 for the copy
+ * @return true if the rule was added, false if the table is full
+ */
+bool midi_filter_table_copy_status(midi_filter_table_t* table, uint8_t cable, uint8_t status, uint8_t copy_cable);
+
+/**
+ * @brief send a copy of messages with a specific first data byte on another virtual cable
+ *
+ * @param table a pointer to the filter table; call midi_filter_table_set_copy_sink() first
+ * @param cable the virtual cable number 0-15
+ * @param status the MIDI status byte 0x80-0xFF
+ * @param data1 the first data byte value to match 0-127
+ * @param copy_cable the virtual cable number 0-15 for the copy
+ * @return true if the rule was added, false if the table is full
+ */
+bool midi_filter_table_copy_data1(midi_filter_table_t* table, uint8_t cable, uint8_t status, uint8_t data1, uint8_t copy_cable);
+
+/**
+ * @brief apply the compiled filter rules to a packet
+ *
+ * @param table a pointer to the filter table
+ * @param packet the 4-byte USB MIDI packet; it may be modified
+ * @return true if the packet should be forwarded, false if it is filtered out
+ */
+static inline bool midi_filter_table_apply(const midi_filter_table_t* table, uint8_t packet[4])
+{
+  if ((packet[1] & 0x80) == 0)
+    return true; // no status byte (e.g., SysEx data); nothing to match
+  uint8_t idx = table->status_action[packet[0] >> 4][packet[1] & 0x7f];
+  if (idx == 0)
+    return true;
+  const midi_filter_action_t* action = &table->actions[idx - 1];
+  if (action->flags & MIDI_FILTER_ACTION_DISPATCH) {
+    idx = table->data1_action[action->data1_table][packet[2] & 0x7f];
+    if (idx != 0)
+      action = &table->actions[idx - 1];
+  }
+  if (action->flags & MIDI_FILTER_ACTION_DROP)
+    return false;
+  if (action->flags & MIDI_FILTER_ACTION_SET_DATA1)
+    packet[2] = action->data1;
+  if (action->flags & MIDI_FILTER_ACTION_COPY) {
+    uint8_t copy[4] = {(uint8_t)((action->copy_cable << 4) | (packet[0] & 0xf)), packet[1], packet[2], packet[3]};
+    table->copy(copy);
+  }
+  if (action->handler)
+    return table->handlers[action->handler - 1](packet);
+  return true;
+}
+
+/**
+ * @brief apply the compiled filter rules to an array of packets in place
+ *
+ * @param table a pointer to the filter table
+ * @param packets the array of 4-byte USB MIDI packets. Packets that are
+ * filtered out are removed and the rest are compacted to the start of the
+ * array in their original order.
+ * @param npackets the number of packets in the array
+ * @return size_t the number of packets left in the array
+ */
+static inline size_t midi_filter_table_apply_batch(const midi_filter_table_t* table, uint32_t* packets, size_t npackets)
+{
+  size_t nkept = 0;
+  for (size_t idx = 0; idx < npackets; idx++) {
+    uint32_t packet = packets[idx];
+    if (midi_filter_table_apply(table, (uint8_t*)&packet))
+      packets[nkept++] = packet;
+  }
+  return nkept;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,87 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "midi_flush_policy.h"
+#include <stdio.h>
+#include <string.h>
+
+void midi_flush_policy_init(midi_flush_policy_t* policy, midi_flush_preset_t preset)
+{
+  memset(policy, 0, sizeof(*policy));
+  midi_flush_policy_set_preset(policy, preset);
+}
+
+void midi_flush_policy_set_preset(midi_flush_policy_t* policy, midi_flush_preset_t preset)
+{
+  uint32_t deadline_us = preset == MIDI_FLUSH_THROUGHPUT ? MIDI_FLUSH_THROUGHPUT_DEADLINE_US : 0;
+  __atomic_store_n(&policy->deadline_us, deadline_us, __ATOMIC_RELAXED);
+  __atomic_store_n(&policy->preset, preset, __ATOMIC_RELAXED);
+}
+
+const char* midi_flush_policy_preset_name(midi_flush_preset_t preset)
+{
+  switch (preset) {
+    case MIDI_FLUSH_LATENCY:
+      return "latency";
+    case MIDI_FLUSH_THROUGHPUT:
+      return "throughput";
+    default:
+      return "unknown";
+  }
+}
+
+bool midi_flush_policy_due(midi_flush_policy_t* policy, uint32_t now_us)
+{
+  if (policy->pending == 0)
+    return false;
+  if (policy->pending >= MIDI_FLUSH_FILL_PACKETS)
+    return true;
+  return now_us - policy->oldest_us >= __atomic_load_n(&policy->deadline_us, __ATOMIC_RELAXED);
+}
+
+void midi_flush_policy_flushed(midi_flush_policy_t* policy, uint32_t nbytes)
+{
+  if (nbytes == 0)
+    return; // the last transfer is still going; flush again on the next loop
+  uint32_t npackets = nbytes / 4;
+  if (policy->pending < MIDI_FLUSH_FILL_PACKETS)
+    ++policy->deadline_flushes;
+  ++policy->transfers;
+  policy->packets += npackets;
+  // the driver may not send everything in one transfer
+  policy->pending = npackets < policy->pending ? policy->pending - npackets : 0;
+}
+
+void midi_flush_policy_print(const char* name, const midi_flush_policy_t* policy)
+{
+  uint32_t transfers = policy->transfers;
+  uint32_t packets = policy->packets;
+  // packets per transfer with two decimal places
+  uint32_t average_x100 = transfers ? (uint32_t)(((uint64_t)packets * 100 + transfers / 2) / transfers) : 0;
+  printf("%s: policy=%s deadline=%lu us transfers=%lu packets=%lu packets/transfer=%lu.%02lu deadline flushes=%lu\r\n",
+      name, midi_flush_policy_preset_name(policy->preset), (unsigned long)policy->deadline_us,
+      (unsigned long)transfers, (unsigned long)packets, (unsigned long)(average_x100 / 100),
+      (unsigned long)(average_x100 % 100), (unsigned long)policy->deadline_flushes);
+}
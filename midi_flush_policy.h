@@ -0,0 +1,169 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_flush_policy.h
+ *
+ * This file contains the policy that decides when to flush the USB MIDI
+ * host driver's transmit FIFO to the MIDI device. Each flush starts a bulk
+ * OUT transfer, and every transfer costs a frame slot on the Pico-PIO-USB
+ * host, so flushing a packet at a time wastes bus time when the DAW sends
+ * a lot of data. The policy flushes when enough packets are waiting to fill
+ * a bulk packet or when the oldest waiting packet has waited longer than a
+ * deadline.
+ *
+ * Two presets set the fill level and deadline:
+ * - MIDI_FLUSH_LATENCY flushes as soon as any packet is waiting (deadline 0).
+ * - MIDI_FLUSH_THROUGHPUT waits up to MIDI_FLUSH_THROUGHPUT_DEADLINE_US for a
+ *   full bulk packet.
+ *
+ * The policy belongs to the core that owns the USB host stack. Another core
+ * may change the preset and read the statistics; each is a 32-bit word.
+ *
+ * To use this code:
+ * 1. Call midi_flush_policy_init() once for each MIDI device.
+ * 2. Call midi_flush_policy_written() after writing packets to the driver.
+ * 3. Once per task loop iteration, if midi_flush_policy_due() returns true,
+ *    flush the driver and pass the number of bytes it sent to midi_flush_policy_flushed().
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  MIDI_FLUSH_LATENCY,
+  MIDI_FLUSH_THROUGHPUT,
+  MIDI_FLUSH_NUM_PRESETS
+} midi_flush_preset_t;
+
+#ifndef MIDI_FLUSH_DEFAULT_PRESET
+#define MIDI_FLUSH_DEFAULT_PRESET MIDI_FLUSH_LATENCY
+#endif
+
+// Packets in one full-speed bulk packet (64 bytes)
+#ifndef MIDI_FLUSH_FILL_PACKETS
+#define MIDI_FLUSH_FILL_PACKETS 16
+#endif
+
+// Longest time a packet waits for the bulk packet to fill with the throughput
+// preset; a full-speed frame is 1000 us
+#ifndef MIDI_FLUSH_THROUGHPUT_DEADLINE_US
+#define MIDI_FLUSH_THROUGHPUT_DEADLINE_US 1000
+#endif
+
+typedef struct {
+  midi_flush_preset_t preset;
+  uint32_t deadline_us;     // flush when the oldest waiting packet has waited this long
+  uint32_t pending;         // packets written to the driver since the last flush
+  uint32_t oldest_us;       // when the oldest waiting packet was written
+  uint32_t transfers;       // number of flushes that started a transfer
+  uint32_t packets;         // number of packets those transfers carried
+  uint32_t deadline_flushes;// number of flushes because a packet reached the deadline
+} midi_flush_policy_t;
+
+/**
+ * @brief initialize the policy with nothing waiting and clear the statistics
+ *
+ * @param policy a pointer to the policy
+ * @param preset the preset to use
+ */
+void midi_flush_policy_init(midi_flush_policy_t* policy, midi_flush_preset_t preset);
+
+/**
+ * @brief change the preset
+ *
+ * @param policy a pointer to the policy
+ * @param preset the new preset
+ */
+void midi_flush_policy_set_preset(midi_flush_policy_t* policy, midi_flush_preset_t preset);
+
+/**
+ * @brief get a short name for a preset
+ *
+ * @param preset the preset
+ * @return const char* the name
+ */
+const char* midi_flush_policy_preset_name(midi_flush_preset_t preset);
+
+/**
+ * @brief note packets written to the driver's transmit FIFO
+ *
+ * @param policy a pointer to the policy
+ * @param npackets the number of packets the driver accepted
+ * @param now_us the current time in microseconds
+ */
+static inline void midi_flush_policy_written(midi_flush_policy_t* policy, uint32_t npackets, uint32_t now_us)
+{
+  if (npackets == 0)
+    return;
+  if (policy->pending == 0)
+    policy->oldest_us = now_us;
+  policy->pending += npackets;
+}
+
+/**
+ * @brief check if the driver's transmit FIFO should be flushed now
+ *
+ * @param policy a pointer to the policy
+ * @param now_us the current time in microseconds
+ * @return true if enough packets are waiting to fill a bulk packet or the
+ * oldest waiting packet has reached the deadline
+ */
+bool midi_flush_policy_due(midi_flush_policy_t* policy, uint32_t now_us);
+
+/**
+ * @brief note the result of a flush
+ *
+ * @param policy a pointer to the policy
+ * @param nbytes the number of bytes the flush sent; 0 if the driver was still
+ * busy with the last transfer, so the packets keep waiting
+ */
+void midi_flush_policy_flushed(midi_flush_policy_t* policy, uint32_t nbytes);
+
+/**
+ * @brief discard the waiting packet count (e.g., the MIDI device was unplugged)
+ *
+ * @param policy a pointer to the policy
+ */
+static inline void midi_flush_policy_clear(midi_flush_policy_t* policy)
+{
+  policy->pending = 0;
+}
+
+/**
+ * @brief print the preset and the transfer statistics using printf()
+ *
+ * @param name the name to print with the statistics
+ * @param policy a pointer to the policy
+ */
+void midi_flush_policy_print(const char* name, const midi_flush_policy_t* policy);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,196 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "midi_hub_router.h"
+#include <string.h>
+
+// Rebuild the composite cable totals and the MIDI OUT cable table from the reserved devices
+static void update_cable_tables(midi_hub_router_t* router)
+{
+  router->num_cables_in = 0;
+  router->num_cables_out = 0;
+  memset(router->out_slot, MIDI_HUB_NO_SLOT, sizeof(router->out_slot));
+  for (uint8_t slot = 0; slot < MIDI_HUB_MAX_DEVICES; slot++) {
+    midi_hub_device_t* device = &router->devices[slot];
+    if (!device->reserved)
+      continue;
+    if (device->in_base + device->num_cables_in > router->num_cables_in)
+      router->num_cables_in = device->in_base + device->num_cables_in;
+    if (device->out_base + device->num_cables_out > router->num_cables_out)
+      router->num_cables_out = device->out_base + device->num_cables_out;
+    for (uint8_t cable = 0; cable < device->num_cables_out; cable++)
+      router->out_slot[device->out_base + cable] = slot;
+  }
+}
+
+// Release the cables of unplugged devices and pack the rest from cable 0 in slot order
+static void compact(midi_hub_router_t* router)
+{
+  uint8_t in_base = 0;
+  uint8_t out_base = 0;
+  for (uint8_t slot = 0; slot < MIDI_HUB_MAX_DEVICES; slot++) {
+    midi_hub_device_t* device = &router->devices[slot];
+    if (device->dev_addr == 0)
+      device->reserved = false;
+    if (!device->reserved)
+      continue;
+    device->in_base = in_base;
+    device->out_base = out_base;
+    in_base += device->num_cables_in;
+    out_base += device->num_cables_out;
+  }
+  update_cable_tables(router);
+}
+
+void midi_hub_router_init(midi_hub_router_t* router)
+{
+  memset(router, 0, sizeof(*router));
+  memset(router->slot_of_addr, MIDI_HUB_NO_SLOT, sizeof(router->slot_of_addr));
+  memset(router->out_slot, MIDI_HUB_NO_SLOT, sizeof(router->out_slot));
+}
+
+uint8_t midi_hub_router_attach(midi_hub_router_t* router, uint8_t dev_addr, uint16_t vid, uint16_t pid,
+    uint8_t num_cables_in, uint8_t num_cables_out, bool* layout_changed)
+{
+  *layout_changed = false;
+  if (dev_addr == 0 || dev_addr > MIDI_HUB_MAX_ADDR || num_cables_in > MIDI_HUB_MAX_CABLES || num_cables_out > MIDI_HUB_MAX_CABLES)
+    return MIDI_HUB_NO_SLOT;
+  uint8_t slot;
+  // give the cables back to the same kind of device if it was unplugged
+  for (slot = 0; slot < MIDI_HUB_MAX_DEVICES; slot++) {
+    midi_hub_device_t* device = &router->devices[slot];
+    if (device->reserved && device->dev_addr == 0 && device->vid == vid && device->pid == pid &&
+        device->num_cables_in == num_cables_in && device->num_cables_out == num_cables_out)
+      break;
+  }
+  if (slot == MIDI_HUB_MAX_DEVICES) {
+    if (router->num_cables_in + num_cables_in > MIDI_HUB_MAX_CABLES ||
+        router->num_cables_out + num_cables_out > MIDI_HUB_MAX_CABLES) {
+      compact(router);
+      *layout_changed = true;
+    }
+    for (slot = 0; slot < MIDI_HUB_MAX_DEVICES && router->devices[slot].reserved; slot++) {
+    }
+    if (slot == MIDI_HUB_MAX_DEVICES) {
+      compact(router);
+      *layout_changed = true;
+      for (slot = 0; slot < MIDI_HUB_MAX_DEVICES && router->devices[slot].reserved; slot++) {
+      }
+    }
+    if (slot == MIDI_HUB_MAX_DEVICES || router->num_cables_in + num_cables_in > MIDI_HUB_MAX_CABLES ||
+        router->num_cables_out + num_cables_out > MIDI_HUB_MAX_CABLES) {
+      if (*layout_changed)
+        ++router->layout_changes;
+      return MIDI_HUB_NO_SLOT;
+    }
+    midi_hub_device_t* device = &router->devices[slot];
+    device->reserved = true;
+    device->vid = vid;
+    device->pid = pid;
+    device->in_base = router->num_cables_in;
+    device->num_cables_in = num_cables_in;
+    device->out_base = router->num_cables_out;
+    device->num_cables_out = num_cables_out;
+    update_cable_tables(router);
+    *layout_changed = true;
+    ++router->layout_changes;
+  }
+  router->devices[slot].dev_addr = dev_addr;
+  router->slot_of_addr[dev_addr] = slot;
+  return slot;
+}
+
+uint8_t midi_hub_router_detach(midi_hub_router_t* router, uint8_t dev_addr)
+{
+  uint8_t slot = midi_hub_router_slot(router, dev_addr);
+  if (slot == MIDI_HUB_NO_SLOT)
+    return slot;
+  router->slot_of_addr[dev_addr] = MIDI_HUB_NO_SLOT;
+  router->devices[slot].dev_addr = 0;
+  router->rx_pending &= ~(1u << slot);
+  return slot;
+}
+
+void midi_hub_router_set_rx_pending(midi_hub_router_t* router, uint8_t dev_addr)
+{
+  uint8_t slot = midi_hub_router_slot(router, dev_addr);
+  if (slot != MIDI_HUB_NO_SLOT)
+    router->rx_pending |= 1u << slot;
+}
+
+void midi_hub_router_clear_rx_pending(midi_hub_router_t* router, uint8_t dev_addr)
+{
+  uint8_t slot = midi_hub_router_slot(router, dev_addr);
+  if (slot != MIDI_HUB_NO_SLOT)
+    router->rx_pending &= ~(1u << slot);
+}
+
+uint8_t midi_hub_router_next_rx(midi_hub_router_t* router)
+{
+  if (router->rx_pending == 0)
+    return 0;
+  for (uint8_t idx = 0; idx < MIDI_HUB_MAX_DEVICES; idx++) {
+    uint8_t slot = (router->next_rx + idx) % MIDI_HUB_MAX_DEVICES;
+    if (router->rx_pending & (1u << slot)) {
+      router->next_rx = (slot + 1) % MIDI_HUB_MAX_DEVICES;
+      return router->devices[slot].dev_addr;
+    }
+  }
+  return 0;
+}
+
+size_t midi_hub_router_in(midi_hub_router_t* router, uint8_t dev_addr, uint32_t* packets, size_t npackets)
+{
+  uint8_t slot = midi_hub_router_slot(router, dev_addr);
+  if (slot == MIDI_HUB_NO_SLOT) {
+    router->dropped += npackets;
+    return 0;
+  }
+  const midi_hub_device_t* device = &router->devices[slot];
+  size_t nkept = 0;
+  for (size_t idx = 0; idx < npackets; idx++) {
+    uint8_t* packet = (uint8_t*)&packets[idx];
+    uint8_t cable = packet[0] >> 4;
+    if (cable >= device->num_cables_in) {
+      ++router->dropped;
+      continue;
+    }
+    packet[0] = (uint8_t)(((device->in_base + cable) << 4) | (packet[0] & 0xf));
+    packets[nkept++] = packets[idx];
+  }
+  return nkept;
+}
+
+uint8_t midi_hub_router_out(midi_hub_router_t* router, uint8_t packet[4])
+{
+  uint8_t cable = packet[0] >> 4;
+  uint8_t slot = router->out_slot[cable];
+  if (slot == MIDI_HUB_NO_SLOT || router->devices[slot].dev_addr == 0) {
+    ++router->dropped;
+    return MIDI_HUB_NO_SLOT;
+  }
+  packet[0] = (uint8_t)(((cable - router->devices[slot].out_base) << 4) | (packet[0] & 0xf));
+  return slot;
+}
@@ -0,0 +1,201 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_hub_router.h
+ *
+ * This file contains a router that merges several USB MIDI devices attached
+ * through a USB hub into one composite MIDI device with a virtual cable for
+ * each cable of each attached device. Each device gets a contiguous range of
+ * composite MIDI IN cables and a contiguous range of composite MIDI OUT
+ * cables, so routing a packet is one table lookup and a cable number add.
+ *
+ * A device that is unplugged keeps its cables reserved. If a device with
+ * the same VID, PID and number of cables is plugged in again, it gets the
+ * same cables back, so the composite device does not change and the DAW
+ * keeps its MIDI ports. Reserved cables are given up only when a new
+ * device needs the room.
+ *
+ * The router also picks which device to read next so that one busy device
+ * cannot starve the others: each device that has packets waiting gets to
+ * read one batch in turn.
+ *
+ * The router is not thread safe. Only the core that owns the USB host stack may use it.
+ *
+ * To use this code:
+ * 1. Call midi_hub_router_init() once.
+ * 2. When a MIDI device is mounted, call midi_hub_router_attach(). If the layout
+ *    changed, build new composite device descriptors from the router's devices[].
+ * 3. When a MIDI device is unmounted, call midi_hub_router_detach().
+ * 4. When a MIDI device has received packets, call midi_hub_router_set_rx_pending().
+ *    Then call midi_hub_router_next_rx() to get the device to read next, read one batch,
+ *    call midi_hub_router_clear_rx_pending() if the device has no more packets, and
+ *    call midi_hub_router_in() to move the packets to their composite cables.
+ *    Repeat until midi_hub_router_next_rx() returns 0.
+ * 5. For each packet from the USB host, call midi_hub_router_out() to find the
+ *    device it is for and move it to the device's cable.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MIDI_HUB_MAX_DEVICES
+#define MIDI_HUB_MAX_DEVICES 4
+#endif
+
+// USB MIDI 1.0 packets have a 4-bit cable number
+#define MIDI_HUB_MAX_CABLES 16
+
+// Largest USB device address the router can look up
+#define MIDI_HUB_MAX_ADDR 15
+
+#define MIDI_HUB_NO_SLOT 0xff
+
+typedef struct {
+  uint8_t dev_addr;       // USB device address, or 0 if the device is not attached
+  bool reserved;          // the device owns cables in the composite device
+  uint16_t vid;
+  uint16_t pid;
+  uint8_t in_base;        // first composite MIDI IN cable
+  uint8_t num_cables_in;  // number of cables from the device
+  uint8_t out_base;       // first composite MIDI OUT cable
+  uint8_t num_cables_out; // number of cables to the device
+} midi_hub_device_t;
+
+typedef struct {
+  midi_hub_device_t devices[MIDI_HUB_MAX_DEVICES];
+  uint8_t slot_of_addr[MIDI_HUB_MAX_ADDR + 1];   // device address -> slot in devices[]
+  uint8_t out_slot[MIDI_HUB_MAX_CABLES];         // composite MIDI OUT cable -> slot in devices[]
+  uint8_t num_cables_in;    // number of composite MIDI IN cables in use
+  uint8_t num_cables_out;   // number of composite MIDI OUT cables in use
+  uint8_t next_rx;          // the slot that reads first in the next round
+  uint16_t rx_pending;      // bit n set means the device in slot n has packets to read
+  uint32_t layout_changes;  // number of times the composite cables changed
+  uint32_t dropped;         // packets on a cable with no attached device
+} midi_hub_router_t;
+
+/**
+ * @brief initialize the router with no devices
+ *
+ * @param router a pointer to the router
+ */
+void midi_hub_router_init(midi_hub_router_t* router);
+
+/**
+ * @brief give a newly mounted MIDI device its composite cables
+ *
+ * @param router a pointer to the router
+ * @param dev_addr the USB device address
+ * @param vid the device's USB vendor ID
+ * @param pid the device's USB product ID
+ * @param num_cables_in the number of cables from the device
+ * @param num_cables_out the number of cables to the device
+ * @param layout_changed set true if the composite cables changed, false if
+ * the device got back cables it had before
+ * @return uint8_t the device's slot in router->devices[], or MIDI_HUB_NO_SLOT if
+ * the device does not fit
+ */
+uint8_t midi_hub_router_attach(midi_hub_router_t* router, uint8_t dev_addr, uint16_t vid, uint16_t pid,
+    uint8_t num_cables_in, uint8_t num_cables_out, bool* layout_changed);
+
+/**
+ * @brief note that a MIDI device was unmounted; its cables stay reserved
+ *
+ * @param router a pointer to the router
+ * @param dev_addr the USB device address
+ * @return uint8_t the device's slot in router->devices[], or MIDI_HUB_NO_SLOT if
+ * the router did not know the device
+ */
+uint8_t midi_hub_router_detach(midi_hub_router_t* router, uint8_t dev_addr);
+
+/**
+ * @brief get the slot of an attached device
+ *
+ * @param router a pointer to the router
+ * @param dev_addr the USB device address
+ * @return uint8_t the device's slot in router->devices[], or MIDI_HUB_NO_SLOT
+ */
+static inline uint8_t midi_hub_router_slot(const midi_hub_router_t* router, uint8_t dev_addr)
+{
+  return dev_addr <= MIDI_HUB_MAX_ADDR ? router->slot_of_addr[dev_addr] : MIDI_HUB_NO_SLOT;
+}
+
+/**
+ * @brief note that an attached device has received packets
+ *
+ * @param router a pointer to the router
+ * @param dev_addr the USB device address
+ */
+void midi_hub_router_set_rx_pending(midi_hub_router_t* router, uint8_t dev_addr);
+
+/**
+ * @brief note that an attached device has no more packets to read
+ *
+ * @param router a pointer to the router
+ * @param dev_addr the USB device address
+ */
+void midi_hub_router_clear_rx_pending(midi_hub_router_t* router, uint8_t dev_addr);
+
+/**
+ * @brief get the next device to read one batch of packets from, in round-robin order
+ *
+ * @param router a pointer to the router
+ * @return uint8_t the USB device address, or 0 if no device has packets to read
+ */
+uint8_t midi_hub_router_next_rx(midi_hub_router_t* router);
+
+/**
+ * @brief move packets from a device to their composite MIDI IN cables in place
+ *
+ * Packets on a cable the device did not declare are removed and the rest
+ * are moved to the start of the array in their original order.
+ *
+ * @param router a pointer to the router
+ * @param dev_addr the USB device address the packets came from
+ * @param packets the array of 4-byte USB MIDI packets
+ * @param npackets the number of packets in the array
+ * @return size_t the number of packets left in the array
+ */
+size_t midi_hub_router_in(midi_hub_router_t* router, uint8_t dev_addr, uint32_t* packets, size_t npackets);
+
+/**
+ * @brief find the device a packet on a composite MIDI OUT cable is for and
+ * move the packet to the device's cable
+ *
+ * @param router a pointer to the router
+ * @param packet the 4-byte USB MIDI packet
+ * @return uint8_t the device's slot in router->devices[], or MIDI_HUB_NO_SLOT if
+ * no attached device has the cable (the packet should be dropped)
+ */
+uint8_t midi_hub_router_out(midi_hub_router_t* router, uint8_t packet[4]);
+
+#ifdef __cplusplus
+}
+#endif
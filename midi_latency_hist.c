@@ -0,0 +1,73 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "midi_latency_hist.h"
+#include <stdio.h>
+#include <string.h>
+
+void midi_latency_hist_init(midi_latency_hist_t* hist)
+{
+  memset(hist, 0, sizeof(*hist));
+  hist->min_us = UINT32_MAX;
+}
+
+static uint32_t bucket_upper_bound(uint32_t bucket)
+{
+  return bucket == 0 ? 0 : (1ul << bucket) - 1;
+}
+
+uint32_t midi_latency_hist_percentile(const midi_latency_hist_t* hist, uint32_t percent)
+{
+  uint32_t count = hist->count;
+  if (count == 0)
+    return 0;
+  if (percent > 100)
+    percent = 100;
+  // the rank of the percentile sample, rounded up, 1-based
+  uint32_t rank = (uint32_t)(((uint64_t)count * percent + 99) / 100);
+  if (rank == 0)
+    rank = 1;
+  uint32_t total = 0;
+  for (uint32_t bucket = 0; bucket < MIDI_LATENCY_HIST_NBUCKETS; bucket++) {
+    total += hist->buckets[bucket];
+    if (total >= rank) {
+      uint32_t bound = bucket_upper_bound(bucket);
+      return bound < hist->max_us ? bound : hist->max_us;
+    }
+  }
+  return hist->max_us;
+}
+
+void midi_latency_hist_print(const char* name, const midi_latency_hist_t* hist)
+{
+  printf("%s latency: count=%lu min=%luus max=%luus p50<=%luus p99<=%luus\r\n", name,
+      (unsigned long)hist->count, (unsigned long)(hist->count ? hist->min_us : 0), (unsigned long)hist->max_us,
+      (unsigned long)midi_latency_hist_percentile(hist, 50), (unsigned long)midi_latency_hist_percentile(hist, 99));
+  for (uint32_t bucket = 0; bucket < MIDI_LATENCY_HIST_NBUCKETS; bucket++) {
+    if (hist->buckets[bucket] != 0) {
+      printf("  <=%8luus: %lu\r\n", (unsigned long)bucket_upper_bound(bucket), (unsigned long)hist->buckets[bucket]);
+    }
+  }
+}
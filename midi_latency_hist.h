@@ -0,0 +1,105 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_latency_hist.h
+ *
+ * This file contains a log2-bucketed latency histogram. Each sample is
+ * the number of microseconds a packet spent inside the Pico. Adding a
+ * sample costs a count-leading-zeros instruction and a few increments,
+ * so it is cheap enough to do for every packet.
+ *
+ * Bucket 0 counts samples of 0 us. Bucket k > 0 counts samples from
+ * 2^(k-1) us through 2^k - 1 us. The last bucket also counts all longer
+ * samples. Percentiles are reported as the upper bound of the bucket
+ * that holds the percentile sample, clamped to the maximum sample.
+ *
+ * Only one core may add samples to a histogram. Any core may read it;
+ * the statistics are 32-bit words, so a reader sees each one whole.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MIDI_LATENCY_HIST_NBUCKETS 24 // the last bucket starts at 2^22 us (about 4 seconds)
+
+typedef struct {
+  uint32_t buckets[MIDI_LATENCY_HIST_NBUCKETS];
+  uint32_t count;   // total number of samples
+  uint32_t min_us;  // shortest sample; UINT32_MAX if there are no samples
+  uint32_t max_us;  // longest sample
+} midi_latency_hist_t;
+
+/**
+ * @brief initialize a histogram with no samples
+ *
+ * @param hist a pointer to the histogram to initialize
+ */
+void midi_latency_hist_init(midi_latency_hist_t* hist);
+
+/**
+ * @brief add a latency sample to the histogram
+ *
+ * @param hist a pointer to the histogram
+ * @param latency_us the latency in microseconds
+ */
+static inline void midi_latency_hist_add(midi_latency_hist_t* hist, uint32_t latency_us)
+{
+  uint32_t bucket = latency_us == 0 ? 0 : 32 - __builtin_clz(latency_us);
+  if (bucket >= MIDI_LATENCY_HIST_NBUCKETS)
+    bucket = MIDI_LATENCY_HIST_NBUCKETS - 1;
+  ++hist->buckets[bucket];
+  ++hist->count;
+  if (latency_us < hist->min_us)
+    hist->min_us = latency_us;
+  if (latency_us > hist->max_us)
+    hist->max_us = latency_us;
+}
+
+/**
+ * @brief estimate a latency percentile from the histogram
+ *
+ * @param hist a pointer to the histogram
+ * @param percent the percentile 0-100
+ * @return uint32_t the upper bound in microseconds of the bucket that holds
+ * the percentile sample, or 0 if the histogram has no samples
+ */
+uint32_t midi_latency_hist_percentile(const midi_latency_hist_t* hist, uint32_t percent);
+
+/**
+ * @brief print the histogram statistics and non-empty buckets with printf()
+ *
+ * @param name the name to print in front of the statistics
+ * @param hist a pointer to the histogram
+ */
+void midi_latency_hist_print(const char* name, const midi_latency_hist_t* hist);
+
+#ifdef __cplusplus
+}
+#endif
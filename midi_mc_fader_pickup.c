@@ -25,12 +25,51 @@
 
 #include "midi_mc_fader_pickup.h"
 #include <stdio.h>
+
+static uint32_t mc_fader_pickup_pack(mc_fader_pickup_state_t state, uint16_t daw, uint16_t fader, bool pending)
+{
+  return ((uint32_t)daw << MC_FADER_PICKUP_DAW_SHIFT) | ((uint32_t)fader << MC_FADER_PICKUP_FADER_SHIFT) |
+      ((uint32_t)state << MC_FADER_PICKUP_STATE_SHIFT) | (pending ? MC_FADER_PICKUP_PENDING : 0);
+}
+
 void mc_fader_pickup_init(mc_fader_pickup_t* pickup, uint16_t sync_delta)
 {
-  pickup->state = MC_FADER_PICKUP_RESET;
+  __atomic_store_n(&pickup->word, mc_fader_pickup_pack(MC_FADER_PICKUP_RESET, 0, 0, false), __ATOMIC_RELEASE);
   pickup->sync_delta = sync_delta;
-  pickup->daw = 0;
-  pickup->fader = 0; 
+  pickup->deadband = 0;
+  pickup->hysteresis = 0;
+  pickup->sent = 0;
+  pickup->direction = 0;
+  pickup->suppressed = 0;
+}
+
+void mc_fader_pickup_set_deadband(mc_fader_pickup_t* pickup, uint16_t deadband, uint16_t hysteresis)
+{
+  pickup->deadband = deadband;
+  pickup->hysteresis = hysteresis;
+}
+
+void mc_fader_pickup_set_sync_delta(mc_fader_pickup_t* pickup, uint16_t sync_delta)
+{
+  __atomic_store_n(&pickup->sync_delta, sync_delta, __ATOMIC_RELAXED);
+}
+
+bool mc_fader_pickup_has_pending_value(const mc_fader_pickup_t* pickup)
+{
+  return (mc_fader_pickup_load(pickup) & MC_FADER_PICKUP_PENDING) != 0;
+}
+
+bool mc_fader_pickup_take_pending_value(mc_fader_pickup_t* pickup, uint16_t* hw_fader_value)
+{
+  uint32_t word = mc_fader_pickup_load(pickup);
+  do {
+    if (!(word & MC_FADER_PICKUP_PENDING))
+      return false;
+  } while (!__atomic_compare_exchange_n(&pickup->word, &word, word & ~MC_FADER_PICKUP_PENDING, true,
+      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  pickup->sent = mc_fader_pickup_word_fader(word);
+  *hw_fader_value = pickup->sent;
+  return true;
 }
 
 uint16_t mc_fader_extract_value(uint8_t packet[4])
@@ -49,91 +88,128 @@ static bool mc_fader_state_is_synchronized(mc_fader_pickup_state_t state)
   return state == MC_FADER_PICKUP_SYNCED;
 }
 
-bool mc_fader_pickup_set_daw_fader_value(mc_fader_pickup_t* pickup, uint16_t daw_fader_value)
+// The state after the DAW sends a new fader value
+static mc_fader_pickup_state_t mc_fader_daw_transition(mc_fader_pickup_state_t state, uint16_t fader,
+    uint16_t daw_fader_value, uint16_t sync_delta)
 {
-  mc_fader_pickup_state_t next_state = pickup->state; // assume state will not change
-  int16_t delta = (int16_t)daw_fader_value - (int16_t)pickup->fader;
-  pickup->daw = daw_fader_value;
-  switch(pickup->state)
+  int16_t delta = (int16_t)daw_fader_value - (int16_t)fader;
+  switch(state)
   {
     case MC_FADER_PICKUP_RESET:
     case MC_FADER_PICKUP_HW_UNKNOWN:
-      next_state = MC_FADER_PICKUP_HW_UNKNOWN;
-      break;
+      return MC_FADER_PICKUP_HW_UNKNOWN;
 
     default: // both DAW fader value and Hardware fader value are known
     {
       uint16_t abs_delta = delta;
       if (delta < 0)
         abs_delta = -delta;
-      if (abs_delta < pickup->sync_delta)
-      {
-        next_state = MC_FADER_PICKUP_SYNCED;
-      }
-      else if (delta < 0)
-      {
-        next_state = MC_FADER_PICKUP_TOO_HIGH;
-      }
-      else
-      {
-        next_state = MC_FADER_PICKUP_TOO_LOW;
-      }
+      if (abs_delta < sync_delta)
+        return MC_FADER_PICKUP_SYNCED;
+      if (delta < 0)
+        return MC_FADER_PICKUP_TOO_HIGH;
+      return MC_FADER_PICKUP_TOO_LOW;
     }
   }
-  pickup->state = next_state;
+}
+
+bool mc_fader_pickup_set_daw_fader_value(mc_fader_pickup_t* pickup, uint16_t daw_fader_value)
+{
+  uint16_t sync_delta = __atomic_load_n(&pickup->sync_delta, __ATOMIC_RELAXED);
+  uint32_t word = mc_fader_pickup_load(pickup);
+  mc_fader_pickup_state_t next_state;
+  uint32_t next;
+  do {
+    uint16_t fader = mc_fader_pickup_word_fader(word);
+    next_state = mc_fader_daw_transition(mc_fader_pickup_word_state(word), fader, daw_fader_value, sync_delta);
+    // if the DAW moved away from the hardware fader, there is nothing to send
+    bool pending = mc_fader_state_is_synchronized(next_state) && (word & MC_FADER_PICKUP_PENDING);
+    next = mc_fader_pickup_pack(next_state, daw_fader_value, fader, pending);
+  } while (!__atomic_compare_exchange_n(&pickup->word, &word, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
   return mc_fader_state_is_synchronized(next_state);
 }
 
-bool mc_fader_pickup_set_hw_fader_value(mc_fader_pickup_t* pickup, uint16_t hw_fader_value)
+// The state after the control surface sends a new fader value
+static mc_fader_pickup_state_t mc_fader_hw_transition(mc_fader_pickup_state_t state, uint16_t daw,
+    uint16_t hw_fader_value, uint16_t sync_delta)
 {
-  int16_t delta = (int16_t)hw_fader_value - (int16_t)pickup->daw;
+  int16_t delta = (int16_t)hw_fader_value - (int16_t)daw;
   uint16_t abs_delta = delta;
-  mc_fader_pickup_state_t next_state = pickup->state; // assume state will not change
   if (delta < 0)
-  abs_delta = -delta;
-  switch(pickup->state)
+    abs_delta = -delta;
+  switch(state)
   {
     case MC_FADER_PICKUP_RESET:
     case MC_FADER_PICKUP_DAW_UNKNOWN:
-      next_state = MC_FADER_PICKUP_DAW_UNKNOWN;
-      break;
+      return MC_FADER_PICKUP_DAW_UNKNOWN;
     case MC_FADER_PICKUP_SYNCED:
-      break;
+      return MC_FADER_PICKUP_SYNCED;
     case MC_FADER_PICKUP_TOO_HIGH:
-      if (abs_delta < pickup->sync_delta)
-        next_state = MC_FADER_PICKUP_SYNCED;
-      else if (delta < 0) {
-          // previous fader value was higher than the DAW fader value, and now is
-          // lower, so the hardware fader must have moved past the DAW value
-          next_state = MC_FADER_PICKUP_SYNCED;
-      }
-      // otherwise, still too high
-      break;
+      // if the previous fader value was higher than the DAW fader value and now is
+      // lower, the hardware fader must have moved past the DAW value
+      if (abs_delta < sync_delta || delta < 0)
+        return MC_FADER_PICKUP_SYNCED;
+      return state; // still too high
     case MC_FADER_PICKUP_TOO_LOW:
-      if (abs_delta < pickup->sync_delta)
-        next_state = MC_FADER_PICKUP_SYNCED;
-      else if (delta > 0) {
-          // previous fader value was lower than the DAW fader value, and now is
-          // higher, so the hardware fader must have moved past the DAW value
-          next_state = MC_FADER_PICKUP_SYNCED;
-      }
-      // otherwise, still too low
-      break;
+      // if the previous fader value was lower than the DAW fader value and now is
+      // higher, the hardware fader must have moved past the DAW value
+      if (abs_delta < sync_delta || delta > 0)
+        return MC_FADER_PICKUP_SYNCED;
+      return state; // still too low
     case MC_FADER_PICKUP_HW_UNKNOWN:
-      if (abs_delta < pickup->sync_delta)
-        next_state = MC_FADER_PICKUP_SYNCED;
-      else if (delta > 0)
-        next_state = MC_FADER_PICKUP_TOO_HIGH;
-      else
-        next_state = MC_FADER_PICKUP_TOO_LOW;
-      break;
+      if (abs_delta < sync_delta)
+        return MC_FADER_PICKUP_SYNCED;
+      if (delta > 0)
+        return MC_FADER_PICKUP_TOO_HIGH;
+      return MC_FADER_PICKUP_TOO_LOW;
     default:
-      printf("unknown pickup state %u\r\n", pickup->state);
-      next_state = MC_FADER_PICKUP_RESET;
-      break;
+      return MC_FADER_PICKUP_RESET;
   }
-  pickup->state = next_state;
-  pickup->fader = hw_fader_value;
-  return mc_fader_state_is_synchronized(next_state);
 }
 
+// Decide if a synchronized hardware fader value should go to the DAW. It only
+// reads the fields the hardware fader core owns, so the caller may retry it.
+static bool mc_fader_deadband_passes(const mc_fader_pickup_t* pickup, uint16_t hw_fader_value, bool just_synced)
+{
+  if (just_synced || pickup->deadband == 0)
+    return true;
+  int16_t delta = (int16_t)hw_fader_value - (int16_t)pickup->sent;
+  uint16_t abs_delta = delta < 0 ? -delta : delta;
+  uint16_t threshold = pickup->deadband;
+  if ((delta > 0 && pickup->direction < 0) || (delta < 0 && pickup->direction > 0))
+    threshold += pickup->hysteresis;
+  return abs_delta >= threshold;
+}
+
+bool mc_fader_pickup_set_hw_fader_value(mc_fader_pickup_t* pickup, uint16_t hw_fader_value)
+{
+  uint16_t sync_delta = __atomic_load_n(&pickup->sync_delta, __ATOMIC_RELAXED);
+  uint32_t word = mc_fader_pickup_load(pickup);
+  mc_fader_pickup_state_t state, next_state;
+  bool passes;
+  uint32_t next;
+  do {
+    state = mc_fader_pickup_word_state(word);
+    next_state = mc_fader_hw_transition(state, mc_fader_pickup_word_daw(word), hw_fader_value, sync_delta);
+    bool pending = (word & MC_FADER_PICKUP_PENDING) != 0;
+    passes = false;
+    if (mc_fader_state_is_synchronized(next_state)) {
+      passes = mc_fader_deadband_passes(pickup, hw_fader_value, !mc_fader_state_is_synchronized(state));
+      pending = !passes && hw_fader_value != pickup->sent;
+    }
+    next = mc_fader_pickup_pack(next_state, mc_fader_pickup_word_daw(word), hw_fader_value, pending);
+  } while (!__atomic_compare_exchange_n(&pickup->word, &word, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  if (next_state == MC_FADER_PICKUP_RESET && state != MC_FADER_PICKUP_RESET)
+    printf("unknown pickup state %u\r\n", state);
+  if (!mc_fader_state_is_synchronized(next_state))
+    return false;
+  if (!passes) {
+    ++pickup->suppressed;
+    return false;
+  }
+  int16_t delta = (int16_t)hw_fader_value - (int16_t)pickup->sent;
+  if (delta != 0)
+    pickup->direction = delta > 0 ? 1 : -1;
+  pickup->sent = hw_fader_value;
+  return true;
+}
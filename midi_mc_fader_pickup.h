@@ -52,6 +52,27 @@
  * mc_fader_pickup_set_hw_fader_value() and note the return value. If the return value value was true, send
  * the fader move message to the DAW because the fader is in sync with the value the DAW thinks it should have.
  * Otherwise, do not send the fader move message to the DAW.
+ *
+ * Non-motorized faders on inexpensive control surfaces often chatter by a few LSBs while
+ * they sit still. To keep the chatter from flooding the DAW with fader moves, call
+ * mc_fader_pickup_set_deadband() after mc_fader_pickup_init(). Once the fader is in sync,
+ * mc_fader_pickup_set_hw_fader_value() returns false for changes smaller than the deadband
+ * relative to the last value it let through. A change that reverses the fader direction
+ * must also exceed the hysteresis. To make sure the DAW always gets the value where the
+ * fader came to rest, periodically check mc_fader_pickup_has_pending_value() and, once
+ * the fader has not moved for a while, send the value mc_fader_pickup_take_pending_value()
+ * returns.
+ *
+ * The DAW fader values and the hardware fader values usually arrive on different cores.
+ * The pickup state, both fader values and the pending flag are packed into one 32-bit
+ * word that each function updates with a compare-and-swap loop, so
+ * mc_fader_pickup_set_daw_fader_value() may run on one core while the hardware fader
+ * functions run on the other, with no lock and without disabling interrupts. The
+ * hardware fader functions, mc_fader_pickup_set_hw_fader_value() and
+ * mc_fader_pickup_take_pending_value(), must all run on the same core. Call
+ * mc_fader_pickup_init() before either core uses the structure. After that, call
+ * mc_fader_pickup_set_deadband() only from the hardware fader core;
+ * mc_fader_pickup_set_sync_delta() may be called from either core.
  */
 #pragma once
 #include <stdint.h>
@@ -69,13 +90,46 @@ typedef enum {
   MC_FADER_PICKUP_SYNCED
 } mc_fader_pickup_state_t;
 
+// The fields of mc_fader_pickup_t.word
+#define MC_FADER_PICKUP_DAW_SHIFT     0
+#define MC_FADER_PICKUP_FADER_SHIFT   14
+#define MC_FADER_PICKUP_STATE_SHIFT   28
+#define MC_FADER_PICKUP_VALUE_MASK    0x3fffu
+#define MC_FADER_PICKUP_STATE_MASK    0x7u
+#define MC_FADER_PICKUP_PENDING       (1u << 31)
+
 typedef struct {
-  mc_fader_pickup_state_t state;  // the current pickup state of the fader
-  uint16_t daw;                   // the last fader value the DAW sent (14-bits, unsigned)
-  uint16_t fader;                 // the last fader value the control surface sent (14-bits, unsigned)
-  uint16_t sync_delta;            // the minimum difference between the fader values before they are considered "equal" (14-bits, unsigned)
+  uint32_t word;                  // the state, DAW value, fader value and pending flag; change it only by compare-and-swap
+  uint16_t sync_delta;            // the minimum difference between the fader values before they are considered "equal" (14-bits, unsigned); see mc_fader_pickup_set_sync_delta()
+  uint16_t deadband;              // suppress synchronized fader changes smaller than this (14-bits, unsigned; 0 disables)
+  uint16_t hysteresis;            // the extra change needed when the fader reverses direction (14-bits, unsigned)
+  uint16_t sent;                  // the last hardware fader value that was let through to the DAW; hardware fader core only
+  int8_t direction;               // direction of the last change let through: 1 up, -1 down, 0 unknown; hardware fader core only
+  uint32_t suppressed;            // number of fader move messages the deadband suppressed; hardware fader core only
 } mc_fader_pickup_t;
 
+// Get a consistent snapshot of the state, fader values and pending flag
+static inline uint32_t mc_fader_pickup_load(const mc_fader_pickup_t* pickup)
+{
+  return __atomic_load_n(&pickup->word, __ATOMIC_ACQUIRE);
+}
+
+// Decode a snapshot of mc_fader_pickup_t.word
+static inline mc_fader_pickup_state_t mc_fader_pickup_word_state(uint32_t word)
+{
+  return (mc_fader_pickup_state_t)((word >> MC_FADER_PICKUP_STATE_SHIFT) & MC_FADER_PICKUP_STATE_MASK);
+}
+
+static inline uint16_t mc_fader_pickup_word_daw(uint32_t word)
+{
+  return (word >> MC_FADER_PICKUP_DAW_SHIFT) & MC_FADER_PICKUP_VALUE_MASK;
+}
+
+static inline uint16_t mc_fader_pickup_word_fader(uint32_t word)
+{
+  return (word >> MC_FADER_PICKUP_FADER_SHIFT) & MC_FADER_PICKUP_VALUE_MASK;
+}
+
 /**
  * @brief initialize a mc_fader_pickup structure
  * 
@@ -85,6 +139,46 @@ typedef struct {
  */
 void mc_fader_pickup_init(mc_fader_pickup_t* pickup, uint16_t sync_delta);
 
+/**
+ * @brief set the deadband and hysteresis for a synchronized fader
+ *
+ * @param pickup a pointer to a mc_fader_pickupt_t structure
+ * @param deadband the unsigned 14-bit fader value change that must be exceeded before
+ * a new fader value is sent to the DAW; 0 disables the deadband
+ * @param hysteresis the additional unsigned 14-bit change that must be exceeded
+ * when the fader reverses direction
+ */
+void mc_fader_pickup_set_deadband(mc_fader_pickup_t* pickup, uint16_t deadband, uint16_t hysteresis);
+
+/**
+ * @brief change the fader value difference that is close enough to call the fader in sync with the DAW
+ *
+ * Each fader value update uses either the old or the new value, never a mix.
+ *
+ * @param pickup a pointer to a mc_fader_pickupt_t structure
+ * @param sync_delta the unsigned 14-bit absolute fader value difference
+ */
+void mc_fader_pickup_set_sync_delta(mc_fader_pickup_t* pickup, uint16_t sync_delta);
+
+/**
+ * @brief check if the deadband suppressed the most recent hardware fader value
+ *
+ * @param pickup a pointer to a mc_fader_pickupt_t structure
+ * @return true if the DAW has not been sent the most recent hardware fader value
+ */
+bool mc_fader_pickup_has_pending_value(const mc_fader_pickup_t* pickup);
+
+/**
+ * @brief get the most recent hardware fader value the deadband suppressed and mark it sent
+ *
+ * Call this once the fader has stopped moving so the DAW gets the final resting value.
+ *
+ * @param pickup a pointer to a mc_fader_pickupt_t structure
+ * @param hw_fader_value the 14-bit unsigned hardware fader value to send to the DAW
+ * @return true if there was a pending value to send
+ */
+bool mc_fader_pickup_take_pending_value(mc_fader_pickup_t* pickup, uint16_t* hw_fader_value);
+
 /**
  * @brief get the 14-bit unsigned fader value from the pitch bend USB MIDI packet
  * 
@@ -119,7 +213,8 @@ bool mc_fader_pickup_set_daw_fader_value(mc_fader_pickup_t* pickup, uint16_t daw
  * 
  * @param pickup a pointer to a mc_fader_pickupt_t structure
  * @param hw_fader_value the 14-bit unsigned hardware fader value
- * @return true if setting the hardware fader causes the hardware fader and DAW fader to be in sync
+ * @return true if the hardware fader and DAW fader are in sync and the change
+ * is not suppressed by the deadband
  */
 bool mc_fader_pickup_set_hw_fader_value(mc_fader_pickup_t* pickup, uint16_t hw_fader_value);
 
@@ -0,0 +1,126 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "midi_note_map.h"
+#include <string.h>
+
+// The velocity curves for note-on velocities 1-127; a velocity of 0 is a note-off and stays 0
+#define CURVE_LINEAR(v)      (v)
+#define CURVE_EXPONENTIAL(v) (((v) * (v) + 126) / 127)
+#define CURVE_COMPRESSED(v)  (64 + (v) / 2)
+#define CURVE_FIXED(v)       MIDI_NOTE_MAP_FIXED_VELOCITY
+#define CURVE_ENTRY(curve, v) ((v) == 0 ? 0 : curve(v))
+#define CURVE_8(curve, v) CURVE_ENTRY(curve, (v)), CURVE_ENTRY(curve, (v) + 1), CURVE_ENTRY(curve, (v) + 2), \
+    CURVE_ENTRY(curve, (v) + 3), CURVE_ENTRY(curve, (v) + 4), CURVE_ENTRY(curve, (v) + 5), \
+    CURVE_ENTRY(curve, (v) + 6), CURVE_ENTRY(curve, (v) + 7)
+#define CURVE_128(curve) {CURVE_8(curve, 0), CURVE_8(curve, 8), CURVE_8(curve, 16), CURVE_8(curve, 24), \
+    CURVE_8(curve, 32), CURVE_8(curve, 40), CURVE_8(curve, 48), CURVE_8(curve, 56), \
+    CURVE_8(curve, 64), CURVE_8(curve, 72), CURVE_8(curve, 80), CURVE_8(curve, 88), \
+    CURVE_8(curve, 96), CURVE_8(curve, 104), CURVE_8(curve, 112), CURVE_8(curve, 120)}
+
+static const uint8_t velocity_curves[MIDI_NOTE_MAP_NUM_CURVES][128] = {
+  [MIDI_NOTE_MAP_CURVE_LINEAR] = CURVE_128(CURVE_LINEAR),
+  [MIDI_NOTE_MAP_CURVE_EXPONENTIAL] = CURVE_128(CURVE_EXPONENTIAL),
+  [MIDI_NOTE_MAP_CURVE_COMPRESSED] = CURVE_128(CURVE_COMPRESSED),
+  [MIDI_NOTE_MAP_CURVE_FIXED] = CURVE_128(CURVE_FIXED),
+};
+
+void midi_note_map_init(midi_note_map_t* map)
+{
+  memset(map->lut_of, 0, sizeof(map->lut_of));
+  map->nluts = 0;
+}
+
+// Get the tables for the cable and channel; create tables that pass every note unchanged if there are none
+static midi_note_map_lut_t* get_lut(midi_note_map_t* map, uint8_t cable, uint8_t chan)
+{
+  if (cable >= MIDI_NOTE_MAP_CABLES || chan > 15)
+    return NULL;
+  uint8_t* entry = &map->lut_of[cable][chan];
+  if (*entry != 0)
+    return &map->luts[*entry - 1];
+  if (map->nluts >= MIDI_NOTE_MAP_MAX_MAPS)
+    return NULL;
+  midi_note_map_lut_t* lut = &map->luts[map->nluts++];
+  *entry = map->nluts;
+  for (uint8_t note = 0; note < 128; note++) {
+    lut->note[note] = note;
+    lut->chan[note] = chan;
+  }
+  memcpy(lut->velocity, velocity_curves[MIDI_NOTE_MAP_CURVE_LINEAR], sizeof(lut->velocity));
+  return lut;
+}
+
+bool midi_note_map_set_notes(midi_note_map_t* map, uint8_t cable, uint8_t chan, uint8_t lo, uint8_t hi,
+    int8_t transpose, uint8_t new_chan)
+{
+  if (lo > hi || hi > 0x7f || new_chan > 15)
+    return false;
+  midi_note_map_lut_t* lut = get_lut(map, cable, chan);
+  if (lut == NULL)
+    return false;
+  for (uint8_t note = lo; note <= hi; note++) {
+    int16_t new_note = note + transpose;
+    lut->note[note] = new_note < 0 || new_note > 0x7f ? MIDI_NOTE_MAP_DROP : new_note;
+    lut->chan[note] = new_chan;
+  }
+  return true;
+}
+
+bool midi_note_map_drop_notes(midi_note_map_t* map, uint8_t cable, uint8_t chan, uint8_t lo, uint8_t hi)
+{
+  if (lo > hi || hi > 0x7f)
+    return false;
+  midi_note_map_lut_t* lut = get_lut(map, cable, chan);
+  if (lut == NULL)
+    return false;
+  for (uint8_t note = lo; note <= hi; note++)
+    lut->note[note] = MIDI_NOTE_MAP_DROP;
+  return true;
+}
+
+bool midi_note_map_set_velocity(midi_note_map_t* map, uint8_t cable, uint8_t chan, midi_note_map_curve_t curve)
+{
+  if (curve >= MIDI_NOTE_MAP_NUM_CURVES)
+    return false;
+  midi_note_map_lut_t* lut = get_lut(map, cable, chan);
+  if (lut == NULL)
+    return false;
+  memcpy(lut->velocity, velocity_curves[curve], sizeof(lut->velocity));
+  return true;
+}
+
+void midi_note_map_state_init(midi_note_map_state_t* state)
+{
+  memset(state, 0, sizeof(*state));
+}
+
+const char* midi_note_map_curve_name(midi_note_map_curve_t curve)
+{
+  static const char* names[MIDI_NOTE_MAP_NUM_CURVES] = {"linear", "exponential", "compressed", "fixed"};
+  if (curve >= MIDI_NOTE_MAP_NUM_CURVES)
+    return "unknown";
+  return names[curve];
+}
@@ -0,0 +1,239 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_note_map.h
+ *
+ * This file contains a note-processing stage for transposing notes,
+ * splitting the keyboard across MIDI channels and re-scaling note-on
+ * velocity. The mapping for each (virtual cable, MIDI channel) is a set of
+ * precomputed 128-entry lookup tables: one maps the note number to the new
+ * note number and channel, and one maps the note-on velocity to the new
+ * velocity. The velocity curves are built at compile time. Mapping a note
+ * costs two table loads no matter how the tables were made.
+ *
+ * The tables may be replaced while notes are sounding (e.g., to move a
+ * split point mid-performance). Every note-on is recorded with the note and
+ * channel it was sent as, and its note-off and poly pressure messages go out
+ * with that same note and channel, so changing the tables never leaves a
+ * stuck note. A note that is struck again before its note-off keeps its
+ * first mapping for the same reason.
+ *
+ * To use this code:
+ * 1. Create a midi_note_map_t for the tables and call midi_note_map_init() to
+ *    initialize it so it passes every note unchanged
+ * 2. Add mappings with midi_note_map_set_notes(), midi_note_map_drop_notes()
+ *    and midi_note_map_set_velocity()
+ * 3. Create a midi_note_map_state_t for the sounding notes and call
+ *    midi_note_map_state_init() to initialize it
+ * 4. For each packet, call midi_note_map_apply() and only forward the packet
+ *    if it returns true, or call midi_note_map_apply_batch() for an array of packets.
+ *    Use the same state with every table that replaces the tables before it.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MIDI_NOTE_MAP_CABLES
+// Notes on virtual cables 0 to MIDI_NOTE_MAP_CABLES - 1 can be mapped. Each
+// cable costs 4 kBytes of RAM for the sounding notes
+#define MIDI_NOTE_MAP_CABLES 1
+#endif
+
+#ifndef MIDI_NOTE_MAP_MAX_MAPS
+// The number of (cable, channel) pairs that can have a mapping
+#define MIDI_NOTE_MAP_MAX_MAPS 4
+#endif
+
+#ifndef MIDI_NOTE_MAP_FIXED_VELOCITY
+// The velocity of every note-on with MIDI_NOTE_MAP_CURVE_FIXED 1-127
+#define MIDI_NOTE_MAP_FIXED_VELOCITY 100
+#endif
+
+typedef enum {
+  MIDI_NOTE_MAP_CURVE_LINEAR,       //!< velocity unchanged
+  MIDI_NOTE_MAP_CURVE_EXPONENTIAL,  //!< velocity squared; soft playing gets softer
+  MIDI_NOTE_MAP_CURVE_COMPRESSED,   //!< velocity 1-127 squeezed into 64-127
+  MIDI_NOTE_MAP_CURVE_FIXED,        //!< every note-on at MIDI_NOTE_MAP_FIXED_VELOCITY
+  MIDI_NOTE_MAP_NUM_CURVES
+} midi_note_map_curve_t;
+
+// In midi_note_map_lut_t note: filter out the note
+#define MIDI_NOTE_MAP_DROP 0x80
+
+// The fields of midi_note_map_state_t sounding
+#define MIDI_NOTE_MAP_SOUNDING   0x8000u  //!< the note-on was sent and its note-off was not
+#define MIDI_NOTE_MAP_CHAN_SHIFT 8        //!< the channel the note-on was sent on
+#define MIDI_NOTE_MAP_NOTE_MASK  0x00ffu  //!< the note number the note-on was sent as, or MIDI_NOTE_MAP_DROP
+
+typedef struct {
+  uint8_t note[128];      // note number -> new note number or MIDI_NOTE_MAP_DROP
+  uint8_t chan[128];      // note number -> new MIDI channel 0-15
+  uint8_t velocity[128];  // note-on velocity -> new velocity 1-127; velocity[0] is 0
+} midi_note_map_lut_t;
+
+typedef struct {
+  uint8_t lut_of[MIDI_NOTE_MAP_CABLES][16];   // (cable, channel) -> 1-based index into luts; 0 means pass unchanged
+  midi_note_map_lut_t luts[MIDI_NOTE_MAP_MAX_MAPS];
+  uint8_t nluts;
+} midi_note_map_t;
+
+typedef struct {
+  uint16_t sounding[MIDI_NOTE_MAP_CABLES][16][128]; // (cable, channel, note) -> the note as it was sent
+} midi_note_map_state_t;
+
+/**
+ * @brief initialize note map tables so they pass every note unchanged
+ *
+ * @param map is a pointer to the tables to initialize
+ */
+void midi_note_map_init(midi_note_map_t* map);
+
+/**
+ * @brief transpose a range of notes and move them to a MIDI channel
+ *
+ * Notes transposed outside 0-127 are filtered out.
+ *
+ * @param map a pointer to the tables
+ * @param cable the virtual cable number 0 to MIDI_NOTE_MAP_CABLES - 1
+ * @param chan the MIDI channel 0-15 of the notes to map
+ * @param lo the lowest note number to map 0-127
+ * @param hi the highest note number to map lo-127
+ * @param transpose the number of semitones to add to the note numbers
+ * @param new_chan the MIDI channel 0-15 for the mapped notes
+ * @return true if the mapping was added, false if there is no room for another (cable, channel)
+ */
+bool midi_note_map_set_notes(midi_note_map_t* map, uint8_t cable, uint8_t chan, uint8_t lo, uint8_t hi,
+    int8_t transpose, uint8_t new_chan);
+
+/**
+ * @brief filter out a range of notes
+ *
+ * @param map a pointer to the tables
+ * @param cable the virtual cable number 0 to MIDI_NOTE_MAP_CABLES - 1
+ * @param chan the MIDI channel 0-15 of the notes
+ * @param lo the lowest note number 0-127
+ * @param hi the highest note number lo-127
+ * @return true if the mapping was added, false if there is no room for another (cable, channel)
+ */
+bool midi_note_map_drop_notes(midi_note_map_t* map, uint8_t cable, uint8_t chan, uint8_t lo, uint8_t hi);
+
+/**
+ * @brief re-scale the note-on velocity of the notes on a MIDI channel
+ *
+ * @param map a pointer to the tables
+ * @param cable the virtual cable number 0 to MIDI_NOTE_MAP_CABLES - 1
+ * @param chan the MIDI channel 0-15 of the notes
+ * @param curve the velocity curve
+ * @return true if the mapping was added, false if there is no room for another (cable, channel)
+ */
+bool midi_note_map_set_velocity(midi_note_map_t* map, uint8_t cable, uint8_t chan, midi_note_map_curve_t curve);
+
+/**
+ * @brief forget all sounding notes
+ *
+ * @param state is a pointer to the structure to initialize
+ */
+void midi_note_map_state_init(midi_note_map_state_t* state);
+
+/**
+ * @brief get the name of a velocity curve
+ *
+ * @param curve the velocity curve
+ * @return const char* the name
+ */
+const char* midi_note_map_curve_name(midi_note_map_curve_t curve);
+
+/**
+ * @brief map a note-on, note-off or poly pressure packet
+ *
+ * @param map a pointer to the tables
+ * @param state a pointer to the sounding notes
+ * @param packet the 4-byte USB MIDI packet; it may be modified
+ * @return true if the packet should be forwarded, false if it is filtered out
+ */
+static inline bool midi_note_map_apply(const midi_note_map_t* map, midi_note_map_state_t* state, uint8_t packet[4])
+{
+  uint8_t cable = packet[0] >> 4;
+  uint8_t type = packet[1] & 0xf0;
+  if (cable >= MIDI_NOTE_MAP_CABLES || type < 0x80 || type > 0xA0)
+    return true;
+  uint8_t chan = packet[1] & 0xf;
+  uint8_t note = packet[2] & 0x7f;
+  uint16_t* sounding = &state->sounding[cable][chan][note];
+  bool note_on = type == 0x90 && packet[3] != 0;
+  uint8_t idx = map->lut_of[cable][chan];
+  uint16_t sent = *sounding;
+  if ((sent & MIDI_NOTE_MAP_SOUNDING) == 0) {
+    // the note is not sounding, so the current tables decide
+    sent = idx == 0 ? (MIDI_NOTE_MAP_SOUNDING | (chan << MIDI_NOTE_MAP_CHAN_SHIFT) | note) :
+        (MIDI_NOTE_MAP_SOUNDING | (map->luts[idx - 1].chan[note] << MIDI_NOTE_MAP_CHAN_SHIFT) | map->luts[idx - 1].note[note]);
+  }
+  if (note_on) {
+    *sounding = sent;
+    if (idx != 0)
+      packet[3] = map->luts[idx - 1].velocity[packet[3] & 0x7f];
+  }
+  else if (type != 0xA0) {
+    *sounding = 0;
+  }
+  if (sent & MIDI_NOTE_MAP_DROP)
+    return false;
+  packet[1] = type | ((sent >> MIDI_NOTE_MAP_CHAN_SHIFT) & 0xf);
+  packet[2] = sent & 0x7f;
+  return true;
+}
+
+/**
+ * @brief map an array of packets in place
+ *
+ * @param map a pointer to the tables
+ * @param state a pointer to the sounding notes
+ * @param packets the array of 4-byte USB MIDI packets. Packets that are
+ * filtered out are removed and the rest are compacted to the start of the
+ * array in their original order.
+ * @param npackets the number of packets in the array
+ * @return size_t the number of packets left in the array
+ */
+static inline size_t midi_note_map_apply_batch(const midi_note_map_t* map, midi_note_map_state_t* state,
+    uint32_t* packets, size_t npackets)
+{
+  size_t nkept = 0;
+  for (size_t idx = 0; idx < npackets; idx++) {
+    uint32_t packet = packets[idx];
+    if (midi_note_map_apply(map, state, (uint8_t*)&packet))
+      packets[nkept++] = packet;
+  }
+  return nkept;
+}
+
+#ifdef __cplusplus
+}
+#endif
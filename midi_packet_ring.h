@@ -0,0 +1,188 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_packet_ring.h
+ *
+ * A fixed-size, lock-free, single-producer/single-consumer ring of 4-byte
+ * USB MIDI packets. One core pushes packets and the other core pops them,
+ * so each core only ever calls into its own USB stack. Each packet carries
+ * the timestamp the producer gave it so the consumer can measure how long
+ * the packet has been inside the Pico.
+ *
+ * The producer owns the head index and the statistics; the consumer owns
+ * the tail index. Each index lives in its own aligned block so the two
+ * cores never write the same bus word (or cache line on targets that
+ * have a data cache).
+ *
+ * To use this code:
+ * 1. Declare a static midi_packet_ring_t and call midi_packet_ring_init() before
+ *    either core touches it.
+ * 2. On the producer core only, call midi_packet_ring_push() or midi_packet_ring_push_n().
+ * 3. On the consumer core only, call midi_packet_ring_pop() or midi_packet_ring_pop_n().
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MIDI_PACKET_RING_SIZE
+// Number of packets in the ring. Must be a power of 2.
+#define MIDI_PACKET_RING_SIZE 256
+#endif
+
+#if (MIDI_PACKET_RING_SIZE & (MIDI_PACKET_RING_SIZE - 1)) != 0
+#error "MIDI_PACKET_RING_SIZE must be a power of 2"
+#endif
+
+#ifndef MIDI_PACKET_RING_ALIGN
+#define MIDI_PACKET_RING_ALIGN 32
+#endif
+
+typedef struct {
+  struct {
+    uint32_t head;          // index of the next slot to write; written only by the producer
+    uint32_t high_water;    // the most packets that have ever been in the ring at once
+    uint32_t overflows;     // number of packets dropped because the ring was full
+  } __attribute__((aligned(MIDI_PACKET_RING_ALIGN))) prod;
+  struct {
+    uint32_t tail;          // index of the next slot to read; written only by the consumer
+  } __attribute__((aligned(MIDI_PACKET_RING_ALIGN))) cons;
+  uint32_t packets[MIDI_PACKET_RING_SIZE] __attribute__((aligned(MIDI_PACKET_RING_ALIGN)));
+  uint32_t timestamps[MIDI_PACKET_RING_SIZE]; // the producer's timestamp for each packet
+} midi_packet_ring_t;
+
+/**
+ * @brief initialize the ring to empty and clear the statistics
+ *
+ * @param ring a pointer to the ring to initialize
+ */
+static inline void midi_packet_ring_init(midi_packet_ring_t* ring)
+{
+  memset(ring, 0, sizeof(*ring));
+}
+
+/**
+ * @brief push up to npackets packets to the ring (producer core only)
+ *
+ * @param ring a pointer to the ring
+ * @param packets the array of 4-byte USB MIDI packets to push
+ * @param npackets the number of packets in the array
+ * @param timestamp the timestamp to store with each packet (e.g., the time in microseconds the packets arrived)
+ * @return uint32_t the number of packets pushed. Packets that do not fit
+ * are dropped and counted in the overflow counter.
+ */
+static inline uint32_t midi_packet_ring_push_n(midi_packet_ring_t* ring, const uint32_t* packets, uint32_t npackets, uint32_t timestamp)
+{
+  uint32_t head = ring->prod.head;
+  uint32_t tail = __atomic_load_n(&ring->cons.tail, __ATOMIC_ACQUIRE);
+  uint32_t space = MIDI_PACKET_RING_SIZE - (head - tail);
+  uint32_t npushed = npackets < space ? npackets : space;
+  for (uint32_t idx = 0; idx < npushed; idx++) {
+    ring->packets[(head + idx) & (MIDI_PACKET_RING_SIZE - 1)] = packets[idx];
+    ring->timestamps[(head + idx) & (MIDI_PACKET_RING_SIZE - 1)] = timestamp;
+  }
+  head += npushed;
+  __atomic_store_n(&ring->prod.head, head, __ATOMIC_RELEASE);
+  ring->prod.overflows += npackets - npushed;
+  if (head - tail > ring->prod.high_water)
+    ring->prod.high_water = head - tail;
+  return npushed;
+}
+
+/**
+ * @brief push one packet to the ring (producer core only)
+ *
+ * @param ring a pointer to the ring
+ * @param packet the standard 4-byte USB MIDI packet
+ * @param timestamp the timestamp to store with the packet
+ * @return true if the packet was pushed, false if the ring was full
+ */
+static inline bool midi_packet_ring_push(midi_packet_ring_t* ring, const uint8_t packet[4], uint32_t timestamp)
+{
+  uint32_t word;
+  memcpy(&word, packet, sizeof(word));
+  return midi_packet_ring_push_n(ring, &word, 1, timestamp) == 1;
+}
+
+/**
+ * @brief pop up to max_packets packets from the ring (consumer core only)
+ *
+ * @param ring a pointer to the ring
+ * @param packets the array to store the 4-byte USB MIDI packets
+ * @param timestamps the array to store the timestamp of each packet, or NULL
+ * @param max_packets the maximum number of packets to pop
+ * @return uint32_t the number of packets popped
+ */
+static inline uint32_t midi_packet_ring_pop_n(midi_packet_ring_t* ring, uint32_t* packets, uint32_t* timestamps, uint32_t max_packets)
+{
+  uint32_t tail = ring->cons.tail;
+  uint32_t head = __atomic_load_n(&ring->prod.head, __ATOMIC_ACQUIRE);
+  uint32_t avail = head - tail;
+  uint32_t npopped = max_packets < avail ? max_packets : avail;
+  for (uint32_t idx = 0; idx < npopped; idx++) {
+    packets[idx] = ring->packets[(tail + idx) & (MIDI_PACKET_RING_SIZE - 1)];
+    if (timestamps)
+      timestamps[idx] = ring->timestamps[(tail + idx) & (MIDI_PACKET_RING_SIZE - 1)];
+  }
+  __atomic_store_n(&ring->cons.tail, tail + npopped, __ATOMIC_RELEASE);
+  return npopped;
+}
+
+/**
+ * @brief pop one packet from the ring (consumer core only)
+ *
+ * @param ring a pointer to the ring
+ * @param packet the standard 4-byte USB MIDI packet popped from the ring
+ * @param timestamp the packet's timestamp, or NULL
+ * @return true if a packet was popped, false if the ring was empty
+ */
+static inline bool midi_packet_ring_pop(midi_packet_ring_t* ring, uint8_t packet[4], uint32_t* timestamp)
+{
+  uint32_t word;
+  if (midi_packet_ring_pop_n(ring, &word, timestamp, 1) != 1)
+    return false;
+  memcpy(packet, &word, sizeof(word));
+  return true;
+}
+
+/**
+ * @brief get the number of packets currently in the ring (safe from either core)
+ *
+ * @param ring a pointer to the ring
+ * @return uint32_t the number of packets in the ring
+ */
+static inline uint32_t midi_packet_ring_level(midi_packet_ring_t* ring)
+{
+  return __atomic_load_n(&ring->prod.head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->cons.tail, __ATOMIC_ACQUIRE);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,184 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "midi_sysex_cmd.h"
+#include <string.h>
+
+#define MIDI_SYSEX_CMD_MAX_CMDS 0x40
+
+static midi_sysex_cmd_send_t send_packets = NULL;
+static midi_sysex_cmd_room_t send_room = NULL;
+static midi_sysex_cmd_handler_t handlers[MIDI_SYSEX_CMD_MAX_CMDS];
+
+// Only one command can be received at a time
+static struct {
+  bool active;        // a command is being received
+  bool overflow;      // the command was too long to store
+  uint8_t cable;      // the virtual cable the command is arriving on
+  uint16_t len;       // number of bytes in buf
+  uint8_t buf[MIDI_SYSEX_CMD_MAX_PAYLOAD + 1]; // the command byte followed by the payload
+} rx;
+
+void midi_sysex_cmd_init(midi_sysex_cmd_send_t send, midi_sysex_cmd_room_t room)
+{
+  send_packets = send;
+  send_room = room;
+  memset(handlers, 0, sizeof(handlers));
+  rx.active = false;
+}
+
+bool midi_sysex_cmd_register(uint8_t cmd, midi_sysex_cmd_handler_t handler)
+{
+  if (cmd >= MIDI_SYSEX_CMD_MAX_CMDS)
+    return false;
+  handlers[cmd] = handler;
+  return true;
+}
+
+static void dispatch(void)
+{
+  if (rx.len == 0)
+    return; // no command byte; nothing to answer
+  uint8_t cmd = rx.buf[0];
+  if (rx.overflow || cmd >= MIDI_SYSEX_CMD_MAX_CMDS || handlers[cmd] == NULL) {
+    midi_sysex_cmd_reply(rx.cable, MIDI_SYSEX_CMD_NAK, &cmd, 1);
+    return;
+  }
+  handlers[cmd](rx.cable, rx.buf + 1, rx.len - 1);
+}
+
+bool midi_sysex_cmd_rx_packet(const uint8_t packet[4])
+{
+  uint8_t cable = packet[0] >> 4;
+  uint8_t cin = packet[0] & 0xf;
+  if (!rx.active) {
+    if (cin == 0x4 && packet[1] == 0xF0 && packet[2] == MIDI_SYSEX_CMD_MANUFACTURER_ID && packet[3] == MIDI_SYSEX_CMD_PRODUCT_ID) {
+      rx.active = true;
+      rx.overflow = false;
+      rx.cable = cable;
+      rx.len = 0;
+      return true;
+    }
+    return false;
+  }
+  if (cable != rx.cable || cin == 0xF)
+    return false; // another cable or a real-time message interleaved with the command
+  uint8_t nbytes;
+  switch (cin) {
+    case 0x4: // SysEx starts or continues
+    case 0x7: // SysEx ends with following three bytes
+      nbytes = 3;
+      break;
+    case 0x6: // SysEx ends with following two bytes
+      nbytes = 2;
+      break;
+    case 0x5: // SysEx ends with following single byte
+      nbytes = 1;
+      break;
+    default:
+      // not SysEx; the command was cut short. Abandon it and pass the packet on
+      rx.active = false;
+      return false;
+  }
+  for (uint8_t idx = 1; idx <= nbytes; idx++) {
+    uint8_t byte = packet[idx];
+    if (byte == 0xF7) {
+      rx.active = false;
+      dispatch();
+      return true;
+    }
+    if (byte & 0x80) {
+      rx.active = false; // malformed; drop it
+      return true;
+    }
+    if (rx.len < sizeof(rx.buf))
+      rx.buf[rx.len++] = byte;
+    else
+      rx.overflow = true;
+  }
+  if (cin != 0x4) {
+    // the message ended without F7; treat it as the end of the command
+    rx.active = false;
+    dispatch();
+  }
+  return true;
+}
+
+void midi_sysex_cmd_reply(uint8_t cable, uint8_t cmd, const uint8_t* payload, uint32_t len)
+{
+  if (send_packets == NULL)
+    return;
+  uint8_t header[4] = {0xF0, MIDI_SYSEX_CMD_MANUFACTURER_ID, MIDI_SYSEX_CMD_PRODUCT_ID,
+      cmd == MIDI_SYSEX_CMD_NAK ? MIDI_SYSEX_CMD_NAK : (cmd | MIDI_SYSEX_CMD_REPLY_FLAG)};
+  uint32_t total = sizeof(header) + len + 1; // header, payload and F7
+  if (send_room != NULL && send_room() < (total + 2) / 3) {
+    // a reply cut short is worse than none; ask for the command again instead
+    if (cmd != MIDI_SYSEX_CMD_NAK)
+      midi_sysex_cmd_reply(cable, MIDI_SYSEX_CMD_NAK, &cmd, 1);
+    return;
+  }
+  // Build the reply a few packets at a time so long replies need no big buffer
+  uint32_t packets[16];
+  uint32_t npackets = 0;
+  uint8_t chunk[3];
+  uint8_t nchunk = 0;
+  for (uint32_t idx = 0; idx < total; idx++) {
+    if (idx < sizeof(header))
+      chunk[nchunk++] = header[idx];
+    else if (idx < sizeof(header) + len)
+      chunk[nchunk++] = payload[idx - sizeof(header)] & 0x7f;
+    else
+      chunk[nchunk++] = 0xF7;
+    bool last = idx + 1 == total;
+    if (nchunk == 3 || last) {
+      uint8_t cin = last ? (uint8_t)(0x4 + nchunk) : 0x4; // 0x5, 0x6 or 0x7 end the SysEx
+      uint8_t packet[4] = {(uint8_t)((cable << 4) | cin), chunk[0], nchunk > 1 ? chunk[1] : 0, nchunk > 2 ? chunk[2] : 0};
+      memcpy(&packets[npackets++], packet, sizeof(packet));
+      nchunk = 0;
+      if (npackets == sizeof(packets) / sizeof(packets[0]) || last) {
+        send_packets(packets, npackets);
+        npackets = 0;
+      }
+    }
+  }
+}
+
+uint8_t* midi_sysex_cmd_put_u32(uint8_t* buf, uint32_t value)
+{
+  for (int idx = 0; idx < 5; idx++) {
+    *buf++ = value & 0x7f;
+    value >>= 7;
+  }
+  return buf;
+}
+
+uint32_t midi_sysex_cmd_get_u32(const uint8_t* buf)
+{
+  uint32_t value = 0;
+  for (int idx = 4; idx >= 0; idx--) {
+    value = (value << 7) | (buf[idx] & 0x7f);
+  }
+  return value;
+}
@@ -0,0 +1,166 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_sysex_cmd.h
+ *
+ * This file contains functions and data that implement a vendor SysEx command
+ * interface on the USB MIDI device port. A program on the DAW computer can use
+ * it to query or control the filter while MIDI traffic is flowing.
+ *
+ * A command is a SysEx message on any virtual cable:
+ *   F0 7D 50 <command> <payload> F7
+ * 0x7D is the MIDI non-commercial manufacturer ID and 0x50 identifies this
+ * project. The reply goes out on the same virtual cable:
+ *   F0 7D 50 <command | 0x40> <payload> F7
+ * or, if the command is unknown or malformed, or the reply does not fit in
+ * the packets that can be sent to the USB host right now:
+ *   F0 7D 50 7F <command> F7
+ * A reply is never cut short; send the command again after a NAK of a known
+ * command.
+ * Multi-byte numbers in a payload are 32-bit unsigned values encoded as
+ * five 7-bit bytes, least significant first.
+ *
+ * To use this code:
+ * 1. Call midi_sysex_cmd_init() with a function that sends reply packets to the USB host
+ *    and a function that tells how many packets it can take without dropping any.
+ *    The send function must hold a reply back while another SysEx message is open on
+ *    its cable.
+ * 2. Call midi_sysex_cmd_register() for each command you want to handle.
+ * 3. Pass every packet from the USB host to midi_sysex_cmd_rx_packet() before filtering it.
+ *    Do not forward packets for which it returns true.
+ * 4. Command handlers call midi_sysex_cmd_reply() to send a reply.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MIDI_SYSEX_CMD_MANUFACTURER_ID 0x7D
+#define MIDI_SYSEX_CMD_PRODUCT_ID      0x50
+#define MIDI_SYSEX_CMD_REPLY_FLAG      0x40
+#define MIDI_SYSEX_CMD_NAK             0x7F
+
+#ifndef MIDI_SYSEX_CMD_MAX_PAYLOAD
+// The longest command payload that can be received
+#define MIDI_SYSEX_CMD_MAX_PAYLOAD 64
+#endif
+
+// Commands
+#define MIDI_SYSEX_CMD_GET_LATENCY 0x01 //!< Reply with the latency histograms; no payload
+#define MIDI_SYSEX_CMD_GET_CAPTURE 0x02 //!< Reply with captured MIDI traffic; see midi_capture.h
+// Replace the filter rules; see midi_filter_rules.h. Rules longer than one command are sent in
+// chunks, in order. The payload is <offset> <total> <rule bytes>, where offset is where the chunk's
+// bytes go in the rules and total is the length of the rules, each as two 7-bit bytes, least
+// significant first. The reply payload is <state> <result> <rule index>: the state is one of the
+// MIDI_SYSEX_CMD_RULES_* values below; a rejected upload carries the result
+// (a MIDI_FILTER_RULES_* code) at the rule index (0x7F if the rule index does not apply)
+#define MIDI_SYSEX_CMD_LOAD_RULES  0x03
+#define MIDI_SYSEX_CMD_RULES_STORED   0
+#define MIDI_SYSEX_CMD_RULES_LOADED   1
+#define MIDI_SYSEX_CMD_RULES_REJECTED 2
+
+/**
+ * @brief handle a command
+ *
+ * @param cable the virtual cable the command arrived on; send the reply on the same cable
+ * @param payload the command payload bytes (all 0-127)
+ * @param len the number of bytes in the payload
+ */
+typedef void (*midi_sysex_cmd_handler_t)(uint8_t cable, const uint8_t* payload, uint16_t len);
+
+/**
+ * @brief send USB MIDI packets to the USB host
+ *
+ * @param packets the array of 4-byte USB MIDI packets
+ * @param npackets the number of packets in the array
+ */
+typedef void (*midi_sysex_cmd_send_t)(const uint32_t* packets, uint32_t npackets);
+
+/**
+ * @brief get the number of packets that can be sent to the USB host without dropping any
+ *
+ * @return uint32_t the number of packets
+ */
+typedef uint32_t (*midi_sysex_cmd_room_t)(void);
+
+/**
+ * @brief initialize the command interface and forget all command handlers
+ *
+ * @param send the function that sends reply packets to the USB host
+ * @param room the function that tells how many packets send can take
+ */
+void midi_sysex_cmd_init(midi_sysex_cmd_send_t send, midi_sysex_cmd_room_t room);
+
+/**
+ * @brief set the handler for a command
+ *
+ * @param cmd the command byte 0x00-0x3F
+ * @param handler the handler function
+ * @return true if the handler was set
+ */
+bool midi_sysex_cmd_register(uint8_t cmd, midi_sysex_cmd_handler_t handler);
+
+/**
+ * @brief process a packet from the USB host
+ *
+ * @param packet the 4-byte USB MIDI packet
+ * @return true if the packet is part of a command and must not be forwarded
+ */
+bool midi_sysex_cmd_rx_packet(const uint8_t packet[4]);
+
+/**
+ * @brief send a reply to a command, or a NAK if the whole reply cannot be sent now
+ *
+ * @param cable the virtual cable to send the reply on
+ * @param cmd the command byte of the command being answered
+ * @param payload the reply payload bytes (all 0-127)
+ * @param len the number of bytes in the payload
+ */
+void midi_sysex_cmd_reply(uint8_t cable, uint8_t cmd, const uint8_t* payload, uint32_t len);
+
+/**
+ * @brief encode a 32-bit value as five 7-bit payload bytes, least significant first
+ *
+ * @param buf the payload buffer
+ * @param value the value to encode
+ * @return uint8_t* a pointer to the byte after the encoded value
+ */
+uint8_t* midi_sysex_cmd_put_u32(uint8_t* buf, uint32_t value);
+
+/**
+ * @brief decode a 32-bit value from five 7-bit payload bytes, least significant first
+ *
+ * @param buf the payload bytes
+ * @return uint32_t the decoded value
+ */
+uint32_t midi_sysex_cmd_get_u32(const uint8_t* buf);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,211 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include "midi_tx_queue.h"
+#include <stddef.h>
+
+void midi_tx_queue_init(midi_tx_queue_t* queue, midi_tx_queue_write_t write, void* write_ctx, midi_tx_queue_policy_t policy)
+{
+  queue->head = 0;
+  queue->count = 0;
+  queue->write = write;
+  queue->write_ctx = write_ctx;
+  queue->queued = 0;
+  queue->retried = 0;
+  queue->dropped = 0;
+  queue->coalesced = 0;
+  queue->coalesce_cc_cables = 0;
+  queue->coalesce_pitch_bend_cables = 0;
+  midi_tx_queue_set_policy(queue, policy);
+}
+
+void midi_tx_queue_set_coalescing(midi_tx_queue_t* queue, uint16_t cc_cables, uint16_t pitch_bend_cables)
+{
+  queue->coalesce_cc_cables = cc_cables;
+  queue->coalesce_pitch_bend_cables = pitch_bend_cables;
+}
+
+void midi_tx_queue_set_policy(midi_tx_queue_t* queue, midi_tx_queue_policy_t policy)
+{
+  queue->policy = policy < MIDI_TX_QUEUE_NUM_POLICIES ? policy : MIDI_TX_QUEUE_DEFAULT_POLICY;
+}
+
+const char* midi_tx_queue_policy_name(midi_tx_queue_policy_t policy)
+{
+  static const char* names[MIDI_TX_QUEUE_NUM_POLICIES] = {"drop-oldest", "drop-newest", "drop-non-realtime-first"};
+  return policy < MIDI_TX_QUEUE_NUM_POLICIES ? names[policy] : "unknown";
+}
+
+static uint32_t slot(uint32_t idx)
+{
+  return idx % MIDI_TX_QUEUE_SIZE;
+}
+
+// Remove the packet at position pos (0 is the oldest) and close the gap
+static void remove_at(midi_tx_queue_t* queue, uint32_t pos)
+{
+  for (uint32_t idx = pos; idx > 0; idx--) {
+    // shifting the older packets toward the back keeps the newer ones in place
+    queue->packets[slot(queue->head + idx)] = queue->packets[slot(queue->head + idx - 1)];
+    queue->timestamps[slot(queue->head + idx)] = queue->timestamps[slot(queue->head + idx - 1)];
+  }
+  queue->head = slot(queue->head + 1);
+  --queue->count;
+}
+
+// Make room for one more packet. Return false if the new packet is the one to drop.
+static bool make_room(midi_tx_queue_t* queue, uint32_t packet)
+{
+  ++queue->dropped;
+  switch (queue->policy) {
+    case MIDI_TX_QUEUE_DROP_NEWEST:
+      return false;
+    case MIDI_TX_QUEUE_DROP_NON_REALTIME_FIRST:
+      for (uint32_t pos = 0; pos < queue->count; pos++) {
+        if (!midi_tx_queue_is_realtime(queue->packets[slot(queue->head + pos)])) {
+          remove_at(queue, pos);
+          return true;
+        }
+      }
+      if (!midi_tx_queue_is_realtime(packet))
+        return false;
+      // every packet is real-time; drop the oldest
+      remove_at(queue, 0);
+      return true;
+    case MIDI_TX_QUEUE_DROP_OLDEST:
+    default:
+      remove_at(queue, 0);
+      return true;
+  }
+}
+
+// Controllers whose order relative to other messages matters
+static bool is_ordered_controller(uint8_t controller)
+{
+  return controller == 0 || controller == 32 ||   // bank select
+      controller == 6 || controller == 38 ||      // data entry
+      (controller >= 64 && controller <= 69) ||   // switches such as sustain
+      (controller >= 96 && controller <= 101) ||  // data increment/decrement and NRPN/RPN
+      controller >= 120;                          // channel mode messages
+}
+
+// Return the mask of the bytes of a packet that must match for a newer packet
+// to replace an older one, or 0 if the packet must never be replaced.
+static uint32_t coalesce_mask(const midi_tx_queue_t* queue, uint32_t packet)
+{
+  const uint8_t* bytes = (const uint8_t*)&packet;
+  uint16_t cable_bit = 1u << (bytes[0] >> 4);
+  switch (bytes[0] & 0xf) {
+    case 0xB: // control change
+      if ((queue->coalesce_cc_cables & cable_bit) && (bytes[1] & 0xf0) == 0xB0 && !is_ordered_controller(bytes[2]))
+        return 0x00ffffff; // cable, CIN, status and controller number
+      break;
+    case 0xE: // pitch bend
+      if ((queue->coalesce_pitch_bend_cables & cable_bit) && (bytes[1] & 0xf0) == 0xE0)
+        return 0x0000ffff; // cable, CIN and status
+      break;
+    default:
+      break;
+  }
+  return 0;
+}
+
+// Return true if a queued packet is a channel message on the same cable and
+// channel as a new packet that the new packet must not move ahead of
+static bool is_ordered_before(const midi_tx_queue_t* queue, uint32_t queued, uint32_t packet)
+{
+  const uint8_t* bytes = (const uint8_t*)&queued;
+  uint8_t cin = bytes[0] & 0xf;
+  if (cin < 0x8 || cin > 0xE || ((queued ^ packet) & 0x00000ff0) != 0)
+    return false; // not a channel message, or another cable (byte 0) or channel (byte 1)
+  return coalesce_mask(queue, queued) == 0;
+}
+
+// Replace a queued packet with the same key. Return true if one was replaced.
+static bool coalesce(midi_tx_queue_t* queue, uint32_t packet, uint32_t timestamp)
+{
+  uint32_t mask = coalesce_mask(queue, packet);
+  if (mask == 0)
+    return false;
+  uint32_t key = packet & mask;
+  // search from the newest packet because a sweep updates the same key again and again
+  for (uint32_t pos = queue->count; pos > 0; pos--) {
+    uint32_t idx = slot(queue->head + pos - 1);
+    if ((queue->packets[idx] & mask) == key) {
+      queue->packets[idx] = packet;
+      queue->timestamps[idx] = timestamp;
+      ++queue->coalesced;
+      return true;
+    }
+    // replacing the older value would move the new one ahead of, e.g., a note-on
+    if (is_ordered_before(queue, queue->packets[idx], packet))
+      return false;
+  }
+  return false;
+}
+
+static void enqueue(midi_tx_queue_t* queue, uint32_t packet, uint32_t timestamp)
+{
+  if (coalesce(queue, packet, timestamp))
+    return;
+  if (queue->count == MIDI_TX_QUEUE_SIZE && !make_room(queue, packet))
+    return;
+  uint32_t idx = slot(queue->head + queue->count);
+  queue->packets[idx] = packet;
+  queue->timestamps[idx] = timestamp;
+  ++queue->count;
+  ++queue->queued;
+}
+
+void midi_tx_queue_retry(midi_tx_queue_t* queue)
+{
+  while (queue->count > 0) {
+    // write the longest run of packets that does not wrap around the end of the buffer
+    uint32_t nrun = MIDI_TX_QUEUE_SIZE - queue->head;
+    if (nrun > queue->count)
+      nrun = queue->count;
+    uint32_t nwritten = queue->write(queue->packets + queue->head, queue->timestamps + queue->head, nrun, queue->write_ctx);
+    queue->head = slot(queue->head + nwritten);
+    queue->count -= nwritten;
+    queue->retried += nwritten;
+    if (nwritten < nrun)
+      break; // the USB stack is full
+  }
+}
+
+void midi_tx_queue_send(midi_tx_queue_t* queue, const uint32_t* packets, const uint32_t* timestamps, uint32_t npackets)
+{
+  uint32_t nwritten = 0;
+  if (queue->count == 0)
+    nwritten = queue->write(packets, timestamps, npackets, queue->write_ctx);
+  for (uint32_t idx = nwritten; idx < npackets; idx++)
+    enqueue(queue, packets[idx], timestamps[idx]);
+}
+
+void midi_tx_queue_clear(midi_tx_queue_t* queue)
+{
+  queue->head = 0;
+  queue->count = 0;
+}
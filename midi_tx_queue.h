@@ -0,0 +1,185 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2022 rppicomidi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file midi_tx_queue.h
+ *
+ * This file contains a bounded retry queue for packets a USB stack refused
+ * to accept because its transmit FIFO was full. Packets the stack refuses are
+ * held in the queue and retried on the next task loop iteration. While the
+ * queue holds packets, new packets go to the back of the queue so packet order
+ * never changes.
+ *
+ * When the queue is full, the drop policy picks the packet to lose:
+ * - MIDI_TX_QUEUE_DROP_OLDEST drops the packet at the front of the queue
+ * - MIDI_TX_QUEUE_DROP_NEWEST drops the packet being added
+ * - MIDI_TX_QUEUE_DROP_NON_REALTIME_FIRST drops the oldest packet that is not a
+ *   single-byte system real-time message (MIDI clock, start, stop, etc.) so
+ *   timing messages survive congestion. If every packet is real-time, it drops
+ *   the oldest packet.
+ *
+ * The queue can also coalesce continuous controller (CC) and pitch bend
+ * messages. If a new CC or pitch bend packet arrives while a packet with the
+ * same virtual cable, status byte and (for CC) controller number is still
+ * waiting in the queue, the new packet replaces the waiting one in place,
+ * unless a message on the same cable and channel that is not coalesced
+ * (e.g., a note-on) waits between them; then the new packet is queued
+ * behind it, so a note never starts with a value that came after it.
+ * Only the newest value matters for a fader or knob, so this cuts traffic
+ * during fast sweeps when the USB port is congested. Coalescing never happens
+ * when the queue is empty, so it adds no latency when the link is idle.
+ * Note, SysEx and all other messages keep strict order. Switch controllers
+ * (e.g., sustain), bank select, data entry, RPN/NRPN and channel mode
+ * controllers are never coalesced because their order relative to other
+ * messages matters. Enable CC coalescing only on virtual cables whose
+ * controllers send absolute values; relative encoders (e.g., Mackie Control
+ * V-Pots) send steps that must not be merged.
+ *
+ * The queue is not thread safe. Only the core that owns the USB stack may use it.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MIDI_TX_QUEUE_SIZE
+#define MIDI_TX_QUEUE_SIZE 128
+#endif
+
+typedef enum {
+  MIDI_TX_QUEUE_DROP_OLDEST,
+  MIDI_TX_QUEUE_DROP_NEWEST,
+  MIDI_TX_QUEUE_DROP_NON_REALTIME_FIRST,
+  MIDI_TX_QUEUE_NUM_POLICIES
+} midi_tx_queue_policy_t;
+
+#ifndef MIDI_TX_QUEUE_DEFAULT_POLICY
+#define MIDI_TX_QUEUE_DEFAULT_POLICY MIDI_TX_QUEUE_DROP_NON_REALTIME_FIRST
+#endif
+
+/**
+ * @brief write packets to a USB stack
+ *
+ * @param packets the array of 4-byte USB MIDI packets
+ * @param timestamps the array of timestamps of the packets
+ * @param npackets the number of packets in the arrays
+ * @param ctx the context passed to midi_tx_queue_init(), e.g., which device to write to
+ * @return uint32_t the number of packets, starting from the first, the USB stack accepted
+ */
+typedef uint32_t (*midi_tx_queue_write_t)(const uint32_t* packets, const uint32_t* timestamps, uint32_t npackets, void* ctx);
+
+typedef struct {
+  uint32_t packets[MIDI_TX_QUEUE_SIZE];
+  uint32_t timestamps[MIDI_TX_QUEUE_SIZE];
+  uint32_t head;                    // index of the oldest packet
+  uint32_t count;                   // number of packets in the queue
+  midi_tx_queue_policy_t policy;
+  midi_tx_queue_write_t write;
+  void* write_ctx;
+  uint32_t queued;                  // packets that had to wait in the queue
+  uint32_t retried;                 // queued packets the USB stack accepted later
+  uint32_t dropped;                 // packets lost because the queue was full
+  uint32_t coalesced;               // queued packets replaced by a newer value
+  uint16_t coalesce_cc_cables;      // bit n set means coalesce CC messages on virtual cable n
+  uint16_t coalesce_pitch_bend_cables; // bit n set means coalesce pitch bend messages on virtual cable n
+} midi_tx_queue_t;
+
+/**
+ * @brief initialize an empty queue and clear the statistics
+ *
+ * @param queue a pointer to the queue to initialize
+ * @param write the function that writes packets to the USB stack
+ * @param write_ctx the context to pass to write
+ * @param policy the drop policy
+ */
+void midi_tx_queue_init(midi_tx_queue_t* queue, midi_tx_queue_write_t write, void* write_ctx, midi_tx_queue_policy_t policy);
+
+/**
+ * @brief change the drop policy
+ *
+ * @param queue a pointer to the queue
+ * @param policy the new drop policy
+ */
+void midi_tx_queue_set_policy(midi_tx_queue_t* queue, midi_tx_queue_policy_t policy);
+
+/**
+ * @brief choose which messages may replace an older queued value
+ *
+ * @param queue a pointer to the queue
+ * @param cc_cables bit n set means coalesce control change messages on virtual cable n
+ * @param pitch_bend_cables bit n set means coalesce pitch bend messages on virtual cable n
+ */
+void midi_tx_queue_set_coalescing(midi_tx_queue_t* queue, uint16_t cc_cables, uint16_t pitch_bend_cables);
+
+/**
+ * @brief get a short name for a drop policy
+ *
+ * @param policy the drop policy
+ * @return const char* the name
+ */
+const char* midi_tx_queue_policy_name(midi_tx_queue_policy_t policy);
+
+/**
+ * @brief send packets to the USB stack in order, queueing any it does not accept
+ *
+ * @param queue a pointer to the queue
+ * @param packets the array of 4-byte USB MIDI packets
+ * @param timestamps the array of timestamps of the packets
+ * @param npackets the number of packets in the arrays
+ */
+void midi_tx_queue_send(midi_tx_queue_t* queue, const uint32_t* packets, const uint32_t* timestamps, uint32_t npackets);
+
+/**
+ * @brief try again to send queued packets to the USB stack; call once per task loop iteration
+ *
+ * @param queue a pointer to the queue
+ */
+void midi_tx_queue_retry(midi_tx_queue_t* queue);
+
+/**
+ * @brief discard all queued packets without counting them as dropped (e.g., the USB port disconnected)
+ *
+ * @param queue a pointer to the queue
+ */
+void midi_tx_queue_clear(midi_tx_queue_t* queue);
+
+/**
+ * @brief check if a packet is a single-byte system real-time message
+ *
+ * @param packet the 4-byte USB MIDI packet as a 32-bit word
+ * @return true if the packet is MIDI clock, start, continue, stop, active sensing or reset
+ */
+static inline bool midi_tx_queue_is_realtime(uint32_t packet)
+{
+  const uint8_t* bytes = (const uint8_t*)&packet;
+  return (bytes[0] & 0xf) == 0xf && bytes[1] >= 0xF8;
+}
+
+#ifdef __cplusplus
+}
+#endif
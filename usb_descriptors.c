@@ -25,27 +25,71 @@
  */
 
 #include "tusb.h"
-#include "stdlib.h"
+#include <stdio.h>
 #include "usb_descriptors.h"
 #include "usb_midi_host.h"
-static tusb_desc_device_t desc_device_connected;
+#include "descriptor_cache.h"
 
-static uint8_t* desc_fs_configuration = NULL;
-static uint8_t daddr;
-struct devstring_set_s {
-    uint16_t langid;
-    uint16_t** string_list;
-};
+// The cloned descriptors are kept as one contiguous descriptor image, which is
+// also the format of the flash descriptor cache:
+//   the device descriptor
+//   the configuration descriptor (wTotalLength bytes)
+//   the number of langids (1 byte) and the number of string indices (1 byte)
+//   the langids (2 bytes each, LSB first)
+//   the string indices (1 byte each)
+//   padding to an even offset
+//   the string offset table: for each string index, for each langid, the 16-bit
+//     offset of the string descriptor from the start of the image; 0 if the
+//     string is not cloned yet
+//   the string descriptors in the order they were cloned, each at an even offset
+#ifndef USB_DESCRIPTOR_ARENA_SIZE
+#define USB_DESCRIPTOR_ARENA_SIZE DESCRIPTOR_CACHE_MAX_IMAGE
+#endif
+#ifndef USB_DESCRIPTOR_MAX_STRINGS
+#define USB_DESCRIPTOR_MAX_STRINGS 64
+#endif
+static uint8_t clone_arena[USB_DESCRIPTOR_ARENA_SIZE] __attribute__((aligned(4)));
+static uint16_t arena_len = 0;
+static tusb_desc_device_t* const desc_device_connected = (tusb_desc_device_t*)clone_arena;
+static const uint8_t* const desc_fs_configuration = clone_arena + sizeof(tusb_desc_device_t);
+static bool config_cloned = false;
+
+// Where to find the strings in a descriptor image
+typedef struct {
+  const uint8_t* image;
+  uint8_t num_langids;
+  uint8_t nstrings;
+  const uint8_t* langids;         // num_langids 16-bit langids, LSB first
+  const uint8_t* string_idx_list; // nstrings string indices
+  const uint16_t* offsets;        // the string offset table
+  uint8_t string_slot[256];       // string index -> 1-based position in string_idx_list; 0 if there is no such string
+} descriptor_index_t;
 
-static struct devstring_set_s* devstrings = NULL;
+static descriptor_index_t cloned_index;  // the image in clone_arena; written only by core1
+static descriptor_index_t cached_index;  // the image in the flash cache
+static bool cached_in_use = false;       // the USB device port is using the cached descriptors
+
+static uint8_t daddr;
 static uint8_t num_langids = 0;
 static uint8_t langid_idx = 0;
 static uint8_t string_idx = 0;
-static uint8_t* string_idx_list = NULL;
+static uint8_t string_idx_list[USB_DESCRIPTOR_MAX_STRINGS];
 static uint8_t nstrings = 0;
+static uint16_t empty_string_offset;     // a zero-length string for strings that do not fit in the arena
 #define SZ_SCRATCHPAD 128
 static uint8_t scratchpad[SZ_SCRATCHPAD];
 static enum {UNCLONED, START_CLONING, CLONING, CLONE_NEXT_DESCRIPTOR, CLONED} clone_state = UNCLONED;
+// The langid list string descriptor tud_descriptor_string_cb() returns; the
+// scratchpad belongs to the cloning code, which may be running at the same time
+static uint16_t desc_langids[1 + SZ_SCRATCHPAD / 2];
+// The device port may come up before the strings are cloned. Core1 publishes
+// the number of langids once cloned_index is set up, and then publishes each
+// string offset as the string arrives.
+static uint8_t published_langids = 0;
+// Returned for a string the device port asks for before it is cloned
+#define PLACEHOLDER_MAX_CHARS 16
+static uint16_t desc_placeholder[1 + PLACEHOLDER_MAX_CHARS];
+static bool placeholder_served = false; // core0 only
 
 
 void set_cloning_required()
@@ -73,36 +117,49 @@ void set_descriptors_uncloned(void)
   clone_state = UNCLONED;
 }
 
+static void strings_cloned(void)
+{
+  clone_state = CLONED;
+  TU_LOG2("all strings cloned; descriptor image is %u of %u bytes\r\n", arena_len, (unsigned)USB_DESCRIPTOR_ARENA_SIZE);
+  if (device_clone_complete_cb) device_clone_complete_cb();
+}
+
+// Strings are cloned in string_idx_list order (product and manufacturer first),
+// each string in every langid before the next string
 static void clone_string_cb(tuh_xfer_t* xfer)
 {
   if (XFER_RESULT_SUCCESS == xfer->result) {
-    devstrings[langid_idx].string_list[string_idx] = malloc(xfer->buffer[0]);
-    memcpy(devstrings[langid_idx].string_list[string_idx], xfer->buffer, xfer->buffer[0]);
-    if (++string_idx < nstrings) {
-      clone_state = CLONE_NEXT_DESCRIPTOR;
+    uint8_t len = xfer->buffer[0];
+    uint16_t offset = (arena_len + 1) & ~1;
+    if (len < 2 || len > xfer->actual_len || offset + len > USB_DESCRIPTOR_ARENA_SIZE) {
+      TU_LOG1("string %u does not fit in the descriptor arena\r\n", string_idx_list[string_idx]);
+      offset = empty_string_offset;
     }
     else {
-      TU_LOG2("All strings for langid 0x%04x:\r\n", devstrings[langid_idx].langid);
-      for (uint8_t idx=0; idx < nstrings; idx++) {
-        uint8_t length_string = (*((uint8_t*)(devstrings[langid_idx].string_list[idx])) - 2);
-        char* cptr = (char*)(devstrings[langid_idx].string_list[idx])+2;
-        for (uint8_t jdx=0; jdx < length_string; jdx++) {
-          if (cptr[jdx]) {
-            TU_LOG2("%c", cptr[jdx]);
-          }
-        }
-        TU_LOG2("\r\n");
-      }
-      if (++langid_idx < num_langids) {
-        string_idx = 0;
-        clone_state = CLONE_NEXT_DESCRIPTOR;
-      }
-      else {
-        clone_state = CLONED;
-        TU_LOG2("all strings cloned\r\n");
-        if (device_clone_complete_cb) device_clone_complete_cb();
+      memcpy(clone_arena + offset, xfer->buffer, len);
+      arena_len = offset + len;
+    }
+    uint16_t* entry = (uint16_t*)&cloned_index.offsets[string_idx * num_langids + langid_idx];
+    __atomic_store_n(entry, offset, __ATOMIC_RELEASE);
+    TU_LOG2("string %u for langid 0x%04x:", string_idx_list[string_idx], cloned_index.langids[2 * langid_idx] | (cloned_index.langids[2 * langid_idx + 1] << 8));
+    uint8_t length_string = clone_arena[offset] - 2;
+    char* cptr = (char*)clone_arena + offset + 2;
+    for (uint8_t jdx=0; jdx < length_string; jdx++) {
+      if (cptr[jdx]) {
+        TU_LOG2("%c", cptr[jdx]);
       }
     }
+    TU_LOG2("\r\n");
+    if (++langid_idx < num_langids) {
+      clone_state = CLONE_NEXT_DESCRIPTOR;
+    }
+    else if (++string_idx < nstrings) {
+      langid_idx = 0;
+      clone_state = CLONE_NEXT_DESCRIPTOR;
+    }
+    else {
+      strings_cloned();
+    }
   }
 }
 
@@ -110,35 +167,91 @@ void clone_next_string()
 {
   if (langid_idx < num_langids && string_idx < nstrings)
   {
-    if (tuh_descriptor_get_string(daddr, string_idx_list[string_idx], devstrings[langid_idx].langid, scratchpad, SZ_SCRATCHPAD, clone_string_cb, 0)) {
+    uint16_t langid = cloned_index.langids[2 * langid_idx] | (cloned_index.langids[2 * langid_idx + 1] << 8);
+    if (tuh_descriptor_get_string(daddr, string_idx_list[string_idx], langid, scratchpad, SZ_SCRATCHPAD, clone_string_cb, 0)) {
       clone_state = CLONING;
     }
   }
 }
 
+// Append the string index part of the image after the configuration descriptor
+// and set up cloned_index. Return false if it does not fit in the arena.
+static bool layout_string_index(const uint8_t* langids)
+{
+  uint16_t pos = arena_len;
+  uint16_t offsets_pos = (pos + 2 + 2 * num_langids + nstrings + 1) & ~1;
+  uint16_t end = offsets_pos + 2 * nstrings * num_langids + 2; // the table and an empty string
+  if (end > USB_DESCRIPTOR_ARENA_SIZE)
+    return false;
+  clone_arena[pos++] = num_langids;
+  clone_arena[pos++] = nstrings;
+  cloned_index.image = clone_arena;
+  cloned_index.num_langids = num_langids;
+  cloned_index.nstrings = nstrings;
+  cloned_index.langids = clone_arena + pos;
+  memcpy(clone_arena + pos, langids, 2 * num_langids);
+  pos += 2 * num_langids;
+  cloned_index.string_idx_list = clone_arena + pos;
+  memcpy(clone_arena + pos, string_idx_list, nstrings);
+  pos += nstrings;
+  if (pos < offsets_pos)
+    clone_arena[pos] = 0;
+  cloned_index.offsets = (const uint16_t*)(clone_arena + offsets_pos);
+  memset(clone_arena + offsets_pos, 0, 2 * nstrings * num_langids);
+  empty_string_offset = end - 2;
+  clone_arena[empty_string_offset] = 2;
+  clone_arena[empty_string_offset + 1] = TUSB_DESC_STRING;
+  arena_len = end;
+  memset(cloned_index.string_slot, 0, sizeof(cloned_index.string_slot));
+  for (uint8_t idx = 0; idx < nstrings; idx++) {
+    cloned_index.string_slot[string_idx_list[idx]] = idx + 1;
+  }
+  return true;
+}
+
 static void clone_langids_cb(tuh_xfer_t* xfer)
 {
   if (XFER_RESULT_SUCCESS == xfer->result) {
     num_langids = (xfer->actual_len - 2)/2;
-    uint16_t* langids = (uint16_t*)(xfer->buffer+2);
-    devstrings = calloc(num_langids, sizeof(uint16_t));
     TU_LOG2("num_langids=%u\r\n", num_langids);
-    int idx;
-    for (idx = 0; idx < num_langids; idx++) {
-      devstrings[idx].langid = langids[idx];
-      TU_LOG2("langid %u=0x%04x\r\n", idx, langids[idx]);
-      devstrings[idx].string_list = calloc(nstrings, sizeof(*(devstrings[idx].string_list)));
-    }
-    if (nstrings > 0) {
-      clone_state = CLONE_NEXT_DESCRIPTOR;
-    }
-    else {
-      clone_state = CLONED;
+    for (int idx = 0; idx < num_langids; idx++) {
+      TU_LOG2("langid %u=0x%04x\r\n", idx, xfer->buffer[2 + 2 * idx] | (xfer->buffer[3 + 2 * idx] << 8));
     }
   }
-  
+  else {
+    // the device has no string descriptors
+    TU_LOG2("no langid list\r\n");
+    num_langids = 0;
+    nstrings = 0;
+  }
+  if (!layout_string_index(xfer->buffer + 2)) {
+    TU_LOG1("string descriptor index does not fit in the descriptor arena\r\n");
+    num_langids = 0;
+    nstrings = 0;
+    (void)layout_string_index(xfer->buffer + 2);
+  }
+  // the device port may look up strings from now on
+  __atomic_store_n(&published_langids, num_langids, __ATOMIC_RELEASE);
+  if (nstrings > 0 && num_langids > 0) {
+    clone_state = CLONE_NEXT_DESCRIPTOR;
+  }
+  else {
+    strings_cloned();
+  }
+
   // Continue until all strings for all langids are fetched.
-  // Then call clone_complete_cb()--that should trigger tud_init(0) call.
+  // Then call device_clone_complete_cb().
+}
+
+static void add_string_idx(uint8_t index)
+{
+  if (index == 0 || nstrings >= USB_DESCRIPTOR_MAX_STRINGS)
+    return;
+  for (uint8_t idx = 0; idx < nstrings; idx++) {
+    if (string_idx_list[idx] == index)
+      return; // already cloning this one
+  }
+  string_idx_list[nstrings++] = index;
 }
 
 // The callback functions capture the device descriptor and configuration descriptor
@@ -147,49 +260,23 @@ static void clone_langids_cb(tuh_xfer_t* xfer)
 // are valid and that all string descriptor indices are available
 static void clone_string_descriptors(uint8_t dev_addr)
 {
-  int idx, jdx;
   const uint8_t* midi_string_idxs;
   uint8_t nmidi_strings;
   TU_LOG2("clone string descriptors for addr=%u\r\n", dev_addr);
   if (dev_addr == daddr) {
-    // first free any old devstrings
-    if (devstrings != NULL) {
-      for (idx = 0; idx < num_langids; idx++) {
-        for (jdx = 0; jdx < nstrings; jdx++) {
-          free(devstrings[idx].string_list[jdx]);
-        }
-        free(devstrings+idx);
-      }
-    }
+    // The PC shows the product and manufacturer names first, so clone them first
+    nstrings = 0;
+    add_string_idx(desc_device_connected->iProduct);
+    add_string_idx(desc_device_connected->iManufacturer);
+    add_string_idx(desc_device_connected->iSerialNumber);
     // Get the list of string indexs
     nmidi_strings = tuh_midi_get_all_istrings(dev_addr, &midi_string_idxs);
-    nstrings = nmidi_strings;
-    if (desc_device_connected.iManufacturer != 0) {
-        ++nstrings;
+    for (uint8_t idx = 0; idx < nmidi_strings; idx++) {
+      add_string_idx(midi_string_idxs[idx]);
     }
-    if (desc_device_connected.iProduct != 0) {
-        ++nstrings;
-    }
-    if (desc_device_connected.iSerialNumber != 0) {
-        ++nstrings;
-    }
-
-    string_idx_list = malloc(nstrings);
-    string_idx = 0;
-    if (desc_device_connected.iManufacturer != 0) {
-        string_idx_list[string_idx++] = desc_device_connected.iManufacturer;
-    }
-    if (desc_device_connected.iProduct != 0) {
-        string_idx_list[string_idx++] = desc_device_connected.iProduct;
-    }
-    if (desc_device_connected.iSerialNumber != 0) {
-        string_idx_list[string_idx++] = desc_device_connected.iSerialNumber;
-    }
-    if (nmidi_strings > 0)
-        memcpy(string_idx_list+string_idx, midi_string_idxs, nmidi_strings);
 
-    TU_LOG2("All %u string indices\n", string_idx+nmidi_strings);
-    TU_LOG2_MEM(string_idx_list, string_idx+nmidi_strings, 2);
+    TU_LOG2("All %u string indices\n", nstrings);
+    TU_LOG2_MEM(string_idx_list, nstrings, 2);
     // Kick off the process of fetching all strings for all languages from the host-connected device
     string_idx = 0;
     langid_idx = 0;
@@ -208,7 +295,11 @@ static void clone_string_descriptors(uint8_t dev_addr)
 static void clone_config_cb(tuh_xfer_t* xfer)
 {
     if (XFER_RESULT_SUCCESS == xfer->result && xfer->actual_len == xfer->user_data) {
-        // We have the configuration descriptor. Now clone the string descriptors
+        arena_len = sizeof(tusb_desc_device_t) + xfer->actual_len;
+        config_cloned = true;
+        // We have the configuration descriptor. The device port can start now
+        // and the string descriptors can follow
+        if (device_config_clone_complete_cb) device_config_clone_complete_cb();
         TU_LOG2("cloning the string descriptors\r\n");
         clone_string_descriptors(xfer->daddr);
     }
@@ -222,13 +313,10 @@ static void clone_config_sz_cb(tuh_xfer_t* xfer)
     if (XFER_RESULT_SUCCESS == xfer->result) {
         TU_LOG2("clone got config size\r\n");
         tusb_desc_configuration_t* base = (tusb_desc_configuration_t*)scratchpad;
-        desc_fs_configuration = malloc(base->wTotalLength);
-        if (!desc_fs_configuration || !tuh_descriptor_get_configuration(xfer->daddr, 0, desc_fs_configuration, base->wTotalLength,
-                            clone_config_cb, base->wTotalLength)) {
-            if (desc_fs_configuration) {
-                free(desc_fs_configuration);
-                desc_fs_configuration = NULL;
-            }
+        uint16_t total_length = base->wTotalLength;
+        if (sizeof(tusb_desc_device_t) + total_length > USB_DESCRIPTOR_ARENA_SIZE ||
+            !tuh_descriptor_get_configuration(xfer->daddr, 0, clone_arena + sizeof(tusb_desc_device_t), total_length,
+                            clone_config_cb, total_length)) {
             clone_state = UNCLONED;
             TU_LOG2("failed to start cloning the config descriptor\r\n");
         }
@@ -241,10 +329,9 @@ static void clone_config_sz_cb(tuh_xfer_t* xfer)
 static void clone_device_cb(tuh_xfer_t* xfer)
 {
     if (XFER_RESULT_SUCCESS == xfer->result) {
-        if (xfer->actual_len == sizeof(desc_device_connected) && desc_device_connected.bNumConfigurations == 1) {
+        if (xfer->actual_len == sizeof(tusb_desc_device_t) && desc_device_connected->bNumConfigurations == 1) {
             // device descriptor copied and has exactly one configuration (all this software can handle)
-            desc_fs_configuration = calloc(desc_device_connected.bNumConfigurations, sizeof(desc_fs_configuration[0]));
-            if (!desc_fs_configuration || !tuh_descriptor_get_configuration(xfer->daddr, 0, scratchpad, sizeof(tusb_desc_configuration_t),
+            if (!tuh_descriptor_get_configuration(xfer->daddr, 0, scratchpad, sizeof(tusb_desc_configuration_t),
                                clone_config_sz_cb, 0)) {
                 clone_state = UNCLONED;
                 TU_LOG2("failed send get config size\r\n");
@@ -254,7 +341,7 @@ static void clone_device_cb(tuh_xfer_t* xfer)
             }
         }
         else {
-            TU_LOG2("xfer->actual_len=%lu num config=%u\r\n", xfer->actual_len, desc_device_connected.bNumConfigurations);
+            TU_LOG2("xfer->actual_len=%lu num config=%u\r\n", xfer->actual_len, desc_device_connected->bNumConfigurations);
         }
     }
     else {
@@ -262,15 +349,21 @@ static void clone_device_cb(tuh_xfer_t* xfer)
     }
 }
 
+void free_cloned_descriptors(void)
+{
+  __atomic_store_n(&published_langids, 0, __ATOMIC_RELEASE);
+  config_cloned = false;
+  arena_len = 0;
+  num_langids = 0;
+  nstrings = 0;
+}
+
 void start_cloning(uint8_t dev_addr)
 {
-    // Free any old configuration descriptors
-    if (desc_fs_configuration != NULL) {
-        free(desc_fs_configuration);
-        desc_fs_configuration = NULL;
-    }
+    // Discard any old descriptors
+    free_cloned_descriptors();
     daddr = dev_addr;
-    if (tuh_descriptor_get_device(dev_addr, &desc_device_connected, sizeof(desc_device_connected),
+    if (tuh_descriptor_get_device(dev_addr, clone_arena, sizeof(tusb_desc_device_t),
                                clone_device_cb, 0)) {
         clone_state = CLONING;
         TU_LOG2("Sent get device descriptor to addr %u\r\n", dev_addr);
@@ -281,40 +374,223 @@ void start_cloning(uint8_t dev_addr)
     }
 }
 
-#if 0
-// grab the device descriptor during enumeration
-void tuh_desc_device_cb(uint8_t dev_addr, const tusb_desc_device_t *desc)
+// Append a string descriptor made from an ASCII string to the arena. Return its offset in the image.
+static uint16_t synthesize_string(const char* text)
 {
-    daddr = dev_addr;        
-    memcpy(&desc_device_connected, desc, sizeof(desc_device_connected));
-    TU_LOG2("device descriptor cloned\r\n");
-    TU_LOG2_MEM((uint8_t*)&desc_device_connected, sizeof(desc_device_connected), 2);
+  uint16_t offset = (arena_len + 1) & ~1;
+  size_t nchars = strlen(text);
+  if (nchars > 126)
+    nchars = 126; // bLength is one byte
+  uint8_t len = 2 + 2 * nchars;
+  if (offset + len > USB_DESCRIPTOR_ARENA_SIZE)
+    return empty_string_offset;
+  clone_arena[offset] = len;
+  clone_arena[offset + 1] = TUSB_DESC_STRING;
+  for (size_t idx = 0; idx < nchars; idx++) {
+    clone_arena[offset + 2 + 2 * idx] = text[idx];
+    clone_arena[offset + 3 + 2 * idx] = 0;
+  }
+  arena_len = offset + len;
+  return offset;
 }
 
-void tuh_desc_config_cb(uint8_t dev_addr, const tusb_desc_configuration_t *desc_config)
+bool synthesize_midi_descriptors(uint16_t vid, uint16_t pid, uint16_t bcd_device, const char* manufacturer, const char* product,
+    uint8_t num_cables_in, const char* const* in_jack_names, uint8_t num_cables_out, const char* const* out_jack_names)
 {
-    if (daddr == dev_addr && desc_config->wTotalLength > 0) {
-        desc_fs_configuration = malloc(desc_config->wTotalLength);
-        if (desc_fs_configuration) {
-            memcpy(desc_fs_configuration, desc_config, desc_config->wTotalLength);
-            TU_LOG2("configuration descriptor cloned\r\n");
-            TU_LOG2_MEM((uint8_t*)desc_fs_configuration, desc_config->wTotalLength, 2);
-        }
-    }
+  // string 1 is the manufacturer, string 2 is the product, then one string per jack
+  uint8_t in_istring = 3;
+  uint8_t out_istring = in_istring + num_cables_in;
+  uint16_t jacks_len = (num_cables_in + num_cables_out) * (6 + 9);
+  uint16_t config_len = 9 + (9 + 9) + (9 + 7) + jacks_len + (7 + 4 + num_cables_out) + (7 + 4 + num_cables_in);
+  if (num_cables_in + num_cables_out == 0 || out_istring + num_cables_out > USB_DESCRIPTOR_MAX_STRINGS + 1 ||
+      sizeof(tusb_desc_device_t) + config_len > USB_DESCRIPTOR_ARENA_SIZE)
+    return false;
+  free_cloned_descriptors();
+  const tusb_desc_device_t device = {
+    .bLength = sizeof(tusb_desc_device_t),
+    .bDescriptorType = TUSB_DESC_DEVICE,
+    .bcdUSB = 0x0200,
+    .bDeviceClass = 0,
+    .bDeviceSubClass = 0,
+    .bDeviceProtocol = 0,
+    .bMaxPacketSize0 = 64,
+    .idVendor = vid,
+    .idProduct = pid,
+    .bcdDevice = bcd_device,
+    .iManufacturer = 1,
+    .iProduct = 2,
+    .iSerialNumber = 0,
+    .bNumConfigurations = 1
+  };
+  memcpy(clone_arena, &device, sizeof(device));
+  uint8_t* ptr = clone_arena + sizeof(tusb_desc_device_t);
+  const uint8_t head[] = {
+    // configuration: audio control and MIDI streaming interfaces
+    9, TUSB_DESC_CONFIGURATION, U16_TO_U8S_LE(config_len), 2, 1, 0, TUSB_DESC_CONFIG_ATT_BUS_POWERED, 100/2,
+    // audio control interface
+    9, TUSB_DESC_INTERFACE, 0, 0, 0, TUSB_CLASS_AUDIO, AUDIO_SUBCLASS_CONTROL, 0, 0,
+    9, TUSB_DESC_CS_INTERFACE, AUDIO_CS_AC_INTERFACE_HEADER, U16_TO_U8S_LE(0x0100), U16_TO_U8S_LE(9), 1, 1,
+    // MIDI streaming interface
+    9, TUSB_DESC_INTERFACE, 1, 0, 2, TUSB_CLASS_AUDIO, AUDIO_SUBCLASS_MIDI_STREAMING, 0, 0,
+    7, TUSB_DESC_CS_INTERFACE, MIDI_CS_INTERFACE_HEADER, U16_TO_U8S_LE(0x0100), U16_TO_U8S_LE(7 + jacks_len),
+  };
+  memcpy(ptr, head, sizeof(head));
+  ptr += sizeof(head);
+  // Cables to the PC: external IN jack 2n+1 feeds embedded OUT jack 2n+2.
+  // Cables from the PC: embedded IN jack 2(num_cables_in+n)+1 feeds external OUT jack 2(num_cables_in+n)+2.
+  for (uint8_t cable = 0; cable < num_cables_in + num_cables_out; cable++) {
+    bool to_pc = cable < num_cables_in;
+    uint8_t in_jack_id = 2 * cable + 1;
+    uint8_t in_jack[6] = {6, TUSB_DESC_CS_INTERFACE, MIDI_CS_INTERFACE_IN_JACK,
+        to_pc ? MIDI_JACK_EXTERNAL : MIDI_JACK_EMBEDDED, in_jack_id, to_pc ? 0 : (uint8_t)(out_istring + cable - num_cables_in)};
+    uint8_t out_jack[9] = {9, TUSB_DESC_CS_INTERFACE, MIDI_CS_INTERFACE_OUT_JACK,
+        to_pc ? MIDI_JACK_EMBEDDED : MIDI_JACK_EXTERNAL, in_jack_id + 1, 1, in_jack_id, 1, to_pc ? (uint8_t)(in_istring + cable) : 0};
+    memcpy(ptr, in_jack, sizeof(in_jack));
+    ptr += sizeof(in_jack);
+    memcpy(ptr, out_jack, sizeof(out_jack));
+    ptr += sizeof(out_jack);
+  }
+  // bulk OUT endpoint 1 carries the embedded IN jacks; bulk IN endpoint 1 carries the embedded OUT jacks
+  const uint8_t ep_out[] = {7, TUSB_DESC_ENDPOINT, 0x01, TUSB_XFER_BULK, U16_TO_U8S_LE(64), 0,
+      4 + num_cables_out, TUSB_DESC_CS_ENDPOINT, MIDI_CS_ENDPOINT_GENERAL, num_cables_out};
+  memcpy(ptr, ep_out, sizeof(ep_out));
+  ptr += sizeof(ep_out);
+  for (uint8_t cable = 0; cable < num_cables_out; cable++)
+    *ptr++ = 2 * (num_cables_in + cable) + 1;
+  const uint8_t ep_in[] = {7, TUSB_DESC_ENDPOINT, 0x01 | TUSB_DIR_IN_MASK, TUSB_XFER_BULK, U16_TO_U8S_LE(64), 0,
+      4 + num_cables_in, TUSB_DESC_CS_ENDPOINT, MIDI_CS_ENDPOINT_GENERAL, num_cables_in};
+  memcpy(ptr, ep_in, sizeof(ep_in));
+  ptr += sizeof(ep_in);
+  for (uint8_t cable = 0; cable < num_cables_in; cable++)
+    *ptr++ = 2 * cable + 2;
+  arena_len = ptr - clone_arena;
+  config_cloned = true;
+
+  // US English strings only
+  const uint8_t langids[2] = {0x09, 0x04};
+  num_langids = 1;
+  nstrings = out_istring + num_cables_out - 1;
+  for (uint8_t idx = 0; idx < nstrings; idx++)
+    string_idx_list[idx] = idx + 1;
+  if (!layout_string_index(langids)) {
+    free_cloned_descriptors();
+    return false;
+  }
+  uint16_t* offsets = (uint16_t*)cloned_index.offsets;
+  for (uint8_t idx = 0; idx < nstrings; idx++) {
+    const char* text;
+    if (idx + 1 == 1)
+      text = manufacturer;
+    else if (idx + 1 == 2)
+      text = product;
+    else if (idx + 1 < out_istring)
+      text = in_jack_names[idx + 1 - in_istring];
+    else
+      text = out_jack_names[idx + 1 - out_istring];
+    offsets[idx] = synthesize_string(text);
+  }
+  __atomic_store_n(&published_langids, num_langids, __ATOMIC_RELEASE);
+  TU_LOG1("synthesized a MIDI device with %u IN and %u OUT cables\r\n", num_cables_in, num_cables_out);
+  if (device_config_clone_complete_cb) device_config_clone_complete_cb();
+  strings_cloned();
+  return true;
+}
+
+// Copy the cloned descriptor image into the descriptor cache image buffer.
+// Return the image length or 0 if the descriptors are not all cloned.
+static uint16_t serialize_cloned_descriptors(void)
+{
+  if (clone_state != CLONED || !config_cloned)
+    return 0;
+  memcpy(descriptor_cache_image_buffer(), clone_arena, arena_len);
+  return arena_len;
+}
+
+// Set up the index for a descriptor image read from the flash cache. Return false if the image is malformed.
+static bool parse_cached_image(const uint8_t* image, uint16_t len)
+{
+  if (len < sizeof(tusb_desc_device_t) + sizeof(tusb_desc_configuration_t) + 2)
+    return false;
+  const uint8_t* config = image + sizeof(tusb_desc_device_t);
+  uint16_t pos = sizeof(tusb_desc_device_t) + (config[2] | (config[3] << 8));
+  if (pos + 2 > len)
+    return false;
+  cached_index.image = image;
+  cached_index.num_langids = image[pos++];
+  cached_index.nstrings = image[pos++];
+  cached_index.langids = image + pos;
+  pos += 2 * cached_index.num_langids;
+  cached_index.string_idx_list = image + pos;
+  pos += cached_index.nstrings;
+  pos = (pos + 1) & ~1;
+  cached_index.offsets = (const uint16_t*)(image + pos);
+  uint16_t noffsets = cached_index.nstrings * cached_index.num_langids;
+  if (pos + 2 * noffsets > len)
+    return false;
+  for (uint16_t idx = 0; idx < noffsets; idx++) {
+    uint16_t offset = cached_index.offsets[idx];
+    if (offset == 0 || (offset & 1) || offset + 2 > len || image[offset] < 2 || offset + image[offset] > len)
+      return false;
+  }
+  memset(cached_index.string_slot, 0, sizeof(cached_index.string_slot));
+  for (uint8_t idx = 0; idx < cached_index.nstrings; idx++) {
+    cached_index.string_slot[cached_index.string_idx_list[idx]] = idx + 1;
+  }
+  return true;
+}
+
+bool load_cached_descriptors(void)
+{
+  uint16_t len;
+  const uint8_t* image = descriptor_cache_get(&len);
+  cached_in_use = image != NULL && parse_cached_image(image, len);
+  if (cached_in_use) {
+    placeholder_served = false;
+    const tusb_desc_device_t* device = (const tusb_desc_device_t*)image;
+    TU_LOG1("using cached descriptors for VID=0x%04x PID=0x%04x\r\n", device->idVendor, device->idProduct);
+  }
+  return cached_in_use;
+}
+
+bool cached_descriptors_in_use(void)
+{
+  return cached_in_use;
+}
+
+bool cloned_descriptors_match_cache(void)
+{
+  uint16_t len = serialize_cloned_descriptors();
+  return len != 0 && descriptor_cache_matches(desc_device_connected->idVendor, desc_device_connected->idProduct,
+      desc_device_connected->bcdDevice, len);
+}
+
+void use_cloned_descriptors(void)
+{
+  cached_in_use = false;
+}
+
+bool save_cloned_descriptors(void)
+{
+  uint16_t len = serialize_cloned_descriptors();
+  return len != 0 && descriptor_cache_save(desc_device_connected->idVendor, desc_device_connected->idProduct,
+      desc_device_connected->bcdDevice, len);
 }
-#endif
 
 // Invoked when received GET DEVICE DESCRIPTOR
 // Application return pointer to descriptor
 uint8_t const * tud_descriptor_device_cb(void)
 {
   TU_LOG2("midi device descriptor returned\r\n");
-  return (uint8_t const *) &desc_device_connected;
+  if (cached_in_use)
+    return cached_index.image;
+  return (uint8_t const *) desc_device_connected;
 }
 
 uint8_t midid_get_endpoint0_size()
 {
-  return desc_device_connected.bMaxPacketSize0;
+  if (cached_in_use)
+    return ((const tusb_desc_device_t*)cached_index.image)->bMaxPacketSize0;
+  return desc_device_connected->bMaxPacketSize0;
 }
 
 //--------------------------------------------------------------------+
@@ -327,7 +603,11 @@ uint8_t midid_get_endpoint0_size()
 uint8_t const * tud_descriptor_configuration_cb(uint8_t index)
 {
   (void) index;
-  if (desc_fs_configuration == NULL) {
+  if (cached_in_use) {
+    TU_LOG2("midi device configuration %u returned from cache\r\n", index);
+    return cached_index.image + sizeof(tusb_desc_device_t);
+  }
+  if (!config_cloned) {
     TU_LOG2("midi device configuration $u not available\r\n", index);
     return NULL;
   }
@@ -338,35 +618,77 @@ uint8_t const * tud_descriptor_configuration_cb(uint8_t index)
 //--------------------------------------------------------------------+
 // String Descriptors
 //--------------------------------------------------------------------+
+// Make a string descriptor to return until the real one is cloned
+static uint16_t const* placeholder_string(uint8_t index)
+{
+  char text[PLACEHOLDER_MAX_CHARS + 1];
+  if (index == desc_device_connected->iProduct)
+    strcpy(text, "USB MIDI Device");
+  else
+    snprintf(text, sizeof(text), "MIDI %u", index);
+  uint8_t nchars = strlen(text);
+  desc_placeholder[0] = (TUSB_DESC_STRING << 8) | ((nchars * 2) + 2);
+  for (uint8_t idx = 0; idx < nchars; idx++) {
+    desc_placeholder[idx + 1] = text[idx];
+  }
+  placeholder_served = true;
+  TU_LOG2("string %u is not cloned yet; returned a placeholder\r\n", index);
+  return desc_placeholder;
+}
+
+bool placeholder_strings_served(void)
+{
+  return placeholder_served;
+}
+
+static uint16_t const* langid_list(const descriptor_index_t* index_table, uint8_t nlangids)
+{
+  desc_langids[0] = (TUSB_DESC_STRING << 8) | ((nlangids * 2) + 2);
+  for (int idx=0; idx < nlangids; idx++) {
+    desc_langids[idx + 1] = index_table->langids[2 * idx] | (index_table->langids[2 * idx + 1] << 8);
+  }
+  return desc_langids;
+}
+
+// Look up a string descriptor with the string index table. Devices have very
+// few langids (usually one), so finding the langid is a short search.
+static uint16_t const* indexed_string(const descriptor_index_t* index_table, uint8_t nlangids, uint8_t index, uint16_t langid)
+{
+  uint8_t slot = index_table->string_slot[index];
+  if (slot == 0)
+    return NULL;
+  int lang;
+  for (lang = 0; lang < nlangids && (index_table->langids[2 * lang] | (index_table->langids[2 * lang + 1] << 8)) != langid; lang++) {
+  }
+  if (lang == nlangids)
+    return NULL;
+  uint16_t offset = __atomic_load_n(&index_table->offsets[(slot - 1) * nlangids + lang], __ATOMIC_ACQUIRE);
+  if (offset == 0)
+    return placeholder_string(index);
+  return (uint16_t const*)(index_table->image + offset);
+}
+
 // Invoked when received GET STRING DESCRIPTOR request
 // Application return pointer to descriptor, whose contents must exist long enough for transfer to complete
 uint16_t const* tud_descriptor_string_cb(uint8_t index, uint16_t langid)
 {
-  uint16_t* ptr = NULL;
-  // return the langid list descriptor if index == 0
-  if (index == 0) {
-    scratchpad[0] = (num_langids * 2) + 2;  // descriptor length
-    scratchpad[1] = TUSB_DESC_STRING;
-    ptr = (uint16_t*)(scratchpad+2);
-    for (int idx=0; idx < num_langids; idx++) {
-      *ptr++ = devstrings[idx].langid;
-    }
-    ptr = (uint16_t*)scratchpad;
+  if (cached_in_use) {
+    if (index == 0)
+      return langid_list(&cached_index, cached_index.num_langids);
+    return indexed_string(&cached_index, cached_index.num_langids, index, langid);
   }
-  else {
-    // find the string descriptor index for this langid
-    int lang;
-    for (lang = 0; lang < num_langids && devstrings[lang].langid != langid; lang++) {
-    }
-    if (lang < num_langids) {
-      // then we found the devstrings structure for this langid
-      int idx;
-      for (idx = 0; idx < nstrings && string_idx_list[idx] != index; idx++) {
-      }
-      if (idx < nstrings) {
-        ptr = (uint16_t*)(devstrings[lang].string_list[idx]);
-      }
-    }
+  uint8_t nlangids = __atomic_load_n(&published_langids, __ATOMIC_ACQUIRE);
+  if (nlangids == 0) {
+    if (index != 0)
+      return placeholder_string(index);
+    // assume US English until the langid list is cloned
+    desc_langids[0] = (TUSB_DESC_STRING << 8) | 4;
+    desc_langids[1] = 0x0409;
+    placeholder_served = true;
+    return desc_langids;
   }
-  return ptr;
+  // return the langid list descriptor if index == 0
+  if (index == 0)
+    return langid_list(&cloned_index, nlangids);
+  return indexed_string(&cloned_index, nlangids, index, langid);
 }
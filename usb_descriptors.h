@@ -8,4 +8,30 @@ bool clone_next_string_is_required();
 void clone_next_string();
 bool descriptors_are_cloned(void);
 void set_descriptors_uncloned(void);
+// Free the descriptors cloned from the MIDI device (core1 only). The USB device
+// port must not be using them; see cached_descriptors_in_use().
+void free_cloned_descriptors(void);
 TU_ATTR_WEAK void device_clone_complete_cb();
+// Called when the device and configuration descriptors are cloned; the string
+// descriptors are still being cloned
+TU_ATTR_WEAK void device_config_clone_complete_cb();
+// Return true if the device port returned a placeholder for a string that was not cloned
+// yet since it last switched to the cached descriptors
+bool placeholder_strings_served(void);
+
+// Serve the descriptors from the flash cache, if it holds any. Call before tud_init().
+bool load_cached_descriptors(void);
+// Return true if the USB device port is using the descriptors from the flash cache
+bool cached_descriptors_in_use(void);
+// Return true if the cloned descriptors are the same as the ones in the flash cache
+bool cloned_descriptors_match_cache(void);
+// Serve the cloned descriptors instead of the ones in the flash cache
+void use_cloned_descriptors(void);
+// Write the cloned descriptors to the flash cache (core0 only)
+bool save_cloned_descriptors(void);
+// Instead of cloning an attached device, build the descriptors of a MIDI device with
+// num_cables_in cables to the USB host and num_cables_out cables from it, named by the
+// jack name arrays (core1 only). The clone complete callbacks are called as if the
+// descriptors were cloned. Return false if the descriptors do not fit.
+bool synthesize_midi_descriptors(uint16_t vid, uint16_t pid, uint16_t bcd_device, const char* manufacturer, const char* product,
+    uint8_t num_cables_in, const char* const* in_jack_names, uint8_t num_cables_out, const char* const* out_jack_names);